@@ -178,6 +178,8 @@ LOCAL_SRC_FILES := \
   ../source/timeman.cpp                                                \
   ../source/book/apery_book.cpp                                        \
   ../source/book/book.cpp                                              \
+  ../source/book/hashed_book.cpp                                       \
+  ../source/book/book_index.cpp                                        \
   ../source/extra/bitop.cpp                                            \
   ../source/extra/long_effect.cpp                                      \
   ../source/extra/sfen_packer.cpp                                      \
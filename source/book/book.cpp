@@ -7,6 +7,8 @@
 #include "../learn/multi_think.h"
 #include "../tt.h"
 #include "apery_book.h"
+#include "hashed_book.h"
+#include "book_index.h"
 
 #include <unordered_set>
 #include <iomanip>		// std::setprecision()
@@ -161,6 +163,7 @@ namespace Book
 	void MemoryBook::merge(MemoryBook& book2)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 		book2.foreach([&](const std::string& sfen, const Book::BookMovesPtr book_moves)
 		{
 			this->append(sfen, book_moves);
@@ -179,6 +182,7 @@ namespace Book
 	void MemoryBook::insert(const std::string& sfen, const BookMove& bp , bool overwrite)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 
 		auto it = book_body.find(sfen);
 		if (it == book_body.end())
@@ -199,6 +203,7 @@ namespace Book
 	void MemoryBook::foreach(std::function<void(const std::string& /*sfen*/, const BookMovesPtr)> f)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 
 		for(auto& it : book_body)
 			f(it.first,it.second);
@@ -238,7 +243,14 @@ namespace Book
 		this->pure_book_name = "";
 
 		// 別のファイルを開こうとしているので前回メモリに丸読みした定跡をクリアしておかないといけない。
+		frozen_book_ptr.store(nullptr, std::memory_order_release);
+		frozen_book.reset();
+		retired_frozen_books.clear();
 		book_body.clear();
+		hashed_book_ptr.store(nullptr, std::memory_order_release);
+		hashed_book.reset();
+		book_index_ptr.store(nullptr, std::memory_order_release);
+		book_index.reset();
 		this->on_the_fly = false;
 		this->ignoreBookPly = ignore_book_ply_;
 
@@ -259,6 +271,25 @@ namespace Book
 			// これ、C++14の機能。C++11用に以下のように書き直す。
 			apery_book = std::unique_ptr<AperyBook>(new AperyBook(filename));
 		}
+		else if (HashedBook::is_hashed_book_file(pure_filename)) {
+			// hash keyをkeyとする定跡データベースを読み込む
+			// 省メモリなのでon the flyであってもメモリに丸読みする。
+			sync_cout << "info string read hashed book file : " << filename << sync_endl;
+
+			auto book = std::make_shared<HashedBook>();
+			auto result = book->read(filename);
+			if (result.is_not_ok())
+				return result;
+
+			hashed_book = book;
+			hashed_book_ptr.store(hashed_book.get(), std::memory_order_release);
+			sync_cout << "info string read hashed book done. number of positions = " << hashed_book->size()
+					  << " , number of moves = " << hashed_book->num_moves() << sync_endl;
+
+			this->book_name = filename;
+			this->pure_book_name = pure_filename;
+			return Tools::Result::Ok();
+		}
 		else {
 			// やねうら王定跡データベースを読み込む
 
@@ -275,6 +306,16 @@ namespace Book
 					return Tools::Result(Tools::ResultCode::FileOpenError);
 				}
 
+				// 索引ファイル("makebook build_index"で作成する)があれば、それを用いてprobeする。
+				auto index = std::make_shared<BookIndex>();
+				if (index->open(filename).is_ok())
+				{
+					book_index = index;
+					book_index_ptr.store(book_index.get(), std::memory_order_release);
+					sync_cout << "info string use book index file : " << filename + BookIndex::kExtension
+							  << " , number of positions = " << book_index->size() << sync_endl;
+				}
+
 				// 定跡ファイルのopenにも成功したし、on the flyできそう。
 				// このときに限りこのフラグをtrueにする。
 				this->on_the_fly = true;
@@ -411,6 +452,9 @@ namespace Book
 
 		vector<pair<string, BookMovesPtr> > vectored_book;
 
+		// 凍結されているなら凍結した定跡を書き出す。
+		const BookType& body = frozen_book ? frozen_book->body : book_body;
+
 		// 重複局面の手数違いを除去するのに用いる。
 		// 手数違いの重複局面はOptions["IgnoreBookPly"]==trueのときに有害であるため、plyが最小のもの以外を削除する必要がある。
 		// (Options["BookOnTheFly"]==true かつ Options["IgnoreBookPly"] == true のときに、手数違いのものがヒットするだとか、そういう問題と、
@@ -419,7 +463,7 @@ namespace Book
 		// sfenの手数の手前までの文字列とそのときの手数
 		std::unordered_map<string, int> book_ply;
 
-		for (auto& it : book_body)
+		for (auto& it : body)
 		{
 			// 指し手のない空っぽのentryは書き出さないように。
 			if (it.second->size() == 0)
@@ -506,8 +550,9 @@ namespace Book
 	{
 		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
 
-		auto it = book_body.find(trim(sfen));
-		return it == book_body.end() ? BookMovesPtr() : it->second;
+		const BookType& body = frozen_book ? frozen_book->body : book_body;
+		auto it = body.find(trim(sfen));
+		return it == body.end() ? BookMovesPtr() : it->second;
 	}
 
 	// [ASYNC] メモリに保持している定跡に局面を一つ追加する。
@@ -516,9 +561,55 @@ namespace Book
 	void MemoryBook::append(const std::string& sfen, const Book::BookMovesPtr ptr)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 		book_body[sfen] = ptr;
 	}
 
+	size_t MemoryBook::size() const
+	{
+		const FrozenBook* frozen = frozen_book_ptr.load(std::memory_order_acquire);
+		return frozen ? frozen->body.size() : book_body.size();
+	}
+
+	void MemoryBook::freeze()
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		// メモリに丸読みしたやねうら王定跡DBのときだけ凍結する。
+		if (frozen_book || on_the_fly || hashed_book || book_body.empty()
+			|| pure_book_name == "no_book" || pure_book_name == kAperyBookName)
+			return;
+
+		auto frozen = std::make_shared<FrozenBook>();
+		frozen->ignore_book_ply = ignoreBookPly;
+		frozen->body = std::move(book_body);
+		book_body.clear();
+
+		// probeのときにsortしなくて済むように、ここで全局面の指し手をsortしておく。
+		for (auto& it : frozen->body)
+			it.second->sort_moves();
+
+		frozen_book = std::move(frozen);
+		frozen_book_ptr.store(frozen_book.get(), std::memory_order_release);
+	}
+
+	void MemoryBook::thaw()
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		if (!frozen_book)
+			return;
+
+		frozen_book_ptr.store(nullptr, std::memory_order_release);
+
+		// 凍結した定跡は他のスレッドがまだ参照しているかも知れないので、指し手はコピーしてから書き換えられるようにする。
+		book_body.reserve(frozen_book->body.size());
+		for (auto& it : frozen_book->body)
+			book_body.emplace(it.first, BookMovesPtr(new BookMoves(*it.second)));
+
+		retired_frozen_books.push_back(std::move(frozen_book));
+	}
+
 	// 反転された指し手を登録した新規エントリーを作成するヘルパー関数。
 	BookMovesPtr make_flipped_bookmoves(BookMovesPtr pt)
 	{
@@ -545,6 +636,8 @@ namespace Book
 		// read_book()で取り除くと、そのあと書き出すときに手数が消失するのでまずい。(気がする)
 		sfen = trim(sfen);
 
+		// 索引ファイルがある場合は、find()がmutex_を取る前にBookIndex::find()で調べているので、ここには来ない。
+
 		// ファイル自体はオープンされてして、ファイルハンドルはfsだと仮定して良い。
 
 		// ファイルサイズ取得
@@ -688,6 +781,74 @@ namespace Book
 
 	BookMovesPtr MemoryBook::find(const Position& pos)
 	{
+		// 凍結されているなら、mutexを取らずに凍結した定跡を調べる。
+		// 凍結した定跡は書き換えられず、各局面の指し手もsort済みなので、BookMoves::sort_moves()も呼び出さなくて良い。
+		if (const FrozenBook* frozen = frozen_book_ptr.load(std::memory_order_acquire))
+		{
+			auto sfen = pos.sfen();
+			const auto& body = frozen->body;
+			auto trim_sfen = [&](const std::string& s) {
+				return frozen->ignore_book_ply ? StringExtension::trim_number(s) : StringExtension::trim(s);
+			};
+
+			auto it = body.find(trim_sfen(sfen));
+			if (it != body.end())
+				return it->second;
+
+			// FlippedBookが有効なら、反転させた局面にhitするか調べる。
+			if (Options["FlippedBook"])
+			{
+				it = body.find(trim_sfen(Position::sfen_to_flipped_sfen(sfen)));
+				if (it != body.end())
+					return make_flipped_bookmoves(it->second);
+			}
+
+			return BookMovesPtr();
+		}
+
+		// HashedBookもread()の後は書き換えないので、mutexを取らずに調べる。
+		if (const HashedBook* hashed = hashed_book_ptr.load(std::memory_order_acquire))
+		{
+			auto entry = hashed->find(pos);
+			if (entry == nullptr && Options["FlippedBook"])
+			{
+				// FlippedBookが有効なら、反転させた局面にhitするか調べる。
+				Position flipped_pos;
+				StateInfo si;
+				flipped_pos.set(Position::sfen_to_flipped_sfen(pos.sfen()), &si, pos.this_thread());
+				entry = hashed->find(flipped_pos);
+				// 指し手をflipさせる
+				if (entry != nullptr)
+					entry = make_flipped_bookmoves(entry);
+			}
+			return entry;
+		}
+
+		// 索引ファイルを用いるon the flyの定跡も、mutexを取らずに索引を調べる。
+		// (索引と定跡DBファイルはmapしたまま書き換えず、fsのような読み込み位置の状態も持たない)
+		if (const BookIndex* index = book_index_ptr.load(std::memory_order_acquire))
+		{
+			// ignoreBookPlyはread_book()でbook_index_ptrより先に設定されている。
+			// probeのたびにOptions["IgnoreBookPly"]を読みに行かないよう、こちらを用いる。
+			const bool ignore_book_ply = ignoreBookPly;
+			auto trim_sfen = [&](const std::string& s) {
+				return ignore_book_ply ? StringExtension::trim_number(s) : StringExtension::trim(s);
+			};
+
+			auto sfen = pos.sfen();
+			auto entry = index->find(trim_sfen(sfen), ignore_book_ply);
+
+			// FlippedBookが有効なら、反転させた局面にhitするか調べる。
+			if (entry == nullptr && Options["FlippedBook"])
+			{
+				entry = index->find(trim_sfen(Position::sfen_to_flipped_sfen(sfen)), ignore_book_ply);
+				// 指し手をflipさせる
+				if (entry != nullptr)
+					entry = make_flipped_bookmoves(entry);
+			}
+			return entry;
+		}
+
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
 
 		// "no_book"は定跡なしという意味なので定跡の指し手が見つからなかったことにする。
@@ -801,6 +962,7 @@ namespace Book
 	Tools::Result MemoryBook::read_apery_book(const std::string& filename, const int unreg_depth)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 
 		/*
 		// 読み込み済であるかの判定
@@ -906,6 +1068,7 @@ namespace Book
 	Tools::Result MemoryBook::write_apery_book(const std::string& filename)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		thaw();
 
 		std::ofstream fs(filename, std::ios::binary);
 
@@ -1010,10 +1173,11 @@ namespace Book
 		//  user_book2.db    ユーザー定跡2
 		//  user_book3.db    ユーザー定跡3
 		//  book.bin         Apery型の定跡DB
+		//  book.hdb         局面のhash keyをkeyとする省メモリな定跡DB(hashed_book.h)
 
 		std::vector<std::string> book_list = { "no_book" , "standard_book.db"
 			, "yaneura_book1.db" , "yaneura_book2.db" , "yaneura_book3.db", "yaneura_book4.db"
-			, "user_book1.db", "user_book2.db", "user_book3.db", "book.bin" };
+			, "user_book1.db", "user_book2.db", "user_book3.db", "book.bin", "book.hdb" };
 
 #if !defined(__EMSCRIPTEN__)
 		o["BookFile"] << Option(book_list, book_list[1]);
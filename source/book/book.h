@@ -7,6 +7,8 @@
 #include "../usi.h"
 #include "../testcmd/unit_test.h"
 
+#include <atomic>
+#include <memory>
 #include <unordered_map>
 
 namespace Search { struct LimitsType; };
@@ -77,6 +79,10 @@ namespace Book
 		// std::recursive_mutexを持っているので暗黙のコピーは不可。自前でコピーしてやる。
 		BookMoves(const BookMoves& bm) { sorted = bm.sorted; moves = bm.moves; }
 
+		// sort_moves()で並び替えた順に並んでいる指し手集合から作る。
+		// sort済みとして扱うので、このあとsort_moves()を呼び出しても並び替えない。
+		explicit BookMoves(std::vector<BookMove>&& sorted_moves) : moves(std::move(sorted_moves)), sorted(true) {}
+
 		// [ASYNC] BookMoveを一つ追加する
 		// ただし、その局面ですでに同じmoveの指し手が登録されている場合、
 		//   overwrite == true の時は、上書き動作となる。このとき、BookMove::num,win,loseは、合算した値となる。
@@ -133,6 +139,12 @@ namespace Book
 
 	typedef std::shared_ptr<BookMoves> BookMovesPtr;
 
+	// 局面のhash keyをkeyとする省メモリな定跡DB。(hashed_book.h)
+	class HashedBook;
+
+	// BookOnTheFly用の定跡DBファイルの索引。(book_index.h)
+	class BookIndex;
+
 	// sfen文字列からBookMovesPtrへの写像。(これが定跡データがメモリ上に存在するときの構造)
 	typedef std::unordered_map<std::string /* sfen */, BookMovesPtr > BookType;
 
@@ -197,15 +209,53 @@ namespace Book
 		// [ASYNC] このクラスの持つ定跡DBに対して、それぞれの局面を列挙する時に用いる
 		void foreach(std::function<void(const std::string& /*sfen*/, const Book::BookMovesPtr)> f);
 
+		// 凍結されている場合は、凍結を解除してから返す。
 		BookType& get_body() {
+			thaw();
 			return book_body;
 		}
 
 		// 保持している局面数を返す。これは、on the flyではない状態でread_book()した時にのみ有効。
-		size_t size() const { return book_body.size(); }
+		size_t size() const;
+
+		// [ASYNC] 定跡を凍結する。
+		// ・メモリに丸読みした定跡の各局面の指し手をsortしておき、読み取り専用の定跡として公開する。
+		// ・凍結中のfind(const Position&)はmutexを取らないので、複数スレッドから同時に呼び出してもお互いを待たない。
+		// ・凍結中に定跡を書き換えるメンバ(insert(),append(),get_body()など)を呼び出すと、凍結は解除される。
+		// 　解除前にfind()で得たBookMovesPtrは凍結した定跡のものなので、解除後に書き換えられることはない。
+		// ・on the flyのときやApery/HashedBookの定跡のときは何もしない。
+		void freeze();
+
+		// 凍結されているか。
+		bool is_frozen() const { return frozen_book_ptr.load(std::memory_order_acquire) != nullptr; }
 
 	protected:
 
+		// 凍結した定跡。一度公開したら書き換えない。
+		struct FrozenBook
+		{
+			// 各局面の指し手はsort済み
+			BookType body;
+
+			// 凍結したときのOptions["IgnoreBookPly"]の値
+			bool ignore_book_ply;
+		};
+
+		// 凍結した定跡。凍結されていないときはnullptr。凍結中はbook_bodyは空である。
+		// mutex_を取って書き換える。
+		std::shared_ptr<const FrozenBook> frozen_book;
+
+		// frozen_bookの指す先。find()はmutex_を取らずにこれを読み出す。
+		// (std::atomic_load(std::shared_ptr*)は実装によっては内部でmutexを取るので、生のポインターにしてある。)
+		std::atomic<const FrozenBook*> frozen_book_ptr { nullptr };
+
+		// 凍結を解除した定跡。解除の直前にfind()を始めたスレッドがまだ参照しているかも知れないので、
+		// 次のread_book()まで解放しない。(read_book()はisreadyのときに呼び出され、probeとは並行しない)
+		std::vector<std::shared_ptr<const FrozenBook>> retired_frozen_books;
+
+		// [ASYNC] 凍結を解除して、凍結した定跡の内容をbook_bodyに戻す。
+		void thaw();
+
 		// メモリ上に読み込まれた定跡本体
 		// book_body.find()の直接呼び出しは禁止
 		// (Options["IgnoreBookPly"]==trueのときにplyの部分を削ってメモリに読み込んでいるため、一致しないから)
@@ -236,12 +286,28 @@ namespace Book
 		// 上のon_the_fly == trueのときに、開いている定跡ファイルのファイルハンドル
 		std::fstream fs;
 
+		// 上のon_the_fly == trueのときに、定跡ファイルの索引ファイルが存在すればそれをmapしたもの。
+		// これがあるときはfsを用いずにこちらでprobeする。
+		std::shared_ptr<BookIndex> book_index;
+
+		// book_indexの指す先。索引はopen()の後は書き換えないので、find()はmutex_を取らずにこれを読み出す。
+		// (frozen_book_ptrと同じく、read_book()とprobeは並行しない)
+		std::atomic<const BookIndex*> book_index_ptr { nullptr };
+
 		// read_book()のときに読み込んだbookの名前
 		// ・on_the_fly == trueのときは、読み込む予定のファイルの名前。
 		// ・二度目のread_book()の呼び出しのときにすでに読み込んである(or ファイルをopenしてある)かどうかの
 		// 判定のためにファイル名を内部的に保持してある。
 		std::string book_name;
 		std::string pure_book_name; // book_nameからフォルダ名を取り除いたもの。
+
+		// HashedBook::kExtensionの拡張子のファイルを読み込んだときの定跡本体。
+		// このときbook_bodyは空である。
+		std::shared_ptr<HashedBook> hashed_book;
+
+		// hashed_bookの指す先。HashedBookはread()の後は書き換えないので、find()はmutex_を取らずにこれを読み出す。
+		// (frozen_book_ptrと同じく、read_book()とprobeは並行しない)
+		std::atomic<const HashedBook*> hashed_book_ptr { nullptr };
 	};
 
 #if defined (ENABLE_MAKEBOOK_CMD)
@@ -261,7 +327,11 @@ namespace Book
 		// ・Search::clear()は、USIのisreadyコマンドのときに呼び出されるので
 		// 　定跡をメモリに丸読みするのであればこのタイミングで行なう。
 		// ・Search::clear()が呼び出されたときのOptions["BookOnTheFly"]の値をcaptureして使う。(ことになる)
-		void read_book() { memory_book.read_book(get_book_name(), (bool)Options["BookOnTheFly"]); }
+		// ・対局中は定跡を書き換えないので、読み込んだ定跡は凍結しておき、probe()がmutexを取らずに済むようにする。
+		void read_book() {
+			memory_book.read_book(get_book_name(), (bool)Options["BookOnTheFly"]);
+			memory_book.freeze();
+		}
 
 		// --- 定跡の指し手の選択
 
@@ -0,0 +1,329 @@
+﻿#include "../config.h"
+#include "book_index.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#if !defined(NOMINMAX)
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Book
+{
+	namespace {
+
+		// 索引ファイルの先頭に置くheader
+		struct BookIndexHeader
+		{
+			char magic[8];
+			u32 version;
+			u32 reserved;
+			// 索引を作成したときの定跡DBファイルのサイズと最終更新日時。定跡DBファイルが更新されていないかの確認に用いる。
+			// サイズの変わらない書き換えもあるので、最終更新日時も比較する。
+			u64 book_file_size;
+			u64 book_file_mtime;
+			u64 num_entries;
+		};
+
+		constexpr char kMagic[8] = { 'Y','O','B','K','I','D','X','1' };
+		constexpr u32 kVersion = 2;
+
+		// 手数を除いたsfen文字列のhash値。(FNV-1a)
+		// 索引ファイルに保存するので、std::hashのような実装依存のものは使わない。
+		u64 sfen_key(const std::string& sfen)
+		{
+			const std::string s = StringExtension::trim_number(sfen);
+			u64 h = 14695981039346656037ULL;
+			for (unsigned char c : s)
+			{
+				h ^= c;
+				h *= 1099511628211ULL;
+			}
+			return h;
+		}
+
+		// mapしたファイルのposの位置から1行読み込み、posを次の行の先頭に進める。
+		// 末尾の'\r'は除去する。
+		std::string read_line(const char* data, size_t size, size_t& pos)
+		{
+			const char* begin = data + pos;
+			const char* end = static_cast<const char*>(memchr(begin, '\n', size - pos));
+			if (end == nullptr)
+				end = data + size;
+
+			pos = size_t(end - data) + (end < data + size ? 1 : 0);
+
+			if (end > begin && end[-1] == '\r')
+				--end;
+			return std::string(begin, end);
+		}
+
+		bool is_sfen_line(const std::string& line)
+		{
+			return line.length() >= 5 && line.compare(0, 5, "sfen ") == 0;
+		}
+	}
+
+	Tools::Result BookIndex::MappedFile::map(const std::string& filename)
+	{
+		unmap();
+
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+		{
+			CloseHandle(file);
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		FILETIME write_time;
+		if (!GetFileTime(file, nullptr, nullptr, &write_time))
+		{
+			CloseHandle(file);
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		void* address = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if (address == nullptr)
+		{
+			if (mapping)
+				CloseHandle(mapping);
+			CloseHandle(file);
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		file_handle = file;
+		mapping_handle = mapping;
+		data = static_cast<const char*>(address);
+		size = size_t(file_size.QuadPart);
+		mtime = (u64(write_time.dwHighDateTime) << 32) | write_time.dwLowDateTime;
+		return Tools::Result::Ok();
+
+#elif !defined(__EMSCRIPTEN__)
+		int fd = ::open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || st.st_size == 0)
+		{
+			::close(fd);
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		void* address = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// マップした領域はfdを閉じても有効
+		::close(fd);
+		if (address == MAP_FAILED)
+			return Tools::Result(Tools::ResultCode::FileReadError);
+
+		// probeはランダムアクセスなので先読みは無駄になる。
+		::madvise(address, size_t(st.st_size), MADV_RANDOM);
+
+		data = static_cast<const char*>(address);
+		size = size_t(st.st_size);
+		mtime = u64(st.st_mtime);
+		return Tools::Result::Ok();
+
+#else
+		// WASMでは従来のon the fly読み込みを用いる。
+		return Tools::Result(Tools::ResultCode::NotImplementedError);
+#endif
+	}
+
+	void BookIndex::MappedFile::unmap()
+	{
+#if defined(_WIN32)
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping_handle)
+			CloseHandle(mapping_handle);
+		if (file_handle)
+			CloseHandle(file_handle);
+		file_handle = nullptr;
+		mapping_handle = nullptr;
+#elif !defined(__EMSCRIPTEN__)
+		if (data)
+			::munmap(const_cast<char*>(data), size);
+#endif
+		data = nullptr;
+		size = 0;
+		mtime = 0;
+	}
+
+	Tools::Result BookIndex::build(const std::string& book_filename)
+	{
+		MappedFile book;
+		auto result = book.map(book_filename);
+		if (result.is_not_ok())
+		{
+			sync_cout << "info string Error! : can't read file : " + book_filename << sync_endl;
+			return result;
+		}
+
+		vector<Entry> index;
+		Tools::ProgressBar progress(book.size);
+		for (size_t pos = 0; pos < book.size; )
+		{
+			const size_t offset = pos;
+			// 指し手の行はsfen文字列を作る必要がないので、行頭だけ見て読み飛ばす。
+			if (book.size - pos >= 5 && memcmp(book.data + pos, "sfen ", 5) == 0)
+			{
+				const std::string line = read_line(book.data, book.size, pos);
+				index.push_back({ sfen_key(line.substr(5)), u64(offset) });
+			}
+			else
+			{
+				const char* end = static_cast<const char*>(memchr(book.data + pos, '\n', book.size - pos));
+				pos = end ? size_t(end - book.data) + 1 : book.size;
+			}
+			progress.check(pos);
+		}
+
+		std::sort(index.begin(), index.end(), [](const Entry& lhs, const Entry& rhs) {
+			return lhs.key != rhs.key ? lhs.key < rhs.key : lhs.offset < rhs.offset;
+		});
+
+		BookIndexHeader header = {};
+		memcpy(header.magic, kMagic, sizeof(kMagic));
+		header.version = kVersion;
+		header.book_file_size = book.size;
+		header.book_file_mtime = book.mtime;
+		header.num_entries = index.size();
+		book.unmap();
+
+		const std::string index_filename = book_filename + kExtension;
+		std::ofstream ofs(index_filename, std::ios::out | std::ios::binary);
+		if (!ofs)
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		cout << "write " + index_filename << endl;
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(index.data()), sizeof(Entry) * index.size());
+		ofs.close();
+		if (ofs.fail())
+			return Tools::Result(Tools::ResultCode::FileWriteError);
+
+		sync_cout << "info string number of positions = " << index.size() << sync_endl;
+
+		return Tools::Result::Ok();
+	}
+
+	Tools::Result BookIndex::open(const std::string& book_filename)
+	{
+		close();
+
+		const std::string index_filename = book_filename + kExtension;
+		auto result = index_file.map(index_filename);
+		if (result.is_not_ok())
+			return result;
+
+		BookIndexHeader header;
+		if (index_file.size < sizeof(header))
+		{
+			close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+		memcpy(&header, index_file.data, sizeof(header));
+		if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0
+			|| header.version != kVersion
+			|| index_file.size != sizeof(header) + sizeof(Entry) * header.num_entries)
+		{
+			sync_cout << "info string Error! : invalid book index file : " + index_filename << sync_endl;
+			close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		result = book_file.map(book_filename);
+		if (result.is_not_ok())
+		{
+			close();
+			return result;
+		}
+
+		if (book_file.size != header.book_file_size || book_file.mtime != header.book_file_mtime)
+		{
+			sync_cout << "info string Error! : the book index file is out of date. rebuild it with \"makebook build_index\" : "
+					  + index_filename << sync_endl;
+			close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		entries = reinterpret_cast<const Entry*>(index_file.data + sizeof(header));
+		num_entries = size_t(header.num_entries);
+
+		return Tools::Result::Ok();
+	}
+
+	void BookIndex::close()
+	{
+		book_file.unmap();
+		index_file.unmap();
+		entries = nullptr;
+		num_entries = 0;
+	}
+
+	BookMovesPtr BookIndex::find(const std::string& sfen, bool ignore_book_ply) const
+	{
+		const u64 key = sfen_key(sfen);
+
+		auto it = std::lower_bound(entries, entries + num_entries, key,
+			[](const Entry& entry, u64 k) { return entry.key < k; });
+
+		for (; it != entries + num_entries && it->key == key; ++it)
+		{
+			size_t pos = size_t(it->offset);
+			if (pos >= book_file.size)
+				continue;
+
+			// hash値が一致しても、hash衝突や手数違いの可能性があるのでsfen文字列を比較する。
+			const std::string line = read_line(book_file.data, book_file.size, pos);
+			if (!is_sfen_line(line))
+				continue;
+
+			std::string sfen2 = ignore_book_ply ? StringExtension::trim_number(line.substr(5))
+												: StringExtension::trim(line.substr(5));
+			if (sfen2 != sfen)
+				continue;
+
+			// 見つけた。直後に書かれている指し手を読み込む。
+			BookMovesPtr pml_entry(new BookMoves());
+			while (pos < book_file.size)
+			{
+				const std::string move_line = read_line(book_file.data, book_file.size, pos);
+
+				// バージョン識別文字列、コメント行は読み飛ばす。
+				if ((move_line.length() >= 1 && move_line[0] == '#')
+					|| (move_line.length() >= 2 && move_line.compare(0, 2, "//") == 0))
+					continue;
+
+				// 次のsfenか空行に遭遇したらこれにて終了。
+				if (is_sfen_line(move_line) || move_line.length() == 0)
+					break;
+
+				pml_entry->push_back(BookMove::from_string(move_line));
+			}
+			pml_entry->sort_moves();
+			return pml_entry;
+		}
+
+		return BookMovesPtr();
+	}
+}
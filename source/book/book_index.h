@@ -0,0 +1,81 @@
+﻿#ifndef BOOK_INDEX_H_INCLUDED
+#define BOOK_INDEX_H_INCLUDED
+
+#include "../types.h"
+#include "../misc.h"
+
+#include "book.h"
+
+namespace Book
+{
+	// BookOnTheFly用の、定跡DBファイル(.db)に対する索引ファイル。
+	//
+	// MemoryBook::find_bookmoves_on_the_fly()は、定跡DBファイルをfstreamのseekg()とgetline()で
+	// 二分探索するので、巨大な定跡では1回のprobeごとに多数のsyscallとsfen文字列のparseが発生していた。
+	// 索引ファイルは、sfen文字列(手数を除いたもの)のhash値と、その"sfen "行のファイル上の位置の組を
+	// hash値順に並べたものであり、定跡DBファイルとともにメモリにmapして用いる。
+	// probeは、索引の二分探索と、hitした位置の数行を読むだけで済む。
+	//
+	// ・索引ファイルは"makebook build_index"コマンドで事前に作成しておく。ファイル名は定跡DBファイル名 + kExtension。
+	// ・定跡DBファイルのサイズか最終更新日時が索引の作成時と異なる場合は、索引を用いない。
+	// 　(最終更新日時を保たずに定跡DBファイルをコピーした場合も、索引を作り直す必要がある)
+	// ・open()の後は内部状態を書き換えないので、find()は複数スレッドから同時に呼び出して良い。
+	// ・hash値が衝突した場合や、手数違いの同一局面がある場合は、hash値の一致するすべての行のsfen文字列を比較する。
+	class BookIndex
+	{
+	public:
+		static constexpr const char* kExtension = ".idx";
+
+		// 索引の1要素
+		struct Entry
+		{
+			u64 key;    // 手数を除いたsfen文字列のhash値
+			u64 offset; // "sfen "行の先頭のファイル上の位置
+		};
+
+		BookIndex() {}
+		BookIndex(const BookIndex&) = delete;
+		BookIndex& operator=(const BookIndex&) = delete;
+		~BookIndex() { close(); }
+
+		// 定跡DBファイルから索引ファイル(book_filename + kExtension)を作成する。
+		static Tools::Result build(const std::string& book_filename);
+
+		// 定跡DBファイルと索引ファイルをメモリにmapする。
+		// 索引ファイルがない場合や、定跡DBファイルと対応していない場合はエラーが返る。
+		Tools::Result open(const std::string& book_filename);
+
+		void close();
+
+		// [ASYNC] sfenの局面の指し手を返す。登録されていなければnullptrが返る。
+		// sfenは末尾の空白を除去したもの。ignore_book_ply == trueのときは手数も除去したもの。
+		BookMovesPtr find(const std::string& sfen, bool ignore_book_ply) const;
+
+		// 索引に登録されている局面数
+		size_t size() const { return num_entries; }
+
+	private:
+		// メモリにmapしたファイル
+		struct MappedFile
+		{
+			const char* data = nullptr;
+			size_t size = 0;
+			// 最終更新日時(OSごとの表現のまま)
+			u64 mtime = 0;
+#if defined(_WIN32)
+			void* file_handle = nullptr;
+			void* mapping_handle = nullptr;
+#endif
+			Tools::Result map(const std::string& filename);
+			void unmap();
+		};
+
+		MappedFile book_file;
+		MappedFile index_file;
+
+		const Entry* entries = nullptr;
+		size_t num_entries = 0;
+	};
+}
+
+#endif // #ifndef BOOK_INDEX_H_INCLUDED
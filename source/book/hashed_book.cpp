@@ -0,0 +1,348 @@
+﻿#include "../config.h"
+#include "hashed_book.h"
+#include "../thread.h"
+
+#include <cstring>	// memcmp(),memcpy()
+#include <fstream>
+#include <deque>
+#include <unordered_set>
+
+using namespace std;
+
+namespace Book
+{
+	namespace {
+
+		// ファイルの先頭に置くheader
+		struct HashedBookHeader
+		{
+			char magic[8];
+			u32 version;
+			// このファイルを作ったビルドのHASH_KEY_BITS
+			u32 hash_key_bits;
+			// 平手の開始局面のkey。Zobrist::*の乱数表が一致しているかの確認に用いる。
+			u64 hirate_key[2];
+			u64 num_positions;
+			u64 num_slots;
+			u64 num_moves;
+		};
+
+		constexpr char kMagic[8] = { 'Y','O','H','B','O','O','K','1' };
+		constexpr u32 kVersion = 1;
+
+		// 局面のkeyを128bitで取り出す。
+		void get_key(const Position& pos, u64 key[2])
+		{
+#if HASH_KEY_BITS <= 64
+			key[0] = pos.hash_key();
+			key[1] = 0;
+#else
+			const auto k = pos.hash_key();
+			key[0] = k.p[0];
+			key[1] = k.p[1];
+#endif
+		}
+
+		void get_hirate_key(u64 key[2])
+		{
+			Position pos;
+			StateInfo si;
+			pos.set_hirate(&si, Threads.main());
+			get_key(pos, key);
+		}
+
+		struct KeyHash {
+			size_t operator()(const pair<u64, u64>& k) const { return size_t(k.first ^ k.second); }
+		};
+
+		HashedBookMove pack(const BookMove& bm)
+		{
+			HashedBookMove hm;
+			hm.move       = bm.move.to_u16();
+			hm.ponder     = bm.ponder.to_u16();
+			hm.value      = s32(bm.value);
+			hm.depth      = s32(bm.depth);
+			hm.move_count = u32(std::min(bm.move_count, u64(UINT32_MAX)));
+			return hm;
+		}
+
+		BookMove unpack(const HashedBookMove& hm)
+		{
+			return BookMove(Move16(hm.move), Move16(hm.ponder), hm.value, hm.depth, hm.move_count);
+		}
+	}
+
+	bool HashedBook::is_hashed_book_file(const std::string& filename)
+	{
+		const std::string ext = kExtension;
+		return filename.size() >= ext.size()
+			&& filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0;
+	}
+
+	size_t HashedBook::slot_index(const u64 key[2]) const
+	{
+		// key[0]のbit0は手番なので、そのまま下位bitを使わずに混ぜてから上位bitを用いる。
+		const u64 h = (key[0] ^ key[1]) * 0x9E3779B97F4A7C15ULL;
+		return size_t(h >> 32) & (slots.size() - 1);
+	}
+
+	const HashedBookSlot* HashedBook::find_slot(const u64 key[2]) const
+	{
+		if (slots.empty())
+			return nullptr;
+
+		// 空きslotのない(壊れた)ファイルを読み込んだ時に無限ループにならないよう、一周したら打ち切る。
+		const size_t mask = slots.size() - 1;
+		size_t i = slot_index(key);
+		for (size_t probe = 0; probe < slots.size(); ++probe, i = (i + 1) & mask)
+		{
+			const auto& slot = slots[i];
+			if (slot.moves == 0)
+				return nullptr;
+			if (slot.key[0] == key[0] && slot.key[1] == key[1])
+				return &slot;
+		}
+		return nullptr;
+	}
+
+	BookMovesPtr HashedBook::find(const Position& pos) const
+	{
+		u64 key[2];
+		get_key(pos, key);
+
+		const auto* slot = find_slot(key);
+		if (slot == nullptr)
+			return BookMovesPtr();
+
+		std::vector<BookMove> book_moves;
+		book_moves.reserve(slot->num_moves());
+		const auto first = slot->first_move();
+		for (size_t i = 0; i < slot->num_moves(); ++i)
+			book_moves.push_back(unpack(moves[first + i]));
+
+		// build()のときにsort済みの順で格納してあるので、sort済みとして返す。
+		return BookMovesPtr(new BookMoves(std::move(book_moves)));
+	}
+
+	void HashedBook::build(MemoryBook& book)
+	{
+		slots.clear();
+		moves.clear();
+		num_positions = 0;
+
+		// keyごとに、手数の一番若いエントリーを採用する。
+		// key → (指し手, ply)
+		unordered_map<pair<u64, u64>, pair<BookMovesPtr, int>, KeyHash> entries;
+
+		Position pos;
+		StateInfo si;
+		book.foreach([&](const std::string& sfen, const BookMovesPtr book_moves)
+			{
+				if (book_moves == nullptr || book_moves->size() == 0)
+					return;
+
+				pos.set(sfen, &si, Threads.main());
+				u64 key[2];
+				get_key(pos, key);
+
+				const int ply = pos.game_ply();
+				auto it = entries.find({ key[0], key[1] });
+				if (it == entries.end() || ply < it->second.second)
+					entries[{ key[0], key[1] }] = { book_moves, ply };
+			});
+
+		// load factorが1/2以下になるようにする。
+		size_t num_slots = 1;
+		while (num_slots < entries.size() * 2)
+			num_slots <<= 1;
+		slots.resize(num_slots, HashedBookSlot{ {0, 0}, 0 });
+
+		const size_t mask = num_slots - 1;
+		for (auto& it : entries)
+		{
+			const u64 key[2] = { it.first.first, it.first.second };
+			auto& book_moves = *it.second.first;
+			book_moves.sort_moves();
+
+			const u64 first = moves.size();
+			size_t n = 0;
+			for (auto& bm : book_moves)
+			{
+				// 上位の指し手から格納しているので、上限を超えた分は捨てて良い。
+				if (n == HashedBookSlot::kMaxMoves)
+					break;
+				moves.push_back(pack(bm));
+				++n;
+			}
+
+			size_t i = slot_index(key);
+			while (slots[i].moves != 0)
+				i = (i + 1) & mask;
+
+			slots[i].key[0] = key[0];
+			slots[i].key[1] = key[1];
+			slots[i].moves = (first << HashedBookSlot::kNumMovesBits) | n;
+		}
+
+		num_positions = entries.size();
+	}
+
+	size_t HashedBook::export_to(MemoryBook& book) const
+	{
+		unordered_set<pair<u64, u64>, KeyHash> visited;
+		deque<std::string> frontier;
+
+		for (auto& start_sfen : BookTools::get_start_sfens())
+			frontier.push_back(start_sfen.substr(5)); // 先頭の"sfen "を除去
+
+		Position pos;
+		StateInfo si, si2;
+		while (!frontier.empty())
+		{
+			const std::string sfen = frontier.front();
+			frontier.pop_front();
+
+			pos.set(sfen, &si, Threads.main());
+			u64 key[2];
+			get_key(pos, key);
+
+			if (!visited.insert({ key[0], key[1] }).second)
+				continue;
+
+			const auto* slot = find_slot(key);
+			if (slot == nullptr)
+				continue;
+
+			const auto first = slot->first_move();
+			for (size_t i = 0; i < slot->num_moves(); ++i)
+			{
+				const BookMove bm = unpack(moves[first + i]);
+				book.insert(sfen, bm);
+
+				// 次の局面へ進める。hash衝突などで非合法手になっている可能性があるので確認しておく。
+				const Move m = pos.to_move(bm.move);
+				if (!pos.pseudo_legal_s<true>(m) || !pos.legal(m))
+					continue;
+
+				pos.do_move(m, si2);
+				frontier.push_back(pos.sfen());
+				pos.undo_move(m);
+			}
+		}
+
+		const size_t exported = book.size();
+		if (exported < num_positions)
+			sync_cout << "info string " << (num_positions - exported)
+					  << " positions are not reachable from the start positions and are not exported." << sync_endl;
+
+		return exported;
+	}
+
+	Tools::Result HashedBook::read(const std::string& filename)
+	{
+		slots.clear();
+		moves.clear();
+		num_positions = 0;
+
+		std::ifstream ifs(filename, std::ios::in | std::ios::binary);
+		if (!ifs)
+		{
+			sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+		}
+
+		// ファイルサイズ。headerに書かれているサイズと照合する。
+		ifs.seekg(0, std::ios::end);
+		const u64 file_size = u64(ifs.tellg());
+		ifs.seekg(0, std::ios::beg);
+
+		HashedBookHeader header;
+		if (!ifs.read(reinterpret_cast<char*>(&header), sizeof(header))
+			|| memcmp(header.magic, kMagic, sizeof(kMagic)) != 0
+			|| header.version != kVersion)
+		{
+			sync_cout << "info string Error! : not a hashed book file : " + filename << sync_endl;
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		u64 hirate_key[2];
+		get_hirate_key(hirate_key);
+		if (header.hash_key_bits != HASH_KEY_BITS
+			|| header.hirate_key[0] != hirate_key[0] || header.hirate_key[1] != hirate_key[1])
+		{
+			sync_cout << "info string Error! : the hashed book was built with a different HASH_KEY_BITS : " + filename
+					  << " , hash_key_bits = " << header.hash_key_bits << sync_endl;
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		// 壊れたファイルで巨大なメモリを確保したり、範囲外を読んだりしないように、headerの値を検証する。
+		// num_slots , num_movesはそれぞれファイルサイズから上限が決まるので、先に比較しておけば乗算は溢れない。
+		const u64 body_size = file_size - sizeof(header);
+		if (header.num_slots == 0
+			|| (header.num_slots & (header.num_slots - 1)) != 0
+			|| header.num_slots > body_size / sizeof(HashedBookSlot)
+			|| header.num_moves > body_size / sizeof(HashedBookMove)
+			|| header.num_slots * sizeof(HashedBookSlot) + header.num_moves * sizeof(HashedBookMove) != body_size
+			|| header.num_positions > header.num_slots)
+		{
+			sync_cout << "info string Error! : the hashed book is broken : " + filename << sync_endl;
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		slots.resize(size_t(header.num_slots));
+		moves.resize(size_t(header.num_moves));
+		if (!ifs.read(reinterpret_cast<char*>(slots.data()), sizeof(HashedBookSlot) * slots.size())
+			|| !ifs.read(reinterpret_cast<char*>(moves.data()), sizeof(HashedBookMove) * moves.size()))
+		{
+			slots.clear();
+			moves.clear();
+			sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		// 各slotの指し手がarenaに収まっているか。
+		for (const auto& slot : slots)
+			if (slot.moves != 0 && slot.first_move() + slot.num_moves() > moves.size())
+			{
+				slots.clear();
+				moves.clear();
+				sync_cout << "info string Error! : the hashed book is broken : " + filename << sync_endl;
+				return Tools::Result(Tools::ResultCode::FileReadError);
+			}
+
+		num_positions = size_t(header.num_positions);
+
+		return Tools::Result::Ok();
+	}
+
+	Tools::Result HashedBook::write(const std::string& filename) const
+	{
+		std::ofstream ofs(filename, std::ios::out | std::ios::binary);
+		if (!ofs)
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		cout << "write " + filename << endl;
+
+		HashedBookHeader header = {};
+		memcpy(header.magic, kMagic, sizeof(kMagic));
+		header.version = kVersion;
+		header.hash_key_bits = HASH_KEY_BITS;
+		get_hirate_key(header.hirate_key);
+		header.num_positions = num_positions;
+		header.num_slots = slots.size();
+		header.num_moves = moves.size();
+
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(reinterpret_cast<const char*>(slots.data()), sizeof(HashedBookSlot) * slots.size());
+		ofs.write(reinterpret_cast<const char*>(moves.data()), sizeof(HashedBookMove) * moves.size());
+
+		if (ofs.fail())
+			return Tools::Result(Tools::ResultCode::FileWriteError);
+
+		ofs.close();
+		if (ofs.fail())
+			return Tools::Result(Tools::ResultCode::FileCloseError);
+
+		return Tools::Result::Ok();
+	}
+}
@@ -0,0 +1,102 @@
+﻿#ifndef HASHED_BOOK_H_INCLUDED
+#define HASHED_BOOK_H_INCLUDED
+
+#include "../types.h"
+#include "../position.h"
+#include "../misc.h"
+
+#include "book.h"
+
+namespace Book
+{
+	// sfen文字列の代わりに局面のhash keyをkeyとする、省メモリな定跡データベース。
+	//
+	// BookType(std::unordered_map<std::string, BookMovesPtr>)では、1局面ごとにsfen文字列、
+	// shared_ptr<BookMoves>、std::vector<BookMove>、std::recursive_mutexをheapに確保するので、
+	// テラショック定跡のような巨大な定跡ではメモリが数十GB必要になる。
+	// このクラスでは、
+	// ・局面はPosition::hash_key()の128bit(HASH_KEY_BITS == 64のときは上位64bitが0)で識別し、
+	// ・指し手は16byteに詰めて1本の配列(arena)に並べ、
+	// ・局面からarena上の位置へはopen addressing(線形探索)のhash tableで引く。
+	// ファイル上の形式もメモリ上の形式と同じで、read()は配列に丸読みするだけである。
+	//
+	// 注意)
+	// ・hash keyにはplyが含まれないので、IgnoreBookPly == trueと同じ挙動になる。
+	// 　手数違いの同一局面が.dbに含まれている場合は、手数の一番若いものだけを変換する。(write_book()と同じ)
+	// ・hash keyはZobrist::*の乱数表に依存するので、HASH_KEY_BITSが異なるビルドで作ったファイルは読み込めない。
+	// ・hash keyから局面は復元できないので、.dbへの変換は平手・駒落ちの開始局面から定跡の指し手で辿れる局面に限られる。
+
+	// 定跡の指し手1つ分。(16 bytes)
+	struct HashedBookMove
+	{
+		u16 move;       // Move16
+		u16 ponder;     // Move16
+		s32 value;
+		s32 depth;
+		u32 move_count; // BookMove::move_countがu32に収まらない場合は飽和させる。
+	};
+	static_assert(sizeof(HashedBookMove) == 16, "");
+
+	// hash tableの1 slot分。(24 bytes)
+	// moves == 0 のslotは空きslot。
+	struct HashedBookSlot
+	{
+		u64 key[2];
+		// 上位54bitがarena上の先頭の指し手のindex、下位10bitがこの局面の指し手の数。
+		u64 moves;
+
+		static constexpr int kNumMovesBits = 10;
+		static constexpr u64 kMaxMoves = (1ULL << kNumMovesBits) - 1;
+
+		u64 first_move() const { return moves >> kNumMovesBits; }
+		size_t num_moves() const { return size_t(moves & kMaxMoves); }
+	};
+	static_assert(sizeof(HashedBookSlot) == 24, "");
+
+	class HashedBook
+	{
+	public:
+		// この拡張子のファイルをMemoryBook::read_book()に渡すと、HashedBookとして読み込む。
+		static constexpr const char* kExtension = ".hdb";
+
+		static bool is_hashed_book_file(const std::string& filename);
+
+		// ファイルから読み込む。
+		Tools::Result read(const std::string& filename);
+
+		// ファイルに書き出す。
+		Tools::Result write(const std::string& filename) const;
+
+		// sfen文字列をkeyとするMemoryBookから構築する。(.db → .hdb)
+		// 事前にis_ready()は呼び出されているものとする。(Position::set()で必要)
+		void build(MemoryBook& book);
+
+		// 平手・駒落ちの開始局面から定跡の指し手で辿れる局面をMemoryBookに書き出す。(.hdb → .db)
+		// 書き出した局面数を返す。
+		size_t export_to(MemoryBook& book) const;
+
+		// [ASYNC] 局面posの定跡の指し手を返す。登録されていなければnullptrが返る。
+		// 読み込み後は内部状態を書き換えないので、複数スレッドから同時に呼び出して良い。
+		BookMovesPtr find(const Position& pos) const;
+
+		// 登録されている局面数
+		size_t size() const { return num_positions; }
+
+		// 登録されている指し手の数
+		size_t num_moves() const { return moves.size(); }
+
+	private:
+		const HashedBookSlot* find_slot(const u64 key[2]) const;
+		size_t slot_index(const u64 key[2]) const;
+
+		// open addressingのhash table。要素数は2の累乗。
+		std::vector<HashedBookSlot> slots;
+
+		// 全局面の指し手を並べたもの。
+		std::vector<HashedBookMove> moves;
+
+		size_t num_positions = 0;
+	};
+}
+
+#endif // #ifndef HASHED_BOOK_H_INCLUDED
@@ -92,6 +92,9 @@ namespace Book
 		cout << "> makebook merge book_src1.db book_src2.db book_merged.db" << endl;
 		cout << "> makebook sort book_src.db book_sorted.db" << endl;
 		cout << "> makebook convert_from_apery book_src.bin book_converted.db" << endl;
+		cout << "> makebook convert_to_hashed book_src.db book_converted.hdb" << endl;
+		cout << "> makebook convert_from_hashed book_src.hdb book_converted.db" << endl;
+		cout << "> makebook build_index book.db" << endl;
 		cout << "> makebook build_tree book2019.db user_book1.db" << endl;
 		cout << "> makebook peta_shock book.db user_book1.db" << endl;
 	}
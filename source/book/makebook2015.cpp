@@ -10,6 +10,8 @@
 #include "../learn/multi_think.h"
 #include "../tt.h"
 #include "apery_book.h"
+#include "hashed_book.h"
+#include "book_index.h"
 
 #include <sstream>
 #include <unordered_set>
@@ -128,9 +130,16 @@ namespace Book
 		bool convert_from_apery = token == "convert_from_apery";
 		// 定跡の変換
 		bool convert_to_apery = token == "convert_to_apery";
+		// 定跡の変換
+		bool convert_to_hashed = token == "convert_to_hashed";
+		// 定跡の変換
+		bool convert_from_hashed = token == "convert_from_hashed";
+		// BookOnTheFly用の索引ファイルの作成
+		bool build_index = token == "build_index";
 		
 		// いずれのコマンドでもないなら、このtokenのコマンドを自分は処理できない。
-		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery || convert_to_apery))
+		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery || convert_to_apery
+			|| convert_to_hashed || convert_from_hashed || build_index))
 			return 0;
 
 		if (from_sfen || from_thinking)
@@ -658,6 +667,41 @@ namespace Book
 
 			book.write_apery_book(book_dst);
 		}
+		else if (convert_to_hashed) {
+			MemoryBook book;
+			string book_src, book_dst;
+			is >> book_src >> book_dst;
+			cout << "convert book from " << book_src << " , write hashed book to " << book_dst << endl;
+			book.read_book(book_src);
+
+			HashedBook hashed_book;
+			hashed_book.build(book);
+			cout << "positions = " << hashed_book.size() << " , moves = " << hashed_book.num_moves() << endl;
+			auto result = hashed_book.write(book_dst);
+			if (result.is_not_ok())
+				cout << "Error! : can't write hashed book : " << book_dst << " , " << result.to_string() << endl;
+		}
+		else if (convert_from_hashed) {
+			string book_src, book_dst;
+			is >> book_src >> book_dst;
+			cout << "convert hashed book from " << book_src << " , write to " << book_dst << endl;
+
+			HashedBook hashed_book;
+			if (hashed_book.read(book_src).is_ok())
+			{
+				MemoryBook book;
+				hashed_book.export_to(book);
+				auto result = book.write_book(book_dst);
+				if (result.is_not_ok())
+					cout << "Error! : can't write book : " << book_dst << " , " << result.to_string() << endl;
+			}
+		}
+		else if (build_index) {
+			string book_src;
+			is >> book_src;
+			cout << "build book index for " << book_src << " , write to " << book_src + BookIndex::kExtension << endl;
+			BookIndex::build(book_src);
+		}
 
 		return 1;
 	}
@@ -165,6 +165,10 @@
 // 評価関数を計算したときに、それをHashTableに記憶しておく機能。KPPT評価関数においてのみサポート。
 // #define USE_EVAL_HASH
 
+// EvalHashのprobe/storeの回数を数え、"evalhash"コマンドでhit率などを表示する。(NNUEのみ)
+// 評価関数の呼び出しごとにカウンターを更新するので、EvalHashのサイズを決めるときにだけ有効にする。
+// #define EVAL_HASH_STATS
+
 
 // 評価関数パラメーターを共有メモリを用いて他プロセスのものと共有する。
 // 少ないメモリのマシンで思考エンジンを何十個も立ち上げようとしたときにメモリ不足になるので
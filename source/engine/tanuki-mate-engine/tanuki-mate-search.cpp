@@ -3,6 +3,7 @@
 
 #include <unordered_set>
 #include <cstring>	// std::memset()
+#include <atomic>
 
 #include "../../extra/all.h"
 
@@ -18,6 +19,16 @@ using namespace Search;
 // TODO(someone): 優越関係の実装
 // TODO(someone): 証明駒の実装
 // TODO(someone): Source Node Detection Algorithm (SNDA)の実装
+//
+// 並列化について
+//   "Threads"オプションで指定したスレッドがすべてrootから同じdf-pnを行い、置換表を共有する。(Shared-memory Parallel df-pn)
+//   置換表のClusterごとにspin lockを持たせて、TTEntryの読み書きはそのlockの中でコピーを介して行う。
+//   ただ同じことをすると全スレッドが同じ経路を探索してしまうので、pn(ORノード)/dn(ANDノード)が同じ子ノードの中からは
+//   探索中のスレッドが少ないものを選ぶようにしてある。
+//   ※　SPDFPNのvirtual proof numberのように探索中の子ノードのpn/dnそのものを大きく見せると、
+//      このノードのpn/dnや子ノードに渡す閾値と辻褄が合わなくなり、閾値を超えている子ノードを選び続けて空回りすることがあった。
+//
+//   Kaneko, T.: Parallel Depth First Proof Number Search. In: Proceedings of the AAAI-10, pp. 95-100 (2010)
 // 
 // リンク＆参考文献
 //
@@ -142,11 +153,24 @@ namespace MateEngine
 
 		// TTEntryを束ねたもの。
 		struct Cluster {
-			// TTEntry 20バイト×3 + 4(padding) == 64
+			// TTEntry 20バイト×3 + 4(lock) == 64
 			static constexpr int kNumEntries = 3;
-			int padding;
+
+			// 並列探索の時にこのClusterを排他するためのspin lock。0ならunlock。
+			// (置換表はゼロクリアで初期化されるので、その状態でunlockになっている必要がある)
+			std::atomic<uint32_t> lock;
 
 			TTEntry entries[kNumEntries];
+
+			void Lock() {
+				while (lock.exchange(1, std::memory_order_acquire))
+					while (lock.load(std::memory_order_relaxed))
+						;
+			}
+
+			void Unlock() {
+				lock.store(0, std::memory_order_release);
+			}
 		};
 		// Clusterのサイズは、CacheLineSizeの整数倍であること。
 		static_assert((sizeof(Cluster) % CacheLineSize) == 0, "");
@@ -160,57 +184,100 @@ namespace MateEngine
 			return sizeof(Cluster) * num_clusters;
 		}
 
-		// 指定したKeyのTTEntryを返す。見つからなければ初期化された新規のTTEntryを返す。
-		TTEntry& LookUp(Key key, Color root_color) {
-			auto& entries = tt[key & clusters_mask];
+		// 指定したKeyのTTEntryのコピーを返す。見つからなければ初期化された新規のTTEntryを返す。
+		// 他のスレッドが同時に書き換えるので参照は返さない。更新したい時はコピーを書き換えてStore()で書き戻すこと。
+		TTEntry LookUp(Key key, Color root_color) {
+			auto& cluster = tt[key & clusters_mask];
 			uint32_t hash_high = ((key >> 32) & ~1) | root_color;
 
 			// 検索条件に合致するエントリを返す
 
-			for (auto& entry : entries.entries)
+			cluster.Lock();
+			for (const auto& entry : cluster.entries)
 				if (hash_high == entry.hash_high && entry.generation == generation)
-					return entry;
+				{
+					TTEntry result = entry;
+					cluster.Unlock();
+					return result;
+				}
 				// TODO(yane) : ここ、優劣関係も見たほうが良いのでは..
 				// cf.
 				//	https://tadaoyamaoka.hatenablog.com/entry/2018/05/20/150355
 				//  https://github.com/TadaoYamaoka/ElmoTeacherDecoder/blob/6c8d476d251e72627e98708bf82b6f307933dc21/extract_mated_hcp/dfpn.cpp
+			cluster.Unlock();
+
+			// 合致するTTEntryが見つからなかった。置換表への書き込みはStore()の時まで行わない。
+			TTEntry result;
+			result.init(hash_high, generation);
+			return result;
+		}
+
+		TTEntry LookUp(Position& n, Color root_color) {
+			return LookUp(n.key(), root_color);
+		}
+
+		// moveを指した後の子ノードの置換表エントリを返す
+		TTEntry LookUpChildEntry(Position& n, Move move, Color root_color) {
+			return LookUp(n.key_after(move), root_color);
+		}
+
+		// LookUp()で得たTTEntryを更新したものを置換表に書き戻す。
+		void Store(Key key, Color root_color, const TTEntry& value) {
+			auto& cluster = tt[key & clusters_mask];
+			uint32_t hash_high = ((key >> 32) & ~1) | root_color;
 
-			// 合致するTTEntryが見つからなかったので空きエントリーを探して返す
+			cluster.Lock();
 
-			for (auto& entry : entries.entries)
+			// 書き込む先のentry
+			TTEntry* target = nullptr;
+
+			for (auto& entry : cluster.entries)
+				if (hash_high == entry.hash_high && entry.generation == generation)
+				{
+					// 他のスレッドがこのノードにより短い距離で到達しているかも知れない。
+					uint16_t minimum_distance = std::min(entry.minimum_distance, value.minimum_distance);
+
+					// 他のスレッドが既に証明・反証しているなら、LookUp()した時点の古い値で上書きしてはならない。
+					bool solved = entry.pn == 0 || entry.dn == 0;
+					if (!solved || value.pn == 0 || value.dn == 0)
+						entry = value;
+
+					entry.minimum_distance = minimum_distance;
+					cluster.Unlock();
+					return;
+				}
+
+			// 合致するTTEntryが見つからなかったので空きエントリーを探す
+
+			for (auto& entry : cluster.entries)
 				// 世代が違うので空きとみなせる
 				// ※ hash_high == 0を条件にしてしまうと 1/2^32ぐらいの確率でいつまでも書き込めないentryができてしまう。
 				if (entry.generation != generation)
 				{
-					entry.init(hash_high , generation);
-					return entry;
+					target = &entry;
+					break;
 				}
 
 			// 空きエントリが見つからなかったので一番不要っぽいentryを潰す。
-
 			// 探索したノード数が一番少ないnodeから優先して潰す。
-			TTEntry* best_entry = nullptr;
-			uint32_t best_node_searched = UINT32_MAX;
-
-			for (auto& entry : entries.entries)
+			if (target == nullptr)
 			{
-				if (best_node_searched > entry.num_searched) {
-					best_entry = &entry;
-					best_node_searched = entry.num_searched;
+				uint32_t best_node_searched = UINT32_MAX;
+
+				for (auto& entry : cluster.entries)
+				{
+					if (best_node_searched > entry.num_searched) {
+						target = &entry;
+						best_node_searched = entry.num_searched;
+					}
 				}
 			}
 
-			best_entry->init(hash_high , generation);
-			return *best_entry;
-		}
+			*target = value;
+			target->hash_high = hash_high;
+			target->generation = generation;
 
-		TTEntry& LookUp(Position& n, Color root_color) {
-			return LookUp(n.key(), root_color);
-		}
-
-		// moveを指した後の子ノードの置換表エントリを返す
-		TTEntry& LookUpChildEntry(Position& n, Move move, Color root_color) {
-			return LookUp(n.key_after(move), root_color);
+			cluster.Unlock();
 		}
 
 		// 置換表を確保する。
@@ -315,27 +382,72 @@ namespace MateEngine
 	// 置換表クラスの実体
 	TranspositionTable transposition_table;
 
+	// 並列探索の時に、各ノードをいま何スレッドが探索しているかを数えておくためのtable。
+	// pn/dnが同じ子ノードの中から、他のスレッドが探索していないものを選ぶのに使う。
+	// hashの衝突は気にしない。(探索の効率が少し落ちるだけで、探索結果には影響しない)
+	struct SearchingNodeTable
+	{
+		static constexpr size_t kSize = 1 << 16;
+
+		// keyのノードの探索を開始する。
+		void Enter(Key key) { counts[key & (kSize - 1)].fetch_add(1, std::memory_order_relaxed); }
+
+		// keyのノードの探索を終了する。
+		void Leave(Key key) { counts[key & (kSize - 1)].fetch_sub(1, std::memory_order_relaxed); }
+
+		// keyのノードを探索中のスレッド数
+		uint32_t Count(Key key) const { return counts[key & (kSize - 1)].load(std::memory_order_relaxed); }
+
+		std::atomic<uint32_t> counts[kSize];
+	};
+
+	SearchingNodeTable searching_nodes;
+
+	// 全スレッドで共有する探索の状態
+
+	// 複数スレッドで探索しているか。
+	bool parallel_search;
+
+	// どれかのスレッドがrootの探索を終えたか。(rootの証明・反証ができたか)
+	std::atomic<bool> root_searched;
+
+	// 制限時間・制限ノード数を超えたか。
+	std::atomic<bool> search_timeup;
+
+	// 直前の探索で詰み手順を返したか。(Search::mate_found()で返す)
+	std::atomic<bool> last_mate_found;
+
+	// 探索開始時刻
+	std::chrono::system_clock::time_point search_start_time;
+
+	// 探索を打ち切るべきか。
+	bool IsStopped() {
+		return Threads.stop.load(std::memory_order_relaxed) || root_searched.load(std::memory_order_relaxed);
+	}
+
 	// TODO(tanuki-): ネガマックス法的な書き方に変更する
 	void DFPNwithTCA(Position& n, uint32_t thpn, uint32_t thdn, bool inc_flag, bool or_node, uint16_t depth,
-		Color root_color, const std::chrono::system_clock::time_point& start_time, bool& timeup) {
-		if (Threads.stop.load(std::memory_order_relaxed)) {
+		Color root_color) {
+		if (IsStopped()) {
 			return;
 		}
 
-		auto nodes_searched = n.this_thread()->nodes.load(memory_order_relaxed);
+		Thread* this_thread = n.this_thread();
+		auto nodes_searched = this_thread->nodes.load(memory_order_relaxed);
 
-		if (nodes_searched && (nodes_searched % 1000000) == 0)
+		if (nodes_searched && (nodes_searched % 1000000) == 0 && this_thread == Threads.main())
 		{
 			// このタイミングで置換表の世代を進める
 			//++transposition_table.now_time;
 
+			auto total_nodes = Threads.nodes_searched();
 			auto current_time = std::chrono::system_clock::now();
 			auto time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-				current_time - start_time).count();
+				current_time - search_start_time).count();
 			time_ms = std::max(time_ms, decltype(time_ms)(1));
-			int64_t nps = nodes_searched * 1000LL / time_ms;
+			int64_t nps = total_nodes * 1000LL / time_ms;
 
-			sync_cout << "info  time " << time_ms << " nodes " << nodes_searched << " nps "
+			sync_cout << "info  time " << time_ms << " nodes " << total_nodes << " nps "
 				<< nps << " hashfull " << transposition_table.hashfull() << sync_endl;
 		}
 
@@ -346,28 +458,33 @@ namespace MateEngine
 			auto elapsed_ms = Time.elapsed_from_ponderhit();
 			if (elapsed_ms > Limits.mate)
 			{
-				timeup = true;
+				search_timeup = true;
 				Threads.stop = true;
 				return;
 			}
 		}
 
 		// 探索ノード数のチェック。
-		// 探索をマルチスレッドでやっていないので、nodes_searchedを求めるコストがなく、
-		// 毎回チェックしてもどうということはないはず。
-		if (Limits.nodes != 0 && nodes_searched >= (uint64_t)Limits.nodes)
+		// シングルスレッドならnodes_searchedを求めるコストがなく、毎回チェックしてもどうということはない。
+		// 並列探索の時は全スレッドの合計を求める必要があるので、1024回に1回だけチェックする。
+		if (Limits.nodes != 0
+			&& (parallel_search ? (nodes_searched % 1024 == 0 && Threads.nodes_searched() >= (uint64_t)Limits.nodes)
+				                : nodes_searched >= (uint64_t)Limits.nodes))
 		{
-			timeup = true;
+			search_timeup = true;
 			Threads.stop = true;
 			return;
 		}
 
-		auto& entry = transposition_table.LookUp(n, root_color);
+		// このノードの置換表の値のコピー。更新したらStore()で置換表に書き戻す。
+		const Key key = n.key();
+		auto entry = transposition_table.LookUp(key, root_color);
 
 		if (depth > kMaxDepth) {
 			entry.pn = kInfinitePnDn;
 			entry.dn = 0;
 			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			transposition_table.Store(key, root_color, entry);
 			return;
 		}
 
@@ -378,6 +495,7 @@ namespace MateEngine
 			entry.pn = 0;
 			entry.dn = kInfinitePnDn;
 			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			transposition_table.Store(key, root_color, entry);
 			return;
 		}
 
@@ -388,7 +506,7 @@ namespace MateEngine
 		for (const auto& move : move_picker) {
 		  // unproven old childの定義はminimum distanceがこのノードよりも小さいノードだと理解しているのだけど、
 		  // 合っているか自信ない
-		  const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+		  const auto child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
 		  if (entry.minimum_distance > child_entry.minimum_distance &&
 		      child_entry.pn != kInfinitePnDn &&
 		      child_entry.dn != kInfinitePnDn) {
@@ -421,6 +539,7 @@ namespace MateEngine
 				entry.dn = 0;
 				entry.minimum_distance = std::min(entry.minimum_distance, depth);
 			}
+			transposition_table.Store(key, root_color, entry);
 			return;
 
 		case REPETITION_LOSE:
@@ -439,6 +558,7 @@ namespace MateEngine
 				entry.dn = kInfinitePnDn;
 				entry.minimum_distance = std::min(entry.minimum_distance, depth);
 			}
+			transposition_table.Store(key, root_color, entry);
 			return;
 
 		case REPETITION_DRAW:
@@ -447,6 +567,7 @@ namespace MateEngine
 			entry.pn = kInfinitePnDn;
 			entry.dn = 0;
 			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			transposition_table.Store(key, root_color, entry);
 			return;
 
 		default:
@@ -469,6 +590,7 @@ namespace MateEngine
 			}
 
 			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			transposition_table.Store(key, root_color, entry);
 			return;
 		}
 
@@ -477,7 +599,7 @@ namespace MateEngine
 		entry.minimum_distance = std::min(entry.minimum_distance, depth);
 
 		bool first_time = true;
-		while (!Threads.stop.load(std::memory_order_relaxed)) {
+		while (!IsStopped()) {
 			++entry.num_searched;
 
 			// determine whether thpn and thdn are increased.
@@ -490,7 +612,7 @@ namespace MateEngine
 			for (const auto& move : move_picker) {
 				// unproven old childの定義はminimum distanceがこのノードよりも小さいノードだと理解しているのだけど、
 				// 合っているか自信ない
-				const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+				const auto child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
 				if (entry.minimum_distance > child_entry.minimum_distance &&
 					child_entry.pn != kInfinitePnDn &&
 					child_entry.dn != kInfinitePnDn) {
@@ -505,7 +627,7 @@ namespace MateEngine
 				entry.dn = 0;
 				bool is_mate = false;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const auto child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
 					if (child_entry.pn == 0){
 						is_mate = true;
 					}
@@ -526,7 +648,7 @@ namespace MateEngine
 				entry.dn = kInfinitePnDn;
 				bool is_nomate = false;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const auto child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
 					if(child_entry.dn == 0){
 						is_nomate = true;
 					}
@@ -569,7 +691,9 @@ namespace MateEngine
 			//   thpn child = thpn - pn(n) + pn(n1);
 			//   thdn child = min(thdn, dn(n2) + 1);
 			// }
+			// 並列探索の時は、pn(ORノード)/dn(ANDノード)が同じなら探索中のスレッドが少ない子ノードを優先する。
 			Move best_move = MOVE_NONE; // gccで初期化していないという警告がでるのでその回避
+			Key best_key = 0;
 			int thpn_child;
 			int thdn_child;
 			if (or_node) {
@@ -578,18 +702,24 @@ namespace MateEngine
 				uint32_t second_best_pn = kInfinitePnDn;
 				uint32_t best_dn = 0;
 				uint32_t best_num_search = UINT32_MAX;
+				uint32_t best_searching = UINT32_MAX;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const Key child_key = n.key_after(move);
+					const auto child_entry = transposition_table.LookUp(child_key, root_color);
 					if(avoid_loop && entry.minimum_distance > child_entry.minimum_distance && child_entry.pn != 0){
 					  continue;
 					}
+					const uint32_t searching = parallel_search ? searching_nodes.Count(child_key) : 0;
 					if (child_entry.pn < best_pn ||
-						(child_entry.pn == best_pn && best_num_search > child_entry.num_searched)) {
+						(child_entry.pn == best_pn && (best_searching > searching ||
+							(best_searching == searching && best_num_search > child_entry.num_searched)))) {
 						second_best_pn = best_pn;
 						best_pn = child_entry.pn;
 						best_dn = child_entry.dn;
 						best_move = move;
+						best_key = child_key;
 						best_num_search = child_entry.num_searched;
+						best_searching = searching;
 					}
 					else if (child_entry.pn < second_best_pn) {
 						second_best_pn = child_entry.pn;
@@ -604,14 +734,20 @@ namespace MateEngine
 				uint32_t second_best_dn = kInfinitePnDn;
 				uint32_t best_pn = 0;
 				uint32_t best_num_search = UINT32_MAX;
+				uint32_t best_searching = UINT32_MAX;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const Key child_key = n.key_after(move);
+					const auto child_entry = transposition_table.LookUp(child_key, root_color);
+					const uint32_t searching = parallel_search ? searching_nodes.Count(child_key) : 0;
 					if (child_entry.dn < best_dn ||
-						(child_entry.dn == best_dn && best_num_search > child_entry.num_searched)) {
+						(child_entry.dn == best_dn && (best_searching > searching ||
+							(best_searching == searching && best_num_search > child_entry.num_searched)))) {
 						second_best_dn = best_dn;
 						best_dn = child_entry.dn;
 						best_pn = child_entry.pn;
 						best_move = move;
+						best_key = child_key;
+						best_searching = searching;
 					}
 					else if (child_entry.dn < second_best_dn) {
 						second_best_dn = child_entry.dn;
@@ -625,14 +761,26 @@ namespace MateEngine
 			if (best_move == MOVE_NONE && or_node){
 			  entry.pn = kInfinitePnDn;
 			  entry.dn = 0;
+			  transposition_table.Store(key, root_color, entry);
 			  return;
 			}
+
+			// 子ノードを探索する前に、このノードの値を他のスレッドから見えるようにしておく。
+			transposition_table.Store(key, root_color, entry);
+
+			if (parallel_search)
+				searching_nodes.Enter(best_key);
+
 			StateInfo state_info;
 			n.do_move(best_move, state_info);
-			DFPNwithTCA(n, thpn_child, thdn_child, inc_flag, !or_node, depth + 1, root_color,
-				start_time, timeup);
+			DFPNwithTCA(n, thpn_child, thdn_child, inc_flag, !or_node, depth + 1, root_color);
 			n.undo_move(best_move);
+
+			if (parallel_search)
+				searching_nodes.Leave(best_key);
 		}
+
+		transposition_table.Store(key, root_color, entry);
 	}
 
 	void pv_check_from_table(Position &pos, vector<Move16> pv_check){
@@ -845,6 +993,7 @@ namespace MateEngine
 	}
 
 	// 詰将棋探索のエントリポイント
+	// main threadから呼び出される。
 	void dfpn(Position& r) {
 		Threads.stop = false;
 
@@ -854,14 +1003,29 @@ namespace MateEngine
 		// キャッシュの世代を進める
 		transposition_table.NewSearch();
 
-		auto start = std::chrono::system_clock::now();
+		search_start_time = std::chrono::system_clock::now();
+		auto start = search_start_time;
+
+		parallel_search = Threads.size() > 1;
+		root_searched   = false;
+		search_timeup   = false;
+		last_mate_found = false;
+
+		// main thread以外のスレッドも探索を開始させる。(dfpn_helper()が呼び出される)
+		Threads.start_searching();
 
-		bool timeup = false;
 		Color root_color = r.side_to_move();
-		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, root_color, start, timeup);
-		const auto& entry = transposition_table.LookUp(r, root_color);
+		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, root_color);
+
+		// 他のスレッドの探索を終了させて、それを待つ。
+		// (PVを求める時に置換表を書き換えられると困るので)
+		root_searched = true;
+		Threads.wait_for_search_finished();
 
-		auto nodes_searched = r.this_thread()->nodes.load(memory_order_relaxed);
+		bool timeup = search_timeup;
+		const auto entry = transposition_table.LookUp(r, root_color);
+
+		auto nodes_searched = Threads.nodes_searched();
 		sync_cout << "info string" <<
 			" pn " << entry.pn <<
 			" dn " << entry.dn <<
@@ -934,6 +1098,7 @@ namespace MateEngine
 		}
 		else {
 			// 詰む手を返す。
+			last_mate_found = true;
 			std::ostringstream oss;
 			oss << "checkmate";
 			for (const auto& move : moves) {
@@ -945,6 +1110,15 @@ namespace MateEngine
 		Threads.stop = true;
 	}
 
+	// main thread以外のスレッドの詰将棋探索のエントリポイント
+	// main threadと同じくrootから探索する。置換表を共有しているので、他のスレッドの探索結果も利用される。
+	void dfpn_helper(Position& r) {
+		Color root_color = r.side_to_move();
+		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, root_color);
+
+		// rootの証明・反証ができたので、他のスレッドの探索を打ち切らせる。
+		root_searched = true;
+	}
 
 }
 
@@ -955,6 +1129,7 @@ void USI::extra_option(USI::OptionsMap & o) {
 // --- Search
 
 void Search::init() {}
+bool Search::mate_found() { return MateEngine::last_mate_found; }
 void Search::clear()
 {
 	MateEngine::transposition_table.Resize();
@@ -968,11 +1143,8 @@ void Search::clear()
 #endif
 
 }
-void MainThread::search() { Thread::search(); }
-
-void Thread::search()
+void MainThread::search()
 {
-
 	if (Search::Limits.pv_check.size() != 0){
 		MateEngine::pv_check_from_table(rootPos, Limits.pv_check);
 		return;
@@ -991,4 +1163,10 @@ void Thread::search()
 	MateEngine::dfpn(rootPos);
 }
 
+// main thread以外のスレッドは、MateEngine::dfpn()からThreads.start_searching()で起こされる。
+void Thread::search()
+{
+	MateEngine::dfpn_helper(rootPos);
+}
+
 #endif
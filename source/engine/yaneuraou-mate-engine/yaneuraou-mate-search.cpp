@@ -18,6 +18,9 @@ namespace
 	MateDfpnSolver solver(DfpnSolverType::None);
 
 	std::vector<std::string> solver_types = { "32bitNodeSolver" , "64bitNodeSolver" };
+
+	// 直前の探索で詰み手順を返したか。(Search::mate_found()で返す)
+	std::atomic<bool> last_mate_found = false;
 }
 
 // USIに追加オプションを設定したいときは、この関数を定義すること。
@@ -56,9 +59,17 @@ void  Search::clear()
 	solver.alloc(mem);
 }
 
+// 直前の探索で詰み手順を返したか。
+bool Search::mate_found()
+{
+	return last_mate_found;
+}
+
 // 探索開始時に呼び出される。
 void MainThread::search()
 {
+	last_mate_found = false;
+
 	// 思考エンジンからの返し値
 	// 詰将棋ルーチンからMOVE_RESIGNが返ってくることはないので、この値が変化していたら返し値があったことを意味する。
 	atomic<Move> move = MOVE_RESIGN;
@@ -129,6 +140,7 @@ void MainThread::search()
 		sync_cout << "checkmate nomate" << sync_endl;
 	}
 	else {
+		last_mate_found = true;
 		auto pv = solver.get_pv();
 		sync_cout << "checkmate" << USI::move(pv) << sync_endl;
 	}
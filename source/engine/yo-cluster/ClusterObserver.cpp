@@ -8,7 +8,7 @@
 // ※　ここで言うClusterとは、ネットワークを介して複数のUSI対応思考エンジンが協調動作すること。
 // ------------------------------------------------------------------------------------------
 //
-// 現状、子プロセスを起動する部分、Windows用の実装しか用意していない。
+// 子プロセスとの通信は、Linuxではepollでエンジンからの受信を待機し、Windowsでは1msごとに調べる。
 //
 // 
 // ■　用語の説明
@@ -63,6 +63,14 @@
 #include <sstream>
 #include <thread>
 #include <variant>
+#include <chrono>
+#include <algorithm>
+
+#if !defined(_WIN32)
+#include <sys/epoll.h>   // epoll_create1
+#include <sys/eventfd.h> // eventfd
+#include <unistd.h>      // close
+#endif
 
 #include "../../position.h"
 #include "../../thread.h"
@@ -118,6 +126,113 @@ namespace YaneuraouTheCluster
 		return i;
 	}
 
+#if !defined(_WIN32)
+	// ---------------------------------------
+	//          EngineEventWaiter
+	// ---------------------------------------
+
+	// エンジン(子プロセス)からの受信と、親クラスからのメッセージの到着をepollで待機する。
+	// 以前は全エンジンに対してreceive()を呼び出して、何も受信しなければ1ms sleepしていたが、
+	// それだとエンジンが多い時にbestmoveなどの中継が最大1ms遅れるし、CPUも無駄に消費する。
+	class EngineEventWaiter
+	{
+	public:
+		EngineEventWaiter()
+		{
+			epoll_fd  = epoll_create1(EPOLL_CLOEXEC);
+			wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+			if (epoll_fd == -1 || wakeup_fd == -1)
+			{
+				error_to_gui("EngineEventWaiter : epoll/eventfd initialization failed.");
+				Tools::exit();
+			}
+
+			add_fd(wakeup_fd);
+		}
+
+		~EngineEventWaiter()
+		{
+			::close(wakeup_fd);
+			::close(epoll_fd);
+		}
+
+		// 待機中のwait()を起こす。(親クラスからメッセージが積まれた時に呼び出す)
+		// どのスレッドから呼び出しても良い。
+		void wakeup()
+		{
+			u64 one = 1;
+			// 失敗するのはcounterが溢れる時だけで、その時はどうせ起きるので無視して良い。
+			[[maybe_unused]] auto r = ::write(wakeup_fd, &one, sizeof(one));
+		}
+
+		// 監視対象のfile descriptorを、生きているエンジンのものと一致させる。
+		void update(std::vector<EngineNegotiator>& engines)
+		{
+			std::vector<int> fds;
+			for (auto& engine : engines)
+			{
+				int fd = engine.get_read_fd();
+				if (fd != -1 && !engine.is_terminated())
+					fds.push_back(fd);
+			}
+			std::sort(fds.begin(), fds.end());
+
+			if (fds == registered_fds)
+				return;
+
+			// 終了したエンジンのfdはcloseされた時点でepollから自動的に外れているので、DELの失敗は無視して良い。
+			for (int fd : registered_fds)
+				if (!std::binary_search(fds.begin(), fds.end(), fd))
+					epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+			for (int fd : fds)
+				if (!std::binary_search(registered_fds.begin(), registered_fds.end(), fd))
+					add_fd(fd);
+
+			registered_fds = std::move(fds);
+		}
+
+		// エンジンからの受信か、wakeup()が呼び出されるまで最大timeout_ms[ms]待機する。
+		// 受信可能になったエンジンのfdがready_fdsに(sortされて)格納される。
+		void wait(int timeout_ms, std::vector<int>& ready_fds)
+		{
+			ready_fds.clear();
+
+			epoll_event events[64];
+			int n = epoll_wait(epoll_fd, events, 64, timeout_ms);
+			for (int i = 0; i < n; ++i)
+			{
+				int fd = events[i].data.fd;
+				if (fd == wakeup_fd)
+				{
+					u64 count;
+					[[maybe_unused]] auto r = ::read(wakeup_fd, &count, sizeof(count));
+				}
+				else
+					ready_fds.push_back(fd);
+			}
+			std::sort(ready_fds.begin(), ready_fds.end());
+		}
+
+	private:
+		void add_fd(int fd)
+		{
+			// 子プロセスが終了した時はEPOLLHUPが来るので、受信可能として扱ってreceive()の中で終了を検知させる。
+			epoll_event ev = {};
+			ev.events  = EPOLLIN;
+			ev.data.fd = fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		}
+
+		int epoll_fd;
+		int wakeup_fd;
+
+		// epollに登録しているエンジンのfd。(sortしてある)
+		std::vector<int> registered_fds;
+	};
+#endif
+
 	// ---------------------------------------
 	//          cluster observer
 	// ---------------------------------------
@@ -137,7 +252,7 @@ namespace YaneuraouTheCluster
 
 			// エンジン接続後のイベントの呼び出し。
 			garbage_engines();
-			strategy->on_connected(StrategyParam(engines,options));
+			strategy->on_connected(strategy_param);
 
 			worker_thread = std::thread([&](){ worker(); });
 		}
@@ -203,6 +318,10 @@ namespace YaneuraouTheCluster
 
 			queue.push(message);
 			send_counter++;
+
+#if !defined(_WIN32)
+			waiter.wakeup();
+#endif
 		}
 
 		// 通信スレッドで受け取ったメッセージをこのSupervisorに伝える。
@@ -216,6 +335,18 @@ namespace YaneuraouTheCluster
 				Tools::sleep(0);
 		}
 
+		// エンジンから受信してからStrategy::on_idle()の処理が終わるまでの時間(中継の遅延)の統計をGUIに出力する。
+		// "stats"コマンドで呼び出される。
+		void output_stats()
+		{
+			u64 count = relay_count;
+			u64 total = relay_time_total;
+			u64 max   = relay_time_max;
+			send_to_gui("info string relay count = " + std::to_string(count)
+				+ " , average latency = " + std::to_string(count ? total / count : 0) + "us"
+				+ " , max latency = " + std::to_string(max) + "us");
+		}
+
 	private:
 		// worker thread
 		void worker()
@@ -246,7 +377,7 @@ namespace YaneuraouTheCluster
 					case USI_Message::ISREADY:
 						usi = message.message; // ← この変数の状態変化まではエンジンの次のメッセージを処理しない。
 						broadcast(message);
-						strategy->on_isready(StrategyParam(engines,options));
+						strategy->on_isready(strategy_param);
 						break;
 
 					case USI_Message::USINEWGAME:
@@ -282,7 +413,7 @@ namespace YaneuraouTheCluster
 
 						// GOコマンドの処理は、Strategyに丸投げ
 						garbage_engines();
-						strategy->on_go_command(StrategyParam(engines,options), message);
+						strategy->on_go_command(strategy_param, message);
 
 						break;
 
@@ -312,12 +443,44 @@ namespace YaneuraouTheCluster
 				// 子クラス(EngineNegotiator)のメッセージの受信
 				// --------------------------------------------
 
+#if !defined(_WIN32)
+				// 親クラスからのメッセージをまだ処理できるなら待機しない。
+				// そうでなければ、エンジンからの受信か親クラスからのメッセージが来るまで待つ。
+				// (on_idle()は1秒間に100回以上呼び出すことになっているので、最大10msで起きる)
+				bool pending = received || (queue.size() && usi == USI_Message::NONE);
+				waiter.update(engines);
+				waiter.wait(pending ? 0 : 10, ready_fds);
+
+				auto wake_time = std::chrono::steady_clock::now();
+				bool engine_received = false;
+
 				for (auto& engine : engines)
-					received |= engine.receive();
+				{
+					// 受信可能になっているエンジンからだけ受信する。
+					// 終了したエンジンはfdが-1になるので、終了の検知のためにreceive()を呼び出しておく。
+					int fd = engine.get_read_fd();
+					if (fd != -1 && !std::binary_search(ready_fds.begin(), ready_fds.end(), fd))
+						continue;
+
+					if (engine.receive())
+					{
+						engine_received = true;
+						strategy->on_engine_received(strategy_param, engine);
+					}
+				}
+#else
+				// Windowsではpipeをepollのように待機できないので、全エンジンを定期的に調べる。
+				for (auto& engine : engines)
+					if (engine.receive())
+					{
+						received = true;
+						strategy->on_engine_received(strategy_param, engine);
+					}
 
 				// 一つもメッセージを受信していないならsleepを入れて休ませておく。
 				if (!received)
 					Tools::sleep(1);
+#endif
 
 				// --------------------------------------------
 				// 何かの状態変化を待っていたなら..
@@ -361,6 +524,19 @@ namespace YaneuraouTheCluster
 
 				// idle時の処理。
 				on_idle();
+
+#if !defined(_WIN32)
+				// エンジンから受信したメッセージはon_idle()でGUIに中継されるので、ここまでの時間を計測しておく。
+				if (engine_received)
+				{
+					u64 elapsed = (u64)std::chrono::duration_cast<std::chrono::microseconds>(
+						std::chrono::steady_clock::now() - wake_time).count();
+					relay_count++;
+					relay_time_total += elapsed;
+					if (elapsed > relay_time_max)
+						relay_time_max = elapsed;
+				}
+#endif
 			}
 
 			// engine止める必要がある。
@@ -398,7 +574,7 @@ namespace YaneuraouTheCluster
 			garbage_engines();
 
 			// idleなので、Strategy::on_idle()を呼び出してやる。
-			strategy->on_idle(StrategyParam(engines,options));
+			strategy->on_idle(strategy_param);
 
 			// エンジンの死活監視
 			//engine_check();
@@ -446,6 +622,10 @@ namespace YaneuraouTheCluster
 		// すべての思考エンジンを表現する。
 		std::vector<EngineNegotiator> engines;
 
+		// strategyのhandlerに渡すパラメーター。(engines,optionsを参照している)
+		// ※　一時オブジェクトを非const参照で渡すとgccではコンパイルが通らないのでメンバーとして持っておく。
+		StrategyParam strategy_param = StrategyParam(engines, options);
+
 		// Supervisorから送られてくるMessageのqueue
 		Concurrent::ConcurrentQueue<Message> queue;
 
@@ -466,6 +646,20 @@ namespace YaneuraouTheCluster
 		// Messageをsendした回数
 		atomic<u64> send_counter = 0;
 
+#if !defined(_WIN32)
+		// エンジンからの受信と親クラスからのメッセージを待機する。
+		EngineEventWaiter waiter;
+
+		// waiter.wait()で受信可能になったエンジンのfd
+		std::vector<int> ready_fds;
+#endif
+
+		// エンジンから受信してからon_idle()が終わるまでの時間の統計。[us]
+		// output_stats()はGUIとの通信スレッドから呼び出されるのでatomicにしておく。
+		atomic<u64> relay_count      = 0;
+		atomic<u64> relay_time_total = 0;
+		atomic<u64> relay_time_max   = 0;
+
 		// TODO : あとで整理する。
 
 		// 最後に受け取った"go"コマンド。"go"を含む。
@@ -663,6 +857,9 @@ namespace YaneuraouTheCluster
 				// 拡張コマンド。途中でdebug出力をやめたい時に用いる。
 				else if (token == "nodebug")
 					debug_mode = false;
+				// 拡張コマンド。エンジンからGUIへの中継の遅延の統計を出力する。
+				else if (token == "stats")
+					observer.output_stats();
 				else {
 					// "ponderhit"はサポートしていない。
 					// "go ponderも送られてこないものと仮定している。
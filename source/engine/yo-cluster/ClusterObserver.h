@@ -47,7 +47,12 @@ namespace YaneuraouTheCluster
 		// command : GUI側から来たコマンド詳細が格納されている。
 		virtual void on_go_command(StrategyParam& param, const Message& command) {}
 
+		// エンジンからメッセージを受信した直後に呼び出される。
+		// engine : 受信したエンジン
+		virtual void on_engine_received(StrategyParam& param, EngineNegotiator& engine) {}
+
 		// idleな時に呼び出される。(通常、1秒間に100回以上呼び出される)
+		// エンジンから受信した時やGUIからコマンドが来た時には、そのたびに呼び出される。
 		// エンジン側から"bestmove"が返ってきていたらGUIにそれを投げる、などの処理はここで行う。
 		virtual void on_idle(StrategyParam& param) {}
 
@@ -242,7 +242,7 @@ namespace YaneuraouTheCluster
 		}
 
 		// エンジンからメッセージを受信して、dispatchする。
-		// このメソッドは親クラス(ClusterObserver)の送受信用スレッドから定期的に呼び出される。(呼び出さなければならない)
+		// このメソッドは親クラス(ClusterObserver)の送受信用スレッドから、受信可能になった時に呼び出される。
 		// メッセージを一つでも受信したならtrueを返す。
 		bool receive()
 		{
@@ -294,6 +294,9 @@ namespace YaneuraouTheCluster
 		// エンジンIDを取得する。
 		virtual size_t get_engine_id() const { return engine_id; }
 
+		// エンジンからの受信を待機するためのfile descriptor。
+		virtual int get_read_fd() const { return neg.get_read_fd(); }
+
 		// 現在、"go","go ponder"によって探索中の局面。
 		// ただし、"go"に対してエンジンが"bestmove"を返したあとも
 		// その探索していた局面のsfenを、このメソッドで取得できる。
@@ -71,10 +71,15 @@ namespace YaneuraouTheCluster
 		virtual void send(Message message) = 0;
 
 		// エンジンからメッセージを受信して、dispatchする。
-		// このメソッドは親クラス(ClusterObserver)の送受信用スレッドから定期的に呼び出される。(呼び出さなければならない)
+		// このメソッドは親クラス(ClusterObserver)の送受信用スレッドから、get_read_fd()が受信可能になった時に呼び出される。
+		// (get_read_fd()が-1の環境では定期的に呼び出される)
 		// メッセージを一つでも受信したならtrueを返す。
 		virtual bool receive() = 0;
 
+		// エンジンからの受信を待機するためのfile descriptor。
+		// 待機できない環境(Windows)や、接続されていない時は-1。
+		virtual int get_read_fd() const = 0;
+
 		// 現在、"go","go ponder"によって探索中の局面。
 		// ただし、"go"に対してエンジンが"bestmove"を返したあとも
 		// その探索していた局面のsfenを、このメソッドで取得できる。
@@ -128,6 +133,7 @@ namespace YaneuraouTheCluster
 		virtual size_t      get_engine_id() const                               { return ptr->get_engine_id();                    }
 		virtual void        send(Message message)                               {        ptr->send(message);                      }
 		virtual bool        receive()                                           { return ptr->receive();                          }
+		virtual int         get_read_fd() const                                 { return ptr->get_read_fd();                      }
 		virtual std::string get_searching_sfen() const                          { return ptr->get_searching_sfen();               }
 		virtual bool        is_ponderhit() const                                { return ptr->is_ponderhit();                     }
 		virtual bool        received_time_to_return_bestmove() const            { return ptr->received_time_to_return_bestmove(); }
@@ -141,6 +147,7 @@ namespace YaneuraouTheCluster
 
 		EngineNegotiator();
 		EngineNegotiator& operator=(EngineNegotiator& rhs) { this->ptr = std::move(rhs.ptr); return *this; } // copy constructor
+		EngineNegotiator& operator=(EngineNegotiator&& rhs) = default; // default move assignment (vector::erase()で必要)
  		EngineNegotiator(EngineNegotiator&&) = default; // default move constructor
 		virtual ~EngineNegotiator(){}
 
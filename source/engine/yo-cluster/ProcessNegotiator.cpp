@@ -5,6 +5,59 @@
 #include "ProcessNegotiator.h"
 #include "../../misc.h"
 
+// 子プロセスから受信したデータを改行で区切って1行ずつ取り出すためのバッファ。
+// 取り出した位置を覚えておき、先頭を詰めるのは取り出し済みの部分が半分を超えた時だけにする。
+// (1行ごとにsubstr()でバッファ全体をコピーすると、大量に溜まっている時に遅い)
+class LineBuffer
+{
+public:
+	// 受信したデータを末尾に追加する。
+	void append(const char* data, size_t size)
+	{
+		buffer.append(data, size);
+	}
+
+	// 1行取り出してlineに格納する。改行コードは含まない。
+	// 1行分溜まっていなければfalseが返る。(空行を取り出した時はtrueでlineが空になる)
+	bool next_line(std::string& line)
+	{
+		auto it = buffer.find('\n', read_pos);
+		if (it == std::string::npos)
+			return false;
+
+		// "\r\n"かも知れないので"\r"も除去。
+		size_t end = (it > read_pos && buffer[it - 1] == '\r') ? it - 1 : it;
+		line.assign(buffer, read_pos, end - read_pos);
+		read_pos = it + 1;
+
+		if (read_pos * 2 >= buffer.size())
+		{
+			buffer.erase(0, read_pos);
+			read_pos = 0;
+		}
+
+		return true;
+	}
+
+private:
+	std::string buffer;
+
+	// bufferのうち、まだ取り出していない部分の先頭
+	size_t read_pos = 0;
+};
+
+// 空行を読み飛ばして1行取り出す。1行も溜まっていなければ空の文字列が返る。
+// USIプロトコルでは空行に意味はないので、receive()が空の文字列を返すのは「受信した行がない」時だけにする。
+// (空行で止めると、その後ろに溜まっている行がepollの通知なしに取り残される)
+static std::string next_non_empty_line(LineBuffer& read_buffer)
+{
+	std::string line;
+	while (read_buffer.next_line(line))
+		if (!line.empty())
+			return line;
+	return std::string();
+}
+
 // Windows環境である。
 #if defined(_WIN32)
 
@@ -138,11 +191,8 @@ struct ProcessNegotiatorImpl : public IProcessNegotiator
 
 				if (success && dwRead != 0)
 				{
-					chBuf[dwRead] = '\0'; // 終端マークを書いてstringに連結する。
-					// バッファを先行して確保したほうがresize()の発生が少ない
-					read_buffer.reserve(read_buffer.size() + dwRead + 1);
-					read_buffer  += chBuf;
-					total        -= dwRead;
+					read_buffer.append(chBuf, dwRead);
+					total -= dwRead;
 				}
 			}
 		}
@@ -218,25 +268,8 @@ protected:
 			ERROR_MES("Error! : SetHandleInformation : std in");
 	}
 
-	std::string receive_next()
-	{
-		// read_bufferから改行までを切り出す
-		// stringで処理しているのでたくさん溜まっているとsubstr()が遅いことになるが、
-		// これをうまく書くのは難しいのでこれで我慢する。
-
-		auto it = read_buffer.find("\n");
-		if (it == std::string::npos)
-			return std::string();
-		// 切り出したいのは"\n"の手前まで(改行コード不要)、このあと"\n"は捨てたいので
-		// it+1から最後までが次回まわし。
-		auto result = read_buffer.substr(0, it);
-		read_buffer = read_buffer.substr(it + 1, read_buffer.size() - it);
-		// "\r\n"かも知れないので"\r"も除去。
-		if (result.size() && result[result.size() - 1] == '\r')
-			result = result.substr(0, result.size() - 1);
-
-		return result;
-	}
+	// read_bufferから1行取り出す。
+	std::string receive_next() { return next_non_empty_line(read_buffer); }
 
 	// wstring変換
 	std::wstring to_wstring(const std::string& src)
@@ -261,7 +294,7 @@ protected:
 	std::atomic<bool> terminated;
 
 	// 受信バッファ
-	std::string read_buffer;
+	LineBuffer read_buffer;
 
 	// プロセスのpath
 	std::string engine_path;
@@ -274,6 +307,7 @@ protected:
 #include <unistd.h> // pid_t
 #include <fcntl.h>  // open
 #include <sys/wait.h> // waitpid
+#include <cerrno>     // errno
 
 using namespace std;
 using namespace YaneuraouTheCluster;
@@ -317,8 +351,9 @@ public:
     // すべてのpipeを閉じる。
     void close_all_pipes()
     {
-        close(PIPE_TYPE:: READ);
-        close(PIPE_TYPE::WRITE);
+        // ※　close()と書くと::close()が呼び出されて、このプロセスの標準入出力(0,1)が閉じられてしまう。
+        close_pipe(PIPE_TYPE:: READ);
+        close_pipe(PIPE_TYPE::WRITE);
     }
 
     // Pipeがopenされているか。
@@ -351,24 +386,29 @@ public:
 		return result != (ssize_t)-1;
     }
 
-    // PIPEから1行を読み出す。何も読みだせなければ空のstringが返る。
-    std::string read()
+    // PIPEから読み出せるだけ読み出してbufferに追加する。(non blockingにしてあること)
+    // 書き込み側が閉じられている(EOF)ならfalseを返す。
+    bool read(LineBuffer& buffer)
     {
-        char buf[1024];
-        std::string s;
+        char buf[4096];
         while (true)
         {
-            ssize_t read_bytes = ::read(handles[PIPE_TYPE::READ], buf, sizeof(buf)-1 );
-            if (read_bytes == (ssize_t)-1 /* is Empty */|| read_bytes == 0 /* is EOF */)
-                return s;
-            // 末尾に'\0'を付与して文字連結してしまう。
-            buf[read_bytes] = '\0';
-			// バッファを先行して確保したほうがresize()の発生が少ない
-			s.reserve(s.size() + (size_t)read_bytes + 1);
-            s += buf;
+            ssize_t read_bytes = ::read(handles[PIPE_TYPE::READ], buf, sizeof(buf));
+            if (read_bytes == 0 /* is EOF */)
+                return false;
+            if (read_bytes == (ssize_t)-1)
+                // EAGAIN(is Empty)以外のエラーもここで打ち切り。EINTRなら次回に読めば良い。
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            buffer.append(buf, (size_t)read_bytes);
         }
     }
 
+    // file descriptorを返す。openされていなければ-1。
+    int get_fd(PIPE_TYPE t) const
+    {
+        return opened[t] ? handles[t] : -1;
+    }
+
     Pipe() { opened[PIPE_TYPE::READ] = opened[PIPE_TYPE::WRITE] = false; }
     ~Pipe() { close_all_pipes(); }
 
@@ -522,7 +562,14 @@ public:
             return string();
         }
 
-        read_buffer += c2p.read();
+        // 子プロセスが標準出力を閉じたなら、これ以上受信することはない。
+        if (!c2p.read(read_buffer))
+        {
+            auto result = receive_next();
+            if (result.empty())
+                terminated = true;
+            return result;
+        }
         return receive_next();
     }
 
@@ -538,6 +585,9 @@ public:
 	// このプロパティにはアクセスしないので同期は問題とならない。
 	virtual std::string get_engine_path() const { return engine_path; }
 
+	// 子プロセスの標準出力を読み出すfile descriptor。
+	virtual int get_read_fd() const { return c2p.get_fd(PIPE_TYPE::READ); }
+
     ProcessNegotiatorImpl() : pid(0) , terminated(false) {}
     ~ProcessNegotiatorImpl() { disconnect(); }
 
@@ -546,27 +596,10 @@ public:
 	ProcessNegotiatorImpl&& operator = (const ProcessNegotiatorImpl&) = delete;
 
 protected:
-	std::string receive_next()
-	{
-		// read_bufferから改行までを切り出す
-		// stringで処理しているのでたくさん溜まっているとsubstr()が遅いことになるが、
-		// これをうまく書くのは難しいのでこれで我慢する。
-
-		auto it = read_buffer.find("\n");
-		if (it == std::string::npos)
-			return std::string();
-		// 切り出したいのは"\n"の手前まで(改行コード不要)、このあと"\n"は捨てたいので
-		// it+1から最後までが次回まわし。
-		auto result = read_buffer.substr(0, it);
-		read_buffer = read_buffer.substr(it + 1, read_buffer.size() - it);
-		// "\r\n"かも知れないので"\r"も除去。
-		if (result.size() && result[result.size() - 1] == '\r')
-			result = result.substr(0, result.size() - 1);
-
-		return result;
-	}
+	// read_bufferから1行取り出す。
+	std::string receive_next() { return next_non_empty_line(read_buffer); }
     // 受信バッファ
-    std::string read_buffer;
+    LineBuffer read_buffer;
 
     // エンジン起動フォルダ
     std::string engine_path;
@@ -20,7 +20,9 @@
 // 親プロセスは必ず quit コマンドか何かで正常に終了させるものとする。
 //
 // また、このclass自体は、worker threadを持たない。
-// send()/receive()を定期的に親classから呼び出すものとする。
+// send()/receive()を親classから呼び出すものとする。
+// Linuxでは、get_read_fd()で得られるfile descriptorをepollなどで監視して、
+// 受信可能になった時にだけreceive()を呼び出せば良い。
 //
 // また、std::mutex()やstd::atomicなどを持っているとstd::move()が出来ないので、
 // std::unique_ptrで管理する。
@@ -52,6 +54,10 @@ struct IProcessNegotiator
 	// このプロパティにはアクセスしないので同期は問題とならない。
 	virtual std::string get_engine_path() const = 0;
 
+	// 子プロセスの標準出力を読み出すfile descriptor。(受信可能になるのを待機するのに用いる)
+	// Linux以外や、接続されていない時は-1が返る。
+	virtual int get_read_fd() const { return -1; }
+
 	virtual ~IProcessNegotiator(){}
 };
 
@@ -83,6 +89,9 @@ struct ProcessNegotiator : public IProcessNegotiator
 	// このプロパティにはアクセスしないので同期は問題とならない。
 	virtual std::string get_engine_path() const { return ptr->get_engine_path(); }
 
+	// 子プロセスの標準出力を読み出すfile descriptor。
+	virtual int get_read_fd() const { return ptr->get_read_fd(); }
+
 	ProcessNegotiator();
 
 protected:
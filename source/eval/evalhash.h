@@ -38,6 +38,9 @@ struct HashTable
 	~HashTable() { release(); }
 
 	T* operator[] (const Key k) { return entries_ + (static_cast<size_t>(k) & (size - 1)); }
+
+	// 要素数
+	size_t count() const { return size; }
 	void clear() { Tools::memclear("eHash", entries_, size * sizeof(T)); }
 
 private:
@@ -6,12 +6,31 @@
 
 #include <fstream>
 
+#if !defined(__EMSCRIPTEN__)
+#include <cstring>
+#include <filesystem>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
 #include "../../evaluate.h"
 #include "../../position.h"
 #include "../../misc.h"
 #include "../../usi.h"
 
 #if defined(USE_EVAL_HASH)
+#include <atomic>
+#include <iomanip>
 #include "../evalhash.h"
 #endif
 
@@ -48,11 +67,20 @@ namespace Eval {
 
                     // →　メモリはLarge Pageから確保することで高速化する。
                     void* ptr = LargeMemory::static_alloc(sizeof(T) , alignof(T), true);
+                    // 以前の領域はreset()の中で、以前のdeleterの状態に従って開放される。
                     pointer.reset(reinterpret_cast<T*>(ptr));
+                    pointer.get_deleter().mapped = false;
 
                     //sync_cout << "nnue.alloc(" << sizeof(T) << "," << alignof(T) << ")" << sync_endl;
                 }
 
+                // ファイルをmapした領域を評価関数パラメータとして用いる
+                template <typename T>
+                void Assign(AlignedPtr<T>& pointer, void* ptr) {
+                    pointer.reset(reinterpret_cast<T*>(ptr));
+                    pointer.get_deleter().mapped = true;
+                }
+
                 // 評価関数パラメータを読み込む
                 template <typename T>
                 bool ReadParameters(std::istream& stream, const AlignedPtr<T>& pointer) {
@@ -72,12 +100,293 @@ namespace Eval {
 
             }  // namespace Detail
 
+#if !defined(__EMSCRIPTEN__)
+
+            // Shared weight image (EvalShare)
+            // EvalShare用の評価関数イメージファイル
+            //
+            // nn.binを読み込んだ後のFeatureTransformerとNetworkのメモリ上の表現を、ページ境界に揃えてそのまま書き出したもの。
+            // 読み込み時の変換が要らないので、mapするだけで評価関数として使える。同じイメージをmapしたプロセス同士は
+            // 物理メモリ(ページキャッシュ)を共有するので、1台で多数のエンジンを立ち上げてもメモリは1つ分で済む。
+            // hugetlbfs上のパスを指定すれば、Huge Pageに載せて共有することもできる。
+            struct SharedImageHeader {
+                char magic[8];
+                std::uint32_t version;
+                std::uint32_t hash_value;
+
+                // 元にしたnn.binのサイズと更新時刻。nn.binが差し替えられたらイメージを作り直す。
+                std::uint64_t source_size;
+                std::int64_t source_time;
+
+                // メモリ上の表現はビルド(SIMDの種類など)によって変わりうるので、サイズも照合する。
+                std::uint64_t feature_transformer_offset;
+                std::uint64_t feature_transformer_size;
+                std::uint64_t network_offset;
+                std::uint64_t network_size;
+                std::uint64_t image_size;
+            };
+
+            constexpr char kSharedImageMagic[8] = { 'N', 'N', 'U', 'E', 'I', 'M', 'G', '1' };
+
+            // 各領域の先頭はページ境界に揃える。
+            constexpr std::uint64_t kSharedImageAlignment = 4096;
+
+            // hugetlbfs上に置けるように、ファイルサイズは2MBの倍数にする。
+            constexpr std::uint64_t kSharedImageFileAlignment = 2 * 1024 * 1024;
+
+            static_assert(alignof(FeatureTransformer) <= kSharedImageAlignment && alignof(Network) <= kSharedImageAlignment,
+                "the shared eval image cannot satisfy the alignment of the parameters");
+
+            constexpr std::uint64_t RoundUp(std::uint64_t size, std::uint64_t alignment) {
+                return (size + alignment - 1) / alignment * alignment;
+            }
+
+            // mapしている評価関数イメージ
+            // 評価関数を読み直すとき以外は解除しない。(プロセス終了時に自動的に解除される)
+            struct SharedImage {
+                void* address = nullptr;
+                std::size_t size = 0;
+#if defined(_WIN32)
+                HANDLE mapping_handle = nullptr;
+#endif
+
+                void Close() {
+                    if (address == nullptr)
+                        return;
+#if defined(_WIN32)
+                    UnmapViewOfFile(address);
+                    CloseHandle(mapping_handle);
+                    mapping_handle = nullptr;
+#else
+                    ::munmap(address, size);
+#endif
+                    address = nullptr;
+                    size = 0;
+                }
+            } shared_image;
+
+            // nn.binのパスと評価関数イメージのパスを取得する。EvalShareが無効なときはfalseを返す。
+            bool GetSharedImagePaths(std::string* source_path, std::string* image_path) {
+                if (!(bool)Options["EvalShare"])
+                    return false;
+
+#if defined(EVAL_LEARN)
+                if (Options["SkipLoadingEval"])
+                    return false;
+#endif
+
+                const std::string dir_name = Options["EvalDir"];
+                if (dir_name == "<internal>")
+                    return false;
+
+                *source_path = Path::Combine(dir_name, kFileName);
+                const std::string image_file = Options["EvalShareFile"];
+                *image_path = image_file.empty() ? *source_path + ".img" : image_file;
+                return true;
+            }
+
+            // source_pathのnn.binから作られるべき評価関数イメージのヘッダを作る
+            bool MakeSharedImageHeader(const std::string& source_path, SharedImageHeader* header) {
+                std::error_code ec;
+                const auto source_size = std::filesystem::file_size(source_path, ec);
+                if (ec)
+                    return false;
+                const auto source_time = std::filesystem::last_write_time(source_path, ec);
+                if (ec)
+                    return false;
+
+                std::memset(header, 0, sizeof(*header));
+                std::memcpy(header->magic, kSharedImageMagic, sizeof(header->magic));
+                header->version = kVersion;
+                header->hash_value = kHashValue;
+                header->source_size = source_size;
+                header->source_time = static_cast<std::int64_t>(source_time.time_since_epoch().count());
+                header->feature_transformer_offset = RoundUp(sizeof(SharedImageHeader), kSharedImageAlignment);
+                header->feature_transformer_size = sizeof(FeatureTransformer);
+                header->network_offset = RoundUp(header->feature_transformer_offset + sizeof(FeatureTransformer), kSharedImageAlignment);
+                header->network_size = sizeof(Network);
+                header->image_size = RoundUp(header->network_offset + sizeof(Network), kSharedImageFileAlignment);
+                return true;
+            }
+
+            // 評価関数イメージをmapして評価関数パラメータとして用いる
+            // イメージがないか、ヘッダがexpectedと合わないときはfalseを返す。
+            bool MapSharedImage(const std::string& image_path, const SharedImageHeader& expected) {
+                // 学習時にはパラメータを書き換えるので、copy on writeでmapする。
+                // 書き換えたページだけがそのプロセス専用になり、残りは共有されたままになる。
+#if defined(_WIN32)
+                HANDLE file_handle = CreateFileA(image_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+                if (file_handle == INVALID_HANDLE_VALUE)
+                    return false;
+
+                LARGE_INTEGER file_size;
+                if (!GetFileSizeEx(file_handle, &file_size) || static_cast<std::uint64_t>(file_size.QuadPart) < expected.image_size) {
+                    CloseHandle(file_handle);
+                    return false;
+                }
+
+                HANDLE mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+                void* address = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, expected.image_size) : nullptr;
+                // mapした領域はファイルのハンドルを閉じても有効
+                CloseHandle(file_handle);
+                if (address == nullptr) {
+                    if (mapping_handle)
+                        CloseHandle(mapping_handle);
+                    return false;
+                }
+#else
+                int fd = ::open(image_path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return false;
+
+                struct stat st;
+                if (::fstat(fd, &st) != 0 || static_cast<std::uint64_t>(st.st_size) < expected.image_size) {
+                    ::close(fd);
+                    return false;
+                }
+
+                // MAP_POPULATEは書き込み可能なprivate mappingだとcopy on writeを起こしてしまうので使わない。
+                void* address = ::mmap(nullptr, expected.image_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                // mapした領域はfdを閉じても有効
+                ::close(fd);
+                if (address == MAP_FAILED)
+                    return false;
+                ::madvise(address, expected.image_size, MADV_WILLNEED);
+#endif
+
+                SharedImage image;
+                image.address = address;
+                image.size = expected.image_size;
+#if defined(_WIN32)
+                image.mapping_handle = mapping_handle;
+#endif
+
+                if (std::memcmp(address, &expected, sizeof(expected)) != 0) {
+                    image.Close();
+                    return false;
+                }
+
+                char* data = static_cast<char*>(address);
+                Detail::Assign(feature_transformer, data + expected.feature_transformer_offset);
+                Detail::Assign(network, data + expected.network_offset);
+                FeatureTransformer::invalidate_accumulator_cache();
+
+                // 以前mapしていた領域はもう参照されていない。
+                shared_image.Close();
+                shared_image = image;
+                return true;
+            }
+
+            // 読み込み済みの評価関数パラメータから評価関数イメージを作る
+            // 同時に起動した複数のプロセスが作ろうとしても壊れたイメージが見えないように、一時ファイルに書き出してからrenameする。
+            bool WriteSharedImage(const std::string& image_path, const SharedImageHeader& header) {
+#if defined(_WIN32)
+                const std::string temp_path = image_path + ".tmp" + std::to_string(GetCurrentProcessId());
+                {
+                    std::ofstream stream(temp_path, std::ios::binary);
+                    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                    stream.seekp(header.feature_transformer_offset);
+                    stream.write(reinterpret_cast<const char*>(feature_transformer.get()), sizeof(FeatureTransformer));
+                    stream.seekp(header.network_offset);
+                    stream.write(reinterpret_cast<const char*>(network.get()), sizeof(Network));
+                    // 末尾まで埋めてファイルサイズをimage_sizeにする。
+                    stream.seekp(header.image_size - 1);
+                    stream.put('\0');
+                    if (!stream) {
+                        stream.close();
+                        std::error_code ec;
+                        std::filesystem::remove(temp_path, ec);
+                        return false;
+                    }
+                }
+#else
+                const std::string temp_path = image_path + ".tmp" + std::to_string(::getpid());
+
+                // hugetlbfsはwrite()に対応していないので、ftruncate()で大きさを決めてからmapして書き込む。
+                int fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (fd < 0)
+                    return false;
+
+                void* address = MAP_FAILED;
+                if (::ftruncate(fd, static_cast<off_t>(header.image_size)) == 0)
+                    address = ::mmap(nullptr, header.image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (address == MAP_FAILED) {
+                    ::unlink(temp_path.c_str());
+                    return false;
+                }
+
+                char* data = static_cast<char*>(address);
+                std::memcpy(data, &header, sizeof(header));
+                std::memcpy(data + header.feature_transformer_offset, feature_transformer.get(), sizeof(FeatureTransformer));
+                std::memcpy(data + header.network_offset, network.get(), sizeof(Network));
+                const bool synced = ::msync(address, header.image_size, MS_SYNC) == 0;
+                ::munmap(address, header.image_size);
+                if (!synced) {
+                    ::unlink(temp_path.c_str());
+                    return false;
+                }
+#endif
+
+                std::error_code ec;
+                std::filesystem::rename(temp_path, image_path, ec);
+                if (ec) {
+                    std::filesystem::remove(temp_path, ec);
+                    return false;
+                }
+                return true;
+            }
+
+#endif
+
             // 評価関数パラメータを初期化する
             void Initialize() {
                 Detail::Initialize(feature_transformer);
                 Detail::Initialize(network);
+
+#if !defined(__EMSCRIPTEN__)
+                // 以前mapしていた評価関数イメージはもう参照されていない。
+                shared_image.Close();
+#endif
             }
 
+#if !defined(__EMSCRIPTEN__)
+            // 評価関数イメージをmapして評価関数パラメータとして用いる(EvalShare)
+            // イメージがないか、nn.binより古いときはfalseを返す。
+            bool LoadSharedImage() {
+                std::string source_path, image_path;
+                SharedImageHeader header;
+                if (!GetSharedImagePaths(&source_path, &image_path) || !MakeSharedImageHeader(source_path, &header))
+                    return false;
+
+                if (!MapSharedImage(image_path, header))
+                    return false;
+
+                sync_cout << "info string use shared eval image : " << image_path << sync_endl;
+                return true;
+            }
+
+            // nn.binから読み込んだ評価関数パラメータを評価関数イメージとして書き出し、それをmapし直す(EvalShare)
+            // 以降に起動したプロセスは、このイメージをmapするだけで済む。
+            void CreateSharedImage() {
+                std::string source_path, image_path;
+                SharedImageHeader header;
+                if (!GetSharedImagePaths(&source_path, &image_path) || !MakeSharedImageHeader(source_path, &header))
+                    return;
+
+                if (!WriteSharedImage(image_path, header)) {
+                    // 書き出せなくても、読み込んだパラメータで動作は続けられる。
+                    sync_cout << "info string Warning! : failed to write shared eval image : " << image_path << sync_endl;
+                    return;
+                }
+
+                // 他のプロセスが同時に作ったイメージに置き換わっている可能性もあるが、同じnn.binから作ったものなら中身も同じ。
+                if (MapSharedImage(image_path, header))
+                    sync_cout << "info string created shared eval image : " << image_path << sync_endl;
+            }
+#endif
+
         }  // namespace
 
         // ヘッダを読み込む
@@ -164,6 +473,60 @@ namespace Eval {
             return accumulator.score;
         }
 
+        namespace {
+            // 入力特徴量の変換結果の、局面1つあたりの要素数
+            constexpr std::size_t kTransformedStride = FeatureTransformer::kBufferSize / sizeof(TransformedFeatureType);
+        }
+
+        BatchEvaluator::BatchEvaluator() {
+            const std::size_t transformed_bytes = FeatureTransformer::kBufferSize * kMaxBatchSize;
+            memory_.resize(transformed_bytes + Network::kBufferSize * kMaxBatchSize + kCacheLineSize);
+            // キャッシュラインの境界に揃える
+            char* aligned = reinterpret_cast<char*>(
+                (reinterpret_cast<std::uintptr_t>(memory_.data()) + kCacheLineSize - 1) & ~(std::uintptr_t)(kCacheLineSize - 1));
+            transformed_features_ = reinterpret_cast<TransformedFeatureType*>(aligned);
+            buffer_ = aligned + transformed_bytes;
+        }
+
+        void BatchEvaluator::Add(const Position& pos) {
+            ASSERT_LV3(size_ < kMaxBatchSize);
+            feature_transformer->Transform(pos, transformed_features_ + kTransformedStride * size_, false);
+            ++size_;
+        }
+
+        void BatchEvaluator::Evaluate(Value* scores) {
+            if (size_ == 0)
+                return;
+
+            const auto output = network->PropagateBatch(transformed_features_, kTransformedStride, size_, buffer_);
+            const std::size_t output_stride = Network::GetBatchStride(kTransformedStride);
+
+            for (std::size_t i = 0; i < size_; ++i) {
+                // ComputeScore()と同じく、FV_SCALEで割ってclipする
+                const auto score = static_cast<Value>(output[output_stride * i] / FV_SCALE);
+                scores[i] = Math::clamp(score, -VALUE_MAX_EVAL, VALUE_MAX_EVAL);
+            }
+            size_ = 0;
+        }
+
+        void ComputeScores(const Position* const* positions, std::size_t num_positions, Value* scores) {
+            // 呼び出し毎に確保し直さないよう、スレッド毎に使い回す
+            thread_local BatchEvaluator evaluator;
+
+            for (std::size_t start = 0; start < num_positions; start += kMaxBatchSize) {
+                const std::size_t size = std::min(kMaxBatchSize, num_positions - start);
+                for (std::size_t i = 0; i < size; ++i)
+                    evaluator.Add(*positions[start + i]);
+                evaluator.Evaluate(scores + start);
+
+                for (std::size_t i = 0; i < size; ++i) {
+                    auto& accumulator = positions[start + i]->state()->accumulator;
+                    accumulator.score = scores[start + i];
+                    accumulator.computed_score = true;
+                }
+            }
+        }
+
     }  // namespace NNUE
 
 #if defined(USE_EVAL_HASH)
@@ -205,18 +568,147 @@ namespace Eval {
         };
     };
 
+    // EvalHashの1つのbucket
+    // キャッシュライン1本にScoreKeyValueをkEntriesPerBucket個詰めたset-associativeな構造にして、
+    // 衝突したときにすぐ上書きされないようにする。
+    // entry[0]が最も新しく保存されたもので、保存するときは最も古いentry[kEntriesPerBucket - 1]を追い出す。
+    // probe()はbucketを書き換えないので、読み出しでキャッシュラインを汚すことはない。
+    struct alignas(64) EvalHashBucket {
+        static constexpr int kEntriesPerBucket = 4;
+
+        // keyに対応する評価値を探す。見つかったらtrue。
+        bool probe(const Key key, Value* score) const {
+            for (const auto& e : entry) {
+                ScoreKeyValue kv = e;
+                kv.decode();
+                if (kv.key == key) {
+                    *score = Value(kv.score);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // 評価値を保存する。別の局面のentryを追い出したときはtrueを返す。
+        bool save(const Key key, const Value score) {
+            ScoreKeyValue kv;
+            kv.key = key;
+            kv.score = score;
+            kv.encode();
+
+            // 他のスレッドが同じ局面を保存済みなら、その場所に上書きする。
+            for (int i = 0; i < kEntriesPerBucket - 1; ++i) {
+                ScoreKeyValue e = entry[i];
+                e.decode();
+                if (e.key == key) {
+                    entry[i] = kv;
+                    return false;
+                }
+            }
+
+            ScoreKeyValue oldest = entry[kEntriesPerBucket - 1];
+            oldest.decode();
+
+            // 1つずつ古い方にずらして、先頭に保存する。
+            // 他のスレッドからは同じentryが2つ見えたりすることがあるが、各entryはatomicにコピーされるので問題ない。
+            for (int i = kEntriesPerBucket - 1; i > 0; --i)
+                entry[i] = entry[i - 1];
+            entry[0] = kv;
+
+            return oldest.key != 0 && oldest.key != key;
+        }
+
+        ScoreKeyValue entry[kEntriesPerBucket];
+    };
+
+    static_assert(sizeof(EvalHashBucket) == 64, "EvalHashBucket should fit in a cache line");
+
     // evaluateしたものを保存しておくHashTable(俗にいうehash)
 
-    struct EvaluateHashTable : HashTable<ScoreKeyValue> {};
+    struct EvaluateHashTable : HashTable<EvalHashBucket> {};
 
     EvaluateHashTable g_evalTable;
+
+#if defined(EVAL_HASH_STATS)
+    // EvalHashの統計情報。USIコマンドの"evalhash"で表示する。
+    // 評価関数の呼び出しごとに更新するので、EVAL_HASH_STATSをdefineした時だけ数える。
+    // 全スレッドで1つのカウンターを更新すると、そのキャッシュラインの奪い合いになるので、
+    // スレッド毎に別のキャッシュラインで数えて、表示するときに合計する。
+    struct alignas(64) EvalHashCounters {
+        std::atomic<u64> probes;
+        std::atomic<u64> hits;
+        std::atomic<u64> stores;
+        std::atomic<u64> overwrites;
+    };
+
+    constexpr int kEvalHashCounterShards = 64;
+    EvalHashCounters g_evalHashCounters[kEvalHashCounterShards];
+
+    // 呼び出したスレッド用のカウンター
+    EvalHashCounters& evalhash_counters() {
+        static std::atomic<int> next_shard;
+        thread_local EvalHashCounters& counters = g_evalHashCounters[next_shard.fetch_add(1) % kEvalHashCounterShards];
+        return counters;
+    }
+#endif
+
     void EvalHash_Resize(size_t mbSize) { g_evalTable.resize(mbSize); }
     void EvalHash_Clear() { g_evalTable.clear(); };
 
+    void EvalHash_ClearStats() {
+#if defined(EVAL_HASH_STATS)
+        for (auto& c : g_evalHashCounters) {
+            c.probes = 0;
+            c.hits = 0;
+            c.stores = 0;
+            c.overwrites = 0;
+        }
+#endif
+    }
+
+    void EvalHash_PrintStats() {
+
+        // hashfull()と同じく、先頭の1000 bucketの使用率を1000分率で求める。
+        const size_t buckets = g_evalTable.count();
+        const size_t samples = std::min<size_t>(1000, buckets);
+        size_t used = 0;
+        for (size_t i = 0; i < samples; ++i) {
+            for (const auto& e : g_evalTable[Key(i)]->entry) {
+                ScoreKeyValue kv = e;
+                kv.decode();
+                used += kv.key != 0;
+            }
+        }
+
+        sync_cout << "info string EvalHash : " << buckets * sizeof(EvalHashBucket) / (1024 * 1024) << " [MB], "
+                  << buckets << " buckets x " << EvalHashBucket::kEntriesPerBucket << " entries"
+                  << " , hashfull = " << (samples ? used * 1000 / (samples * EvalHashBucket::kEntriesPerBucket) : 0)
+                  << sync_endl;
+
+#if defined(EVAL_HASH_STATS)
+        u64 probes = 0, hits = 0, stores = 0, overwrites = 0;
+        for (const auto& c : g_evalHashCounters) {
+            probes += c.probes.load(std::memory_order_relaxed);
+            hits += c.hits.load(std::memory_order_relaxed);
+            stores += c.stores.load(std::memory_order_relaxed);
+            overwrites += c.overwrites.load(std::memory_order_relaxed);
+        }
+
+        auto percent = [](u64 n, u64 d) { return d ? 100.0 * n / d : 0.0; };
+        sync_cout << "info string probes = " << probes
+                  << " , hits = " << hits << " (" << std::fixed << std::setprecision(2) << percent(hits, probes) << "%)"
+                  << " , misses = " << probes - hits << " (" << percent(probes - hits, probes) << "%)" << sync_endl
+                  << "info string stores = " << stores
+                  << " , overwrites = " << overwrites << " (" << percent(overwrites, stores) << "%)"
+                  << std::defaultfloat << sync_endl;
+#else
+        sync_cout << "info string hits and stores are not counted. Define EVAL_HASH_STATS to count them." << sync_endl;
+#endif
+    }
+
     // prefetchする関数も用意しておく。
     void prefetch_evalhash(const Key key) {
-        constexpr auto mask = ~((u64)0x1f);
-        prefetch((void*)((u64)g_evalTable[key] & mask));
+        prefetch(g_evalTable[key]);
     }
 #endif
 
@@ -224,6 +716,12 @@ namespace Eval {
     // benchコマンドなどでOptionsを保存して復元するのでこのときEvalDirが変更されたことになって、
     // 評価関数の再読込の必要があるというフラグを立てるため、この関数は2度呼び出されることがある。
     void load_eval() {
+#if !defined(__EMSCRIPTEN__)
+        // 評価関数イメージが作ってあれば、mapするだけで良い。
+        if (NNUE::LoadSharedImage())
+            return;
+#endif
+
         NNUE::Initialize();
 
 #if defined(EVAL_LEARN)
@@ -275,6 +773,10 @@ namespace Eval {
                 sync_cout << "Error! : failed to read " << file_name << sync_endl;
                 Tools::exit();
             }
+
+#if !defined(__EMSCRIPTEN__)
+            NNUE::CreateSharedImage();
+#endif
         }
     }
 
@@ -308,21 +810,30 @@ namespace Eval {
 #if defined(USE_EVAL_HASH)
         // evaluate hash tableにはあるかも。
         const Key key = pos.state()->key();
-        ScoreKeyValue entry = *g_evalTable[key];
-        entry.decode();
-        if (entry.key == key) {
+#if defined(EVAL_HASH_STATS)
+        auto& counters = evalhash_counters();
+        counters.probes.fetch_add(1, std::memory_order_relaxed);
+#endif
+        Value hash_score;
+        if (g_evalTable[key]->probe(key, &hash_score)) {
             // あった！
-            return Value(entry.score);
+#if defined(EVAL_HASH_STATS)
+            counters.hits.fetch_add(1, std::memory_order_relaxed);
+#endif
+            return hash_score;
         }
 #endif
 
         Value score = NNUE::ComputeScore(pos);
 #if defined(USE_EVAL_HASH)
         // せっかく計算したのでevaluate hash tableに保存しておく。
-        entry.key = key;
-        entry.score = score;
-        entry.encode();
-        *g_evalTable[key] = entry;
+#if defined(EVAL_HASH_STATS)
+        counters.stores.fetch_add(1, std::memory_order_relaxed);
+        if (g_evalTable[key]->save(key, score))
+            counters.overwrites.fetch_add(1, std::memory_order_relaxed);
+#else
+        g_evalTable[key]->save(key, score);
+#endif
 #endif
 
         return score;
@@ -13,6 +13,7 @@
 #include "../../misc.h"
 
 #include <memory>
+#include <vector>
 
 #if defined(EVAL_EMBEDDING)
 	extern const char*  gEmbeddedNNUEData;
@@ -39,10 +40,18 @@ namespace Eval::NNUE {
 	        // Tクラスのデストラクタ
 	        ptr->~T();
 
+			// ファイルをmapした領域(EvalShare)はmapの解除とともに開放されるので、ここでは何もしない。
+			if (mapped)
+				return;
+
 			// このメモリはLargeMemoryクラスを利用して確保したものなので、
 			// このクラスのfree()を呼び出して開放する。
 	        LargeMemory::static_free(ptr);
 	    }
+
+		// Whether the pointer refers to a memory-mapped shared weight image
+		// 共有用の評価関数イメージファイルをmapした領域を指しているか
+		bool mapped = false;
 	};
 
 	template <typename T>
@@ -74,6 +83,38 @@ namespace Eval::NNUE {
 	// 評価関数パラメータを書き込む
 	bool WriteParameters(std::ostream& stream);
 
+	// BatchEvaluatorで一度にネットワークに通す局面数の上限
+	constexpr std::size_t kMaxBatchSize = 256;
+
+	// 複数の局面の評価値をまとめて計算するクラス
+	// Add()で局面の入力特徴量を変換して溜めておき、Evaluate()でネットワークを層ごとに全局面分まとめて計算する。
+	// 棋譜を1手ずつ進めながらAdd()すれば、入力特徴量の変換は差分計算で済む。
+	class BatchEvaluator {
+	public:
+		BatchEvaluator();
+
+		// 局面を追加する。入力特徴量の変換はこの時点で行うので、追加した後にposを動かしてよい。
+		// size() < kMaxBatchSizeでなければならない。
+		void Add(const Position& pos);
+
+		// 溜まっている局面数
+		std::size_t size() const { return size_; }
+
+		// 溜まっている局面の評価値(手番側から見たもの)を追加した順にscoresに書き出し、空にする。
+		void Evaluate(Value* scores);
+
+	private:
+		// 入力特徴量とネットワークの順伝播用バッファ。キャッシュラインの境界に揃えて使う。
+		std::vector<char> memory_;
+		TransformedFeatureType* transformed_features_;
+		char* buffer_;
+		std::size_t size_ = 0;
+	};
+
+	// 複数の局面の評価値をまとめて計算する。評価値は手番側から見たもの。
+	// 各局面のaccumulatorに評価値を記録するので、その後のevaluate()は計算済みの値を返す。
+	void ComputeScores(const Position* const* positions, std::size_t num_positions, Value* scores);
+
 }  // namespace Eval::NNUE
 
 #endif  // defined(EVAL_NNUE)
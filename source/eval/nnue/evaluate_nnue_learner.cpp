@@ -6,6 +6,8 @@
 
 #include <random>
 #include <fstream>
+#include <iterator>
+#include <memory>
 
 #include "../../learn/learn.h"
 #include "../../learn/learning_tools.h"
@@ -13,6 +15,7 @@
 #include "../../position.h"
 #include "../../usi.h"
 #include "../../misc.h"
+#include "../../thread.h"
 
 #include "../evaluate_common.h"
 
@@ -38,11 +41,17 @@ namespace NNUE {
 
 namespace {
 
-// 学習データ
-std::vector<Example> examples;
+// 学習データを溜めるスレッドごとのバッファ
+// mutexは、TrainParameters()がバッファを回収するときにしか競合しない。
+struct alignas(kCacheLineSize) ExampleBuffer {
+  std::mutex mutex;
+  std::vector<Example> examples;
+};
+std::unique_ptr<ExampleBuffer[]> example_buffers;
+std::size_t num_example_buffers;
 
-// examplesの排他制御をするMutex
-std::mutex examples_mutex;
+// バッファから回収した学習データ(ミニバッチに満たなかった分は次回に持ち越す)
+std::vector<Example> examples;
 
 // ミニバッチのサンプル数
 u64 batch_size;
@@ -85,6 +94,9 @@ void InitializeTraining(double eta1, u64 eta1_epoch,
     trainer->Initialize(rng);
   }
 
+  num_example_buffers = std::max<std::size_t>(Threads.size(), 1);
+  example_buffers = std::make_unique<ExampleBuffer[]>(num_example_buffers);
+
   global_learning_rate_scale = 1.0;
   EvalLearningTools::Weight::init_eta(eta1, eta2, eta3, eta1_epoch, eta2_epoch);
 }
@@ -165,19 +177,28 @@ void AddExample(Position& pos, Color rootColor,
     }
   }
 
-  std::lock_guard<std::mutex> lock(examples_mutex);
-  examples.push_back(std::move(example));
+  auto& buffer = example_buffers[pos.this_thread()->thread_id() % num_example_buffers];
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.examples.push_back(std::move(example));
 }
 
-// 評価関数パラメーターを更新する
-void UpdateParameters(u64 epoch) {
+// 溜まった学習データで学習用の評価関数パラメータを更新する
+void TrainParameters(u64 epoch) {
   ASSERT_LV3(batch_size > 0);
 
   EvalLearningTools::Weight::calc_eta(epoch);
   const auto learning_rate = static_cast<LearnFloatType>(
       get_eta() / batch_size);
 
-  std::lock_guard<std::mutex> lock(examples_mutex);
+  // 各スレッドのバッファから学習データを回収する
+  for (std::size_t i = 0; i < num_example_buffers; ++i) {
+    auto& buffer = example_buffers[i];
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    std::move(buffer.examples.begin(), buffer.examples.end(),
+              std::back_inserter(examples));
+    buffer.examples.clear();
+  }
+
   std::shuffle(examples.begin(), examples.end(), rng);
   while (examples.size() >= batch_size) {
     std::vector<Example> batch(examples.end() - batch_size, examples.end());
@@ -196,6 +217,10 @@ void UpdateParameters(u64 epoch) {
 
     trainer->Backpropagate(gradients.data(), learning_rate);
   }
+}
+
+// 学習用の評価関数パラメータを整数化して評価関数に反映する
+void QuantizeParameters() {
   SendMessages({{"quantize_parameters"}});
 }
 
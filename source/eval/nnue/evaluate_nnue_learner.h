@@ -33,8 +33,13 @@ void RestoreParameters(const std::string& dir_name);
 void AddExample(Position& pos, Color rootColor,
                 const Learner::PackedSfenValue& psv, double weight);
 
-// 評価関数パラメータを更新する
-void UpdateParameters(u64 epoch);
+// 溜まった学習データで学習用の評価関数パラメータを更新する
+// 評価関数(整数化されたパラメータ)は書き換えないので、AddExample()や探索と並行して呼び出して良い。
+void TrainParameters(u64 epoch);
+
+// 学習用の評価関数パラメータを整数化して評価関数に反映する
+// 評価関数を書き換えるので、この間は他のスレッドに評価関数を使わせないこと。
+void QuantizeParameters();
 
 // 学習に問題が生じていないかチェックする
 void CheckHealth();
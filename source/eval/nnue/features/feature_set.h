@@ -83,11 +83,22 @@ class FeatureSetBase {
   static void AppendChangedIndices(
       const PositionType& pos, TriggerEvent trigger,
       IndexListType removed[2], IndexListType added[2], bool reset[2]) {
-    const auto& dp = pos.state()->dirtyPiece;
+    AppendChangedIndices(pos, pos.state()->dirtyPiece, trigger,
+                         removed, added, reset);
+  }
+
+  // 特徴量のうち、dpで表される一手分の変化によって値が変化したインデックスのリストを取得する
+  // 現局面より前の手のdpを渡す場合、その手以降にtriggerによる全計算が起きていないこと、
+  // および全ての特徴量がkSupportsMultiPlyUpdateであることが前提となる。
+  template <typename PositionType, typename IndexListType>
+  static void AppendChangedIndices(
+      const PositionType& pos, const DirtyPiece& dp, TriggerEvent trigger,
+      IndexListType removed[2], IndexListType added[2], bool reset[2]) {
+    // null moveなど、駒が動いていない場合は何もしない
+    reset[BLACK] = reset[WHITE] = false;
     if (dp.dirty_num == 0) return;
 
     for (const auto perspective : COLOR) {
-      reset[perspective] = false;
       switch (trigger) {
         case TriggerEvent::kNone:
           break;
@@ -114,7 +125,7 @@ class FeatureSetBase {
             pos, trigger, perspective, &added[perspective]);
       } else {
         Derived::CollectChangedIndices(
-            pos, trigger, perspective,
+            pos, dp, trigger, perspective,
             &removed[perspective], &added[perspective]);
       }
     }
@@ -146,6 +157,9 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   using SortedTriggerSet = typename InsertToSet<TriggerEvent,
       typename Tail::SortedTriggerSet, Head::kRefreshTrigger>::Result;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
+  // 複数手分の差分計算をまとめて行えるか
+  static constexpr bool kSupportsMultiPlyUpdate =
+      Head::kSupportsMultiPlyUpdate && Tail::kSupportsMultiPlyUpdate;
 
   // 特徴量名を取得する
   static std::string GetName() {
@@ -171,13 +185,14 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   template <typename IndexListType>
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const DirtyPiece& dp, const TriggerEvent trigger,
+      const Color perspective,
       IndexListType* const removed, IndexListType* const added) {
-    Tail::CollectChangedIndices(pos, trigger, perspective, removed, added);
+    Tail::CollectChangedIndices(pos, dp, trigger, perspective, removed, added);
     if (Head::kRefreshTrigger == trigger) {
       const auto start_removed = removed->size();
       const auto start_added = added->size();
-      Head::AppendChangedIndices(pos, perspective, removed, added);
+      Head::AppendChangedIndices(pos, dp, perspective, removed, added);
       for (auto i = start_removed; i < removed->size(); ++i) {
         (*removed)[i] += Tail::kDimensions;
       }
@@ -215,6 +230,9 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
   using SortedTriggerSet =
       CompileTimeList<TriggerEvent, FeatureType::kRefreshTrigger>;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
+  // 複数手分の差分計算をまとめて行えるか
+  static constexpr bool kSupportsMultiPlyUpdate =
+      FeatureType::kSupportsMultiPlyUpdate;
 
   // 特徴量名を取得する
   static std::string GetName() {
@@ -233,10 +251,11 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
 
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const DirtyPiece& dp, const TriggerEvent trigger,
+      const Color perspective,
       IndexList* const removed, IndexList* const added) {
     if (FeatureType::kRefreshTrigger == trigger) {
-      FeatureType::AppendChangedIndices(pos, perspective, removed, added);
+      FeatureType::AppendChangedIndices(pos, dp, perspective, removed, added);
     }
   }
 
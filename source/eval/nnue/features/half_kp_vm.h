@@ -36,14 +36,16 @@ namespace Eval {
 				static constexpr TriggerEvent kRefreshTrigger =
 					(AssociatedKing == Side::kFriend) ?
 					TriggerEvent::kFriendKingMoved : TriggerEvent::kEnemyKingMoved;
+				// 複数手分の差分計算をまとめて行えるか(一手前からの変化がDirtyPieceと玉の位置だけで決まるか)
+				static constexpr bool kSupportsMultiPlyUpdate = true;
 
 				// 特徴量のうち、値が1であるインデックスのリストを取得する
 				static void AppendActiveIndices(const Position& pos, Color perspective,
 					IndexList* active);
 
-				// 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
-				static void AppendChangedIndices(const Position& pos, Color perspective,
-					IndexList* removed, IndexList* added);
+				// 特徴量のうち、dpで表される一手分の変化によって値が変化したインデックスのリストを取得する
+				static void AppendChangedIndices(const Position& pos, const DirtyPiece& dp,
+					Color perspective, IndexList* removed, IndexList* added);
 
 				// 玉の位置とBonaPieceから特徴量のインデックスを求める
 				static IndexType MakeIndex(Square sq_k, BonaPiece p);
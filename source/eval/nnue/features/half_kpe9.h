@@ -37,13 +37,17 @@ class HalfKPE9 {
   static constexpr TriggerEvent kRefreshTrigger =
       (AssociatedKing == Side::kFriend) ?
       TriggerEvent::kFriendKingMoved : TriggerEvent::kEnemyKingMoved;
+  // 複数手分の差分計算をまとめて行えるか
+  // 利きの数が直前の局面の利き(board_effect_prev)に依存するので、一手分しか差分計算できない。
+  static constexpr bool kSupportsMultiPlyUpdate = false;
 
   // 特徴量のうち、値が1であるインデックスのリストを取得する
   static void AppendActiveIndices(const Position& pos, Color perspective,
                                   IndexList* active);
 
-  // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
-  static void AppendChangedIndices(const Position& pos, Color perspective,
+  // 特徴量のうち、dpで表される一手分の変化によって値が変化したインデックスのリストを取得する
+  static void AppendChangedIndices(const Position& pos, const DirtyPiece& dp,
+                                   Color perspective,
                                    IndexList* removed, IndexList* added);
 
   // 玉の位置とBonaPieceと利き数から特徴量のインデックスを求める
@@ -81,6 +81,30 @@ class AffineTransform {
 	// 順伝播
 	const OutputType* Propagate(const TransformedFeatureType* transformed_features, char* buffer) const {
 		const auto input = previous_layer_.Propagate(transformed_features, buffer + kSelfBufferSize);
+		return Forward(input, buffer);
+	}
+
+	// Forward propagation of a batch
+	// 複数局面分の順伝播
+	// 直前の層を全局面分計算してから、この層を全局面分まとめて計算する。
+	// bufferにはkBufferSize * batch_sizeバイトが必要。
+	// i番目の局面の出力は、戻り値 + i * GetBatchStride(transformed_stride) から始まる。
+	const OutputType* PropagateBatch(const TransformedFeatureType* transformed_features, std::size_t transformed_stride,
+	                                 std::size_t batch_size, char* buffer) const {
+		const auto input = previous_layer_.PropagateBatch(transformed_features, transformed_stride, batch_size,
+		                                                  buffer + kSelfBufferSize * batch_size);
+		ForwardBatch(input, PreviousLayer::GetBatchStride(transformed_stride), batch_size, buffer);
+		return reinterpret_cast<const OutputType*>(buffer);
+	}
+
+	// PropagateBatch()の出力における、局面1つあたりの要素数
+	static constexpr std::size_t GetBatchStride(std::size_t /*transformed_stride*/) {
+		return kSelfBufferSize / sizeof(OutputType);
+	}
+
+   private:
+	// この層だけの順伝播
+	const OutputType* Forward(const InputType* input, char* buffer) const {
 
 #if defined(USE_WASM_SIMD)
 		{
@@ -712,7 +736,257 @@ class AffineTransform {
 		return output;
 	}
 
-   private:
+	// 複数局面分のこの層の順伝播
+	// 重みのチャンクを1つ読み込むごとに、kBatchTile局面分の入力にまとめて掛けるので、
+	// 重みの読み込み回数が1局面ずつForward()を呼ぶ場合の1/kBatchTileになる。
+	// 各局面の計算結果はForward()と同じになる。
+	void ForwardBatch(const InputType* input, std::size_t input_stride, std::size_t batch_size, char* buffer) const {
+		constexpr std::size_t kOutputStride = kSelfBufferSize / sizeof(OutputType);
+		[[maybe_unused]] const auto output = reinterpret_cast<OutputType*>(buffer);
+		std::size_t b = 0;
+
+#if defined(USE_WASM_SIMD)
+		// 1局面ずつForward()を呼ぶ。
+
+#elif defined(USE_AVX2)
+
+		constexpr IndexType   kNumChunks = kPaddedInputDimensions / 32;
+		constexpr std::size_t kBatchTile = 4;
+		const __m256i         kOnes256   = _mm256_set1_epi16(1);
+
+		auto m256_add_dpbusd_epi32 = [=](__m256i& acc, __m256i a, __m256i w) {
+#if defined(USE_VNNI)
+			acc = _mm256_dpbusd_epi32(acc, a, w);
+#else
+			__m256i product0 = _mm256_maddubs_epi16(a, w);
+			product0         = _mm256_madd_epi16(product0, kOnes256);
+			acc              = _mm256_add_epi32(acc, product0);
+#endif
+		};
+
+		auto m256_add_dpbusd_epi32x2 = [=](__m256i& acc, __m256i a0, __m256i w0, __m256i a1, __m256i w1) {
+#if defined(USE_VNNI)
+			acc = _mm256_dpbusd_epi32(acc, a0, w0);
+			acc = _mm256_dpbusd_epi32(acc, a1, w1);
+#else
+			__m256i product0 = _mm256_maddubs_epi16(a0, w0);
+			__m256i product1 = _mm256_maddubs_epi16(a1, w1);
+			product0         = _mm256_adds_epi16(product0, product1);
+			product0         = _mm256_madd_epi16(product0, kOnes256);
+			acc              = _mm256_add_epi32(acc, product0);
+#endif
+		};
+
+		// 4局面分の和を水平加算してbiasを足し、各局面の出力のi番目に書き込む
+		auto store_x4 = [&](std::size_t b0, IndexType i, __m256i sum0, __m256i sum1, __m256i sum2, __m256i sum3) {
+			sum0 = _mm256_hadd_epi32(sum0, sum1);
+			sum2 = _mm256_hadd_epi32(sum2, sum3);
+			sum0 = _mm256_hadd_epi32(sum0, sum2);
+			__m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum0), _mm256_extracti128_si256(sum0, 1));
+			sum128         = _mm_add_epi32(sum128, _mm_set1_epi32(biases_[i]));
+			output[kOutputStride * (b0 + 0) + i] = _mm_cvtsi128_si32(sum128);
+			output[kOutputStride * (b0 + 1) + i] = _mm_extract_epi32(sum128, 1);
+			output[kOutputStride * (b0 + 2) + i] = _mm_extract_epi32(sum128, 2);
+			output[kOutputStride * (b0 + 3) + i] = _mm_extract_epi32(sum128, 3);
+		};
+
+		for (; b + kBatchTile <= batch_size; b += kBatchTile) {
+			const auto in0 = reinterpret_cast<const __m256i*>(input + input_stride * (b + 0));
+			const auto in1 = reinterpret_cast<const __m256i*>(input + input_stride * (b + 1));
+			const auto in2 = reinterpret_cast<const __m256i*>(input + input_stride * (b + 2));
+			const auto in3 = reinterpret_cast<const __m256i*>(input + input_stride * (b + 3));
+
+			if constexpr (kOutputDimensions % 4 == 0) {
+				// 2行×4局面ずつ計算する。
+				for (IndexType i = 0; i < kOutputDimensions; i += 2) {
+					const auto row0 = reinterpret_cast<const __m256i*>(&weights_[(i + 0) * kPaddedInputDimensions]);
+					const auto row1 = reinterpret_cast<const __m256i*>(&weights_[(i + 1) * kPaddedInputDimensions]);
+
+					__m256i sum00 = _mm256_setzero_si256(), sum01 = _mm256_setzero_si256();
+					__m256i sum02 = _mm256_setzero_si256(), sum03 = _mm256_setzero_si256();
+					__m256i sum10 = _mm256_setzero_si256(), sum11 = _mm256_setzero_si256();
+					__m256i sum12 = _mm256_setzero_si256(), sum13 = _mm256_setzero_si256();
+
+					// Forward()と同じ順序・同じ飽和の仕方で積和を取る。
+					int j = 0;
+					if (!canSaturate16x4[i / 4]) {
+						for (; j < (int)kNumChunks - 1; j += 2) {
+							const __m256i w00 = _mm256_load_si256(&row0[j]), w01 = _mm256_load_si256(&row0[j + 1]);
+							const __m256i w10 = _mm256_load_si256(&row1[j]), w11 = _mm256_load_si256(&row1[j + 1]);
+							m256_add_dpbusd_epi32x2(sum00, in0[j], w00, in0[j + 1], w01);
+							m256_add_dpbusd_epi32x2(sum10, in0[j], w10, in0[j + 1], w11);
+							m256_add_dpbusd_epi32x2(sum01, in1[j], w00, in1[j + 1], w01);
+							m256_add_dpbusd_epi32x2(sum11, in1[j], w10, in1[j + 1], w11);
+							m256_add_dpbusd_epi32x2(sum02, in2[j], w00, in2[j + 1], w01);
+							m256_add_dpbusd_epi32x2(sum12, in2[j], w10, in2[j + 1], w11);
+							m256_add_dpbusd_epi32x2(sum03, in3[j], w00, in3[j + 1], w01);
+							m256_add_dpbusd_epi32x2(sum13, in3[j], w10, in3[j + 1], w11);
+						}
+					}
+					for (; j < (int)kNumChunks; ++j) {
+						const __m256i w0 = _mm256_load_si256(&row0[j]);
+						const __m256i w1 = _mm256_load_si256(&row1[j]);
+						m256_add_dpbusd_epi32(sum00, in0[j], w0);
+						m256_add_dpbusd_epi32(sum10, in0[j], w1);
+						m256_add_dpbusd_epi32(sum01, in1[j], w0);
+						m256_add_dpbusd_epi32(sum11, in1[j], w1);
+						m256_add_dpbusd_epi32(sum02, in2[j], w0);
+						m256_add_dpbusd_epi32(sum12, in2[j], w1);
+						m256_add_dpbusd_epi32(sum03, in3[j], w0);
+						m256_add_dpbusd_epi32(sum13, in3[j], w1);
+					}
+
+					store_x4(b, i + 0, sum00, sum01, sum02, sum03);
+					store_x4(b, i + 1, sum10, sum11, sum12, sum13);
+				}
+			} else if constexpr (kOutputDimensions == 1) {
+				const auto row0 = reinterpret_cast<const __m256i*>(&weights_[0]);
+
+				__m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+				__m256i sum2 = _mm256_setzero_si256(), sum3 = _mm256_setzero_si256();
+
+				for (IndexType j = 0; j < kNumChunks; ++j) {
+					const __m256i w = _mm256_load_si256(&row0[j]);
+					m256_add_dpbusd_epi32(sum0, in0[j], w);
+					m256_add_dpbusd_epi32(sum1, in1[j], w);
+					m256_add_dpbusd_epi32(sum2, in2[j], w);
+					m256_add_dpbusd_epi32(sum3, in3[j], w);
+				}
+
+				store_x4(b, 0, sum0, sum1, sum2, sum3);
+			} else {
+				// kOutputDimensionsは1かkSimdWidthの倍数なので、ここには来ない。
+				ASSERT_LV5(false);
+			}
+		}
+
+#elif defined(USE_SSSE3)
+
+		constexpr IndexType   kNumChunks = kPaddedInputDimensions / 16;
+		constexpr std::size_t kBatchTile = 4;
+		const __m128i         kOnes128   = _mm_set1_epi16(1);
+
+		auto m128_add_dpbusd_epi32 = [=](__m128i& acc, __m128i a, __m128i w) {
+			__m128i product0 = _mm_maddubs_epi16(a, w);
+			product0         = _mm_madd_epi16(product0, kOnes128);
+			acc              = _mm_add_epi32(acc, product0);
+		};
+
+		auto m128_add_dpbusd_epi32x2 = [=](__m128i& acc, __m128i a0, __m128i w0, __m128i a1, __m128i w1) {
+			__m128i product0 = _mm_maddubs_epi16(a0, w0);
+			__m128i product1 = _mm_maddubs_epi16(a1, w1);
+			product0         = _mm_adds_epi16(product0, product1);
+			product0         = _mm_madd_epi16(product0, kOnes128);
+			acc              = _mm_add_epi32(acc, product0);
+		};
+
+		// 4局面分の和を水平加算してbiasを足し、各局面の出力のi番目に書き込む
+		auto store_x4 = [&](std::size_t b0, IndexType i, __m128i sum0, __m128i sum1, __m128i sum2, __m128i sum3) {
+			sum0 = _mm_hadd_epi32(sum0, sum1);
+			sum2 = _mm_hadd_epi32(sum2, sum3);
+			sum0 = _mm_hadd_epi32(sum0, sum2);
+			sum0 = _mm_add_epi32(sum0, _mm_set1_epi32(biases_[i]));
+			alignas(16) OutputType sums[4];
+			_mm_store_si128(reinterpret_cast<__m128i*>(sums), sum0);
+			for (std::size_t k = 0; k < 4; ++k)
+				output[kOutputStride * (b0 + k) + i] = sums[k];
+		};
+
+		for (; b + kBatchTile <= batch_size; b += kBatchTile) {
+			const auto in0 = reinterpret_cast<const __m128i*>(input + input_stride * (b + 0));
+			const auto in1 = reinterpret_cast<const __m128i*>(input + input_stride * (b + 1));
+			const auto in2 = reinterpret_cast<const __m128i*>(input + input_stride * (b + 2));
+			const auto in3 = reinterpret_cast<const __m128i*>(input + input_stride * (b + 3));
+
+			if constexpr (kOutputDimensions % 4 == 0) {
+				// 2行×4局面ずつ計算する。
+				for (IndexType i = 0; i < kOutputDimensions; i += 2) {
+					const auto row0 = reinterpret_cast<const __m128i*>(&weights_[(i + 0) * kPaddedInputDimensions]);
+					const auto row1 = reinterpret_cast<const __m128i*>(&weights_[(i + 1) * kPaddedInputDimensions]);
+
+					__m128i sum00 = _mm_setzero_si128(), sum01 = _mm_setzero_si128();
+					__m128i sum02 = _mm_setzero_si128(), sum03 = _mm_setzero_si128();
+					__m128i sum10 = _mm_setzero_si128(), sum11 = _mm_setzero_si128();
+					__m128i sum12 = _mm_setzero_si128(), sum13 = _mm_setzero_si128();
+
+					// Forward()と同じ順序・同じ飽和の仕方で積和を取る。
+					int j = 0;
+					if (!canSaturate16x4[i / 4]) {
+						for (; j < (int)kNumChunks - 1; j += 2) {
+							const __m128i w00 = _mm_load_si128(&row0[j]), w01 = _mm_load_si128(&row0[j + 1]);
+							const __m128i w10 = _mm_load_si128(&row1[j]), w11 = _mm_load_si128(&row1[j + 1]);
+							m128_add_dpbusd_epi32x2(sum00, in0[j], w00, in0[j + 1], w01);
+							m128_add_dpbusd_epi32x2(sum10, in0[j], w10, in0[j + 1], w11);
+							m128_add_dpbusd_epi32x2(sum01, in1[j], w00, in1[j + 1], w01);
+							m128_add_dpbusd_epi32x2(sum11, in1[j], w10, in1[j + 1], w11);
+							m128_add_dpbusd_epi32x2(sum02, in2[j], w00, in2[j + 1], w01);
+							m128_add_dpbusd_epi32x2(sum12, in2[j], w10, in2[j + 1], w11);
+							m128_add_dpbusd_epi32x2(sum03, in3[j], w00, in3[j + 1], w01);
+							m128_add_dpbusd_epi32x2(sum13, in3[j], w10, in3[j + 1], w11);
+						}
+					}
+					for (; j < (int)kNumChunks; ++j) {
+						const __m128i w0 = _mm_load_si128(&row0[j]);
+						const __m128i w1 = _mm_load_si128(&row1[j]);
+						m128_add_dpbusd_epi32(sum00, in0[j], w0);
+						m128_add_dpbusd_epi32(sum10, in0[j], w1);
+						m128_add_dpbusd_epi32(sum01, in1[j], w0);
+						m128_add_dpbusd_epi32(sum11, in1[j], w1);
+						m128_add_dpbusd_epi32(sum02, in2[j], w0);
+						m128_add_dpbusd_epi32(sum12, in2[j], w1);
+						m128_add_dpbusd_epi32(sum03, in3[j], w0);
+						m128_add_dpbusd_epi32(sum13, in3[j], w1);
+					}
+
+					store_x4(b, i + 0, sum00, sum01, sum02, sum03);
+					store_x4(b, i + 1, sum10, sum11, sum12, sum13);
+				}
+			} else if constexpr (kOutputDimensions == 1) {
+				const auto row0 = reinterpret_cast<const __m128i*>(&weights_[0]);
+
+				__m128i sum0 = _mm_setzero_si128(), sum1 = _mm_setzero_si128();
+				__m128i sum2 = _mm_setzero_si128(), sum3 = _mm_setzero_si128();
+
+				for (IndexType j = 0; j < kNumChunks; ++j) {
+					const __m128i w = _mm_load_si128(&row0[j]);
+					m128_add_dpbusd_epi32(sum0, in0[j], w);
+					m128_add_dpbusd_epi32(sum1, in1[j], w);
+					m128_add_dpbusd_epi32(sum2, in2[j], w);
+					m128_add_dpbusd_epi32(sum3, in3[j], w);
+				}
+
+				store_x4(b, 0, sum0, sum1, sum2, sum3);
+			} else {
+				// kOutputDimensionsは1かkSimdWidthの倍数なので、ここには来ない。
+				ASSERT_LV5(false);
+			}
+		}
+
+#elif !defined(USE_SSE2) && !defined(USE_MMX) && !defined(USE_NEON)
+
+		// CPUに依存しないコード
+		// 重みの1行を全局面に続けて使う。
+		for (IndexType i = 0; i < kOutputDimensions; ++i) {
+			const IndexType offset = i * kPaddedInputDimensions;
+			for (std::size_t k = 0; k < batch_size; ++k) {
+				const InputType* in  = input + input_stride * k;
+				OutputType       sum = biases_[i];
+				for (IndexType j = 0; j < kInputDimensions; ++j) {
+					sum += weights_[offset + j] * in[j];
+				}
+				output[kOutputStride * k + i] = sum;
+			}
+		}
+		b = batch_size;
+
+#endif
+
+		// 端数の局面と、上で扱わなかったアーキテクチャでは1局面ずつ計算する。
+		for (; b < batch_size; ++b) {
+			Forward(input + input_stride * b, buffer + kSelfBufferSize * b);
+		}
+	}
+
 	// パラメータの型
 	using BiasType   = OutputType;
 	using WeightType = std::int8_t;
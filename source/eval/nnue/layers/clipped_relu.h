@@ -70,6 +70,36 @@ class ClippedReLU {
       const TransformedFeatureType* transformed_features, char* buffer) const {
     const auto input = previous_layer_.Propagate(
         transformed_features, buffer + kSelfBufferSize);
+    return Forward(input, buffer);
+  }
+
+  // Forward propagation of a batch
+  // 複数局面分の順伝播
+  const OutputType* PropagateBatch(
+      const TransformedFeatureType* transformed_features,
+      std::size_t transformed_stride, std::size_t batch_size,
+      char* buffer) const {
+    const auto input = previous_layer_.PropagateBatch(
+        transformed_features, transformed_stride, batch_size,
+        buffer + kSelfBufferSize * batch_size);
+    // この層は重みを持たないので、1局面ずつForward()を呼ぶ。
+    const std::size_t input_stride =
+        PreviousLayer::GetBatchStride(transformed_stride);
+    for (std::size_t i = 0; i < batch_size; ++i) {
+      Forward(input + input_stride * i, buffer + kSelfBufferSize * i);
+    }
+    return reinterpret_cast<const OutputType*>(buffer);
+  }
+
+  // PropagateBatch()の出力における、局面1つあたりの要素数
+  static constexpr std::size_t GetBatchStride(
+      std::size_t /*transformed_stride*/) {
+    return kSelfBufferSize / sizeof(OutputType);
+  }
+
+ private:
+  // この層だけの順伝播
+  const OutputType* Forward(const InputType* input, char* buffer) const {
     const auto output = reinterpret_cast<OutputType*>(buffer);
 
   #if defined(USE_AVX2)
@@ -161,7 +191,6 @@ class ClippedReLU {
     return output;
   }
 
- private:
    // 学習用クラスをfriendにする
    friend class Trainer<ClippedReLU>;
  
@@ -67,6 +67,21 @@ class InputSlice {
     return transformed_features + Offset;
   }
 
+  // Forward propagation of a batch
+  // 複数局面分の順伝播
+  // 入力特徴量はtransformed_strideごとに並んでいるので、その位置をそのまま返す。
+  const OutputType* PropagateBatch(
+      const TransformedFeatureType* transformed_features,
+      std::size_t /*transformed_stride*/, std::size_t /*batch_size*/,
+      char* /*buffer*/) const {
+    return transformed_features + Offset;
+  }
+
+  // PropagateBatch()の出力における、局面1つあたりの要素数
+  static constexpr std::size_t GetBatchStride(std::size_t transformed_stride) {
+    return transformed_stride;
+  }
+
  private:
 };
 
@@ -12,7 +12,10 @@
 #include "nnue_architecture.h"
 #include "features/index_list.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>  // std::memset()
+#include <memory>
 
 namespace Eval::NNUE {
 
@@ -87,6 +90,12 @@ class FeatureTransformer {
 	static_assert(kHalfDimensions % kTileHeight == 0, "kTileHeight must divide kHalfDimensions");
 #endif
 
+	// Maximum number of plies to walk back for the difference calculation
+	// 差分計算のために遡る最大の手数
+	// 1手あたりの変化は高々数個の特徴量なので、この程度までなら全計算より速い。
+	// 一手前の局面にしか依存しない特徴量(利きなど)を含む場合は1手のみ。
+	static constexpr int kMaxUpdatePlies = RawFeatures::kSupportsMultiPlyUpdate ? 8 : 1;
+
    public:
 	// Output type
 	// 出力の型
@@ -101,6 +110,15 @@ class FeatureTransformer {
 	// 順伝播用バッファのサイズ
 	static constexpr std::size_t kBufferSize = kOutputDimensions * sizeof(OutputType);
 
+	// Whether refreshes use the per-thread accumulator cache (switchable for benchmarks)
+	// 全計算の際にスレッド毎の累積値キャッシュを用いるか(ベンチマークのために切り替えられるようにしてある)
+	static inline bool use_accumulator_cache = true;
+
+	// Invalidate the accumulator caches of all threads after the parameters have changed
+	// パラメータが変更されたので、全スレッドのキャッシュを無効にする
+	// (ReadParameters()以外でパラメータを差し替えたときは呼び出し側で呼ぶこと)
+	static void invalidate_accumulator_cache() { ++parameters_version_; }
+
 	// Hash value embedded in the evaluation file
 	// 評価関数ファイルに埋め込むハッシュ値
 	static constexpr std::uint32_t GetHashValue() { return RawFeatures::kHashValue ^ kOutputDimensions; }
@@ -118,6 +136,7 @@ class FeatureTransformer {
 		for (std::size_t i = 0; i < kHalfDimensions; ++i) biases_[i] = read_little_endian<BiasType>(stream);
 		for (std::size_t i = 0; i < kHalfDimensions * kInputDimensions; ++i)
 			weights_[i] = read_little_endian<WeightType>(stream);
+		invalidate_accumulator_cache();
 		return !stream.fail();
 	}
 
@@ -131,17 +150,22 @@ class FeatureTransformer {
 
 	// Proceed with the difference calculation if possible
 	// 可能なら差分計算を進める
+	// 累積値が計算済みの局面までkMaxUpdatePlies手まで遡り、その間の差分をまとめて適用する。
 	bool UpdateAccumulatorIfPossible(const Position& pos) const {
 		const auto now = pos.state();
 		if (now->accumulator.computed_accumulation) {
 			return true;
 		}
-		const auto prev = now->previous;
-		if (prev && prev->accumulator.computed_accumulation) {
-			update_accumulator(pos);
-			return true;
+		const StateInfo* states[kMaxUpdatePlies];
+		int              num_states = 0;
+		for (auto st = now; !st->accumulator.computed_accumulation; st = st->previous) {
+			if (num_states == kMaxUpdatePlies || !st->previous) {
+				return false;
+			}
+			states[num_states++] = st;
 		}
-		return false;
+		update_accumulator(pos, states, num_states);
+		return true;
 	}
 
 	// Convert input features
@@ -279,35 +303,8 @@ class FeatureTransformer {
 			Features::IndexList active_indices[2];
 			RawFeatures::AppendActiveIndices(pos, kRefreshTriggers[i], active_indices);
 			for (Color perspective : {BLACK, WHITE}) {
-#if defined(VECTOR)
-				if (i == 0) {
-					std::memcpy(accumulator.accumulation[perspective][i], biases_, kHalfDimensions * sizeof(BiasType));
-				} else {
-					std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-				}
-				for (const auto index : active_indices[perspective]) {
-					const IndexType offset = kHalfDimensions * index;
-					auto accumulation      = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
-					auto column            = reinterpret_cast<const vec_t*>(&weights_[offset]);
-					constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
-					for (IndexType j = 0; j < kNumChunks; ++j) {
-						accumulation[j] = vec_add_16(accumulation[j], column[j]);
-					}
-				}
-#else
-				if (i == 0) {
-					std::memcpy(accumulator.accumulation[perspective][i], biases_, kHalfDimensions * sizeof(BiasType));
-				} else {
-					std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-				}
-				for (const auto index : active_indices[perspective]) {
-					const IndexType offset = kHalfDimensions * index;
-
-					for (IndexType j = 0; j < kHalfDimensions; ++j) {
-						accumulator.accumulation[perspective][i][j] += weights_[offset + j];
-					}
-				}
-#endif
+				refresh_accumulation(pos, i, perspective, active_indices[perspective],
+				                     accumulator.accumulation[perspective][i]);
 			}
 		}
 
@@ -318,61 +315,83 @@ class FeatureTransformer {
 
 	// Calculate cumulative value using difference calculation
 	// 差分計算を用いて累積値を計算する
-	void update_accumulator(const Position& pos) const {
-		const auto prev_accumulator = pos.state()->previous->accumulator;
-		auto&      accumulator      = pos.state()->accumulator;
+	// statesには現局面から遡って累積値が未計算の局面が並び、最後の局面のpreviousが計算済みであること。
+	// 途中の局面の累積値は計算せず、全ての手の差分を計算済みの累積値に一度に適用する。
+	void update_accumulator(const Position& pos, const StateInfo* const* states, int num_states) const {
+		const auto& prev_accumulator = states[num_states - 1]->previous->accumulator;
+		auto&       accumulator      = pos.state()->accumulator;
 		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
-			Features::IndexList removed_indices[2], added_indices[2];
-			bool                reset[2];
-			RawFeatures::AppendChangedIndices(pos, kRefreshTriggers[i], removed_indices, added_indices, reset);
+			Features::IndexList removed_indices[kMaxUpdatePlies][2], added_indices[kMaxUpdatePlies][2];
+			bool                reset[2] = {false, false};
+			for (int k = 0; k < num_states; ++k) {
+				bool reset_this_ply[2];
+				RawFeatures::AppendChangedIndices(pos, states[k]->dirtyPiece, kRefreshTriggers[i],
+				                                  removed_indices[k], added_indices[k], reset_this_ply);
+				reset[BLACK] |= reset_this_ply[BLACK];
+				reset[WHITE] |= reset_this_ply[WHITE];
+			}
+
+			// 途中で全計算が必要になった視点については、現局面で全計算する
+			Features::IndexList active_indices[2];
+			if ((reset[BLACK] || reset[WHITE]) && num_states > 1) {
+				RawFeatures::AppendActiveIndices(pos, kRefreshTriggers[i], active_indices);
+			}
+
 			for (Color perspective : {BLACK, WHITE}) {
-#if defined(VECTOR)
-				constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
-				auto accumulation              = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
-#endif
 				if (reset[perspective]) {
-					if (i == 0) {
-						std::memcpy(accumulator.accumulation[perspective][i], biases_,
-						            kHalfDimensions * sizeof(BiasType));
-					} else {
-						std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-					}
-				} else {
-					// Difference calculation for the feature amount changed from 1 to 0
-					// 1から0に変化した特徴量に関する差分計算
-					std::memcpy(accumulator.accumulation[perspective][i], prev_accumulator.accumulation[perspective][i],
-					            kHalfDimensions * sizeof(BiasType));
-					for (const auto index : removed_indices[perspective]) {
-						const IndexType offset = kHalfDimensions * index;
+					// 一手分だけの場合、added_indicesには値が1である全ての特徴量が入っている
+					refresh_accumulation(pos, i, perspective,
+					                     num_states > 1 ? active_indices[perspective] : added_indices[0][perspective],
+					                     accumulator.accumulation[perspective][i]);
+					continue;
+				}
+
 #if defined(VECTOR)
-						auto column = reinterpret_cast<const vec_t*>(&weights_[offset]);
-						for (IndexType j = 0; j < kNumChunks; ++j) {
-							accumulation[j] = vec_sub_16(accumulation[j], column[j]);
+				// 計算済みの累積値をレジスタに読み込み、全ての手の差分を適用してから書き戻す
+				for (IndexType j = 0; j < kHalfDimensions / kTileHeight; ++j) {
+					auto prev_tile = reinterpret_cast<const vec_t*>(
+					    &prev_accumulator.accumulation[perspective][i][j * kTileHeight]);
+					auto  tile = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][j * kTileHeight]);
+					vec_t acc[kNumRegs];
+					for (IndexType r = 0; r < kNumRegs; ++r) {
+						acc[r] = vec_load(&prev_tile[r]);
+					}
+					for (int k = 0; k < num_states; ++k) {
+						// Difference calculation for the feature amount changed from 1 to 0
+						// 1から0に変化した特徴量に関する差分計算
+						for (const auto index : removed_indices[k][perspective]) {
+							const IndexType offset = kHalfDimensions * index + j * kTileHeight;
+							auto            column = reinterpret_cast<const vec_t*>(&weights_[offset]);
+							for (IndexType r = 0; r < kNumRegs; ++r) {
+								acc[r] = vec_sub_16(acc[r], column[r]);
+							}
 						}
-#else
-						for (IndexType j = 0; j < kHalfDimensions; ++j) {
-							accumulator.accumulation[perspective][i][j] -= weights_[offset + j];
+						// Difference calculation for features that changed from 0 to 1
+						// 0から1に変化した特徴量に関する差分計算
+						for (const auto index : added_indices[k][perspective]) {
+							const IndexType offset = kHalfDimensions * index + j * kTileHeight;
+							auto            column = reinterpret_cast<const vec_t*>(&weights_[offset]);
+							for (IndexType r = 0; r < kNumRegs; ++r) {
+								acc[r] = vec_add_16(acc[r], column[r]);
+							}
 						}
-#endif
+					}
+					for (IndexType r = 0; r < kNumRegs; ++r) {
+						vec_store(&tile[r], acc[r]);
 					}
 				}
-				{
-					// Difference calculation for features that changed from 0 to 1
-					// 0から1に変化した特徴量に関する差分計算
-					for (const auto index : added_indices[perspective]) {
-						const IndexType offset = kHalfDimensions * index;
-#if defined(VECTOR)
-						auto column = reinterpret_cast<const vec_t*>(&weights_[offset]);
-						for (IndexType j = 0; j < kNumChunks; ++j) {
-							accumulation[j] = vec_add_16(accumulation[j], column[j]);
-						}
 #else
-						for (IndexType j = 0; j < kHalfDimensions; ++j) {
-							accumulator.accumulation[perspective][i][j] += weights_[offset + j];
-						}
-#endif
+				std::memcpy(accumulator.accumulation[perspective][i], prev_accumulator.accumulation[perspective][i],
+				            kHalfDimensions * sizeof(BiasType));
+				for (int k = 0; k < num_states; ++k) {
+					for (const auto index : removed_indices[k][perspective]) {
+						sub_weights(accumulator.accumulation[perspective][i], index);
+					}
+					for (const auto index : added_indices[k][perspective]) {
+						add_weights(accumulator.accumulation[perspective][i], index);
 					}
 				}
+#endif
 			}
 		}
 
@@ -386,6 +405,156 @@ class FeatureTransformer {
 	using BiasType   = std::int16_t;
 	using WeightType = std::int16_t;
 
+	// Per-thread cache of accumulators keyed by king square ("Finny table")
+	// 玉の升目毎に、最後に全計算した累積値とその特徴量をスレッド毎に保持するキャッシュ
+	// 全計算の際は、キャッシュ済みの特徴量との差分だけを足し引きすればよい。
+	// 入玉模様の将棋のように玉が何度も動く局面で、全計算のコストを大きく減らせる。
+	struct AccumulatorCache {
+		struct Entry {
+			alignas(kCacheLineSize) BiasType accumulation[kHalfDimensions];
+			// 値が1である特徴量のインデックス(AppendActiveIndices()の列挙順)
+			Features::IndexList active_indices;
+			bool valid = false;
+		};
+
+		const FeatureTransformer* owner = nullptr;
+		std::uint64_t parameters_version = 0;
+		// 玉がいない局面のためにSQ_NB_PLUS1だけ確保する
+		Entry entries[kRefreshTriggers.size()][COLOR_NB][SQ_NB_PLUS1];
+	};
+
+	// 呼び出したスレッドのキャッシュから、この局面に対応するエントリを取得する
+	AccumulatorCache::Entry& accumulator_cache_entry(const Position& pos, IndexType i, Color perspective) const {
+		thread_local std::unique_ptr<AccumulatorCache> cache;
+		if (!cache) {
+			cache = std::make_unique<AccumulatorCache>();
+		}
+
+		const std::uint64_t parameters_version = parameters_version_.load(std::memory_order_relaxed);
+		if (cache->owner != this || cache->parameters_version != parameters_version) {
+			for (auto& entries : cache->entries) {
+				for (auto& entries_of_color : entries) {
+					for (auto& entry : entries_of_color) {
+						entry.valid = false;
+					}
+				}
+			}
+			cache->owner              = this;
+			cache->parameters_version = parameters_version;
+		}
+
+		// トリガーとなる玉の升目をキーとする。それ以外のトリガーは升目を区別しない。
+		Square king_square;
+		switch (kRefreshTriggers[i]) {
+		case Features::TriggerEvent::kFriendKingMoved:
+		case Features::TriggerEvent::kAnyKingMoved:
+			king_square = pos.king_square(perspective);
+			break;
+		case Features::TriggerEvent::kEnemyKingMoved:
+			king_square = pos.king_square(~perspective);
+			break;
+		default:
+			king_square = SQ_ZERO;
+			break;
+		}
+		return cache->entries[i][perspective][king_square];
+	}
+
+	// Calculate the cumulative value of one trigger and one perspective, using the cache if possible
+	// 1つのトリガー・1つの視点について累積値を全計算する。キャッシュが使えれば差分だけを計算する。
+	void refresh_accumulation(const Position& pos, IndexType i, Color perspective,
+	                          const Features::IndexList& active_indices, BiasType* accumulation) const {
+		if (!use_accumulator_cache) {
+			reset_accumulation(i, active_indices, accumulation);
+			return;
+		}
+
+		auto& entry          = accumulator_cache_entry(pos, i, perspective);
+		bool  use_difference = entry.valid;
+		Features::IndexList removed_indices, added_indices;
+		if (use_difference) {
+			// 特徴量は駒番号の順に列挙されるので、同じ位置同士を比べれば動いた駒だけが差分として残る。
+			// 順序が揃っていない特徴量でも、差分として足し引きする結果は正しい。
+			const std::size_t cached_size = entry.active_indices.size();
+			const std::size_t active_size = active_indices.size();
+			for (std::size_t k = 0; k < std::max(cached_size, active_size); ++k) {
+				if (k < cached_size && k < active_size && entry.active_indices[k] == active_indices[k])
+					continue;
+				if (k < cached_size)
+					removed_indices.push_back(entry.active_indices[k]);
+				if (k < active_size)
+					added_indices.push_back(active_indices[k]);
+			}
+			// 差分の方が多いなら、バイアスから足し直した方が速い
+			use_difference = removed_indices.size() + added_indices.size() < active_size;
+		}
+
+		if (use_difference) {
+			for (const auto index : removed_indices) {
+				sub_weights(entry.accumulation, index);
+			}
+			for (const auto index : added_indices) {
+				add_weights(entry.accumulation, index);
+			}
+		} else {
+			reset_accumulation(i, active_indices, entry.accumulation);
+		}
+		entry.active_indices = active_indices;
+		entry.valid          = true;
+
+		std::memcpy(accumulation, entry.accumulation, kHalfDimensions * sizeof(BiasType));
+	}
+
+	// Calculate the cumulative value from the biases without any cache
+	// キャッシュを用いずに、バイアスから累積値を計算する
+	void reset_accumulation(IndexType i, const Features::IndexList& active_indices, BiasType* accumulation) const {
+		if (i == 0) {
+			std::memcpy(accumulation, biases_, kHalfDimensions * sizeof(BiasType));
+		} else {
+			std::memset(accumulation, 0, kHalfDimensions * sizeof(BiasType));
+		}
+		for (const auto index : active_indices) {
+			add_weights(accumulation, index);
+		}
+	}
+
+	// 特徴量indexの重みを累積値に足す
+	void add_weights(BiasType* accumulation, IndexType index) const {
+		const IndexType offset = kHalfDimensions * index;
+#if defined(VECTOR)
+		constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
+		auto                acc        = reinterpret_cast<vec_t*>(accumulation);
+		auto                column     = reinterpret_cast<const vec_t*>(&weights_[offset]);
+		for (IndexType j = 0; j < kNumChunks; ++j) {
+			acc[j] = vec_add_16(acc[j], column[j]);
+		}
+#else
+		for (IndexType j = 0; j < kHalfDimensions; ++j) {
+			accumulation[j] += weights_[offset + j];
+		}
+#endif
+	}
+
+	// 特徴量indexの重みを累積値から引く
+	void sub_weights(BiasType* accumulation, IndexType index) const {
+		const IndexType offset = kHalfDimensions * index;
+#if defined(VECTOR)
+		constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
+		auto                acc        = reinterpret_cast<vec_t*>(accumulation);
+		auto                column     = reinterpret_cast<const vec_t*>(&weights_[offset]);
+		for (IndexType j = 0; j < kNumChunks; ++j) {
+			acc[j] = vec_sub_16(acc[j], column[j]);
+		}
+#else
+		for (IndexType j = 0; j < kHalfDimensions; ++j) {
+			accumulation[j] -= weights_[offset + j];
+		}
+#endif
+	}
+
+	// パラメータが変更される毎に1ずつ増える。キャッシュの無効化に用いる。
+	static inline std::atomic<std::uint64_t> parameters_version_{0};
+
 	// Make the learning class a friend
 	// 学習用クラスをfriendにする
 	friend class Trainer<FeatureTransformer>;
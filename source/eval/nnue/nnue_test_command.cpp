@@ -8,6 +8,7 @@
 #include "evaluate_nnue.h"
 #include "nnue_test_command.h"
 
+#include <iomanip>
 #include <set>
 
 namespace Eval {
@@ -138,6 +139,138 @@ void TestFeatures(Position& pos) {
             << ") features" << std::endl;
 }
 
+// 玉が何度も動く(入玉模様の)棋譜を用いて、累積値キャッシュの有無による入力特徴量変換の速度を比較する
+void BenchRefresh(Position& pos, std::istream& stream) {
+  std::uint64_t num_games = 100;
+  stream >> num_games;
+  StateInfo si;
+  const int MAX_PLY = 256; // 256手まで
+
+  StateInfo state[MAX_PLY];
+  PRNG prng(20240313);
+
+  // 玉の指し手があれば3/4の確率でそれを選ぶランダムな棋譜を作る
+  std::vector<std::vector<Move>> games(num_games);
+  std::uint64_t num_moves = 0, num_king_moves = 0;
+  for (auto& game : games) {
+    pos.set_hirate(&si, Threads.main());
+    for (int ply = 0; ply < MAX_PLY; ++ply) {
+      MoveList<LEGAL_ALL> mg(pos);
+      if (mg.size() == 0)
+        break;
+
+      std::vector<Move> king_moves;
+      for (const auto& m : mg)
+        if (type_of(pos.moved_piece_before(m)) == KING)
+          king_moves.push_back(m);
+
+      Move m;
+      if (!king_moves.empty() && prng.rand(4) != 0) {
+        m = king_moves[prng.rand(king_moves.size())];
+        ++num_king_moves;
+      } else {
+        m = mg.begin()[prng.rand(mg.size())];
+      }
+      pos.do_move(m, state[ply]);
+      game.push_back(m);
+      ++num_moves;
+    }
+  }
+  std::cout << num_games << " games, " << num_moves << " moves, "
+            << (100.0 * num_king_moves / std::max<std::uint64_t>(num_moves, 1))
+            << "% king moves" << std::endl;
+
+  // 1手ずつ進めながら差分計算で入力特徴量を変換する
+  auto run = [&](bool use_cache, std::uint64_t* checksum) {
+    FeatureTransformer::use_accumulator_cache = use_cache;
+    alignas(kCacheLineSize) TransformedFeatureType
+        transformed_features[FeatureTransformer::kBufferSize];
+    *checksum = 0;
+    const auto start = now();
+    for (const auto& game : games) {
+      pos.set_hirate(&si, Threads.main());
+      for (std::size_t ply = 0; ply < game.size(); ++ply) {
+        pos.do_move(game[ply], state[ply]);
+        feature_transformer->Transform(pos, transformed_features, false);
+        const auto words = reinterpret_cast<const std::uint64_t*>(transformed_features);
+        for (std::size_t i = 0; i < sizeof(transformed_features) / sizeof(*words); ++i)
+          *checksum = (*checksum ^ words[i]) * 0x100000001b3ULL;
+      }
+    }
+    const auto elapsed = std::max<TimePoint>(now() - start, 1);
+    std::cout << "accumulator cache " << (use_cache ? "on " : "off")
+              << ": " << elapsed << " ms, "
+              << (1000 * num_moves / elapsed) << " transforms/sec" << std::endl;
+    return elapsed;
+  };
+
+  const bool use_accumulator_cache = FeatureTransformer::use_accumulator_cache;
+  std::uint64_t checksum_off, checksum_on;
+  const auto elapsed_off = run(false, &checksum_off);
+  const auto elapsed_on = run(true, &checksum_on);
+  FeatureTransformer::use_accumulator_cache = use_accumulator_cache;
+
+  std::cout << "speedup: " << (1.0 * elapsed_off / elapsed_on)
+            << (checksum_off == checksum_on ? ", results match" : ", results MISMATCH")
+            << std::endl;
+
+  pos.set_hirate(&si, Threads.main());
+}
+
+// ComputeScores()のバッチサイズ毎のスループットを比較する
+void BenchBatch(Position& pos, std::istream& stream) {
+  std::uint64_t num_positions = 4096;
+  stream >> num_positions;
+  StateInfo si;
+  const int MAX_PLY = 256; // 256手まで
+
+  StateInfo state[MAX_PLY];
+  PRNG prng(20240314);
+
+  // ランダムな棋譜の局面を集める
+  std::vector<std::string> sfens;
+  while (sfens.size() < num_positions) {
+    pos.set_hirate(&si, Threads.main());
+    for (int ply = 0; ply < MAX_PLY && sfens.size() < num_positions; ++ply) {
+      MoveList<LEGAL_ALL> mg(pos);
+      if (mg.size() == 0)
+        break;
+      pos.do_move(mg.begin()[prng.rand(mg.size())], state[ply]);
+      sfens.push_back(pos.sfen());
+    }
+  }
+  std::vector<Position> positions(num_positions);
+  std::vector<StateInfo> states(num_positions);
+  std::vector<const Position*> position_pointers(num_positions);
+  for (std::size_t i = 0; i < num_positions; ++i) {
+    positions[i].set(sfens[i], &states[i], Threads.main());
+    position_pointers[i] = &positions[i];
+  }
+  pos.set_hirate(&si, Threads.main());
+
+  // 局面をset()した時点で計算済みの評価値を正解とする
+  std::vector<Value> expected(num_positions);
+  for (std::size_t i = 0; i < num_positions; ++i)
+    expected[i] = positions[i].state()->accumulator.score;
+
+  std::cout << num_positions << " positions" << std::endl;
+  std::vector<Value> scores(num_positions);
+  for (const std::size_t batch_size : {1, 16, 64, 256}) {
+    const int kRepeat = 100;
+    const auto start = now();
+    for (int r = 0; r < kRepeat; ++r) {
+      for (auto& p : positions)
+        p.state()->accumulator.computed_score = false;
+      for (std::size_t i = 0; i < num_positions; i += batch_size)
+        ComputeScores(&position_pointers[i], std::min(batch_size, num_positions - i), &scores[i]);
+    }
+    const auto elapsed = std::max<TimePoint>(now() - start, 1);
+    std::cout << "batch size " << std::setw(3) << batch_size << ": " << elapsed << " ms, "
+              << (1000 * kRepeat * num_positions / elapsed) << " evals/sec"
+              << (scores == expected ? "" : ", results MISMATCH") << std::endl;
+  }
+}
+
 // 評価関数の構造を表す文字列を出力する
 void PrintInfo(std::istream& stream) {
   std::cout << "network architecture: " << GetArchitectureString() << std::endl;
@@ -184,10 +317,16 @@ void TestCommand(Position& pos, std::istream& stream) {
     TestFeatures(pos);
   } else if (sub_command == "info") {
     PrintInfo(stream);
+  } else if (sub_command == "bench_refresh") {
+    BenchRefresh(pos, stream);
+  } else if (sub_command == "bench_batch") {
+    BenchBatch(pos, stream);
   } else {
     std::cout << "usage:" << std::endl;
     std::cout << " test nn test_features" << std::endl;
     std::cout << " test nn info [path/to/" << kFileName << "...]" << std::endl;
+    std::cout << " test nn bench_refresh [num_games]" << std::endl;
+    std::cout << " test nn bench_batch [num_positions]" << std::endl;
   }
 }
 
@@ -12,6 +12,7 @@
 #include "trainer.h"
 #include "features/factorizer_feature_set.h"
 
+#include <algorithm>
 #include <array>
 #include <bitset>
 #include <numeric>
@@ -173,35 +174,6 @@ class Trainer<FeatureTransformer> {
     }
     cblas_saxpy(kHalfDimensions, -local_learning_rate,
                 biases_diff_, 1, biases_, 1);
-#pragma omp parallel
-    {
-#if defined(_OPENMP)
-      const IndexType num_threads = omp_get_num_threads();
-      const IndexType thread_index = omp_get_thread_num();
-
-      // Windows環境下でCPUが２つあるときに、論理64コアまでしか使用されないのを防ぐために
-      // ここで明示的にCPUに割り当てる
-      WinProcGroup::bindThisThread(thread_index);
-#endif
-      for (IndexType b = 0; b < batch_->size(); ++b) {
-        const IndexType batch_offset = kOutputDimensions * b;
-        for (IndexType c = 0; c < 2; ++c) {
-          const IndexType output_offset = batch_offset + kHalfDimensions * c;
-          for (const auto& feature : (*batch_)[b].training_features[c]) {
-#if defined(_OPENMP)
-            if (feature.GetIndex() % num_threads != thread_index) continue;
-#endif
-            const IndexType weights_offset =
-                kHalfDimensions * feature.GetIndex();
-            const auto scale = static_cast<LearnFloatType>(
-                effective_learning_rate / feature.GetCount());
-            cblas_saxpy(kHalfDimensions, -scale,
-                        &gradients_[output_offset], 1,
-                        &weights_[weights_offset], 1);
-          }
-        }
-      }
-    }
 #else
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
       biases_diff_[i] *= momentum_;
@@ -218,22 +190,31 @@ class Trainer<FeatureTransformer> {
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
       biases_[i] -= local_learning_rate * biases_diff_[i];
     }
-    for (IndexType b = 0; b < batch_->size(); ++b) {
-      const IndexType batch_offset = kOutputDimensions * b;
-      for (IndexType c = 0; c < 2; ++c) {
-        const IndexType output_offset = batch_offset + kHalfDimensions * c;
-        for (const auto& feature : (*batch_)[b].training_features[c]) {
-          const IndexType weights_offset = kHalfDimensions * feature.GetIndex();
-          const auto scale = static_cast<LearnFloatType>(
-              effective_learning_rate / feature.GetCount());
-          for (IndexType i = 0; i < kHalfDimensions; ++i) {
-            weights_[weights_offset + i] -=
-                scale * gradients_[output_offset + i];
-          }
-        }
+#endif
+    // 重み行列の更新
+    // 各スレッドが全特徴量を走査して自分の担当分だけを拾うと、走査のコストがスレッド数に比例して増えるので、
+    // 先に特徴量のindexで担当スレッドごとのバケットに振り分けてから、各スレッドが自分のバケットだけを適用する。
+    BucketGradients(effective_learning_rate);
+    const IndexType num_buckets =
+        static_cast<IndexType>(gradient_bucket_offsets_.size() - 1);
+#pragma omp parallel
+    {
+#if defined(_OPENMP)
+      const IndexType num_threads = omp_get_num_threads();
+      const IndexType thread_index = omp_get_thread_num();
+
+      // Windows環境下でCPUが２つあるときに、論理64コアまでしか使用されないのを防ぐために
+      // ここで明示的にCPUに割り当てる
+      WinProcGroup::bindThisThread(thread_index);
+#else
+      const IndexType num_threads = 1;
+      const IndexType thread_index = 0;
+#endif
+      for (IndexType bucket = thread_index; bucket < num_buckets;
+           bucket += num_threads) {
+        ApplyGradients(bucket);
       }
     }
-#endif
     for (IndexType b = 0; b < batch_->size(); ++b) {
       for (IndexType c = 0; c < 2; ++c) {
         for (const auto& feature : (*batch_)[b].training_features[c]) {
@@ -262,6 +243,110 @@ class Trainer<FeatureTransformer> {
     DequantizeParameters();
   }
 
+  // 重み行列の1行(特徴量1つ)に対する勾配
+  struct GradientEntry {
+    IndexType index;          // 特徴量のindex(重み行列の行)
+    IndexType output_offset;  // gradients_上の位置
+    LearnFloatType scale;     // 学習率を掛けた係数
+  };
+
+  // ミニバッチに出現した特徴量の勾配を、担当スレッド(index % バケット数)ごとのバケットに振り分ける。
+  // バケット内は元の出現順を保つ。(計数ソートによる)
+  void BucketGradients(LearnFloatType effective_learning_rate) {
+#if defined(_OPENMP)
+    const IndexType num_buckets = omp_get_max_threads();
+#else
+    const IndexType num_buckets = 1;
+#endif
+    // ミニバッチをバケット数と同じ個数の連続した区間に分け、区間ごとにバケットの要素数を数える
+    const IndexType batch_size = static_cast<IndexType>(batch_->size());
+    const IndexType num_chunks = num_buckets;
+    gradient_bucket_counts_.assign(num_chunks * num_buckets, 0);
+#pragma omp parallel for schedule(static, 1)
+    for (IndexType chunk = 0; chunk < num_chunks; ++chunk) {
+      IndexType* counts = &gradient_bucket_counts_[chunk * num_buckets];
+      for (IndexType b = batch_size * chunk / num_chunks;
+           b < batch_size * (chunk + 1) / num_chunks; ++b) {
+        for (IndexType c = 0; c < 2; ++c) {
+          for (const auto& feature : (*batch_)[b].training_features[c]) {
+            ++counts[feature.GetIndex() % num_buckets];
+          }
+        }
+      }
+    }
+
+    // バケット順、同じバケットの中では区間順に書き込み位置を割り当てる
+    gradient_bucket_offsets_.assign(num_buckets + 1, 0);
+    IndexType offset = 0;
+    for (IndexType bucket = 0; bucket < num_buckets; ++bucket) {
+      gradient_bucket_offsets_[bucket] = offset;
+      for (IndexType chunk = 0; chunk < num_chunks; ++chunk) {
+        IndexType& count = gradient_bucket_counts_[chunk * num_buckets + bucket];
+        const IndexType n = count;
+        count = offset;
+        offset += n;
+      }
+    }
+    gradient_bucket_offsets_[num_buckets] = offset;
+    gradient_entries_.resize(offset);
+
+#pragma omp parallel for schedule(static, 1)
+    for (IndexType chunk = 0; chunk < num_chunks; ++chunk) {
+      IndexType* positions = &gradient_bucket_counts_[chunk * num_buckets];
+      for (IndexType b = batch_size * chunk / num_chunks;
+           b < batch_size * (chunk + 1) / num_chunks; ++b) {
+        const IndexType batch_offset = kOutputDimensions * b;
+        for (IndexType c = 0; c < 2; ++c) {
+          const IndexType output_offset = batch_offset + kHalfDimensions * c;
+          for (const auto& feature : (*batch_)[b].training_features[c]) {
+            const IndexType index = feature.GetIndex();
+            const auto scale = static_cast<LearnFloatType>(
+                effective_learning_rate / feature.GetCount());
+            gradient_entries_[positions[index % num_buckets]++] =
+                GradientEntry{index, output_offset, scale};
+          }
+        }
+      }
+    }
+  }
+
+  // バケットの勾配を重み行列に適用する。
+  // 同じ行への勾配はまとめて1本のベクトルにしてから、重み行列の行に1回だけ足し込む。
+  void ApplyGradients(IndexType bucket) {
+    const auto first = gradient_entries_.begin() + gradient_bucket_offsets_[bucket];
+    const auto last = gradient_entries_.begin() + gradient_bucket_offsets_[bucket + 1];
+    // 行ごとにまとめる。同じ行の中ではミニバッチ上の出現順(output_offset順)に並べる。
+    std::sort(first, last,
+              [](const GradientEntry& lhs, const GradientEntry& rhs) {
+                return lhs.index != rhs.index ? lhs.index < rhs.index
+                                              : lhs.output_offset < rhs.output_offset;
+              });
+
+    alignas(kCacheLineSize) LearnFloatType delta[kHalfDimensions];
+    for (auto it = first; it != last;) {
+      const IndexType index = it->index;
+      std::fill(std::begin(delta), std::end(delta), +kZero);
+      for (; it != last && it->index == index; ++it) {
+#if defined(USE_BLAS)
+        cblas_saxpy(kHalfDimensions, it->scale,
+                    &gradients_[it->output_offset], 1, delta, 1);
+#else
+        for (IndexType i = 0; i < kHalfDimensions; ++i) {
+          delta[i] += it->scale * gradients_[it->output_offset + i];
+        }
+#endif
+      }
+      const IndexType weights_offset = kHalfDimensions * index;
+#if defined(USE_BLAS)
+      cblas_saxpy(kHalfDimensions, -1.0, delta, 1, &weights_[weights_offset], 1);
+#else
+      for (IndexType i = 0; i < kHalfDimensions; ++i) {
+        weights_[weights_offset + i] -= delta[i];
+      }
+#endif
+    }
+  }
+
   // 重みの飽和とパラメータの整数化
   void QuantizeParameters() {
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
@@ -294,6 +379,9 @@ class Trainer<FeatureTransformer> {
         }
       }
     }
+
+    // 整数化したパラメータが変わったので、全計算用のキャッシュを無効にする
+    LayerType::invalidate_accumulator_cache();
   }
 
   // 整数化されたパラメータの読み込み
@@ -382,6 +470,12 @@ class Trainer<FeatureTransformer> {
   // 順伝播用バッファ
   std::vector<LearnFloatType> output_;
 
+  // 重み行列の更新で用いるバッファ
+  // gradient_entries_はバケット順に並んでおり、バケットiはgradient_bucket_offsets_[i]からi+1の手前まで。
+  std::vector<GradientEntry> gradient_entries_;
+  std::vector<IndexType> gradient_bucket_offsets_;
+  std::vector<IndexType> gradient_bucket_counts_;
+
   // 学習データに出現した特徴量
   std::bitset<kInputDimensions> observed_features;
 
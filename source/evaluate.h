@@ -382,6 +382,14 @@ namespace Eval {
 
 	// EvalHashのクリア
 	extern void EvalHash_Clear();
+
+#if defined(EVAL_NNUE)
+	// EvalHashの統計情報(hit率、追い出された回数など)を表示する
+	extern void EvalHash_PrintStats();
+
+	// EvalHashの統計情報をリセットする
+	extern void EvalHash_ClearStats();
+#endif
 #endif
 
 }
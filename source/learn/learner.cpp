@@ -66,6 +66,7 @@
 #include "../book/book.h"
 #include "../tt.h"
 #include "../mate/mate.h"
+#include "../tanuki_kifu_container.h"
 #include "multi_think.h"
 
 #if defined(EVAL_NNUE)
@@ -1339,24 +1340,42 @@ struct SfenReader
 	// ファイルの読み込み専用スレッド用
 	void file_read_worker()
 	{
+		// 開けないファイルは読み飛ばし、次のファイルを開く。
 		auto open_next_file = [&]()
 		{
-			// もう無い
-			if (filenames.size() == 0)
-				return false;
+			while (filenames.size() != 0)
+			{
+				// 次のファイル名ひとつ取得。
+				string filename = *filenames.rbegin();
+				filenames.pop_back();
+
+				// 圧縮棋譜コンテナ形式ならブロック単位で読み込む。
+				container_reader.reset();
+				if (Tanuki::KifuContainer::IsContainerFile(filename))
+				{
+					if (open_container(filename))
+						return true;
+					continue;
+				}
 
-			// 次のファイル名ひとつ取得。
-			string filename = *filenames.rbegin();
-			filenames.pop_back();
+				auto result = binary_reader.Open(filename);
+				// cout << "open filename = " << filename << endl;
+				if (result.is_ok())
+					return true;
 
-			auto result = binary_reader.Open(filename);
-			// cout << "open filename = " << filename << endl;
-			ASSERT(result.is_ok());
+				cout << "Failed to open a sfen file : " << filename << endl;
+			}
 
-			return true;
+			// もう無い
+			return false;
 		};
 
-		open_next_file();
+		if (!open_next_file())
+		{
+			cout << "..end of files." << endl;
+			end_of_files = true;
+			return;
+		}
 
 		while (true)
 		{
@@ -1374,6 +1393,21 @@ struct SfenReader
 			// ファイルバッファにファイルから読み込む。
 			while (sfens_read_offset < SFEN_READ_SIZE)
 			{
+				if (container_reader)
+				{
+					if (read_from_container(sfens, sfens_read_offset))
+						continue;
+
+					// 壊れたブロックがあった場合もそのファイルは諦めて次のファイルへ。
+					if (!open_next_file())
+					{
+						cout << "..end of files." << endl;
+						end_of_files = true;
+						return;
+					}
+					continue;
+				}
+
 				size_t expected_size_of_read_bytes = (SFEN_READ_SIZE - sfens_read_offset) * sizeof(PackedSfenValue);
 				size_t actual_size_of_read_bytes = 0;
 				auto result = binary_reader.Read(&sfens[sfens_read_offset], expected_size_of_read_bytes, &actual_size_of_read_bytes);
@@ -1451,7 +1485,8 @@ struct SfenReader
 	u64 last_done;
 
 	// total_readがこの値を超えたらupdate_weights()してmseの計算をする。
-	u64 next_update_weights;
+	// NNUEの場合は、他のスレッドが教師を作っている間にthread 0が書き換えるのでatomicにしておく。
+	atomic<u64> next_update_weights;
 
 	u64 save_count;
 
@@ -1481,6 +1516,63 @@ protected:
 	// fileをバックグラウンドで読み込みしているworker thread
 	std::thread file_worker_thread;
 
+	// 圧縮棋譜コンテナを開く。ブロックを読み込む順番はシャッフルしておく。
+	bool open_container(const string& filename)
+	{
+		container_reader = std::make_unique<Tanuki::KifuContainerReader>();
+		if (!container_reader->Open(filename))
+		{
+			cout << "Failed to open a compressed sfen file : " << filename << endl;
+			container_reader.reset();
+			return false;
+		}
+
+		container_block_order.resize(container_reader->NumBlocks());
+		for (int i = 0; i < container_reader->NumBlocks(); ++i)
+			container_block_order[i] = i;
+		if (!no_shuffle)
+			for (size_t i = 0; i < container_block_order.size(); ++i)
+				swap(container_block_order[i], container_block_order[(size_t)(prng.rand((u64)container_block_order.size() - i) + i)]);
+
+		container_next_block = 0;
+		container_buffer.clear();
+		container_buffer_offset = 0;
+		return true;
+	}
+
+	// 圧縮棋譜コンテナからsfensに局面を補充する。コンテナを読み終えたらfalseを返す。
+	// バッファが空になったら、スレッド数分のブロックをまとめて並列に展開する。
+	bool read_from_container(PSVector& sfens, size_t& sfens_read_offset)
+	{
+		if (container_buffer_offset == container_buffer.size())
+		{
+			int num_blocks = std::min(omp_get_max_threads(), container_reader->NumBlocks() - container_next_block);
+			if (num_blocks <= 0)
+				return false;
+
+			std::vector<PSVector> blocks(num_blocks);
+			std::atomic<bool> failed = false;
+#pragma omp parallel for
+			for (int i = 0; i < num_blocks; ++i)
+				if (!container_reader->ReadBlock(container_block_order[container_next_block + i], blocks[i]))
+					failed = true;
+			container_next_block += num_blocks;
+			if (failed)
+				return false;
+
+			container_buffer.clear();
+			container_buffer_offset = 0;
+			for (const auto& block : blocks)
+				container_buffer.insert(container_buffer.end(), block.begin(), block.end());
+		}
+
+		size_t size = std::min(SFEN_READ_SIZE - sfens_read_offset, container_buffer.size() - container_buffer_offset);
+		memcpy(&sfens[sfens_read_offset], &container_buffer[container_buffer_offset], sizeof(PackedSfenValue) * size);
+		sfens_read_offset += size;
+		container_buffer_offset += size;
+		return true;
+	}
+
 	// 局面の読み込み時にshuffleするための乱数
 	PRNG prng;
 
@@ -1491,6 +1583,13 @@ protected:
 	// sfenファイルのハンドル
 	SystemIO::BinaryReader binary_reader;
 
+	// 圧縮棋譜コンテナ形式のsfenファイルを読み込んでいる場合のハンドル
+	std::unique_ptr<Tanuki::KifuContainerReader> container_reader;
+	std::vector<int> container_block_order;
+	int container_next_block;
+	PSVector container_buffer;
+	size_t container_buffer_offset;
+
 	// 各スレッド用のsfen
 	// (使いきったときにスレッドが自らdeleteを呼び出して開放すべし。)
 	std::vector<PSVector*> packed_sfens;
@@ -1579,6 +1678,11 @@ struct LearnerThink: public MultiThink
 
 #if defined(EVAL_NNUE)
 	shared_timed_mutex nn_mutex;
+	// thread 0が評価関数を書き換える・lossを計算する間、他のスレッドに教師の生成を止めさせるフラグ。
+	// shared_timed_mutexは実装によっては読み込み側が優先されるので、他のスレッドが局面ごとに
+	// try_lock()し続けると、thread 0の書き込みロックがいつまでも取れないことがある。
+	// 他のスレッドはtry_lock()の前にこれを確かめ、trueなら待機してtask_dispatcherのtaskを処理する。
+	atomic<bool> pause_workers{ false };
 	double newbob_scale;
 	double newbob_decay;
 	int newbob_num_trials;
@@ -1586,6 +1690,10 @@ struct LearnerThink: public MultiThink
 	double latest_loss_sum;
 	u64 latest_loss_count;
 	std::string best_nn_directory;
+
+	// 学習速度の表示用。前回パラメータを更新した時刻と、その時点での処理局面数。
+	TimePoint last_update_time;
+	u64 last_update_done;
 #endif
 
 	u64 eval_save_interval;
@@ -1867,7 +1975,7 @@ void LearnerThink::thread_worker(size_t thread_id)
 		// 更新中に評価関数を使わないようにロックする。
 		shared_lock<shared_timed_mutex> read_lock(nn_mutex, defer_lock);
 		if (sr.next_update_weights <= sr.total_done ||
-		    (thread_id != 0 && !read_lock.try_lock()))
+		    (thread_id != 0 && (pause_workers || !read_lock.try_lock())))
 #else
 		if (sr.next_update_weights <= sr.total_done)
 #endif
@@ -1891,6 +1999,10 @@ void LearnerThink::thread_worker(size_t thread_id)
 				if (sr.next_update_weights == 0)
 				{
 					sr.next_update_weights += mini_batch_size;
+#if defined(EVAL_NNUE)
+					last_update_time = now();
+					last_update_done = sr.total_done;
+#endif
 					continue;
 				}
 
@@ -1907,9 +2019,30 @@ void LearnerThink::thread_worker(size_t thread_id)
 				{
 					// パラメータの更新
 
-					// 更新中に評価関数を使わないようにロックする。
-					lock_guard<shared_timed_mutex> write_lock(nn_mutex);
-					Eval::NNUE::UpdateParameters(epoch);
+					// 先に次のミニバッチの区切りを進めておき、他のスレッドには更新前の評価関数で
+					// 次のミニバッチの教師を作らせておく。更新が終わる前に次のミニバッチが溜まったら
+					// 他のスレッドは待機するので、教師を作った評価関数は高々1回分しか古くならない。
+					const TimePoint update_start = now();
+					const u64 done = sr.total_done;
+					sr.next_update_weights += mini_batch_size;
+
+					// 学習用のパラメータの更新は評価関数を書き換えないので、ロックせずに行う。
+					Eval::NNUE::TrainParameters(epoch);
+					{
+						// 評価関数に反映する間だけ、他のスレッドが評価関数を使わないようにロックする。
+						pause_workers = true;
+						lock_guard<shared_timed_mutex> write_lock(nn_mutex);
+						Eval::NNUE::QuantizeParameters();
+					}
+					pause_workers = false;
+
+					const TimePoint update_end = now();
+					const TimePoint elapsed = std::max<TimePoint>(update_end - last_update_time, 1);
+					std::cout << "epoch = " << epoch
+						<< " , examples/s = " << (done - last_update_done) * 1000 / elapsed
+						<< " , update time = " << update_end - update_start << "ms" << std::endl;
+					last_update_time = update_end;
+					last_update_done = done;
 				}
 #endif
 				++epoch;
@@ -1922,6 +2055,11 @@ void LearnerThink::thread_worker(size_t thread_id)
 					sr.save_count = 0;
 
 					// この間、gradientの計算が進むと値が大きくなりすぎて困る気がするので他のスレッドを停止させる。
+#if defined(EVAL_NNUE)
+					// 他のスレッドは次のミニバッチの教師を作っているので、評価関数を使わないようにロックする。
+					pause_workers = true;
+					lock_guard<shared_timed_mutex> write_lock(nn_mutex);
+#endif
 					const bool converged = save();
 					if (converged)
 					{
@@ -1929,6 +2067,9 @@ void LearnerThink::thread_worker(size_t thread_id)
 						sr.stop_flag = true;
 						break;
 					}
+#if defined(EVAL_NNUE)
+					pause_workers = false;
+#endif
 				}
 
 				// rmseを計算する。1万局面のサンプルに対して行う。
@@ -1942,19 +2083,29 @@ void LearnerThink::thread_worker(size_t thread_id)
 					// 今回処理した件数
 					u64 done = sr.total_done - sr.last_done;
 
+#if defined(EVAL_NNUE)
+					// 他のスレッドは次のミニバッチの教師を作っていて、calc_loss()のtaskを拾わないので、
+					// lossの計算の間は教師の生成を止めさせ、待機中にtaskを処理させる。
+					pause_workers = true;
+#endif
+
 					// lossの計算
 					calc_loss(thread_id , done);
 
 #if defined(EVAL_NNUE)
 					Eval::NNUE::CheckHealth();
+					pause_workers = false;
 #endif
 
 					// どこまで集計したかを記録しておく。
 					sr.last_done = sr.total_done;
 				}
 
+#if !defined(EVAL_NNUE)
 				// 次回、この一連の処理は、次回、mini_batch_sizeだけ処理したときに再度やって欲しい。
+				// (NNUEの場合は、パラメータの更新前に進めてある)
 				sr.next_update_weights += mini_batch_size;
+#endif
 
 				// main thread以外は、このsr.next_update_weightsの更新を待っていたので
 				// この値が更新されると再度動き始める。				
@@ -31,6 +31,7 @@ extern "C" {
 
 #endif
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 //#include <iostream>
@@ -41,6 +42,10 @@ extern "C" {
 #if defined(__linux__) && !defined(__ANDROID__)
 #include <stdlib.h>
 #include <sys/mman.h> // madvise()
+#include <dirent.h>      // opendir()
+#include <sched.h>       // sched_getaffinity()
+#include <sys/syscall.h> // SYS_set_mempolicy, SYS_mbind
+#include <unistd.h>      // syscall()
 #endif
 
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32)) || defined(__e2k__)
@@ -693,6 +698,10 @@ void* LargeMemory::static_alloc(size_t size, size_t align, bool zero_clear)
 	if ((reinterpret_cast<size_t>(mem) % align) != 0)
 		error_exit("can't alloc algined memory.");
 
+	// 置換表などの全スレッドから参照するメモリなので、NUMA環境では全NODEに交互に配置する。
+	// (ゼロクリアで書き込む前に設定しておく必要がある)
+	WinProcGroup::interleaveMemory(mem, size);
+
 	// ゼロクリアが必要なのか？
 	if (zero_clear)
 	{
@@ -722,12 +731,239 @@ void LargeMemory::static_free(void* mem)
 
 namespace WinProcGroup {
 
-#if !defined ( _WIN32 )
+#if defined(__linux__) && !defined(__ANDROID__)
+
+	namespace {
+
+		// linux/mempolicy.hの定数。(libnumaのnumaif.hを必要としないようにここで定義しておく)
+		constexpr int kMpolPreferred = 1;
+		constexpr int kMpolInterleave = 3;
+
+		// set_mempolicy(),mbind()に渡すNUMA NODEのbit mask
+		struct NodeMask
+		{
+			static constexpr size_t kMaxNodes = 1024;
+			unsigned long bits[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+
+			void set(int node) { bits[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long))); }
+
+			// set_mempolicy(),mbind()のmaxnodeに渡す値
+			unsigned long max_node() const { return kMaxNodes + 1; }
+		};
+
+		// ファイルの1行目を読み込む。読み込めなければ空の文字列が返る。
+		std::string read_first_line(const std::string& path)
+		{
+			std::ifstream ifs(path);
+			std::string line;
+			std::getline(ifs, line);
+			return line;
+		}
+
+		// "0-3,8-11"のような形式の論理プロセッサ番号の一覧をparseする。
+		std::vector<int> parse_cpu_list(const std::string& list)
+		{
+			std::vector<int> cpus;
+			std::istringstream iss(list);
+			std::string range;
+			while (std::getline(iss, range, ','))
+			{
+				int first, last;
+				char dash;
+				std::istringstream range_stream(range);
+				if (!(range_stream >> first))
+					continue;
+				if (!(range_stream >> dash >> last))
+					last = first;
+				for (int cpu = first; cpu <= last; ++cpu)
+					cpus.push_back(cpu);
+			}
+			return cpus;
+		}
+
+		// 論理プロセッサ番号の一覧を"0-3,8-11"のような形式にする。
+		std::string to_cpu_list(const std::vector<int>& cpus)
+		{
+			std::string list;
+			for (size_t i = 0; i < cpus.size(); )
+			{
+				size_t j = i;
+				while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+					++j;
+				list += (list.empty() ? "" : ",") + std::to_string(cpus[i]);
+				if (j != i)
+					list += "-" + std::to_string(cpus[j]);
+				i = j + 1;
+			}
+			return list;
+		}
+
+		// NUMA NODEの構成
+		struct NumaTopology
+		{
+			// NUMA NODE番号(sysfs上の番号)
+			std::vector<int> node_ids;
+
+			// NUMA NODEごとの、このプロセスが使って良い論理プロセッサ
+			std::vector<std::vector<int>> node_cpus;
+
+			// スレッド番号に対応する、node_ids,node_cpusのindex
+			std::vector<int> groups;
+		};
+
+		// NUMA NODEの構成を調べる。
+		// 最初にbindThisThread()を呼び出したときに一度だけ調べる。
+		// (そのときのaffinityをこのプロセスが使って良い論理プロセッサとみなす)
+		const NumaTopology& topology()
+		{
+			static const NumaTopology topology = [] {
+				NumaTopology t;
+
+				cpu_set_t allowed;
+				CPU_ZERO(&allowed);
+				if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+					return t;
+
+				// /sys/devices/system/node/node0 , node1 , …
+				std::vector<int> node_ids;
+				if (DIR* dir = opendir("/sys/devices/system/node"))
+				{
+					while (dirent* entry = readdir(dir))
+					{
+						int node;
+						char rest;
+						if (std::sscanf(entry->d_name, "node%d%c", &node, &rest) == 1)
+							node_ids.push_back(node);
+					}
+					closedir(dir);
+				}
+				std::sort(node_ids.begin(), node_ids.end());
+
+				for (int node : node_ids)
+				{
+					std::vector<int> cpus;
+					for (int cpu : parse_cpu_list(read_first_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+						if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+							cpus.push_back(cpu);
+
+					// 使える論理プロセッサのないNUMA NODE(メモリだけのNODEなど)は無視する。
+					if (!cpus.empty())
+					{
+						t.node_ids.push_back(node);
+						t.node_cpus.push_back(cpus);
+					}
+				}
+
+				// sysfsからNUMA NODEの構成が得られなかった場合は、NUMA NODEが1つだけあるものとみなす。
+				if (t.node_ids.empty())
+				{
+					std::vector<int> cpus;
+					for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+						if (CPU_ISSET(cpu, &allowed))
+							cpus.push_back(cpu);
+					t.node_ids.push_back(0);
+					t.node_cpus.push_back(cpus);
+				}
+
+				// Windows版のbest_node()と同じく、各NUMA NODEの物理コア数だけ、そのNODEを順番に割り当て、
+				// 論理プロセッサがまだ余っていれば、それを各NUMA NODEに均等に割り当てていく。
+				const int nodes = (int)t.node_ids.size();
+				std::vector<int> smt_left(nodes);
+				for (int n = 0; n < nodes; ++n)
+				{
+					int cores = 0;
+					for (int cpu : t.node_cpus[n])
+					{
+						// 同じ物理コアの論理プロセッサのうち、番号が最小のものだけを物理コアとして数える。
+						auto siblings = parse_cpu_list(read_first_line("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list"));
+						if (siblings.empty() || *std::min_element(siblings.begin(), siblings.end()) == cpu)
+							++cores;
+					}
+					cores = std::max(cores, 1);
+					for (int i = 0; i < cores; ++i)
+						t.groups.push_back(n);
+					smt_left[n] = (int)t.node_cpus[n].size() - cores;
+				}
+				for (bool assigned = true; assigned; )
+				{
+					assigned = false;
+					for (int n = 0; n < nodes; ++n)
+						if (smt_left[n] > 0)
+						{
+							t.groups.push_back(n);
+							--smt_left[n];
+							assigned = true;
+						}
+				}
+
+				return t;
+			}();
+
+			return topology;
+		}
+	}
+
+	/// bindThisThread() set the affinity of the current thread to the cpus of a numa node
+
+	void bindThisThread(size_t idx) {
+
+		const NumaTopology& t = topology();
+
+		// 論理プロセッサの数を上回るスレッドは、OSに任せる。
+		if (idx >= t.groups.size())
+			return;
+
+		const int node = t.groups[idx];
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (int cpu : t.node_cpus[node])
+			CPU_SET(cpu, &cpus);
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+
+		// このスレッドが確保するメモリは、まずこのNUMA NODEから確保する。(足りなければ他のNODEから確保される)
+		// コンテナ内などでsyscallが許可されていない場合は、単に失敗するだけなので無視する。
+#if defined(SYS_set_mempolicy)
+		if (t.node_ids.size() > 1)
+		{
+			NodeMask mask;
+			mask.set(t.node_ids[node]);
+			syscall(SYS_set_mempolicy, kMpolPreferred, mask.bits, mask.max_node());
+		}
+#endif
+
+		if (Options.count("PrintThreadPlacement") && Options["PrintThreadPlacement"])
+			sync_cout << "info string thread " << idx << " : numa node " << t.node_ids[node]
+				<< " , cpus " << to_cpu_list(t.node_cpus[node]) << sync_endl;
+	}
+
+	void interleaveMemory(void* mem, size_t size) {
+
+		const NumaTopology& t = topology();
+		if (mem == nullptr || t.node_ids.size() <= 1)
+			return;
+
+#if defined(SYS_mbind)
+		NodeMask mask;
+		for (int node : t.node_ids)
+			mask.set(node);
+		syscall(SYS_mbind, mem, size, kMpolInterleave, mask.bits, mask.max_node(), 0);
+
+		if (Options.count("PrintThreadPlacement") && Options["PrintThreadPlacement"])
+			sync_cout << "info string interleave " << size / (1024 * 1024) << "[MB] across "
+				<< t.node_ids.size() << " numa nodes" << sync_endl;
+#endif
+	}
+
+#elif !defined ( _WIN32 )
 
 	void bindThisThread(size_t) {}
+	void interleaveMemory(void*, size_t) {}
 
 #else
 
+	void interleaveMemory(void*, size_t) {}
+
 
 	/// best_node() retrieves logical processor information using Windows specific
 	/// API and returns the best node id for the thread with index idx. Original
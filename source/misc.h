@@ -300,12 +300,20 @@ inline uint64_t mul_hi64(uint64_t a, uint64_t b) {
 // これを克服するためには、いくつかの特殊なプラットフォーム固有のAPIを呼び出して、
 // それぞのスレッドがgroup affinityを設定しなければならない。
 // 元のコードはPeter ÖsterlundによるTexelから。
+//
+// Linux環境では、sysfsからNUMA NODEの構成を調べて、同様の割当てをスレッドのaffinityとして行う。
+// (libnumaは必要としない)
 
 namespace WinProcGroup {
 	// 各スレッドがidle_loop()などで自分のスレッド番号(0～)を渡す。
 	// 1つ目のプロセッサをまず使い切るようにgroup affinityを割り当てる。
 	// 1つ目のプロセッサの論理コアを使い切ったら次は2つ目のプロセッサを使っていくような動作。
+	// Linuxでは、そのスレッドが以降に確保するメモリも、割り当てたNUMA NODEから優先的に確保されるようにする。
 	void bindThisThread(size_t idx);
+
+	// 全スレッドから参照する巨大なメモリ(置換表など)を、全NUMA NODEに交互に配置されるようにする。
+	// 確保した直後、まだ書き込む前に呼び出すこと。NUMA NODEが1つしかない環境やLinux以外では何もしない。
+	void interleaveMemory(void* mem, size_t size);
 }
 
 // -----------------------
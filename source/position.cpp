@@ -1202,6 +1202,9 @@ void Position::do_move_impl(Move m, StateInfo& new_st, bool givesCheck)
 	st->accumulator.computed_accumulation = false;
 	st->accumulator.computed_score = false;
 #endif
+#if defined(USE_EVAL_LIST)
+	st->progressVersion = 0;
+#endif
 
 #if defined(USE_BOARD_EFFECT_PREV)
 	// NNUE-HalfKPE9
@@ -1729,6 +1732,11 @@ void Position::do_null_move(StateInfo& newSt) {
 	// NNUEの場合、KPPT型と違って、手番が違う場合、計算なしに済ますわけにはいかない。
 	st->accumulator.computed_score = false;
 #endif
+#if defined(USE_EVAL_LIST)
+	// 駒は動いていないので、コピーした一手前の変化を差分計算で再び適用しないようにしておく。
+	// (進行度の重みの総和は、一手前のものがそのまま使える)
+	st->dirtyPiece.dirty_num = 0;
+#endif
 
 	st->board_key_ ^= Zobrist::side;
 
@@ -125,6 +125,12 @@ struct StateInfo {
 #if defined (USE_EVAL_LIST)
 	// 評価値の差分計算の管理用
 	Eval::DirtyPiece dirtyPiece;
+
+	// 進行度(Tanuki::Progress)の重みの総和。[先手玉から見たもの, 後手玉から見たもの]
+	// 次の局面で進行度を差分計算するときに用いる。
+	// progressVersionが進行度の重みの版と一致していなければ未計算。(0ならどの版とも一致しない)
+	float progressSum[COLOR_NB];
+	u32 progressVersion;
 #endif
 
 
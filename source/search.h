@@ -224,6 +224,12 @@ namespace Search {
 	// 置換表のクリアなど時間のかかる探索の初期化処理をここでやる。isreadyに対して呼び出される。
 	void clear();
 
+#if defined(TANUKI_MATE_ENGINE) || defined(YANEURAOU_MATE_ENGINE)
+	// 直前の詰将棋探索で、詰み手順を"checkmate"で返したか。
+	// "test matebench3"で、解けなかった局面を集計から除くのに用いる。
+	bool mate_found();
+#endif
+
 } // end of namespace Search
 
 #endif // _SEARCH_H_INCLUDED_
@@ -18,7 +18,7 @@ namespace
 void Tanuki::AnalyzeProgress()
 {
 	auto kifu_folder_path = Options["KifuDir"];
-	KifuReader reader(kifu_folder_path, 1);
+	KifuReader reader(kifu_folder_path, 1, true);
 
 	Progress progress;
 	if (!progress.Load()) {
@@ -4,14 +4,21 @@
 #ifdef EVAL_LEARN
 
 #include <atomic>
+#include <climits>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <numeric>
 #include <queue>
 #include <random>
 #include <set>
 #include <sstream>
+#include <string_view>
 #include <regex>
+#include <shared_mutex>
+#include <unordered_set>
 
 #include <omp.h>
 
@@ -62,8 +69,21 @@ namespace {
 	constexpr const char* kBookUctNumMatches = "BookUctNumMatches";
 	constexpr const char* kBookUctMaxSearchPerPosition = "BookUctMaxSearchPerPosition";
 	constexpr const char* kBookUctRecordFile = "BookUctRecordFile";
+	constexpr const char* kBookCoordinatorFolder = "BookCoordinatorFolder";
+	constexpr const char* kBookUctParallelMatches = "BookUctParallelMatches";
+	constexpr const char* kBookCsaCacheFile = "BookCsaCacheFile";
+	constexpr const char* kBookMergeBufferMb = "BookMergeBufferMB";
+	constexpr const char* kBookWorkerName = "BookWorkerName";
+	constexpr const char* kBookKeepSnapshotHistory = "BookKeepSnapshotHistory";
 	constexpr int kShowProgressPerAtMostSec = 1 * 60 * 60;	// 1時間
 	constexpr time_t kSavePerAtMostSec = 6 * 60 * 60;		// 6時間
+	// MergeBook()で同時に開くrunファイルの数の上限
+	// Windowsでは一度に512個までのファイルしか開けないため、余裕を持たせておく
+	constexpr int kMergeBookMaxOpenFiles = 384;
+	constexpr int kBookJobsPerChunk = 16;
+	constexpr int kBookJobLeaseSec = 60 * 60;				// 1時間
+	constexpr int kBookJobPollSec = 60;						// 1分
+	constexpr int kUctGamesPerTransaction = 16;
 
 	struct SfenAndMove {
 		std::string sfen;
@@ -180,6 +200,12 @@ bool Tanuki::InitializeBook(USI::OptionsMap& o) {
 	o[kBookUctNumMatches] << Option(5 * 1000, 0, INT_MAX);
 	o[kBookUctMaxSearchPerPosition] << Option(3, 0, INT_MAX);
 	o[kBookUctRecordFile] << Option("record.sqlite");
+	o[kBookCoordinatorFolder] << Option("");
+	o[kBookUctParallelMatches] << Option(1, 1, 1024);
+	o[kBookCsaCacheFile] << Option("");
+	o[kBookMergeBufferMb] << Option(1024, 1, 1024 * 1024);
+	o[kBookWorkerName] << Option("");
+	o[kBookKeepSnapshotHistory] << Option(false);
 
 	return true;
 }
@@ -239,14 +265,666 @@ bool Tanuki::CreateRawBook() {
 	return true;
 }
 
-bool Tanuki::CreateScoredBook() {
+namespace {
+	// MergeBook()で用いる、定跡の1局面分のデータ
+	struct MergeBookEntry {
+		// Position::sfen()で正規化したsfen文字列(手数を含む)
+		std::string sfen;
+		std::vector<BookMove> moves;
+	};
+
+	// 定跡ファイルの一部をsfen順に並べ替えて書き出した一時ファイル(run)
+	struct MergeBookRun {
+		std::string file_path;
+		// 読み込んだ定跡ファイルの番号。同じ定跡ファイルのrunは連続して並んでいる。
+		int source_index = 0;
+		// 採択回数が設定されている局面で、採択回数が0の指し手を取り除くかどうか
+		bool skip_zero_count_moves = false;
+		// kMergeBookSampleInterval局面ごとの、手数を除いたsfen文字列とファイル上の位置。
+		// key rangeの分割と、各rangeの先頭へのseekに用いる。
+		std::vector<std::pair<std::string, u64>> samples;
+	};
+
+	constexpr int kMergeBookSampleInterval = 1024;
+
+	// other_movesの指し手をmovesに追加する。BookMoves::insert()と同じく、
+	// すでに同じ指し手がある場合、overwrite == trueなら上書きして採択回数を合算し、falseなら何もしない。
+	void InsertMergeBookMoves(std::vector<BookMove>& moves, const std::vector<BookMove>& other_moves, bool overwrite) {
+		for (const auto& book_move : other_moves) {
+			auto it = std::find(moves.begin(), moves.end(), book_move);
+			if (it == moves.end()) {
+				moves.push_back(book_move);
+			}
+			else if (overwrite) {
+				auto move_count = it->move_count;
+				*it = book_move;
+				it->move_count += move_count;
+			}
+		}
+	}
+
+	// 採択回数が設定されており、採択回数が0の指し手は、手動でこの手を指さないよう調整されている。
+	// そのような手を取り除く。
+	void RemoveZeroCountMergeBookMoves(std::vector<BookMove>& moves) {
+		uint64_t max_move_count = 0;
+		for (const auto& book_move : moves) {
+			max_move_count = std::max(max_move_count, book_move.move_count);
+		}
+
+		if (max_move_count > 0) {
+			moves.erase(std::remove_if(moves.begin(), moves.end(),
+				[](const BookMove& book_move) { return book_move.move_count == 0; }), moves.end());
+		}
+	}
+
+	std::string MergeBookMoveToString(const BookMove& book_move) {
+		return to_usi_string(book_move.move) + ' ' + to_usi_string(book_move.ponder) + ' '
+			+ std::to_string(book_move.value) + " " + std::to_string(book_move.depth) + " " + std::to_string(book_move.move_count);
+	}
+
+	// entriesのsfen文字列を正規化し、sfen順に並べ替えてrunファイルに書き出す。
+	// 同じ局面が複数ある場合は、MemoryBook::read_book()と同様に後に読み込んだもので上書きしてまとめる。
+	bool WriteMergeBookRun(std::vector<MergeBookEntry>& entries, const std::string& file_path, MergeBookRun& run) {
+		// MemoryBook::write_book()と同様に、一度局面を設定してsfen()化しなおすことで手駒の表記の揺れを吸収する。
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			Position pos;
+			StateInfo state_info;
+#pragma omp for schedule(dynamic, 1024)
+			for (s64 i = 0; i < s64(entries.size()); ++i) {
+				pos.set(entries[i].sfen, &state_info, Threads[thread_index % Threads.size()]);
+				entries[i].sfen = pos.sfen();
+			}
+		}
+
+		std::stable_sort(entries.begin(), entries.end(), [](const MergeBookEntry& lhs, const MergeBookEntry& rhs) {
+			return lhs.sfen < rhs.sfen;
+			});
+
+		std::ofstream ofs(file_path, std::ios::out | std::ios::binary);
+		if (!ofs) {
+			sync_cout << "Failed to open a run file. file_path=" << file_path << sync_endl;
+			return false;
+		}
+
+		run.file_path = file_path;
+		run.samples.clear();
+		u64 offset = 0;
+		int num_entries = 0;
+		for (size_t i = 0; i < entries.size(); ) {
+			auto& entry = entries[i];
+			size_t j = i + 1;
+			for (; j < entries.size() && entries[j].sfen == entry.sfen; ++j) {
+				InsertMergeBookMoves(entry.moves, entries[j].moves, true);
+			}
+			i = j;
+
+			if (num_entries++ % kMergeBookSampleInterval == 0) {
+				run.samples.emplace_back(StringExtension::trim_number(entry.sfen), offset);
+			}
+
+			std::string text = "sfen " + entry.sfen + "\n";
+			for (const auto& book_move : entry.moves) {
+				text += MergeBookMoveToString(book_move) + "\n";
+			}
+			ofs.write(text.data(), text.size());
+			offset += text.size();
+		}
+
+		ofs.close();
+		if (ofs.fail()) {
+			sync_cout << "Failed to write a run file. file_path=" << file_path << sync_endl;
+			return false;
+		}
+		return true;
+	}
+
+	// 定跡ファイルを先頭から読み、メモリ使用量がbuffer_size程度になるごとにrunファイルに書き出す。
+	// skip_zero_count_moves == trueの場合、マージ時に採択回数が0の指し手を取り除く。
+	bool SplitBookIntoRuns(const std::string& book_file_path, int source_index, bool skip_zero_count_moves, size_t buffer_size,
+		const std::string& work_folder_path, std::vector<MergeBookRun>& runs) {
+		std::ifstream ifs(book_file_path, std::ios::in | std::ios::binary);
+		if (!ifs) {
+			sync_cout << "info string Error! : can't read file : " + book_file_path << sync_endl;
+			return false;
+		}
+
+		std::vector<MergeBookEntry> entries;
+		size_t used_size = 0;
+
+		auto flush_entry = [&]() {
+			if (entries.empty()) {
+				return;
+			}
+
+			auto& moves = entries.back().moves;
+
+			// 指し手のない空っぽのentryは書き出さないように。
+			if (moves.empty()) {
+				entries.pop_back();
+				return;
+			}
+
+			used_size += sizeof(MergeBookEntry) + entries.back().sfen.capacity() + moves.capacity() * sizeof(BookMove);
+		};
+
+		auto flush_run = [&]() {
+			if (entries.empty()) {
+				return true;
+			}
+
+			MergeBookRun run;
+			run.source_index = source_index;
+			run.skip_zero_count_moves = skip_zero_count_moves;
+			std::string file_path = (std::filesystem::path(work_folder_path) / ("run" + std::to_string(runs.size()))).string();
+			if (!WriteMergeBookRun(entries, file_path, run)) {
+				return false;
+			}
+			runs.push_back(std::move(run));
+			entries.clear();
+			used_size = 0;
+			return true;
+		};
+
+		std::string line;
+		while (std::getline(ifs, line)) {
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+
+			// バージョン識別文字列、コメント行は読み飛ばす。
+			if ((line.length() >= 1 && line[0] == '#') || (line.length() >= 2 && line.compare(0, 2, "//") == 0)) {
+				continue;
+			}
+
+			if (line.length() >= 5 && line.compare(0, 5, "sfen ") == 0) {
+				flush_entry();
+				if (used_size >= buffer_size && !flush_run()) {
+					return false;
+				}
+
+				entries.emplace_back();
+				entries.back().sfen = StringExtension::trim(line.substr(5));
+				continue;
+			}
+
+			if (entries.empty() || line.empty()) {
+				continue;
+			}
+
+			entries.back().moves.push_back(BookMove::from_string(line));
+		}
+
+		flush_entry();
+		return flush_run();
+	}
+
+	// runファイルを先頭から1局面ずつ読み進める。
+	class MergeBookRunReader {
+	public:
+		// runファイルを開き、offsetの位置の局面を読み込む。開けなかった場合はfalseを返す。
+		bool Open(const std::string& file_path, u64 offset) {
+			ifs_.open(file_path, std::ios::in | std::ios::binary);
+			if (!ifs_) {
+				return false;
+			}
+			ifs_.seekg(offset);
+			ReadLine();
+			Next();
+			return true;
+		}
+
+		// 次の局面を読み込む。ファイルの終端に達した場合はfalseを返す。
+		bool Next() {
+			entry_.moves.clear();
+			if (!has_line_) {
+				sfen_left_.clear();
+				return valid_ = false;
+			}
+
+			entry_.sfen = line_.substr(5);
+			sfen_left_ = StringExtension::trim_number(entry_.sfen);
+			while (ReadLine() && line_.compare(0, 5, "sfen ") != 0) {
+				entry_.moves.push_back(BookMove::from_string(line_));
+			}
+			return valid_ = true;
+		}
+
+		bool valid() const { return valid_; }
+		const MergeBookEntry& entry() const { return entry_; }
+		// 手数を除いたsfen文字列
+		const std::string& sfen_left() const { return sfen_left_; }
+
+	private:
+		bool ReadLine() {
+			has_line_ = static_cast<bool>(std::getline(ifs_, line_));
+			return has_line_;
+		}
+
+		std::ifstream ifs_;
+		std::string line_;
+		bool has_line_ = false;
+		bool valid_ = false;
+		MergeBookEntry entry_;
+		std::string sfen_left_;
+	};
+
+	// MergeBookRunGroups()がまとめた同一局面の、(runの番号, 手数, 指し手)の組。runの順に並んでいる。
+	using MergeBookGroup = std::vector<std::tuple<int, int, std::vector<BookMove>>>;
+
+	// runファイルのうち、手数を除いたsfen文字列がbegin_sfen_left以上end_sfen_left未満の局面を、
+	// 手数を除いたsfen文字列の順に、同一局面ごとにまとめてcallback(sfen_left, group)に渡す。
+	// end_sfen_leftが空の場合は末尾まで処理する。
+	template <typename Callback>
+	bool MergeBookRunGroups(const std::vector<MergeBookRun>& runs, const std::string& begin_sfen_left,
+		const std::string& end_sfen_left, Callback callback) {
+		std::vector<std::unique_ptr<MergeBookRunReader>> readers;
+		for (const auto& run : runs) {
+			// begin_sfen_left未満の最後のsampleの位置から読み始める。
+			auto it = std::lower_bound(run.samples.begin(), run.samples.end(), begin_sfen_left,
+				[](const std::pair<std::string, u64>& sample, const std::string& sfen_left) { return sample.first < sfen_left; });
+			u64 offset = it == run.samples.begin() ? 0 : std::prev(it)->second;
+
+			auto reader = std::make_unique<MergeBookRunReader>();
+			if (!reader->Open(run.file_path, offset)) {
+				sync_cout << "Failed to open a run file. file_path=" << run.file_path << sync_endl;
+				return false;
+			}
+			while (reader->valid() && reader->sfen_left() < begin_sfen_left) {
+				reader->Next();
+			}
+			readers.push_back(std::move(reader));
+		}
+
+		auto in_range = [&end_sfen_left](const MergeBookRunReader& reader) {
+			return reader.valid() && (end_sfen_left.empty() || reader.sfen_left() < end_sfen_left);
+		};
+
+		// 手数を除いたsfen文字列が最小のrunから順に取り出す。同じ局面ではrunの順(読み込んだ順)に取り出す。
+		using QueueItem = std::pair<const std::string*, int>;
+		auto greater = [](const QueueItem& lhs, const QueueItem& rhs) {
+			int compare = lhs.first->compare(*rhs.first);
+			return compare != 0 ? compare > 0 : lhs.second > rhs.second;
+		};
+		std::priority_queue<QueueItem, std::vector<QueueItem>, decltype(greater)> queue(greater);
+		for (int run_index = 0; run_index < static_cast<int>(readers.size()); ++run_index) {
+			if (in_range(*readers[run_index])) {
+				queue.emplace(&readers[run_index]->sfen_left(), run_index);
+			}
+		}
+
+		MergeBookGroup group;
+		std::string sfen_left;
+		while (!queue.empty()) {
+			sfen_left = *queue.top().first;
+			group.clear();
+			while (!queue.empty() && *queue.top().first == sfen_left) {
+				int run_index = queue.top().second;
+				queue.pop();
+
+				auto& reader = *readers[run_index];
+				do {
+					const auto& entry = reader.entry();
+					int ply = StringExtension::to_int(entry.sfen.substr(sfen_left.length()), 0);
+					group.emplace_back(run_index, ply, entry.moves);
+					reader.Next();
+				} while (in_range(reader) && reader.sfen_left() == sfen_left);
+
+				if (in_range(reader)) {
+					queue.emplace(&reader.sfen_left(), run_index);
+				}
+			}
+
+			if (!callback(sfen_left, group)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// groupのうち手数がuse_ply(ply)を満たす指し手を、定跡ファイルごとにrunの順に上書きしてまとめたあと、
+	// 定跡ファイルの順にBookMoves::insert(overwrite = false)と同じ規則でまとめる。
+	// remove_zero_count_moves == falseの場合は、runのskip_zero_count_movesによらず採択回数が0の指し手を残す。
+	template <typename UsePly>
+	void FoldMergeBookGroup(const std::vector<MergeBookRun>& runs, const MergeBookGroup& group, UsePly use_ply,
+		bool remove_zero_count_moves, std::vector<BookMove>& moves) {
+		moves.clear();
+		std::vector<BookMove> source_moves;
+		for (size_t i = 0; i < group.size(); ) {
+			// 同じ定跡ファイルの指し手をまとめる。
+			const auto& first_run = runs[std::get<0>(group[i])];
+			source_moves.clear();
+			for (; i < group.size() && runs[std::get<0>(group[i])].source_index == first_run.source_index; ++i) {
+				const auto& [run_index, ply, group_moves] = group[i];
+				if (use_ply(ply)) {
+					InsertMergeBookMoves(source_moves, group_moves, true);
+				}
+			}
+
+			if (remove_zero_count_moves && first_run.skip_zero_count_moves) {
+				RemoveZeroCountMergeBookMoves(source_moves);
+			}
+			InsertMergeBookMoves(moves, source_moves, false);
+		}
+	}
+
+	// runファイルのうち、手数を除いたsfen文字列がbegin_sfen_left以上end_sfen_left未満の局面をマージしてoutput_file_pathに書き出す。
+	// end_sfen_leftが空の場合は末尾まで処理する。
+	// 同じ局面の指し手は、定跡ファイルごとにrunの順に上書きしてまとめたあと、
+	// 定跡ファイルの順にBookMoves::insert(overwrite = false)と同じ規則でまとめる。
+	// 手数違いの同一局面は、MemoryBook::write_book()と同様に手数の一番若いものだけを書き出す。
+	// IgnoreBookPly == trueの場合は、MemoryBookと同様に手数違いの同一局面の指し手もまとめる。
+	bool MergeBookRuns(const std::vector<MergeBookRun>& runs, const std::string& begin_sfen_left,
+		const std::string& end_sfen_left, bool ignore_book_ply, const std::string& output_file_path, u64& num_positions) {
+		std::ofstream ofs(output_file_path, std::ios::out | std::ios::binary);
+		if (!ofs) {
+			sync_cout << "Failed to open an output file. file_path=" << output_file_path << sync_endl;
+			return false;
+		}
+
+		std::vector<BookMove> moves;
+		bool succeeded = MergeBookRunGroups(runs, begin_sfen_left, end_sfen_left,
+			[&](const std::string& sfen_left, const MergeBookGroup& group) {
+				int min_ply = INT_MAX;
+				for (const auto& [run_index, ply, group_moves] : group) {
+					min_ply = std::min(min_ply, ply);
+				}
+
+				FoldMergeBookGroup(runs, group, [&](int ply) { return ignore_book_ply || ply == min_ply; }, true, moves);
+				if (moves.empty()) {
+					return true;
+				}
+				std::stable_sort(moves.begin(), moves.end());
+
+				std::string text = "sfen " + sfen_left + " " + std::to_string(min_ply) + "\r\n";
+				for (const auto& book_move : moves) {
+					text += MergeBookMoveToString(book_move) + "\r\n";
+				}
+				ofs.write(text.data(), text.size());
+				++num_positions;
+				return true;
+			});
+		if (!succeeded) {
+			return false;
+		}
+
+		ofs.close();
+		if (ofs.fail()) {
+			sync_cout << "Failed to write an output file. file_path=" << output_file_path << sync_endl;
+			return false;
+		}
+		return true;
+	}
+
+	// 連続するrunをまとめて、1つのrunファイルに書き出す。
+	// MergeBookRuns()の結果が変わらないよう、手数違いの同一局面は別の局面として残し、
+	// IgnoreBookPly == trueの場合のみ、手数の一番若い局面にまとめる。
+	// runsが1つの定跡ファイルのrunのみからなる場合は、その定跡ファイルの残りのrunと後でまとめられるよう、
+	// 採択回数が0の指し手を取り除かず、source_indexとskip_zero_count_movesを引き継ぐ。
+	// 複数の定跡ファイルのrunからなる場合は、それぞれの定跡ファイルのrunがすべて含まれている必要がある。
+	bool CombineMergeBookRuns(const std::vector<MergeBookRun>& runs, bool ignore_book_ply,
+		const std::string& output_file_path, MergeBookRun& output_run) {
+		std::ofstream ofs(output_file_path, std::ios::out | std::ios::binary);
+		if (!ofs) {
+			sync_cout << "Failed to open a run file. file_path=" << output_file_path << sync_endl;
+			return false;
+		}
+
+		bool single_source = runs.front().source_index == runs.back().source_index;
+		output_run.file_path = output_file_path;
+		output_run.source_index = runs.front().source_index;
+		output_run.skip_zero_count_moves = single_source && runs.front().skip_zero_count_moves;
+		output_run.samples.clear();
+
+		u64 offset = 0;
+		int num_groups = 0;
+		std::vector<int> plies;
+		std::vector<BookMove> moves;
+		bool succeeded = MergeBookRunGroups(runs, "", "",
+			[&](const std::string& sfen_left, const MergeBookGroup& group) {
+				plies.clear();
+				for (const auto& [run_index, ply, group_moves] : group) {
+					plies.push_back(ply);
+				}
+				std::sort(plies.begin(), plies.end());
+				plies.erase(std::unique(plies.begin(), plies.end()), plies.end());
+				if (ignore_book_ply) {
+					plies.resize(1);
+				}
+
+				if (num_groups++ % kMergeBookSampleInterval == 0) {
+					output_run.samples.emplace_back(sfen_left, offset);
+				}
+
+				for (int target_ply : plies) {
+					FoldMergeBookGroup(runs, group, [&](int ply) { return ignore_book_ply || ply == target_ply; },
+						!single_source, moves);
+
+					std::string text = "sfen " + sfen_left + " " + std::to_string(target_ply) + "\n";
+					for (const auto& book_move : moves) {
+						text += MergeBookMoveToString(book_move) + "\n";
+					}
+					ofs.write(text.data(), text.size());
+					offset += text.size();
+				}
+				return true;
+			});
+		if (!succeeded) {
+			return false;
+		}
+
+		ofs.close();
+		if (ofs.fail()) {
+			sync_cout << "Failed to write a run file. file_path=" << output_file_path << sync_endl;
+			return false;
+		}
+		return true;
+	}
+
+	// runの数が、出力ファイルと合わせて一度に開けるファイル数の上限に収まるまで、連続するrunをまとめる。
+	// まとめるrunは、1つの定跡ファイルのrunの一部か、いくつかの定跡ファイルのrunすべてのどちらかとする。
+	bool ReduceMergeBookRuns(std::vector<MergeBookRun>& runs, bool ignore_book_ply, const std::string& work_folder_path) {
+		constexpr int kMaxRunsPerGroup = kMergeBookMaxOpenFiles - 1;
+		int num_combined_runs = 0;
+		while (static_cast<int>(runs.size()) > kMaxRunsPerGroup) {
+			// [begin, end)の範囲をまとめる。
+			std::vector<std::pair<size_t, size_t>> groups;
+			// 最後のgroupが定跡ファイルのrunすべてからなり、他の定跡ファイルのrunを追加できるかどうか
+			bool extendable = false;
+			for (size_t source_begin = 0; source_begin < runs.size(); ) {
+				size_t source_end = source_begin;
+				while (source_end < runs.size() && runs[source_end].source_index == runs[source_begin].source_index) {
+					++source_end;
+				}
+
+				if (source_end - source_begin > kMaxRunsPerGroup) {
+					// 1つの定跡ファイルのrunが多すぎる場合は、その定跡ファイルのrunだけを分けてまとめる。
+					for (size_t begin = source_begin; begin < source_end; begin += kMaxRunsPerGroup) {
+						groups.emplace_back(begin, std::min(source_end, begin + kMaxRunsPerGroup));
+					}
+					extendable = false;
+				}
+				else if (extendable && source_end - groups.back().first <= kMaxRunsPerGroup) {
+					groups.back().second = source_end;
+				}
+				else {
+					groups.emplace_back(source_begin, source_end);
+					extendable = true;
+				}
+				source_begin = source_end;
+			}
+
+			sync_cout << "Combining run files. |runs|=" << runs.size() << " |groups|=" << groups.size() << sync_endl;
+
+			std::vector<MergeBookRun> combined_runs;
+			for (const auto& [begin, end] : groups) {
+				if (end - begin == 1) {
+					combined_runs.push_back(std::move(runs[begin]));
+					continue;
+				}
+
+				std::vector<MergeBookRun> group_runs(runs.begin() + begin, runs.begin() + end);
+				std::string file_path = (std::filesystem::path(work_folder_path) / ("combined" + std::to_string(num_combined_runs++))).string();
+				MergeBookRun combined_run;
+				if (!CombineMergeBookRuns(group_runs, ignore_book_ply, file_path, combined_run)) {
+					return false;
+				}
+				combined_runs.push_back(std::move(combined_run));
+
+				std::error_code error_code;
+				for (const auto& run : group_runs) {
+					std::filesystem::remove(run.file_path, error_code);
+				}
+			}
+			runs = std::move(combined_runs);
+		}
+		return true;
+	}
+}
+
+// 複数の定跡をマージする
+// BookInputFileには「;」区切りで定跡データベースの古パースを指定する
+// BookOutputFileにはbook以下のファイル名を指定する
+// 定跡全体をメモリに読み込まないよう、各定跡をBookMergeBufferMBごとにsfen順に並べ替えた一時ファイルに書き出し、
+// それらをk-wayマージしながら出力する。マージはkey range単位で並列に行う。
+bool Tanuki::MergeBook() {
+	std::string input_file_list = Options[kBookInputFile];
+	std::string output_file = Options[kBookOutputFile];
+	size_t buffer_size = static_cast<size_t>(static_cast<int>(Options[kBookMergeBufferMb])) * 1024 * 1024;
+	bool ignore_book_ply = Options["IgnoreBookPly"];
+	int num_threads = Options[kThreads];
+	omp_set_num_threads(num_threads);
+
+	sync_cout << "info string input_file_list=" << input_file_list << sync_endl;
+	sync_cout << "info string output_file=" << output_file << sync_endl;
+
+	std::string output_file_path = "book/" + output_file;
+	std::string work_folder_path = output_file_path + ".merge";
+	std::error_code error_code;
+	std::filesystem::remove_all(work_folder_path, error_code);
+	if (!std::filesystem::create_directories(work_folder_path, error_code)) {
+		sync_cout << "Failed to create a work folder. work_folder_path=" << work_folder_path << sync_endl;
+		return false;
+	}
+
+	std::vector<MergeBookRun> runs;
+	if (std::filesystem::exists(output_file_path)) {
+		sync_cout << "Reading output book file: " << output_file_path << sync_endl;
+		if (!SplitBookIntoRuns(output_file_path, 0, false, buffer_size, work_folder_path, runs)) {
+			return false;
+		}
+		sync_cout << "done..." << sync_endl;
+	}
+
+	std::vector<std::string> input_files;
+	{
+		std::istringstream iss(input_file_list);
+		std::string input_file;
+		while (std::getline(iss, input_file, ';')) {
+			input_files.push_back(input_file);
+		}
+	}
+
+	for (int input_file_index = 0; input_file_index < static_cast<int>(input_files.size()); ++input_file_index) {
+		sync_cout << (input_file_index + 1) << " / " << input_files.size() << sync_endl;
+
+		const auto& input_file = input_files[input_file_index];
+		sync_cout << "Reading input book file: " << input_file << sync_endl;
+		if (!SplitBookIntoRuns(input_file, input_file_index + 1, true, buffer_size, work_folder_path, runs)) {
+			return false;
+		}
+		sync_cout << "done..." << sync_endl;
+	}
+	sync_cout << "|runs|=" << runs.size() << sync_endl;
+
+	// key rangeごとにすべてのrunファイルと出力ファイルを開くので、
+	// runの数が多い場合は先にまとめ、同時にマージするkey rangeの数を、開くファイルの数が上限に収まるように制限する。
+	if (!ReduceMergeBookRuns(runs, ignore_book_ply, work_folder_path)) {
+		return false;
+	}
+	int num_files_per_range = static_cast<int>(runs.size()) + 1;
+	int num_merge_threads = std::clamp(kMergeBookMaxOpenFiles / num_files_per_range, 1, num_threads);
+	sync_cout << "num_merge_threads=" << num_merge_threads << sync_endl;
+
+	// runファイルのsampleから、key rangeの境界を選ぶ。
+	std::vector<std::string> samples;
+	for (const auto& run : runs) {
+		for (const auto& sample : run.samples) {
+			samples.push_back(sample.first);
+		}
+	}
+	std::sort(samples.begin(), samples.end());
+	samples.erase(std::unique(samples.begin(), samples.end()), samples.end());
+
+	int num_ranges = std::max(1, std::min(num_threads * 4, static_cast<int>(samples.size())));
+	std::vector<std::string> boundaries(num_ranges + 1);
+	for (int range_index = 1; range_index < num_ranges; ++range_index) {
+		boundaries[range_index] = samples[samples.size() * range_index / num_ranges];
+	}
+
+	std::vector<std::string> part_file_paths(num_ranges);
+	std::vector<u64> num_positions(num_ranges);
+	std::atomic<bool> succeeded = true;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(num_merge_threads)
+	for (int range_index = 0; range_index < num_ranges; ++range_index) {
+		part_file_paths[range_index] = (std::filesystem::path(work_folder_path) / ("part" + std::to_string(range_index))).string();
+		if (!MergeBookRuns(runs, boundaries[range_index], boundaries[range_index + 1], ignore_book_ply,
+			part_file_paths[range_index], num_positions[range_index])) {
+			succeeded = false;
+		}
+	}
+
+	if (!succeeded) {
+		return false;
+	}
+
+	std::string backup_file_path = output_file_path + ".bak";
+	if (std::filesystem::exists(backup_file_path)) {
+		sync_cout << "Removing the backup file. backup_file_path=" << backup_file_path << sync_endl;
+		std::filesystem::remove(backup_file_path);
+	}
+
+	if (std::filesystem::exists(output_file_path)) {
+		sync_cout << "Renaming the output file. output_book_file_path=" << output_file_path << " backup_file_path=" << backup_file_path << sync_endl;
+		std::filesystem::rename(output_file_path, backup_file_path);
+	}
+
+	std::ofstream ofs(output_file_path, std::ios::out | std::ios::binary);
+	if (!ofs) {
+		sync_cout << "Failed to open the output file. output_book_file_path=" << output_file_path << sync_endl;
+		return false;
+	}
+
+	sync_cout << "write " << output_file_path << sync_endl;
+	ofs << "#YANEURAOU-DB2016 1.00\r\n";
+	for (const auto& part_file_path : part_file_paths) {
+		std::ifstream ifs(part_file_path, std::ios::in | std::ios::binary);
+		if (ifs.peek() != std::ifstream::traits_type::eof()) {
+			ofs << ifs.rdbuf();
+		}
+	}
+	ofs.close();
+	if (ofs.fail()) {
+		sync_cout << "Failed to write the output file. output_book_file_path=" << output_file_path << sync_endl;
+		return false;
+	}
+
+	std::filesystem::remove_all(work_folder_path, error_code);
+
+	sync_cout << "|output_book_file_path|=" << std::accumulate(num_positions.begin(), num_positions.end(), u64(0)) << sync_endl;
+
+	return true;
+}
+
+// 定跡の各指し手に評価値を付ける
+// 相手の応手が設定されていない場合、読み筋から設定する。
+bool Tanuki::SetScoreToMove() {
 	int num_threads = (int)Options[kThreads];
 	std::string input_book_file = Options[kBookInputFile];
 	int search_depth = (int)Options[kBookSearchDepth];
 	int search_nodes = (int)Options[kBookSearchNodes];
-	int multi_pv = (int)Options[kMultiPV];
 	std::string output_book_file = Options[kBookOutputFile];
-	bool overwrite_existing_positions = static_cast<bool>(Options[kBookOverwriteExistingPositions]);
 
 	omp_set_num_threads(num_threads);
 
@@ -254,10 +932,7 @@ bool Tanuki::CreateScoredBook() {
 	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
 	sync_cout << "info string search_depth=" << search_depth << sync_endl;
 	sync_cout << "info string search_nodes=" << search_nodes << sync_endl;
-	sync_cout << "info string multi_pv=" << multi_pv << sync_endl;
 	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
-	sync_cout << "info string overwrite_existing_positions=" << overwrite_existing_positions
-		<< sync_endl;
 
 	Search::LimitsType limits;
 	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
@@ -281,28 +956,61 @@ bool Tanuki::CreateScoredBook() {
 	sync_cout << "done..." << sync_endl;
 	sync_cout << "|output_book|=" << output_book.get_body().size() << sync_endl;
 
-	std::vector<std::string> sfens;
-	for (const auto& sfen_and_count : input_book.get_body()) {
-		if (!overwrite_existing_positions &&
-			output_book.get_body().find(sfen_and_count.first) != output_book.get_body().end()) {
+	std::vector<SfenAndMove> sfen_and_moves;
+
+	// 未処理の局面をキューに登録する
+	for (const auto& input_sfen_and_pos_move_list : input_book.get_body()) {
+		const auto& input_sfen = input_sfen_and_pos_move_list.first;
+
+		Position& position = Threads[0]->rootPos;
+		StateInfo state_info;
+		position.set(input_sfen, &state_info, Threads[0]);
+
+		auto output_book_moves_it = output_book.get_body().find(input_sfen);
+		if (output_book_moves_it == output_book.get_body().end()) {
+			// 出力定跡データベースに局面が登録されていなかった場合
+			for (const auto& input_book_move : *input_sfen_and_pos_move_list.second) {
+				sfen_and_moves.push_back({
+					input_sfen,
+					position.to_move(input_book_move.move),
+					position.to_move(input_book_move.ponder)
+					});
+			}
 			continue;
 		}
-		sfens.push_back(sfen_and_count.first);
+
+		auto& output_book_moves = *output_book_moves_it->second;
+		for (const auto& input_book_move : *input_sfen_and_pos_move_list.second) {
+			if (std::find_if(output_book_moves.begin(), output_book_moves.end(),
+				[&input_book_move](const auto& x) {
+					return input_book_move.move == x.move;
+				}) != output_book_moves.end()) {
+				continue;
+			}
+
+			// 出力定跡データベースに指し手が登録されていなかった場合
+			sfen_and_moves.push_back({
+				input_sfen,
+				position.to_move(input_book_move.move),
+				position.to_move(input_book_move.ponder)
+				});
+		}
 	}
-	int num_sfens = static_cast<int>(sfens.size());
-	sync_cout << "Number of the positions to be processed: " << num_sfens << sync_endl;
+	int num_sfen_and_moves = static_cast<int>(sfen_and_moves.size());
+	sync_cout << "Number of the moves to be processed: " << num_sfen_and_moves << sync_endl;
 
-	time_t start_time = 0;
-	std::time(&start_time);
+	// マルチスレッド処理準備のため、インデックスを初期化する
+	std::atomic_int global_sfen_and_move_index;
+	global_sfen_and_move_index = 0;
 
-	std::atomic_int global_position_index;
-	global_position_index = 0;
-	ProgressReport progress_report(num_sfens, kShowProgressPerAtMostSec);
+	// 進捗状況表示の準備
+	ProgressReport progress_report(num_sfen_and_moves, kShowProgressPerAtMostSec);
+
+	// 定跡を定期的に保存するための変数
 	time_t last_save_time_sec = std::time(nullptr);
 
+	// Apery式マルチスレッド処理
 	std::atomic<bool> need_wait = false;
-	std::atomic_int global_pos_index;
-	global_pos_index = 0;
 	std::atomic_int global_num_processed_positions;
 	global_num_processed_positions = 0;
 #pragma omp parallel
@@ -310,35 +1018,49 @@ bool Tanuki::CreateScoredBook() {
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
 
-		for (int position_index = global_pos_index++; position_index < num_sfens;
-			position_index = global_pos_index++) {
-			const std::string& sfen = sfens[position_index];
+		for (int position_index = global_sfen_and_move_index++; position_index < num_sfen_and_moves;
+			position_index = global_sfen_and_move_index++) {
+			const auto& sfen_and_move = sfen_and_moves[position_index];
+			const auto& sfen = sfen_and_move.sfen;
 			Thread& thread = *Threads[thread_index];
 			StateInfo state_info = {};
 			Position& pos = thread.rootPos;
 			pos.set(sfen, &state_info, &thread);
+			Move best_move = sfen_and_move.best_move;
+			Move next_move = MOVE_NONE;
 
 			if (pos.is_mated()) {
 				continue;
 			}
 
-			Learner::search(pos, search_depth, multi_pv, search_nodes);
+			if (!pos.pseudo_legal(best_move) || !pos.legal(best_move)) {
+				sync_cout << "Illegal move. sfen=" << sfen << " best_move=" <<
+					USI::move(best_move) << " next_move=" << USI::move(next_move) << sync_endl;
+				continue;
+			}
 
-			int num_pv = std::min(multi_pv, static_cast<int>(thread.rootMoves.size()));
-			for (int pv_index = 0; pv_index < num_pv; ++pv_index) {
-				const auto& root_move = thread.rootMoves[pv_index];
-				Move best = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 1) {
-					best = root_move.pv[0];
-				}
-				Move next = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 2) {
-					next = root_move.pv[1];
-				}
-				int value = root_move.score;
-				UpsertBookMove(output_book, sfen, best, next, value, thread.completedDepth, 1);
+			StateInfo state_info0;
+			pos.do_move(best_move, state_info0);
+			Eval::evaluate_with_no_return(pos);
+
+			// この局面について探索する
+			auto value_and_pv = Learner::search(pos, search_depth, 1, search_nodes);
+
+			// ひとつ前の局面から見た評価値を代入する必要があるので、符号を反転する。
+			Value value = -value_and_pv.first;
+
+			auto pv = value_and_pv.second;
+			if (next_move == MOVE_NONE && pv.size() >= 1) {
+				// 定跡の手を指した次の局面なので、nextMoveにはpv[0]を代入する。
+				// ただし、もともとnextMoveが設定されている場合、それを優先する。
+				next_move = pv[0];
 			}
 
+			Depth depth = pos.this_thread()->completedDepth;
+
+			// 指し手を出力先の定跡に登録する
+			UpsertBookMove(output_book, sfen, best_move, next_move, value, depth, 1);
+
 			int num_processed_positions = ++global_num_processed_positions;
 			// 念のため、I/Oはマスタースレッドでのみ行う
 #pragma omp master
@@ -346,13 +1068,11 @@ bool Tanuki::CreateScoredBook() {
 				// 進捗状況を表示する
 				progress_report.Show(num_processed_positions);
 
-				// 一定時間ごとに保存する
-				{
+				// 定跡をストレージに書き出す。
+				if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
 					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-						WriteBook(output_book, output_book_file);
-						last_save_time_sec = std::time(nullptr);
-					}
+					WriteBook(output_book, output_book_file);
+					last_save_time_sec = std::time(nullptr);
 				}
 			}
 
@@ -365,7 +1085,7 @@ bool Tanuki::CreateScoredBook() {
 				// 全てのスレッドを待機する。
 #pragma omp barrier
 
-				// マスタースレッドでしばらく待機する。
+			// マスタースレッドでしばらく待機する。
 #pragma omp master
 				{
 					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
@@ -388,411 +1108,979 @@ bool Tanuki::CreateScoredBook() {
 	return true;
 }
 
-// 複数の定跡をマージする
-// BookInputFileには「;」区切りで定跡データベースの古パースを指定する
-// BookOutputFileにはbook以下のファイル名を指定する
-bool Tanuki::MergeBook() {
-	std::string input_file_list = Options[kBookInputFile];
-	std::string output_file = Options[kBookOutputFile];
+namespace {
+	// 定跡データベースの局面を、整数のindexで表したグラフ(DAG + 循環)に変換し、
+	// 末端局面の評価値をroot局面に向けて後退解析で伝搬する。
+	//
+	// 以前は局面ごとにsfen文字列をkeyとしたメモ付きの再帰Nega-Maxを用いていたが、
+	// sfen文字列の生成・hash mapの参照が支配的で、巨大な定跡ではスレッド数を増やしても速くならなかった。
+	// ここでは、
+	// 1. 局面をhash key(+手数)でindexに変換し、各局面の子局面へのedgeを並列に列挙する。
+	// 2. 出次数0の局面から順に、親局面へ評価値を伝搬する。(トポロジカル順。段ごとに並列に処理する)
+	// 3. 循環に含まれていて 2. で処理できなかった局面は、MakeBook2023と同様に、
+	//    子局面への指し手を千日手の評価値で初期化し、評価値が変化しなくなるまで(最大MAX_PLY回)親局面への伝搬を繰り返す。
+	//    千日手を打開する権利の扱いもMakeBook2023のDrawStateと同じである。
+	// 4. 結果を定跡データベースに書き戻す。
+	// という手順で処理する。
+
+	// 定跡グラフ上の局面のindex
+	using BookNodeIndex = u32;
+	constexpr BookNodeIndex kBookNodeIndexNull = std::numeric_limits<BookNodeIndex>::max();
+
+	// 循環していて評価値が確定していない指し手の探索深さ
+	constexpr int kBookDepthInf = 9999;
+
+	// 千日手を打開する権利の状態。MakeBook2023::DrawStateと同じ。
+	// bit0 : 先手は千日手を打開する権利を持っていない。
+	// bit1 : 後手は千日手を打開する権利を持っていない。
+	struct DrawState {
+		u8 state = 0;
+
+		bool operator==(const DrawState& rhs) const { return state == rhs.state; }
+		bool operator!=(const DrawState& rhs) const { return state != rhs.state; }
+
+		// 手番cにおいて評価値が同じときに、thisのほうがrhsより優れているか。
+		bool IsSuperior(DrawState rhs, Color c) const {
+			// 先手は 00b > 10b > 01b > 11b 、後手は 00b > 01b > 10b > 11b の順に優れている。
+			constexpr int kBlackOrder[] = { 1, 3, 2, 4 };
+			constexpr int kWhiteOrder[] = { 1, 2, 3, 4 };
+			return c == BLACK ? kBlackOrder[state] < kBlackOrder[rhs.state]
+				: kWhiteOrder[state] < kWhiteOrder[rhs.state];
+		}
 
-	sync_cout << "info string input_file_list=" << input_file_list << sync_endl;
-	sync_cout << "info string output_file=" << output_file << sync_endl;
+		// 手番cにおいて評価値が同じ指し手が複数あるときの、この局面のDrawState。
+		// 手番側のbitはand、非手番側のbitはorを取る。
+		static DrawState Select(DrawState x, DrawState y, Color c) {
+			u8 our_bit = c == BLACK ? 1 : 2;
+			u8 them_bit = c == BLACK ? 2 : 1;
+			return { u8((x.state & y.state & our_bit) | ((x.state | y.state) & them_bit)) };
+		}
+	};
 
-	BookMoveSelector output_book;
-	sync_cout << "Reading output book file: " << output_file << sync_endl;
-	output_book.get_body().read_book("book/" + output_file);
-	sync_cout << "done..." << sync_endl;
-	sync_cout << "|output_book|=" << output_book.get_body().get_body().size() << sync_endl;
+	// 評価値・探索深さ・千日手の状態の組
+	struct ValueDepth {
+		int value = 0;
+		int depth = 0;
+		DrawState draw_state;
 
-	std::vector<std::string> input_files;
-	{
-		std::istringstream iss(input_file_list);
-		std::string input_file;
-		while (std::getline(iss, input_file, ';')) {
-			input_files.push_back(input_file);
+		bool operator==(const ValueDepth& rhs) const {
+			return value == rhs.value && depth == rhs.depth && draw_state == rhs.draw_state;
+		}
+		bool operator!=(const ValueDepth& rhs) const { return !(*this == rhs); }
+
+		// 手番colorにおいて、thisのほうがrhsより優れているか。MakeBook2023::ValueDepth::is_superior()と同じ。
+		// 評価値、千日手の状態の順に比較し、それも同じ場合、
+		// 千日手の評価値より良い評価値であれば探索深さの浅いほうを、悪い評価値であれば深いほうを優れているとする。
+		bool IsSuperior(const ValueDepth& rhs, Color color, int draw_value) const {
+			if (value != rhs.value) {
+				return value > rhs.value;
+			}
+
+			if (draw_state != rhs.draw_state) {
+				return draw_state.IsSuperior(rhs.draw_state, color);
+			}
+
+			if (value > draw_value || (value == draw_value && color == BLACK)) {
+				return depth < rhs.depth;
+			}
+			else {
+				return depth > rhs.depth;
+			}
+		}
+	};
+
+	// 定跡グラフ上の指し手
+	struct BookGraphMove {
+		Move16 move;
+		// この指し手を指したときの評価値・探索深さ
+		ValueDepth vd;
+		// 子局面のindex。子局面が定跡データベースに登録されていない場合はkBookNodeIndexNull。
+		BookNodeIndex next = kBookNodeIndexNull;
+	};
+
+	// ある局面の親局面と、その何番目の指し手でこの局面に進むか
+	struct BookGraphParent {
+		BookNodeIndex parent;
+		u32 move_index;
+	};
+
+	// 定跡グラフ上の局面
+	struct BookGraphNode {
+		// 定跡データベースのエントリー
+		Book::BookType::value_type* entry = nullptr;
+		Color color = BLACK;
+		// 詰み・宣言勝ちの局面の場合true。この局面の評価値はterminal_vdで固定する。
+		bool terminal = false;
+		ValueDepth terminal_vd;
+		std::vector<BookGraphMove> moves;
+		// 子局面が定跡データベースに登録されている指し手の数
+		u32 out_count = 0;
+		// 親局面へ最後に伝搬した評価値
+		ValueDepth last_parent_vd;
+	};
+
+	// 局面のhash keyと手数の組。IgnoreBookPlyがtrueの場合、手数は0とする。
+	struct BookNodeKey {
+		u64 key[2];
+		int ply;
+
+		bool operator<(const BookNodeKey& rhs) const {
+			if (key[0] != rhs.key[0]) return key[0] < rhs.key[0];
+			if (key[1] != rhs.key[1]) return key[1] < rhs.key[1];
+			return ply < rhs.ply;
 		}
+		bool operator==(const BookNodeKey& rhs) const {
+			return key[0] == rhs.key[0] && key[1] == rhs.key[1] && ply == rhs.ply;
+		}
+	};
+
+	BookNodeKey GetBookNodeKey(const Position& pos, bool ignore_book_ply) {
+		BookNodeKey node_key;
+#if HASH_KEY_BITS <= 64
+		node_key.key[0] = pos.hash_key();
+		node_key.key[1] = 0;
+#else
+		const auto key = pos.hash_key();
+		node_key.key[0] = key.p[0];
+		node_key.key[1] = key.p[1];
+#endif
+		node_key.ply = ignore_book_ply ? 0 : pos.game_ply();
+		return node_key;
 	}
 
-	for (int input_file_index = 0; input_file_index < static_cast<int>(input_files.size()); ++input_file_index) {
-		sync_cout << (input_file_index + 1) << " / " << input_files.size() << sync_endl;
+	class BookGraph {
+	public:
+		explicit BookGraph(int draw_value) : draw_value_(draw_value) {}
 
-		const auto& input_file = input_files[input_file_index];
-		BookMoveSelector input_book;
-		sync_cout << "Reading input book file: " << input_file << sync_endl;
-		input_book.get_body().read_book(input_file);
-		sync_cout << "done..." << sync_endl;
-		sync_cout << "|input_book|=" << input_book.get_body().get_body().size() << sync_endl;
+		// 定跡データベースからグラフを構築する。
+		void Build(MemoryBook& book);
+
+		// 末端局面の評価値を後退解析で伝搬する。
+		void Propagate();
+
+		// 伝搬した評価値を定跡データベースに書き戻す。
+		void WriteBack();
+
+	private:
+		// 局面nodeの最善の指し手のindexと、親局面に伝搬する評価値を求める。
+		// MakeBook2023の同名のヘルパー関数と同じ処理である。
+		size_t GetBestValue(const BookGraphNode& node, ValueDepth& parent_vd) const;
+
+		// 局面nodeの評価値を親局面に伝搬する。
+		void PropagateToParents(BookNodeIndex index, const ValueDepth& parent_vd);
+
+		std::vector<BookGraphNode> nodes_;
+		// parents_[parent_offsets_[i]]〜parents_[parent_offsets_[i+1]-1]が局面iの親局面
+		std::vector<size_t> parent_offsets_;
+		std::vector<BookGraphParent> parents_;
+		int draw_value_;
+	};
+
+	void BookGraph::Build(MemoryBook& book) {
+		bool ignore_book_ply = Options["IgnoreBookPly"];
+
+		nodes_.clear();
+		nodes_.resize(book.get_body().size());
+		BookNodeIndex num_nodes = 0;
+		for (auto& book_entry : book.get_body()) {
+			nodes_[num_nodes++].entry = &book_entry;
+		}
+
+		// 局面ごとにhash keyを求め、hash key順に並べて局面の検索に用いる。
+		std::vector<std::pair<BookNodeKey, BookNodeIndex>> keys(nodes_.size());
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			Thread* thread = Threads[thread_index % Threads.size()];
+			Position pos;
+			StateInfo state_info;
+#pragma omp for schedule(dynamic, 4096)
+			for (s64 i = 0; i < s64(nodes_.size()); ++i) {
+				pos.set(nodes_[i].entry->first, &state_info, thread);
+				keys[i] = { GetBookNodeKey(pos, ignore_book_ply), BookNodeIndex(i) };
+			}
+		}
+		std::sort(keys.begin(), keys.end());
+
+		auto find_node = [&keys](const BookNodeKey& node_key) {
+			auto it = std::lower_bound(keys.begin(), keys.end(), node_key,
+				[](const std::pair<BookNodeKey, BookNodeIndex>& lhs, const BookNodeKey& rhs) { return lhs.first < rhs; });
+			return it != keys.end() && it->first == node_key ? it->second : kBookNodeIndexNull;
+		};
+
+		// 各局面について、定跡データベースの指し手と、子局面が定跡データベースに登録されている合法手を列挙する。
+		std::vector<std::atomic<u32>> in_counts(nodes_.size());
+		for (auto& in_count : in_counts) {
+			in_count.store(0, std::memory_order_relaxed);
+		}
+
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			Thread* thread = Threads[thread_index % Threads.size()];
+			Position pos;
+			StateInfo state_info;
+			StateInfo child_state_info;
+#pragma omp for schedule(dynamic, 1024)
+			for (s64 i = 0; i < s64(nodes_.size()); ++i) {
+				auto& node = nodes_[i];
+				pos.set(node.entry->first, &state_info, thread);
+				node.color = pos.side_to_move();
+
+				if (pos.is_mated()) {
+					// 詰んでいる場合
+					node.terminal = true;
+					node.terminal_vd = { mated_in(0), 0, DrawState() };
+					continue;
+				}
+
+				if (pos.DeclarationWin() != MOVE_NONE) {
+					// 宣言勝ちできる場合
+					node.terminal = true;
+					node.terminal_vd = { mate_in(1), 0, DrawState() };
+					continue;
+				}
+
+				for (const auto& book_move : *node.entry->second) {
+					node.moves.push_back({ book_move.move, { book_move.value, book_move.depth, DrawState() }, kBookNodeIndexNull });
+				}
+
+				for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
+					pos.do_move(move, child_state_info);
+					BookNodeIndex child = find_node(GetBookNodeKey(pos, ignore_book_ply));
+					pos.undo_move(move);
+
+					if (child == kBookNodeIndexNull || child == BookNodeIndex(i)) {
+						continue;
+					}
 
-		for (const auto& book_type : input_book.get_body().get_body()) {
-			const auto& sfen = book_type.first;
-			const auto& pos_move_list = book_type.second;
+					Move16 move16(move.move);
+					auto it = std::find_if(node.moves.begin(), node.moves.end(),
+						[move16](const BookGraphMove& m) { return m.move == move16; });
+					if (it == node.moves.end()) {
+						node.moves.push_back({ move16, {}, kBookNodeIndexNull });
+						it = node.moves.end() - 1;
+					}
 
-			uint64_t max_move_count = 0;
-			for (const auto& pos_move : *pos_move_list) {
-				max_move_count = std::max(max_move_count, pos_move.move_count);
+					// 子局面に進む指し手は、千日手の評価値で初期化しておく。
+					// 循環から抜け出せない指し手は、この値のまま残る。
+					it->vd = { draw_value_, kBookDepthInf, DrawState{ 3 } };
+					it->next = child;
+					++node.out_count;
+					in_counts[child].fetch_add(1, std::memory_order_relaxed);
+				}
 			}
+		}
 
-			for (const auto& pos_move : *pos_move_list) {
-				if (max_move_count > 0 && pos_move.move_count == 0) {
-					// 採択回数が設定されており、この手の採択回数が0の場合、
-					// 手動でこの手を指さないよう調整されている。
-					// そのような手はスキップする。
+		// 親局面のリストを詰めて格納する。
+		parent_offsets_.assign(nodes_.size() + 1, 0);
+		for (size_t i = 0; i < nodes_.size(); ++i) {
+			parent_offsets_[i + 1] = parent_offsets_[i] + in_counts[i].load(std::memory_order_relaxed);
+		}
+		parents_.resize(parent_offsets_.back());
+
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (s64 i = 0; i < s64(nodes_.size()); ++i) {
+			const auto& node = nodes_[i];
+			for (size_t move_index = 0; move_index < node.moves.size(); ++move_index) {
+				BookNodeIndex child = node.moves[move_index].next;
+				if (child == kBookNodeIndexNull) {
 					continue;
 				}
-				output_book.get_body().insert(sfen, pos_move, false);
+				u32 slot = in_counts[child].fetch_sub(1, std::memory_order_relaxed) - 1;
+				parents_[parent_offsets_[child] + slot] = { BookNodeIndex(i), u32(move_index) };
 			}
 		}
 	}
 
-	WriteBook(output_book, "book/" + output_file);
+	size_t BookGraph::GetBestValue(const BookGraphNode& node, ValueDepth& parent_vd) const {
+		if (node.terminal) {
+			parent_vd = { -node.terminal_vd.value, node.terminal_vd.depth + 1, node.terminal_vd.draw_state };
+			return 0;
+		}
 
-	return true;
-}
+		if (node.moves.empty()) {
+			parent_vd = { -mated_in(0), 1, DrawState() };
+			return 0;
+		}
 
-// 定跡の各指し手に評価値を付ける
-// 相手の応手が設定されていない場合、読み筋から設定する。
-bool Tanuki::SetScoreToMove() {
-	int num_threads = (int)Options[kThreads];
-	std::string input_book_file = Options[kBookInputFile];
-	int search_depth = (int)Options[kBookSearchDepth];
-	int search_nodes = (int)Options[kBookSearchNodes];
-	std::string output_book_file = Options[kBookOutputFile];
+		size_t best_index = 0;
+		ValueDepth best = node.moves[0].vd;
+		parent_vd = node.moves[0].vd;
+		for (size_t i = 1; i < node.moves.size(); ++i) {
+			const auto& vd = node.moves[i].vd;
+			if (vd.IsSuperior(best, node.color, draw_value_)) {
+				best = vd;
+				best_index = i;
+			}
 
-	omp_set_num_threads(num_threads);
+			if (parent_vd.value < vd.value) {
+				parent_vd = vd;
+			}
+			else if (parent_vd.value == vd.value) {
+				// 評価値が同じ指し手を選べるので、千日手の状態を合成する。
+				parent_vd.draw_state = DrawState::Select(parent_vd.draw_state, vd.draw_state, node.color);
+				parent_vd.depth = best.depth;
+			}
+		}
 
-	sync_cout << "info string num_threads=" << num_threads << sync_endl;
-	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
-	sync_cout << "info string search_depth=" << search_depth << sync_endl;
-	sync_cout << "info string search_nodes=" << search_nodes << sync_endl;
-	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+		// 親局面から見た評価値にする。
+		parent_vd.value = -parent_vd.value;
+		parent_vd.depth = std::min(parent_vd.depth + 1, kBookDepthInf);
+		return best_index;
+	}
 
-	Search::LimitsType limits;
-	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
-	limits.max_game_ply = 1 << 16;
-	limits.depth = MAX_PLY;
-	limits.silent = true;
-	limits.enteringKingRule = EKR_27_POINT;
-	Search::Limits = limits;
+	void BookGraph::PropagateToParents(BookNodeIndex index, const ValueDepth& parent_vd) {
+		// 親局面のある指し手で進む子局面は1つだけなので、
+		// 異なる子局面からの書き込みが同じ指し手に対して行われることはない。
+		for (size_t i = parent_offsets_[index]; i < parent_offsets_[index + 1]; ++i) {
+			const auto& parent = parents_[i];
+			nodes_[parent.parent].moves[parent.move_index].vd = parent_vd;
+		}
+	}
 
-	MemoryBook input_book;
-	input_book_file = "book/" + input_book_file;
-	sync_cout << "Reading input book file: " << input_book_file << sync_endl;
-	input_book.read_book(input_book_file);
-	sync_cout << "done..." << sync_endl;
-	sync_cout << "|input_book|=" << input_book.get_body().size() << sync_endl;
+	void BookGraph::Propagate() {
+		// 後退解析その1 : 出次数0の局面から順に、親局面に評価値を伝搬する。
+		// 同じ段の局面は互いに依存しないので並列に処理できる。
+		std::vector<std::atomic<u32>> out_counts(nodes_.size());
+		std::vector<BookNodeIndex> frontier;
+		for (size_t i = 0; i < nodes_.size(); ++i) {
+			out_counts[i].store(nodes_[i].out_count, std::memory_order_relaxed);
+			if (nodes_[i].out_count == 0) {
+				frontier.push_back(BookNodeIndex(i));
+			}
+		}
 
-	MemoryBook output_book;
-	output_book_file = "book/" + output_book_file;
-	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
-	output_book.read_book(output_book_file);
-	sync_cout << "done..." << sync_endl;
-	sync_cout << "|output_book|=" << output_book.get_body().size() << sync_endl;
+		u64 num_resolved_nodes = 0;
+		while (!frontier.empty()) {
+			num_resolved_nodes += frontier.size();
+			std::vector<BookNodeIndex> next_frontier;
+#pragma omp parallel
+			{
+				std::vector<BookNodeIndex> local_frontier;
+#pragma omp for schedule(dynamic, 1024)
+				for (s64 i = 0; i < s64(frontier.size()); ++i) {
+					BookNodeIndex index = frontier[i];
+					ValueDepth parent_vd;
+					GetBestValue(nodes_[index], parent_vd);
+					nodes_[index].last_parent_vd = parent_vd;
+					PropagateToParents(index, parent_vd);
+
+					for (size_t j = parent_offsets_[index]; j < parent_offsets_[index + 1]; ++j) {
+						BookNodeIndex parent = parents_[j].parent;
+						if (out_counts[parent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+							local_frontier.push_back(parent);
+						}
+					}
+				}
+#pragma omp critical
+				next_frontier.insert(next_frontier.end(), local_frontier.begin(), local_frontier.end());
+			}
+			frontier.swap(next_frontier);
+		}
 
-	std::vector<SfenAndMove> sfen_and_moves;
+		// 後退解析その2 : 循環に含まれる局面について、評価値が変化しなくなるまで親局面への伝搬を繰り返す。
+		// 1回の反復の中では、すべての局面の評価値を求めてから親局面に伝搬する。
+		std::vector<BookNodeIndex> loop_nodes;
+		for (size_t i = 0; i < nodes_.size(); ++i) {
+			if (out_counts[i].load(std::memory_order_relaxed) != 0) {
+				loop_nodes.push_back(BookNodeIndex(i));
+			}
+		}
+		sync_cout << "|resolved_nodes|=" << num_resolved_nodes << " |loop_nodes|=" << loop_nodes.size() << sync_endl;
+
+		std::vector<ValueDepth> parent_vds(loop_nodes.size());
+		std::vector<u8> updated(loop_nodes.size());
+		for (int loop = 0; loop < MAX_PLY && !loop_nodes.empty(); ++loop) {
+			u64 num_updated_nodes = 0;
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+:num_updated_nodes)
+			for (s64 i = 0; i < s64(loop_nodes.size()); ++i) {
+				const auto& node = nodes_[loop_nodes[i]];
+				GetBestValue(node, parent_vds[i]);
+				updated[i] = parent_vds[i] != node.last_parent_vd;
+				num_updated_nodes += updated[i];
+			}
 
-	// 未処理の局面をキューに登録する
-	for (const auto& input_sfen_and_pos_move_list : input_book.get_body()) {
-		const auto& input_sfen = input_sfen_and_pos_move_list.first;
+			if (num_updated_nodes == 0) {
+				break;
+			}
 
-		Position& position = Threads[0]->rootPos;
-		StateInfo state_info;
-		position.set(input_sfen, &state_info, Threads[0]);
+#pragma omp parallel for schedule(dynamic, 1024)
+			for (s64 i = 0; i < s64(loop_nodes.size()); ++i) {
+				if (!updated[i]) {
+					continue;
+				}
+				nodes_[loop_nodes[i]].last_parent_vd = parent_vds[i];
+				PropagateToParents(loop_nodes[i], parent_vds[i]);
+			}
+		}
+	}
 
-		auto output_book_moves_it = output_book.get_body().find(input_sfen);
-		if (output_book_moves_it == output_book.get_body().end()) {
-			// 出力定跡データベースに局面が登録されていなかった場合
-			for (const auto& input_book_move : *input_sfen_and_pos_move_list.second) {
-				sfen_and_moves.push_back({
-					input_sfen,
-					position.to_move(input_book_move.move),
-					position.to_move(input_book_move.ponder)
-					});
+	void BookGraph::WriteBack() {
+		// 子局面の最善手を応手として書き込むため、先に全局面の最善手を求めておく。
+		std::vector<Move16> best_moves(nodes_.size());
+#pragma omp parallel for schedule(dynamic, 4096)
+		for (s64 i = 0; i < s64(nodes_.size()); ++i) {
+			const auto& node = nodes_[i];
+			ValueDepth parent_vd;
+			size_t best_index = GetBestValue(node, parent_vd);
+			best_moves[i] = node.terminal || node.moves.empty() ? Move16(MOVE_NONE) : node.moves[best_index].move;
+		}
+
+		// 局面ごとに別のBookMovesを書き換えるので、並列に処理して良い。
+#pragma omp parallel for schedule(dynamic, 1024)
+		for (s64 i = 0; i < s64(nodes_.size()); ++i) {
+			const auto& node = nodes_[i];
+			auto& book_moves = *node.entry->second;
+			for (const auto& move : node.moves) {
+				if (move.next == kBookNodeIndexNull) {
+					continue;
+				}
+				book_moves.insert(BookMove(move.move, best_moves[move.next], move.vd.value, move.vd.depth, 1), true);
 			}
-			continue;
 		}
+	}
+}
 
-		auto& output_book_moves = *output_book_moves_it->second;
-		for (const auto& input_book_move : *input_sfen_and_pos_move_list.second) {
-			if (std::find_if(output_book_moves.begin(), output_book_moves.end(),
-				[&input_book_move](const auto& x) {
-					return input_book_move.move == x.move;
-				}) != output_book_moves.end()) {
-				continue;
+namespace {
+	// 定跡作成時の探索条件を設定する
+	void SetUpBookSearchLimits() {
+		Search::LimitsType limits;
+		// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
+		limits.max_game_ply = 1 << 16;
+		limits.depth = MAX_PLY;
+		limits.silent = true;
+		limits.enteringKingRule = EKR_27_POINT;
+		Search::Limits = limits;
+	}
+
+	// 定跡データベースへの追記内容を記録するジャーナル。
+	// 形式は定跡データベースと同じで、"sfen "で始まる行と指し手の行を1組ずつ追記する。
+	// スナップショット(定跡データベース全体)を書き出すたびに空にする。
+	// 起動時にスナップショットを読み込んだあと、ジャーナルを再生することで、
+	// 定跡データベース全体を頻繁に書き出すことなく、処理結果を失わないようにする。
+	class BookJournal {
+	public:
+		explicit BookJournal(const std::string& file_path) : file_path_(file_path) {}
+
+		// ジャーナルを再生し、定跡データベースに反映する。
+		// 反映した指し手の数を返す。
+		// スナップショットの書き出し後、ジャーナルを空にする前に異常終了した場合、
+		// ジャーナルの内容はスナップショットにも含まれている。二重に数えないよう、
+		// 定跡データベースにすでにある指し手は評価値などを上書きするだけで、採択回数は合算しない。
+		// replayed_sfensがnullptrでない場合、ジャーナルに記録されている局面のsfen文字列を格納する。
+		uint64_t Replay(MemoryBook& book, std::unordered_set<std::string>* replayed_sfens = nullptr) {
+			std::ifstream ifs(file_path_);
+			if (!ifs) {
+				return 0;
 			}
 
-			// 出力定跡データベースに指し手が登録されていなかった場合
-			sfen_and_moves.push_back({
-				input_sfen,
-				position.to_move(input_book_move.move),
-				position.to_move(input_book_move.ponder)
-				});
+			bool ignore_book_ply = Options["IgnoreBookPly"];
+			uint64_t num_moves = 0;
+			std::string sfen;
+			std::string line;
+			while (std::getline(ifs, line)) {
+				if (line.length() >= 5 && line.compare(0, 5, "sfen ") == 0) {
+					sfen = line.substr(5);
+					if (replayed_sfens != nullptr) {
+						replayed_sfens->insert(sfen);
+					}
+					if (ignore_book_ply) {
+						StringExtension::trim_number_inplace(sfen);
+					}
+					continue;
+				}
+
+				// 書き込み途中で異常終了した場合、末尾の行が欠けている可能性がある。
+				// 指し手の行は5つのフィールドからなるため、足りないものは読み飛ばす。
+				std::istringstream iss(line);
+				std::string token;
+				int num_tokens = 0;
+				while (iss >> token) {
+					++num_tokens;
+				}
+				if (sfen.empty() || num_tokens < 5) {
+					continue;
+				}
+
+				BookMove book_move = BookMove::from_string(line);
+				auto book_moves = book.find(sfen);
+				if (book_moves && book_moves->find_move(book_move.move)) {
+					// insert()は採択回数を合算するので、0にしておくと既存の採択回数が残る。
+					book_move.move_count = 0;
+				}
+				book.insert(sfen, book_move);
+				++num_moves;
+			}
+			return num_moves;
 		}
-	}
-	int num_sfen_and_moves = static_cast<int>(sfen_and_moves.size());
-	sync_cout << "Number of the moves to be processed: " << num_sfen_and_moves << sync_endl;
 
-	// マルチスレッド処理準備のため、インデックスを初期化する
-	std::atomic_int global_sfen_and_move_index;
-	global_sfen_and_move_index = 0;
+		bool Open() {
+			ofs_.open(file_path_, std::ios::app);
+			if (!ofs_) {
+				sync_cout << "info string Failed to open the journal file. file_path=" << file_path_ << sync_endl;
+				return false;
+			}
+			return true;
+		}
 
-	// 進捗状況表示の準備
-	ProgressReport progress_report(num_sfen_and_moves, kShowProgressPerAtMostSec);
+		// 1局面分の追記内容をまとめて書き込む。
+		void Append(const std::string& entries) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			ofs_ << entries;
+			ofs_.flush();
+		}
 
-	// 定跡を定期的に保存するための変数
-	time_t last_save_time_sec = std::time(nullptr);
+		// スナップショットを書き出したあとに呼び出し、ジャーナルを空にする。
+		void Truncate() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			ofs_.close();
+			ofs_.open(file_path_, std::ios::trunc);
+		}
 
-	// Apery式マルチスレッド処理
-	std::atomic<bool> need_wait = false;
-	std::atomic_int global_num_processed_positions;
-	global_num_processed_positions = 0;
-#pragma omp parallel
-	{
-		int thread_index = ::omp_get_thread_num();
-		WinProcGroup::bindThisThread(thread_index);
+		void Close() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			ofs_.close();
+		}
 
-		for (int position_index = global_sfen_and_move_index++; position_index < num_sfen_and_moves;
-			position_index = global_sfen_and_move_index++) {
-			const auto& sfen_and_move = sfen_and_moves[position_index];
-			const auto& sfen = sfen_and_move.sfen;
-			Thread& thread = *Threads[thread_index];
-			StateInfo state_info = {};
-			Position& pos = thread.rootPos;
-			pos.set(sfen, &state_info, &thread);
-			Move best_move = sfen_and_move.best_move;
-			Move next_move = MOVE_NONE;
+	private:
+		std::string file_path_;
+		std::ofstream ofs_;
+		std::mutex mutex_;
+	};
+
+	// 定跡の延長・評価値付けの対象局面(ジョブ)を、スレッドおよびプロセスに割り当てる。
+	//
+	// ジョブはkBookJobsPerChunk個ずつのチャンクに分け、チャンク単位で各スレッドのキューに取り出す。
+	// 自スレッドのキューが空になった場合は、他のスレッドのキューの末尾から半分を奪う(work stealing)。
+	// どのキューも空の場合は、新しいチャンクを取り出す。
+	//
+	// coordinator_folderが指定された場合、同じフォルダを指定した複数のプロセスでチャンクを分け合う。
+	// ・チャンクを取り出すときは"<チャンク番号>.claim"ファイルを排他的に作成する。作成できたプロセスが担当する。
+	// ・担当中のプロセスは、ジョブを1つ終えるごとにclaimファイルの更新日時を更新する。
+	// ・チャンクのジョブをすべて終えたら"<チャンク番号>.done"ファイルを作成する。
+	// ・未担当のチャンクがない場合、kBookJobLeaseSec以上更新されていないclaimファイルのチャンクは、
+	//   異常終了したプロセスのものとみなし、claimファイルをrenameで奪ってから担当する。
+	// ・worker_nameを固定して再起動した場合、前回の自プロセス名義のclaimファイルは期限を待たずに引き継ぐ。
+	// ・未担当のチャンクも引き継げるチャンクもないが、すべてのチャンクが終わっていない場合は、
+	//   kBookJobPollSecごとに確認しながら、他のプロセスが終えるかclaimファイルが期限切れになるまで待つ。
+	// ・定跡データベースを書き出したプロセスは、コーディネーター用のファイルを削除する。
+	//   同じフォルダを指定して、次の実行をやり直せるようにするため。
+	//   待機中のプロセスは、"jobs"ファイルが削除されたことで、他のプロセスが書き出したと判断する。
+	class BookJobScheduler {
+	public:
+		// worker_nameが空の場合は、ランダムな名前を付ける。
+		BookJobScheduler(int num_jobs, int num_threads, const std::string& coordinator_folder,
+			const std::string& worker_name)
+			: num_jobs_(num_jobs),
+			num_chunks_((num_jobs + kBookJobsPerChunk - 1) / kBookJobsPerChunk),
+			coordinator_folder_(coordinator_folder),
+			worker_name_(worker_name),
+			remaining_jobs_(num_chunks_),
+			claimed_chunks_(num_chunks_) {
+			for (int thread_index = 0; thread_index < num_threads; ++thread_index) {
+				queues_.emplace_back(new JobQueue());
+			}
+			for (int chunk_index = 0; chunk_index < num_chunks_; ++chunk_index) {
+				remaining_jobs_[chunk_index] = std::min(kBookJobsPerChunk, num_jobs - chunk_index * kBookJobsPerChunk);
+			}
+
+			if (worker_name_.empty()) {
+				std::random_device random_device;
+				std::ostringstream oss;
+				oss << std::hex << ((u64(random_device()) << 32) | random_device());
+				worker_name_ = oss.str();
+			}
+		}
+
+		// 複数プロセスで分担する場合、コーディネーター用のフォルダを準備する。
+		// 他のプロセスとジョブの数が一致しない場合はfalseを返す。
+		bool Open() {
+			if (!IsDistributed()) {
+				return true;
+			}
+
+			std::error_code error_code;
+			std::filesystem::create_directories(coordinator_folder_, error_code);
+
+			// 最初のプロセスがジョブの数を書き込み、以降のプロセスは一致するかを確認する。
+			std::filesystem::path jobs_file_path = JobsFilePath();
+			if (FILE* fp = std::fopen(jobs_file_path.string().c_str(), "wx")) {
+				std::fprintf(fp, "%d\n", num_jobs_);
+				std::fclose(fp);
+			}
+
+			std::ifstream ifs(jobs_file_path);
+			int num_jobs = -1;
+			ifs >> num_jobs;
+			if (num_jobs != num_jobs_) {
+				sync_cout << "info string The number of the jobs does not match the other workers. coordinator_folder="
+					<< coordinator_folder_ << " num_jobs=" << num_jobs_ << " expected=" << num_jobs << sync_endl;
+				return false;
+			}
+
+			sync_cout << "info string worker_name=" << worker_name_ << " |chunks|=" << num_chunks_ << sync_endl;
+			return true;
+		}
+
+		// thread_index番目のスレッドが処理するジョブを取り出す。
+		// すべてのジョブが終わった場合はfalseを返す。
+		// 複数プロセスで分担する場合、他のプロセスが担当中のチャンクが終わるまでここで待つ。
+		bool Pop(int thread_index, int& job_index) {
+			auto& own_queue = *queues_[thread_index];
+			for (;;) {
+				{
+					std::lock_guard<std::mutex> lock(own_queue.mutex);
+					if (!own_queue.jobs.empty()) {
+						job_index = own_queue.jobs.front();
+						own_queue.jobs.pop_front();
+						return true;
+					}
+				}
+
+				if (Steal(thread_index)) {
+					continue;
+				}
+
+				int chunk_index;
+				if (!ClaimChunk(chunk_index)) {
+					if (!IsDistributed() || AllDone() || !std::filesystem::exists(JobsFilePath())) {
+						return false;
+					}
 
-			if (pos.is_mated()) {
-				continue;
+					if (!waiting_reported_.exchange(true)) {
+						sync_cout << "info string Waiting for the chunks claimed by the other workers." << sync_endl;
+					}
+					std::this_thread::sleep_for(std::chrono::seconds(kBookJobPollSec));
+					continue;
+				}
+
+				std::lock_guard<std::mutex> lock(own_queue.mutex);
+				int end = std::min(num_jobs_, (chunk_index + 1) * kBookJobsPerChunk);
+				for (int job = chunk_index * kBookJobsPerChunk; job < end; ++job) {
+					own_queue.jobs.push_back(job);
+				}
 			}
+		}
 
-			if (!pos.pseudo_legal(best_move) || !pos.legal(best_move)) {
-				sync_cout << "Illegal move. sfen=" << sfen << " best_move=" <<
-					USI::move(best_move) << " next_move=" << USI::move(next_move) << sync_endl;
-				continue;
+		// ジョブの処理が終わったときに呼び出す。
+		void Done(int job_index) {
+			int chunk_index = job_index / kBookJobsPerChunk;
+			if (!IsDistributed()) {
+				--remaining_jobs_[chunk_index];
+				return;
 			}
 
-			StateInfo state_info0;
-			pos.do_move(best_move, state_info0);
-			Eval::evaluate_with_no_return(pos);
+			std::error_code error_code;
+			if (--remaining_jobs_[chunk_index] == 0) {
+				std::ofstream(ChunkFilePath(chunk_index, ".done"));
+			}
+			else {
+				// 担当中であることを他のプロセスに知らせる。
+				std::filesystem::last_write_time(ChunkFilePath(chunk_index, ".claim"),
+					std::filesystem::file_time_type::clock::now(), error_code);
+			}
+		}
 
-			// この局面について探索する
-			auto value_and_pv = Learner::search(pos, search_depth, 1, search_nodes);
+		// すべてのプロセスで、すべてのジョブが終わったかどうかを返す。
+		bool AllDone() const {
+			for (int chunk_index = 0; chunk_index < num_chunks_; ++chunk_index) {
+				if (IsDistributed() ? !std::filesystem::exists(ChunkFilePath(chunk_index, ".done"))
+					: remaining_jobs_[chunk_index] > 0) {
+					return false;
+				}
+			}
+			return true;
+		}
 
-			// ひとつ前の局面から見た評価値を代入する必要があるので、符号を反転する。
-			Value value = -value_and_pv.first;
+		// すべてのジョブが終わったあと、最終的な定跡データベースを書き出すプロセスを1つに決める。
+		bool TryClaimMerge() {
+			if (!IsDistributed()) {
+				return true;
+			}
+			return TryCreateExclusively(std::filesystem::path(coordinator_folder_) / "merge.claim");
+		}
 
-			auto pv = value_and_pv.second;
-			if (next_move == MOVE_NONE && pv.size() >= 1) {
-				// 定跡の手を指した次の局面なので、nextMoveにはpv[0]を代入する。
-				// ただし、もともとnextMoveが設定されている場合、それを優先する。
-				next_move = pv[0];
+		// 定跡データベースを書き出したあとに呼び出し、コーディネーター用のファイルを削除する。
+		// 待機中のプロセスが終了を判断できるよう、"jobs"ファイルは最後に削除する。
+		void Cleanup() {
+			if (!IsDistributed()) {
+				return;
 			}
 
-			Depth depth = pos.this_thread()->completedDepth;
+			std::error_code error_code;
+			std::vector<std::filesystem::path> file_paths;
+			for (const auto& entry : std::filesystem::directory_iterator(coordinator_folder_, error_code)) {
+				auto extension = entry.path().extension().string();
+				if (extension == ".done" || extension == ".claim" || extension == ".stale") {
+					file_paths.push_back(entry.path());
+				}
+			}
+			for (const auto& file_path : file_paths) {
+				std::filesystem::remove(file_path, error_code);
+			}
+			std::filesystem::remove(JobsFilePath(), error_code);
+		}
 
-			// 指し手を出力先の定跡に登録する
-			UpsertBookMove(output_book, sfen, best_move, next_move, value, depth, 1);
+		bool IsDistributed() const { return !coordinator_folder_.empty(); }
 
-			int num_processed_positions = ++global_num_processed_positions;
-			// 念のため、I/Oはマスタースレッドでのみ行う
-#pragma omp master
-			{
-				// 進捗状況を表示する
-				progress_report.Show(num_processed_positions);
+		const std::string& worker_name() const { return worker_name_; }
 
-				// 定跡をストレージに書き出す。
-				if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					WriteBook(output_book, output_book_file);
-					last_save_time_sec = std::time(nullptr);
+	private:
+		struct JobQueue {
+			std::mutex mutex;
+			std::deque<int> jobs;
+		};
+
+		// 他のスレッドのキューから、残っているジョブの半分を奪う。
+		bool Steal(int thread_index) {
+			auto& own_queue = *queues_[thread_index];
+			for (int offset = 1; offset < static_cast<int>(queues_.size()); ++offset) {
+				auto& victim = *queues_[(thread_index + offset) % queues_.size()];
+				std::deque<int> stolen;
+				{
+					std::lock_guard<std::mutex> lock(victim.mutex);
+					size_t num_stolen = (victim.jobs.size() + 1) / 2;
+					stolen.assign(victim.jobs.end() - num_stolen, victim.jobs.end());
+					victim.jobs.erase(victim.jobs.end() - num_stolen, victim.jobs.end());
 				}
+				if (stolen.empty()) {
+					continue;
+				}
+
+				std::lock_guard<std::mutex> lock(own_queue.mutex);
+				own_queue.jobs.insert(own_queue.jobs.end(), stolen.begin(), stolen.end());
+				return true;
 			}
+			return false;
+		}
 
-			need_wait = need_wait ||
-				(progress_report.HasDataPerTime() &&
-					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
+		// 新しいチャンクを取り出す。
+		bool ClaimChunk(int& chunk_index) {
+			std::lock_guard<std::mutex> lock(claim_mutex_);
+			if (!IsDistributed()) {
+				if (next_chunk_index_ >= num_chunks_) {
+					return false;
+				}
+				chunk_index = next_chunk_index_++;
+				return true;
+			}
 
-			if (need_wait) {
-				// 処理速度が低下してきている。
-				// 全てのスレッドを待機する。
-#pragma omp barrier
+			for (; next_chunk_index_ < num_chunks_; ++next_chunk_index_) {
+				if (std::filesystem::exists(ChunkFilePath(next_chunk_index_, ".done"))) {
+					continue;
+				}
+				if (TryCreateExclusively(ChunkFilePath(next_chunk_index_, ".claim"))) {
+					chunk_index = next_chunk_index_++;
+					claimed_chunks_[chunk_index] = true;
+					return true;
+				}
+			}
 
-			// マスタースレッドでしばらく待機する。
-#pragma omp master
-				{
-					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
-						progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
-						progress_report.GetMaxDataPerTime() << sync_endl;
+			// 未担当のチャンクがない場合、異常終了したプロセスが担当していたチャンクを引き継ぐ。
+			auto now = std::filesystem::file_time_type::clock::now();
+			for (int index = 0; index < num_chunks_; ++index) {
+				if (claimed_chunks_[index] || std::filesystem::exists(ChunkFilePath(index, ".done"))) {
+					continue;
+				}
 
-					std::this_thread::sleep_for(std::chrono::minutes(10));
-					progress_report.Reset();
-					need_wait = false;
+				std::error_code error_code;
+				auto claim_file_path = ChunkFilePath(index, ".claim");
+				auto last_write_time = std::filesystem::last_write_time(claim_file_path, error_code);
+				if (error_code) {
+					continue;
 				}
 
-				// マスタースレッドの待機が終わるまで、再度全てのスレッドを待機する。
-#pragma omp barrier
-			}
-		}
-	}
+				// 前回の自プロセス名義のclaimファイルは、期限切れを待たずに引き継ぐ。
+				if (now - last_write_time < std::chrono::seconds(kBookJobLeaseSec)
+					&& ReadClaimOwner(claim_file_path) != worker_name_) {
+					continue;
+				}
 
-	WriteBook(output_book, output_book_file);
+				// renameは1つのプロセスしか成功しないので、これを奪う操作とする。
+				auto stale_file_path = ChunkFilePath(index, ".claim." + worker_name_ + ".stale");
+				std::filesystem::rename(claim_file_path, stale_file_path, error_code);
+				if (error_code || !TryCreateExclusively(claim_file_path)) {
+					continue;
+				}
+				std::filesystem::remove(stale_file_path, error_code);
 
-	return true;
-}
+				sync_cout << "info string Took over a stale chunk. chunk_index=" << index << sync_endl;
+				chunk_index = index;
+				claimed_chunks_[chunk_index] = true;
+				return true;
+			}
 
-namespace {
-	struct ValueMoveDepth {
-		// 評価値
-		Value value = VALUE_NONE;
-		// この局面における指し手
-		// 定跡の指し手に対する応手を定跡データベースに登録するため、指し手も返せるようにしておく
-		Move move = MOVE_NONE;
-		// 探索深さ
-		Depth depth = DEPTH_NONE;
-	};
+			return false;
+		}
 
-	// (sfen, ValueAndDepth)
-	// やねうら王本家では手数の部分を削除しているが、
-	// 実装を容易にするため手数も含めて格納する。
-	// 本来であればこれによる副作用を熟考する必要があるが、
-	// よく分からなかったので適当に実装する。
-	std::unordered_map<std::string, ValueMoveDepth> memo;
+		// claimファイルに書かれているworker_nameを返す。
+		static std::string ReadClaimOwner(const std::filesystem::path& claim_file_path) {
+			std::ifstream ifs(claim_file_path);
+			std::string owner;
+			std::getline(ifs, owner);
+			return owner;
+		}
 
-	// IgnoreBookPlyオプションがtrueの場合、
-	// 与えられたsfen文字列からplyを取り除く
-	std::string RemovePlyIfIgnoreBookPly(const std::string& sfen) {
-		if (Options["IgnoreBookPly"]) {
-			return StringExtension::trim_number(sfen);
+		bool TryCreateExclusively(const std::filesystem::path& file_path) const {
+			FILE* fp = std::fopen(file_path.string().c_str(), "wx");
+			if (fp == nullptr) {
+				return false;
+			}
+			std::fprintf(fp, "%s\n", worker_name_.c_str());
+			std::fclose(fp);
+			return true;
 		}
-		else {
-			return sfen;
+
+		std::filesystem::path JobsFilePath() const {
+			return std::filesystem::path(coordinator_folder_) / "jobs";
 		}
-	}
 
-	// Nega-Max法で末端局面の評価値をroot局面に向けて伝搬する
-	// book 定跡データベース
-	// pos 現在の局面
-	// value_and_depth_without_nega_max_parent SetScoreToMove()で設定した評価値と探索深さ
-	//                                         現局面から見た評価値になるよう、符号を反転してから渡すこと
-	ValueMoveDepth NegaMax(MemoryBook& book, Position& pos, int& counter) {
-		if (++counter % 1000000 == 0) {
-			sync_cout << counter << " |memo|=" << memo.size() << sync_endl;
+		std::filesystem::path ChunkFilePath(int chunk_index, const std::string& extension) const {
+			return std::filesystem::path(coordinator_folder_) / (std::to_string(chunk_index) + extension);
 		}
 
-		// この局面に対してのキーとして使用するsfen文字列。
-		// 必要に応じて末尾のplyを取り除いておく。
-		std::string sfen = RemovePlyIfIgnoreBookPly(pos.sfen());
+		int num_jobs_;
+		int num_chunks_;
+		std::string coordinator_folder_;
+		std::string worker_name_;
+		std::vector<std::unique_ptr<JobQueue>> queues_;
+		std::vector<std::atomic_int> remaining_jobs_;
+		std::mutex claim_mutex_;
+		int next_chunk_index_ = 0;
+		// 自プロセスが担当したチャンク。claim_mutex_で保護する。
+		std::vector<bool> claimed_chunks_;
+		std::atomic<bool> waiting_reported_ = false;
+	};
+
+	// 探索結果をジャーナルに追記し、定跡データベースに反映するまで保持する。
+	// 保持する指し手はsfen文字列のhash値でshardに分け、shardごとにロックを取る。
+	// 探索中のスレッドは定跡データベース自体には触れないので、大域的なロックを待つことがない。
+	class BookResultWriter {
+	public:
+		explicit BookResultWriter(BookJournal& journal) : journal_(journal) {}
+
+		// 1局面分の探索結果を記録する。
+		void Record(const std::string& sfen, const std::vector<BookMove>& book_moves) {
+			std::string journal_entries;
+			for (const auto& book_move : book_moves) {
+				journal_entries += "sfen " + sfen + "\n" + to_usi_string(book_move.move) + " "
+					+ to_usi_string(book_move.ponder) + " " + std::to_string(book_move.value) + " "
+					+ std::to_string(book_move.depth) + " " + std::to_string(book_move.move_count) + "\n";
+			}
 
-		// NegaMax()は定跡データベースに登録されている局面についてのみ処理を行う。
-		ASSERT_LV3(book.get_body().count(sfen));
+			// スナップショットの書き出し中は、ジャーナルとshardの両方への書き込みを待つ。
+			std::shared_lock<std::shared_mutex> snapshot_lock(snapshot_mutex_);
+			journal_.Append(journal_entries);
 
-		auto& vmd = memo[sfen];
-		if (vmd.depth != DEPTH_NONE) {
-			// キャッシュにヒットした場合、その値を返す。
-			return vmd;
+			auto& shard = shards_[std::hash<std::string>()(sfen) % kNumShards];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			for (const auto& book_move : book_moves) {
+				shard.entries.emplace_back(sfen, book_move);
+			}
 		}
 
-		if (pos.is_mated()) {
-			// 詰んでいる場合
-			vmd.value = mated_in(0);
-			vmd.depth = 0;
-			return vmd;
-		}
-
-		if (pos.DeclarationWin() != MOVE_NONE) {
-			// 宣言勝ちできる場合
-			vmd.value = mate_in(1);
-			vmd.depth = 0;
-			return vmd;
-		}
-
-		auto repetition_state = pos.is_repetition();
-		switch (repetition_state) {
-		case REPETITION_WIN:
-			// 連続王手の千日手により勝ちの場合
-			vmd.value = mate_in(MAX_PLY);
-			vmd.depth = 0;
-			return vmd;
-
-		case REPETITION_LOSE:
-			// 連続王手の千日手により負けの場合
-			vmd.value = mated_in(MAX_PLY);
-			vmd.depth = 0;
-			return vmd;
-
-		case REPETITION_DRAW:
-			// 引き分けの場合
-			// やねうら王では先手後手に別々の評価値を付加している。
-			// ここでは簡単のため、同じ評価値を付加する。
-			vmd.value = static_cast<Value>(Options["Contempt"] * Eval::PawnValue / 100);
-			vmd.depth = 0;
-			return vmd;
-
-		case REPETITION_SUPERIOR:
-			// 優等局面の場合
-			vmd.value = VALUE_SUPERIOR;
-			vmd.depth = 0;
-			return vmd;
-
-		case REPETITION_INFERIOR:
-			// 劣等局面の場合
-			vmd.value = -VALUE_SUPERIOR;
-			vmd.depth = 0;
-			return vmd;
-
-		default:
-			break;
+		// 保持している探索結果を定跡データベースに反映する。
+		void Flush(MemoryBook& book) {
+			std::unique_lock<std::shared_mutex> snapshot_lock(snapshot_mutex_);
+			FlushLocked(book);
 		}
 
-		vmd.value = mated_in(0);
-		vmd.depth = 0;
-		// 全合法手について調べる
-		for (const auto& move : MoveList<LEGAL_ALL>(pos)) {
-			StateInfo state_info = {};
-			pos.do_move(move, state_info);
-			if (book.get_body().find(pos.sfen()) != book.get_body().end()) {
-				// 子局面が存在する場合のみ処理する。
-				ValueMoveDepth vmd_child = NegaMax(book, pos, counter);
+		// 保持している探索結果を定跡データベースに反映してから書き出し、ジャーナルを空にする。
+		void Snapshot(MemoryBook& book, const std::string& output_book_file_path) {
+			std::unique_lock<std::shared_mutex> snapshot_lock(snapshot_mutex_);
+			FlushLocked(book);
+			WriteBook(book, output_book_file_path);
+			journal_.Truncate();
+		}
+
+	private:
+		static constexpr int kNumShards = 64;
+
+		struct Shard {
+			std::mutex mutex;
+			std::vector<std::pair<std::string, BookMove>> entries;
+		};
 
-				// 指し手情報に探索の結果を格納する。
-				// 返ってきた評価値は次の局面から見た評価値なので、符号を反転する。
-				// また、探索深さを+1する。
-				UpsertBookMove(book, sfen, move, vmd_child.move, -vmd_child.value, vmd_child.depth + 1, 1);
+		void FlushLocked(MemoryBook& book) {
+			for (auto& shard : shards_) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				for (const auto& entry : shard.entries) {
+					book.insert(entry.first, entry.second);
+				}
+				shard.entries.clear();
 			}
-			pos.undo_move(move);
 		}
 
-		// 現局面について、定跡データベースに子局面への指し手が登録された。
-		// 定跡データベースを調べ、この局面における最適な指し手を調べて返す。
-		auto book_moves = book.get_body().find(sfen);
-		ASSERT_LV3(book_moves != book.get_body().end());
-		for (const auto& book_move : *book_moves->second) {
-			if (vmd.value < book_move.value) {
-				vmd.value = static_cast<Value>(book_move.value);
-				vmd.move = pos.to_move(book_move.move);
-				vmd.depth = book_move.depth;
+		BookJournal& journal_;
+		std::shared_mutex snapshot_mutex_;
+		std::array<Shard, kNumShards> shards_;
+	};
+
+	// output_book_file_pathに対するジャーナルファイルを列挙する。
+	// 複数プロセスで分担した場合は、プロセスごとに"<output_book_file_path>.<worker_name>.journal"が作られる。
+	std::vector<std::filesystem::path> FindJournalFiles(const std::string& output_book_file_path) {
+		std::filesystem::path output_path(output_book_file_path);
+		std::string prefix = output_path.filename().string() + ".";
+		std::string suffix = ".journal";
+		std::filesystem::path folder = output_path.has_parent_path() ? output_path.parent_path() : ".";
+
+		std::vector<std::filesystem::path> journal_file_paths;
+		std::error_code error_code;
+		for (const auto& entry : std::filesystem::directory_iterator(folder, error_code)) {
+			// "<output_book_file_path>.journal"も対象とするため、prefixとsuffixの"."は重なって良い。
+			std::string file_name = entry.path().filename().string();
+			if (file_name.size() >= prefix.size() + suffix.size() - 1 && file_name.compare(0, prefix.size(), prefix) == 0
+				&& file_name.compare(file_name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+				journal_file_paths.push_back(entry.path());
 			}
 		}
+		return journal_file_paths;
+	}
+
+	// output_book_file_pathに対するジャーナルファイルをすべて再生する。
+	// replayed_sfensには、ジャーナルに記録されている局面のsfen文字列を格納する。
+	uint64_t ReplayJournals(MemoryBook& book, const std::string& output_book_file_path,
+		std::unordered_set<std::string>& replayed_sfens) {
+		uint64_t num_moves = 0;
+		for (const auto& journal_file_path : FindJournalFiles(output_book_file_path)) {
+			sync_cout << "Replaying journal file: " << journal_file_path.string() << sync_endl;
+			num_moves += BookJournal(journal_file_path.string()).Replay(book, &replayed_sfens);
+		}
+		return num_moves;
+	}
+
+	// 定跡データベースの末端局面の評価値をroot局面に向けて伝搬する。
+	// bookはその場で書き換える。
+	void PropagateLeafNodeValues(MemoryBook& book) {
+		// やねうら王では先手後手に別々の千日手の評価値を付加している。
+		// ここでは簡単のため、同じ評価値を付加する。
+		BookGraph graph(static_cast<int>(Options["Contempt"] * Eval::PawnValue / 100));
 
-		return vmd;
+		sync_cout << "Building the book graph..." << sync_endl;
+		graph.Build(book);
+
+		sync_cout << "Propagating the values..." << sync_endl;
+		graph.Propagate();
+
+		sync_cout << "Writing back the values..." << sync_endl;
+		graph.WriteBack();
 	}
 }
 
 // 定跡データベースの末端局面の評価値をroot局面に向けて伝搬する
 bool Tanuki::PropagateLeafNodeValuesToRoot() {
+	int num_threads = (int)Options[kThreads];
 	std::string input_book_file = Options[kBookInputFile];
 	std::string output_book_file = Options[kBookOutputFile];
 
+	omp_set_num_threads(num_threads);
+
+	sync_cout << "info string num_threads=" << num_threads << sync_endl;
 	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
 	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
 
-	Search::LimitsType limits;
-	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
-	limits.max_game_ply = 1 << 16;
-	limits.depth = MAX_PLY;
-	limits.silent = true;
-	limits.enteringKingRule = EKR_27_POINT;
-	Search::Limits = limits;
+	SetUpBookSearchLimits();
 
 	MemoryBook book;
 	input_book_file = "book/" + input_book_file;
@@ -801,22 +2089,7 @@ bool Tanuki::PropagateLeafNodeValuesToRoot() {
 	sync_cout << "done..." << sync_endl;
 	sync_cout << "|input_book_file|=" << book.get_body().size() << sync_endl;
 
-	// 平手の局面からたどれる局面について処理する
-	// メモをクリアするのを忘れない
-	memo.clear();
-	auto& pos = Threads[0]->rootPos;
-	StateInfo state_info = {};
-	pos.set_hirate(&state_info, Threads[0]);
-	int counter = 0;
-	NegaMax(book, pos, counter);
-
-	// 平手の局面から辿れなかった局面を処理する
-	for (const auto& book_entry : book.get_body()) {
-		auto& pos = Threads[0]->rootPos;
-		StateInfo state_info = {};
-		pos.set(book_entry.first, &state_info, Threads[0]);
-		NegaMax(book, pos, counter);
-	}
+	PropagateLeafNodeValues(book);
 
 	WriteBook(book, "book/" + output_book_file);
 	sync_cout << "|output_book|=" << book.get_body().size() << sync_endl;
@@ -828,8 +2101,8 @@ namespace {
 	// 与えられた局面における、与えられた指し手が定跡データベースに含まれているかどうかを返す。
 	// 含まれている場合は、その指し手へのポインターを返す。
 	// 含まれていない場合は、nullptrを返す。
-	BookMove* IsBookMoveExist(BookMoveSelector& book, Position& position, Move move) {
-		auto book_moves = book.get_body().find(position);
+	BookMove* IsBookMoveExist(MemoryBook& book, Position& position, Move move) {
+		auto book_moves = book.find(position);
 		if (book_moves == nullptr) {
 			return nullptr;
 		}
@@ -851,7 +2124,7 @@ namespace {
 	// 展開する条件は、
 	// - 定跡データベースに指し手が含まれている、かつ評価値が閾値以上
 	// - 定跡データベースに指し手が含まれていない、かつ次の局面が含まれている
-	bool IsTargetMove(BookMoveSelector& book, Position& position, Move move32, int book_eval_black_limit, int book_eval_white_limit) {
+	bool IsTargetMove(MemoryBook& book, Position& position, Move move32, int book_eval_black_limit, int book_eval_white_limit) {
 		auto book_pos = IsBookMoveExist(book, position, move32);
 		if (book_pos != nullptr) {
 			// 定跡データベースに指し手が含まれている
@@ -861,15 +2134,15 @@ namespace {
 		else {
 			StateInfo state_info = {};
 			position.do_move(move32, state_info);
-			bool exist = book.get_body().get_body().find(position.sfen()) != book.get_body().get_body().end();
+			bool exist = book.get_body().find(position.sfen()) != book.get_body().end();
 			position.undo_move(move32);
 			return exist;
 		}
 	}
 
 	// 与えられた局面を延長すべきかどうか判断する
-	bool IsTargetPosition(BookMoveSelector& book, Position& position, int multi_pv) {
-		auto book_moves = book.get_body().find(position);
+	bool IsTargetPosition(MemoryBook& book, Position& position, int multi_pv) {
+		auto book_moves = book.find(position);
 		if (book_moves == nullptr) {
 			// 定跡データベースに、この局面が登録されていない場合、延長する。
 			return true;
@@ -878,6 +2151,261 @@ namespace {
 		// 登録されている指し手の数が、MultiPVより少ない場合、延長する。
 		return static_cast<int>(book_moves->size()) < multi_pv;
 	}
+
+	// 定跡の延長の対象となる局面を抽出する。
+	// 戻り値の各要素は、平手局面からの指し手をスペース区切りで並べたものとする。
+	// これは、千日手等を認識させるため。
+	std::vector<std::string> CollectTargetPositions(MemoryBook& book, int multi_pv, int book_eval_black_limit, int book_eval_white_limit) {
+		std::vector<std::string> target_positions;
+
+		std::set<std::string> explorered;
+		explorered.insert(SFEN_HIRATE);
+		// 千日手の処理等のため、平手局面からの指し手として保持する
+		// Moveは32ビット版とする
+		std::deque<std::vector<Move>> frontier;
+		frontier.push_back({});
+
+		int counter = 0;
+		std::vector<StateInfo> state_info(1024);
+		while (!frontier.empty()) {
+			if (++counter % 1000 == 0) {
+				sync_cout << counter << sync_endl;
+			}
+
+			auto moves = frontier.front();
+			Position& position = Threads[0]->rootPos;
+			position.set_hirate(&state_info[0], Threads[0]);
+			// 現局面まで指し手を進める
+			for (auto move : moves) {
+				position.do_move(move, state_info[position.game_ply()]);
+			}
+			frontier.pop_front();
+
+			// 千日手の局面は処理しない
+			auto draw_type = position.is_repetition(MAX_PLY);
+			if (draw_type == REPETITION_DRAW) {
+				continue;
+			}
+
+			// 詰み、宣言勝ちの局面も処理しない
+			if (position.is_mated() || position.DeclarationWin() != MOVE_NONE) {
+				continue;
+			}
+
+			if (IsTargetPosition(book, position, multi_pv)) {
+				// 対象の局面を追加する。
+				std::ostringstream oss;
+				for (auto m : moves) {
+					oss << m << " ";
+				}
+				target_positions.push_back(oss.str());
+			}
+
+			// 子局面を展開する
+			for (const auto& move : MoveList<LEGAL_ALL>(position)) {
+				if (!position.pseudo_legal(move) || !position.legal(move)) {
+					// 不正な手の場合は処理しない
+					continue;
+				}
+
+				if (!IsTargetMove(book, position, move, book_eval_black_limit, book_eval_white_limit)) {
+					// この指し手の先の局面は処理しない。
+					continue;
+				}
+
+				position.do_move(move, state_info[position.game_ply()]);
+
+				// undo_move()を呼び出す必要があるので、continueとbreakを禁止する。
+				if (!explorered.count(position.sfen())) {
+					explorered.insert(position.sfen());
+
+					moves.push_back(move);
+					frontier.push_back(moves);
+					moves.pop_back();
+				}
+
+				position.undo_move(move);
+			}
+		}
+
+		return target_positions;
+	}
+
+	// 対象の局面を探索し、結果を定跡データベースに登録する。
+	// linesの各要素は、平手局面からの指し手をスペース区切りで並べたもの、または"sfen "で始まる局面とする。
+	// 探索結果はジャーナルに追記し、処理の最後に定跡データベースに反映する。
+	// completed_sfensに含まれる局面は、前回までに処理済みとして読み飛ばす。
+	// snapshot_book_fileが空でない場合、一定時間ごとに定跡データベース全体を書き出し、ジャーナルを空にする。
+	void SearchTargetPositions(MemoryBook& book, const std::vector<std::string>& lines, int search_depth, int search_nodes,
+		int multi_pv, BookJournal& journal, BookJobScheduler& scheduler,
+		const std::unordered_set<std::string>& completed_sfens, const std::string& snapshot_book_file) {
+		int num_positions = static_cast<int>(lines.size());
+
+		Tanuki::ProgressReport progress_report(num_positions, kShowProgressPerAtMostSec);
+		time_t last_save_time_sec = std::time(nullptr);
+		BookResultWriter writer(journal);
+
+		std::atomic<bool> paused = false;
+		std::atomic_int global_num_processed_positions;
+		global_num_processed_positions = 0;
+
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			WinProcGroup::bindThisThread(thread_index);
+
+			int position_index;
+			while (scheduler.Pop(thread_index, position_index)) {
+				Thread& thread = *Threads[thread_index];
+				std::vector<StateInfo> state_info(1024);
+				Position& pos = thread.rootPos;
+
+				const std::string& line = lines[position_index];
+				std::string sfen;
+				if (line.compare(0, 5, "sfen ") == 0) {
+					sfen = line.substr(5);
+					pos.set(sfen, &state_info[0], &thread);
+				}
+				else {
+					pos.set_hirate(&state_info[0], &thread);
+					std::istringstream iss(line);
+					std::string move_string;
+					while (iss >> move_string) {
+						Move16 move16 = USI::to_move16(move_string);
+						Move move = pos.to_move(move16);
+						pos.do_move(move, state_info[pos.game_ply()]);
+					}
+					sfen = pos.sfen();
+				}
+
+				if (pos.is_mated() || completed_sfens.count(sfen)) {
+					scheduler.Done(position_index);
+					continue;
+				}
+
+				Learner::search(pos, search_depth, multi_pv, search_nodes);
+
+				std::vector<BookMove> book_moves;
+				int num_pv = std::min(multi_pv, static_cast<int>(thread.rootMoves.size()));
+				for (int pv_index = 0; pv_index < num_pv; ++pv_index) {
+					const auto& root_move = thread.rootMoves[pv_index];
+					Move best = Move::MOVE_NONE;
+					if (root_move.pv.size() >= 1) {
+						best = root_move.pv[0];
+					}
+					Move next = Move::MOVE_NONE;
+					if (root_move.pv.size() >= 2) {
+						next = root_move.pv[1];
+					}
+					int value = root_move.score;
+					book_moves.emplace_back(Move16(best), Move16(next), value, thread.completedDepth, 1);
+				}
+
+				if (!book_moves.empty()) {
+					writer.Record(sfen, book_moves);
+				}
+				scheduler.Done(position_index);
+
+				int num_processed_positions = ++global_num_processed_positions;
+				// 念のため、I/Oはマスタースレッドでのみ行う
+#pragma omp master
+				{
+					// 進捗状況を表示する
+					progress_report.Show(num_processed_positions);
+
+					// 一定時間ごとに保存する
+					if (!snapshot_book_file.empty() && last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
+						writer.Snapshot(book, snapshot_book_file);
+						last_save_time_sec = std::time(nullptr);
+					}
+				}
+
+				// 処理速度が低下してきている場合は、最初に気づいたスレッドがしばらく待機し、
+				// その間は他のスレッドも次の局面に進まずに待機する。
+				// ジョブの取り出しは動的で、各スレッドのループ回数がそろわないため、omp barrierは使わない。
+				bool need_wait = progress_report.HasDataPerTime() &&
+					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime();
+				bool expected = false;
+				if (need_wait && paused.compare_exchange_strong(expected, true)) {
+					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
+						progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
+						progress_report.GetMaxDataPerTime() << sync_endl;
+
+					std::this_thread::sleep_for(std::chrono::minutes(10));
+					progress_report.Reset();
+					paused = false;
+				}
+				while (paused) {
+					std::this_thread::sleep_for(std::chrono::seconds(1));
+				}
+
+				// 置換表の世代を進める
+				Threads[thread_index]->tt.new_search();
+			}
+		}
+
+		writer.Flush(book);
+	}
+
+	// 対象の局面を探索し、結果をoutput_book_file_pathに書き出す。
+	// AddTargetPositions()とCreateScoredBook()から用いる。
+	// 前回異常終了した場合は、ジャーナルに記録されている局面を読み飛ばして再開する。
+	// coordinator_folderが空でない場合、同じフォルダを指定した複数のプロセスで分担し、
+	// 最後にすべてのジョブを終えたプロセスが、全プロセスのジャーナルを反映した定跡データベースを書き出す。
+	bool RunBookJobs(MemoryBook& output_book, const std::vector<std::string>& lines, int search_depth, int search_nodes,
+		int multi_pv, const std::string& output_book_file_path, const std::string& coordinator_folder,
+		const std::string& worker_name) {
+		BookJobScheduler scheduler(static_cast<int>(lines.size()), omp_get_max_threads(), coordinator_folder, worker_name);
+		if (!scheduler.Open()) {
+			return false;
+		}
+
+		// 前回までの処理結果をジャーナルから復元する
+		std::unordered_set<std::string> completed_sfens;
+		uint64_t num_replayed_moves = ReplayJournals(output_book, output_book_file_path, completed_sfens);
+		sync_cout << "|replayed_moves|=" << num_replayed_moves << " |completed_positions|=" << completed_sfens.size()
+			<< " |output_book|=" << output_book.get_body().size() << sync_endl;
+
+		std::string journal_file_path = scheduler.IsDistributed()
+			? output_book_file_path + "." + scheduler.worker_name() + ".journal"
+			: output_book_file_path + ".journal";
+		BookJournal journal(journal_file_path);
+		if (!journal.Open()) {
+			return false;
+		}
+
+		// 複数プロセスで分担する場合、定跡データベースの書き出しは最後に1回だけ行う。
+		SearchTargetPositions(output_book, lines, search_depth, search_nodes, multi_pv, journal, scheduler,
+			completed_sfens, scheduler.IsDistributed() ? "" : output_book_file_path);
+
+		if (!scheduler.IsDistributed()) {
+			WriteBook(output_book, output_book_file_path);
+			journal.Truncate();
+			return true;
+		}
+
+		if (!scheduler.AllDone() || !scheduler.TryClaimMerge()) {
+			sync_cout << "The output book will be written by another worker." << sync_endl;
+			return true;
+		}
+
+		// すべてのプロセスのジャーナルを反映する。
+		// output_bookには自プロセスの結果が反映済みなので、読み込み直してから再生する。
+		MemoryBook merged_book;
+		merged_book.read_book(output_book_file_path);
+		completed_sfens.clear();
+		ReplayJournals(merged_book, output_book_file_path, completed_sfens);
+		WriteBook(merged_book, output_book_file_path);
+
+		journal.Close();
+		std::error_code error_code;
+		for (const auto& journal_file_path : FindJournalFiles(output_book_file_path)) {
+			std::filesystem::remove(journal_file_path, error_code);
+		}
+		scheduler.Cleanup();
+
+		return true;
+	}
 }
 
 // 定跡の延長の対象となる局面を抽出する。
@@ -897,98 +2425,81 @@ bool Tanuki::ExtractTargetPositions() {
 	sync_cout << "info string book_eval_white_limit=" << book_eval_white_limit << sync_endl;
 	sync_cout << "info string target_sfens_file=" << sync_endl;
 
-	Search::LimitsType limits;
-	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
-	limits.max_game_ply = 1 << 16;
-	limits.depth = MAX_PLY;
-	limits.silent = true;
-	limits.enteringKingRule = EKR_27_POINT;
-	Search::Limits = limits;
+	SetUpBookSearchLimits();
 
-	BookMoveSelector book;
+	MemoryBook book;
 	input_book_file = "book/" + input_book_file;
 	sync_cout << "Reading input book file: " << input_book_file << sync_endl;
-	book.get_body().read_book(input_book_file);
+	book.read_book(input_book_file);
 	sync_cout << "done..." << sync_endl;
-	sync_cout << "|input_book_file|=" << book.get_body().get_body().size() << sync_endl;
+	sync_cout << "|input_book_file|=" << book.get_body().size() << sync_endl;
 
-	std::set<std::string> explorered;
-	explorered.insert(SFEN_HIRATE);
-	// 千日手の処理等のため、平手局面からの指し手として保持する
-	// Moveは32ビット版とする
-	std::deque<std::vector<Move>> frontier;
-	frontier.push_back({});
+	auto target_positions = CollectTargetPositions(book, multi_pv, book_eval_black_limit, book_eval_white_limit);
 
 	std::ofstream ofs(target_sfens_file);
+	for (const auto& target_position : target_positions) {
+		ofs << target_position << std::endl;
+	}
 
-	int counter = 0;
-	std::vector<StateInfo> state_info(1024);
-	while (!frontier.empty()) {
-		if (++counter % 1000 == 0) {
-			sync_cout << counter << sync_endl;
-		}
-
-		auto moves = frontier.front();
-		Position& position = Threads[0]->rootPos;
-		position.set_hirate(&state_info[0], Threads[0]);
-		// 現局面まで指し手を進める
-		for (auto move : moves) {
-			position.do_move(move, state_info[position.game_ply()]);
-		}
-		frontier.pop_front();
-
-		// 千日手の局面は処理しない
-		auto draw_type = position.is_repetition(MAX_PLY);
-		if (draw_type == REPETITION_DRAW) {
-			continue;
-		}
-
-		// 詰み、宣言勝ちの局面も処理しない
-		if (position.is_mated() || position.DeclarationWin() != MOVE_NONE) {
-			continue;
-		}
+	sync_cout << "done..." << sync_endl;
 
-		if (IsTargetPosition(book, position, multi_pv)) {
-			// 対象の局面を書き出す。
-			// 形式はmoveをスペース区切りで並べたものとする。
-			// これは、千日手等を認識させるため。
+	return true;
+}
 
-			for (auto m : moves) {
-				ofs << m << " ";
-			}
-			ofs << std::endl;
-		}
+bool Tanuki::CreateScoredBook() {
+	int num_threads = (int)Options[kThreads];
+	std::string input_book_file = Options[kBookInputFile];
+	int search_depth = (int)Options[kBookSearchDepth];
+	int search_nodes = (int)Options[kBookSearchNodes];
+	int multi_pv = (int)Options[kMultiPV];
+	std::string output_book_file = Options[kBookOutputFile];
+	bool overwrite_existing_positions = static_cast<bool>(Options[kBookOverwriteExistingPositions]);
+	std::string coordinator_folder = Options[kBookCoordinatorFolder];
+	std::string worker_name = Options[kBookWorkerName];
 
-		// 子局面を展開する
-		for (const auto& move : MoveList<LEGAL_ALL>(position)) {
-			if (!position.pseudo_legal(move) || !position.legal(move)) {
-				// 不正な手の場合は処理しない
-				continue;
-			}
+	omp_set_num_threads(num_threads);
 
-			if (!IsTargetMove(book, position, move, book_eval_black_limit, book_eval_white_limit)) {
-				// この指し手の先の局面は処理しない。
-				continue;
-			}
+	sync_cout << "info string num_threads=" << num_threads << sync_endl;
+	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
+	sync_cout << "info string search_depth=" << search_depth << sync_endl;
+	sync_cout << "info string search_nodes=" << search_nodes << sync_endl;
+	sync_cout << "info string multi_pv=" << multi_pv << sync_endl;
+	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+	sync_cout << "info string overwrite_existing_positions=" << overwrite_existing_positions
+		<< sync_endl;
+	sync_cout << "info string coordinator_folder=" << coordinator_folder << sync_endl;
+	sync_cout << "info string worker_name=" << worker_name << sync_endl;
 
-			position.do_move(move, state_info[position.game_ply()]);
+	SetUpBookSearchLimits();
 
-			// undo_move()を呼び出す必要があるので、continueとbreakを禁止する。
-			if (!explorered.count(position.sfen())) {
-				explorered.insert(position.sfen());
+	MemoryBook input_book;
+	input_book_file = "book/" + input_book_file;
+	sync_cout << "Reading input book file: " << input_book_file << sync_endl;
+	input_book.read_book(input_book_file);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|input_book|=" << input_book.get_body().size() << sync_endl;
 
-				moves.push_back(move);
-				frontier.push_back(moves);
-				moves.pop_back();
-			}
+	MemoryBook output_book;
+	output_book_file = "book/" + output_book_file;
+	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
+	output_book.read_book(output_book_file);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|output_book|=" << output_book.get_body().size() << sync_endl;
 
-			position.undo_move(move);
+	std::vector<std::string> sfens;
+	for (const auto& sfen_and_count : input_book.get_body()) {
+		if (!overwrite_existing_positions &&
+			output_book.get_body().find(sfen_and_count.first) != output_book.get_body().end()) {
+			continue;
 		}
+		sfens.push_back("sfen " + sfen_and_count.first);
 	}
+	// 複数プロセスで分担する場合に、ジョブの順番をプロセス間で一致させるため、並び替えておく。
+	std::sort(sfens.begin(), sfens.end());
+	sync_cout << "Number of the positions to be processed: " << sfens.size() << sync_endl;
 
-	sync_cout << "done..." << sync_endl;
-
-	return true;
+	return RunBookJobs(output_book, sfens, search_depth, search_nodes, multi_pv, output_book_file, coordinator_folder,
+		worker_name);
 }
 
 bool Tanuki::AddTargetPositions() {
@@ -999,6 +2510,8 @@ bool Tanuki::AddTargetPositions() {
 	int multi_pv = (int)Options[kMultiPV];
 	std::string output_book_file = Options[kBookOutputFile];
 	std::string target_sfens_file = Options[kBookTargetSfensFile];
+	std::string coordinator_folder = Options[kBookCoordinatorFolder];
+	std::string worker_name = Options[kBookWorkerName];
 
 	omp_set_num_threads(num_threads);
 
@@ -1009,14 +2522,10 @@ bool Tanuki::AddTargetPositions() {
 	sync_cout << "info string multi_pv=" << multi_pv << sync_endl;
 	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
 	sync_cout << "info string target_sfens_file=" << sync_endl;
+	sync_cout << "info string coordinator_folder=" << coordinator_folder << sync_endl;
+	sync_cout << "info string worker_name=" << worker_name << sync_endl;
 
-	Search::LimitsType limits;
-	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
-	limits.max_game_ply = 1 << 16;
-	limits.depth = MAX_PLY;
-	limits.silent = true;
-	limits.enteringKingRule = EKR_27_POINT;
-	Search::Limits = limits;
+	SetUpBookSearchLimits();
 
 	MemoryBook input_book;
 	input_book_file = "book/" + input_book_file;
@@ -1040,108 +2549,126 @@ bool Tanuki::AddTargetPositions() {
 	while (std::getline(ifs, line)) {
 		lines.push_back(line);
 	}
-	int num_positions = static_cast<int>(lines.size());
 	sync_cout << "done..." << sync_endl;
-	sync_cout << "|lines|=" << num_positions << sync_endl;
+	sync_cout << "|lines|=" << lines.size() << sync_endl;
 
-	ProgressReport progress_report(num_positions, kShowProgressPerAtMostSec);
-	time_t last_save_time_sec = std::time(nullptr);
+	return RunBookJobs(output_book, lines, search_depth, search_nodes, multi_pv, output_book_file, coordinator_folder,
+		worker_name);
+}
 
-	std::atomic<bool> need_wait = false;
-	std::atomic_int global_pos_index;
-	global_pos_index = 0;
-	std::atomic_int global_num_processed_positions;
-	global_num_processed_positions = 0;
+// ExtractTargetPositions()、AddTargetPositions()、PropagateLeafNodeValuesToRoot()を無限に繰り返す。
+// 定跡データベースはメモリ上に1つだけ保持し、3つの処理で共有する。
+// AddTargetPositions()で登録した指し手はジャーナルに追記し、
+// 一定時間ごとにスナップショットとしてBookOutputFileに書き出したうえでジャーナルを空にする。
+// 再開時はBookOutputFile(存在しない場合はBookInputFile)を読み込み、ジャーナルを再生する。
+bool Tanuki::EndlessTeraShock() {
+	int num_threads = (int)Options[kThreads];
+	std::string input_book_file = Options[kBookInputFile];
+	std::string output_book_file = Options[kBookOutputFile];
+	int search_depth = (int)Options[kBookSearchDepth];
+	int search_nodes = (int)Options[kBookSearchNodes];
+	int multi_pv = (int)Options[kMultiPV];
+	int book_eval_black_limit = (int)Options["BookEvalBlackLimit"];
+	int book_eval_white_limit = (int)Options["BookEvalWhiteLimit"];
 
-#pragma omp parallel
-	{
-		int thread_index = ::omp_get_thread_num();
-		WinProcGroup::bindThisThread(thread_index);
+	omp_set_num_threads(num_threads);
 
-		for (int position_index = global_pos_index++; position_index < num_positions;
-			position_index = global_pos_index++) {
-			Thread& thread = *Threads[thread_index];
-			std::vector<StateInfo> state_info(1024);
-			Position& pos = thread.rootPos;
-			pos.set_hirate(&state_info[0], &thread);
+	sync_cout << "info string num_threads=" << num_threads << sync_endl;
+	sync_cout << "info string input_book_file=" << input_book_file << sync_endl;
+	sync_cout << "info string output_book_file=" << output_book_file << sync_endl;
+	sync_cout << "info string search_depth=" << search_depth << sync_endl;
+	sync_cout << "info string search_nodes=" << search_nodes << sync_endl;
+	sync_cout << "info string multi_pv=" << multi_pv << sync_endl;
+	sync_cout << "info string book_eval_black_limit=" << book_eval_black_limit << sync_endl;
+	sync_cout << "info string book_eval_white_limit=" << book_eval_white_limit << sync_endl;
 
-			std::istringstream iss(lines[position_index]);
-			std::string move_string;
-			while (iss >> move_string) {
-				Move16 move16 = USI::to_move16(move_string);
-				Move move = pos.to_move(move16);
-				pos.do_move(move, state_info[pos.game_ply()]);
-			}
+	SetUpBookSearchLimits();
 
-			if (pos.is_mated()) {
-				continue;
-			}
+	std::string input_book_file_path = "book/" + input_book_file;
+	std::string output_book_file_path = "book/" + output_book_file;
+	std::string journal_file_path = output_book_file_path + ".journal";
 
-			Learner::search(pos, search_depth, multi_pv, search_nodes);
+	// スナップショットを読み込む
+	MemoryBook book;
+	std::string snapshot_file_path =
+		std::filesystem::exists(output_book_file_path) ? output_book_file_path : input_book_file_path;
+	sync_cout << "Reading snapshot book file: " << snapshot_file_path << sync_endl;
+	book.read_book(snapshot_file_path);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|book|=" << book.get_body().size() << sync_endl;
 
-			int num_pv = std::min(multi_pv, static_cast<int>(thread.rootMoves.size()));
-			for (int pv_index = 0; pv_index < num_pv; ++pv_index) {
-				const auto& root_move = thread.rootMoves[pv_index];
-				Move best = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 1) {
-					best = root_move.pv[0];
-				}
-				Move next = Move::MOVE_NONE;
-				if (root_move.pv.size() >= 2) {
-					next = root_move.pv[1];
-				}
-				int value = root_move.score;
-				UpsertBookMove(output_book, pos.sfen(), best, next, value, thread.completedDepth, 1);
-			}
+	// 前回異常終了した際の処理結果をジャーナルから復元する
+	BookJournal journal(journal_file_path);
+	sync_cout << "Replaying journal file: " << journal_file_path << sync_endl;
+	uint64_t num_replayed_moves = journal.Replay(book);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|replayed_moves|=" << num_replayed_moves << " |book|=" << book.get_body().size() << sync_endl;
 
-			int num_processed_positions = ++global_num_processed_positions;
-			// 念のため、I/Oはマスタースレッドでのみ行う
-#pragma omp master
-			{
-				// 進捗状況を表示する
-				progress_report.Show(num_processed_positions);
+	if (!journal.Open()) {
+		return false;
+	}
 
-				// 一定時間ごとに保存する
-				{
-					std::lock_guard<std::mutex> lock(UPSERT_BOOK_MOVE_MUTEX);
-					if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-						WriteBook(output_book, output_book_file);
-						last_save_time_sec = std::time(nullptr);
-					}
-				}
-			}
+	if (num_replayed_moves > 0) {
+		// ジャーナルの内容は伝搬前の値のため、抽出の前に伝搬しておく
+		sync_cout << "PropagateLeafNodeValuesToRoot" << sync_endl;
+		PropagateLeafNodeValues(book);
+	}
 
-			need_wait = need_wait ||
-				(progress_report.HasDataPerTime() &&
-					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
+	// スナップショットを書き出し、ジャーナルを空にする。
+	// BookKeepSnapshotHistoryがtrueの場合、後から遡れるよう時刻付きのファイル名のコピーも残す。
+	// コピーはジャーナルを空にしたあとに行い、スナップショットとジャーナルが重複する時間を短くする。
+	bool keep_snapshot_history = Options[kBookKeepSnapshotHistory];
+	auto save_snapshot = [&]() {
+		WriteBook(book, output_book_file_path);
+		journal.Truncate();
 
-			if (need_wait) {
-				// 処理速度が低下してきている。
-				// 全てのスレッドを待機する。
-#pragma omp barrier
+		if (!keep_snapshot_history) {
+			return;
+		}
+		std::string history_file_path =
+			output_book_file_path + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+		std::error_code error_code;
+		std::filesystem::copy_file(output_book_file_path, history_file_path, error_code);
+		if (error_code) {
+			sync_cout << "info string Failed to copy the snapshot. history_file_path=" << history_file_path
+				<< " error=" << error_code.message() << sync_endl;
+		}
+	};
 
-				// マスタースレッドでしばらく待機する。
-#pragma omp master
-				{
-					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
-						progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
-						progress_report.GetMaxDataPerTime() << sync_endl;
+	time_t last_save_time_sec = std::time(nullptr);
+	for (int iteration = 0;; ++iteration) {
+		sync_cout << "iteration=" << iteration << sync_endl;
+
+		sync_cout << "ExtractTargetPositions" << sync_endl;
+		auto target_positions = CollectTargetPositions(book, multi_pv, book_eval_black_limit, book_eval_white_limit);
+		sync_cout << "|target_positions|=" << target_positions.size() << sync_endl;
+		if (target_positions.empty()) {
+			// 延長すべき局面がなくなった場合、以降の処理で定跡データベースは変化しない。
+			sync_cout << "No target positions. Finishing..." << sync_endl;
+			break;
+		}
 
-					std::this_thread::sleep_for(std::chrono::minutes(10));
-					progress_report.Reset();
-					need_wait = false;
-				}
+		sync_cout << "AddTargetPositions" << sync_endl;
+		BookJobScheduler scheduler(static_cast<int>(target_positions.size()), num_threads, "", "");
+		SearchTargetPositions(book, target_positions, search_depth, search_nodes, multi_pv, journal, scheduler,
+			std::unordered_set<std::string>(), "");
+		sync_cout << "|book|=" << book.get_body().size() << sync_endl;
 
-				// マスタースレッドの待機が終わるまで、再度全てのスレッドを待機する。
-#pragma omp barrier
-			}
+		sync_cout << "PropagateLeafNodeValuesToRoot" << sync_endl;
+		PropagateLeafNodeValues(book);
 
-			// 置換表の世代を進める
-			Threads[thread_index]->tt.new_search();
+		// 一定時間ごとにスナップショットを書き出し、ジャーナルを空にする。
+		// スナップショットの書き出し後、ジャーナルを空にする前に異常終了した場合は、
+		// BookJournal::Replay()が既存の指し手の採択回数を合算しないため、二重には数えない。
+		if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
+			save_snapshot();
+			last_save_time_sec = std::time(nullptr);
 		}
+
+		TT.new_search();
 	}
 
-	WriteBook(output_book, output_book_file);
+	save_snapshot();
 
 	return true;
 }
@@ -1253,186 +2780,56 @@ bool Tanuki::CreateFromTanukiColiseum()
 						// 後手勝ち
 						winner_offset = 1;
 					}
-					else {
-						// 先手勝ち
-						winner_offset = 0;
-					}
-					break;
-				}
-				else if (repetition == REPETITION_DRAW) {
-					// 連続王手ではない普通の千日手
-					break;
-				}
-				else if (repetition == REPETITION_SUPERIOR) {
-					// 優等局面(盤上の駒が同じで手駒が相手より優れている)
-					if (moves.size() % 2 == 0) {
-						// 先手勝ち
-						winner_offset = 0;
-					}
-					else {
-						// 後手勝ち
-						winner_offset = 1;
-					}
-					break;
-				}
-				else if (repetition == REPETITION_INFERIOR) {
-					// 劣等局面(盤上の駒が同じで手駒が相手より優れている)
-					if (moves.size() % 2 == 0) {
-						// 後手勝ち
-						winner_offset = 1;
-					}
-					else {
-						// 先手勝ち
-						winner_offset = 0;
-					}
-					break;
-				}
-			}
-
-			if (winner_offset == -1) {
-				continue;
-			}
-
-			for (int move_index = winner_offset; move_index < static_cast<int>(moves.size()); move_index += 2) {
-				const auto& sfen = moves[move_index].first;
-				Move16 best = moves[move_index].second;
-				Move16 next = MOVE_NONE;
-				if (move_index + 1 < static_cast<int>(moves.size())) {
-					next = moves[move_index + 1].second;
-				}
-
-				output_book.insert(sfen, BookMove(best, next, 0, 0, 1));
-			}
-		}
-	}
-
-	WriteBook(output_book, output_book_file);
-
-	return true;
-}
-
-bool Tanuki::Create18Book() {
-	std::string csa_folder = Options[kBookCsaFolder];
-	std::string output_book_file = Options[kBookOutputFile];
-	int minimum_rating = static_cast<int>(Options[kBookMinimumRating]);
-
-	MemoryBook output_book;
-	output_book_file = "book/" + output_book_file;
-	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
-	output_book.read_book(output_book_file);
-	sync_cout << "done..." << sync_endl;
-	sync_cout << "|output_book|=" << output_book.get_body().size() << sync_endl;
-
-	std::vector<Player> strong_players;
-	if (!ReadStrongPlayers(strong_players)) {
-		sync_cout << "Failed to read the player list." << sync_endl;
-		return false;
-	}
-
-	int num_records = 0;
-	for (const std::filesystem::directory_entry& entry :
-		std::filesystem::recursive_directory_iterator(csa_folder)) {
-		auto& file_path = entry.path();
-		if (file_path.extension() != ".csa") {
-			// 拡張子が .csa でなかったらスキップする。
-			continue;
-		}
-
-		if (std::count_if(strong_players.begin(), strong_players.end(),
-			[&file_path, minimum_rating](const auto& strong_player) {
-				// レーティングが低いソフトの棋譜は使用しない。
-				if (strong_player.rate < minimum_rating) {
-					return false;
-				}
-
-				return file_path.string().find("+" + strong_player.name + "+") != std::string::npos;
-			}) != 2) {
-			// 強いプレイヤー同士の対局でなかったらスキップする。
-			continue;
-		}
-
-		if (++num_records % 1000 == 0) {
-			sync_cout << num_records << sync_endl;
-		}
-
-		auto& pos = Threads[0]->rootPos;
-		StateInfo state_info[512];
-		pos.set_hirate(&state_info[0], Threads[0]);
-
-		FILE* file = std::fopen(file_path.string().c_str(), "r");
-
-		if (file == nullptr) {
-			std::cout << "!!! Failed to open the input file: filepath=" << file_path << std::endl;
-			continue;
-		}
-
-		bool toryo = false;
-		std::string black_player_name;
-		std::string white_player_name;
-		std::vector<Move> moves;
-		int winner_offset = 0;
-		char buffer[1024];
-		while (std::fgets(buffer, sizeof(buffer) - 1, file)) {
-			std::string line = buffer;
-			// std::fgets()の出力は行末の改行を含むため、ここで削除する。
-			while (!line.empty() && std::isspace(line.back())) {
-				line.pop_back();
-			}
-
-			auto offset = line.find(',');
-			if (offset != std::string::npos) {
-				// 将棋所の出力するCSAの指し手の末尾に",T1"などとつくため
-				// ","以降を削除する
-				line = line.substr(0, offset);
-			}
-
-			if (line.find("N+") == 0) {
-				black_player_name = line.substr(2);
-			}
-			else if (line.find("N-") == 0) {
-				white_player_name = line.substr(2);
-			}
-			else if (line.size() == 7 && (line[0] == '+' || line[0] == '-')) {
-				Move move = CSA::to_move(pos, line.substr(1));
-
-				if (!pos.pseudo_legal(move) || !pos.legal(move)) {
-					std::cout << "!!! Found an illegal move." << std::endl;
+					else {
+						// 先手勝ち
+						winner_offset = 0;
+					}
+					break;
+				}
+				else if (repetition == REPETITION_DRAW) {
+					// 連続王手ではない普通の千日手
+					break;
+				}
+				else if (repetition == REPETITION_SUPERIOR) {
+					// 優等局面(盤上の駒が同じで手駒が相手より優れている)
+					if (moves.size() % 2 == 0) {
+						// 先手勝ち
+						winner_offset = 0;
+					}
+					else {
+						// 後手勝ち
+						winner_offset = 1;
+					}
+					break;
+				}
+				else if (repetition == REPETITION_INFERIOR) {
+					// 劣等局面(盤上の駒が同じで手駒が相手より優れている)
+					if (moves.size() % 2 == 0) {
+						// 後手勝ち
+						winner_offset = 1;
+					}
+					else {
+						// 先手勝ち
+						winner_offset = 0;
+					}
 					break;
 				}
-
-				pos.do_move(move, state_info[pos.game_ply()]);
-
-				moves.push_back(move);
-			}
-			else if (line.find(black_player_name + " win") != std::string::npos) {
-				winner_offset = 0;
-			}
-			else if (line.find(white_player_name + " win") != std::string::npos) {
-				winner_offset = 1;
 			}
 
-			if (line.find("toryo") != std::string::npos) {
-				toryo = true;
+			if (winner_offset == -1) {
+				continue;
 			}
-		}
 
-		std::fclose(file);
-		file = nullptr;
-
-		// 投了以外の棋譜はスキップする
-		if (!toryo) {
-			continue;
-		}
-
-		pos.set_hirate(&state_info[0], Threads[0]);
+			for (int move_index = winner_offset; move_index < static_cast<int>(moves.size()); move_index += 2) {
+				const auto& sfen = moves[move_index].first;
+				Move16 best = moves[move_index].second;
+				Move16 next = MOVE_NONE;
+				if (move_index + 1 < static_cast<int>(moves.size())) {
+					next = moves[move_index + 1].second;
+				}
 
-		for (int play = 0; play < static_cast<int>(moves.size()); ++play) {
-			Move move = moves[play];
-			if (play % 2 == winner_offset) {
-				Move ponder = (play + 1 < static_cast<int>(moves.size())) ? moves[play + 1] : Move::MOVE_NONE;
-				output_book.insert(pos.sfen(), Book::BookMove(move, ponder, 0, 0, 1));
+				output_book.insert(sfen, BookMove(best, next, 0, 0, 1));
 			}
-			pos.do_move(move, state_info[pos.game_ply()]);
 		}
 	}
 
@@ -1456,139 +2853,453 @@ namespace {
 	};
 	using InternalBook = std::map<std::string, std::map<u16 /* Move16 */, InternalBookMove>>;
 
-	bool ReadCsaFile(const std::string& file_path, std::vector<Move>& moves, bool& toryo, int& winner_offset) {
-		auto& pos = Threads[0]->rootPos;
-		StateInfo state_info[512];
-		pos.set_hirate(&state_info[0], Threads[0]);
-
-		FILE* file = std::fopen(file_path.c_str(), "r");
-
-		if (file == nullptr) {
-			std::cout << "!!! Failed to open the input file: filepath=" << file_path << std::endl;
-			return false;
-		}
+	// CSA形式の棋譜1局分
+	struct CsaGame {
+		std::vector<Move> moves;
+		// 投了で終わった対局かどうか
+		bool toryo = false;
+		// 先手が勝った場合は0、後手が勝った場合は1
+		int winner_offset = 0;
+	};
 
-		std::string black_player_name;
-		std::string white_player_name;
-		char buffer[1024];
-		while (std::fgets(buffer, sizeof(buffer) - 1, file)) {
-			std::string line = buffer;
-			// std::fgets()の出力は行末の改行を含むため、ここで削除する。
-			while (!line.empty() && std::isspace(line.back())) {
-				line.pop_back();
+	// 解析済みの棋譜のキャッシュファイルの1要素
+	// ファイルのサイズと更新日時が一致している場合、ファイルを読み直さずに解析結果を用いる。
+	struct CsaGameCacheEntry {
+		u64 file_size = 0;
+		s64 last_write_time = 0;
+		CsaGame game;
+	};
+	using CsaGameCache = std::unordered_map<std::string, CsaGameCacheEntry>;
+
+	constexpr char kCsaGameCacheMagic[8] = { 'T','N','K','C','S','A','C','1' };
+
+	// CSA形式の棋譜の文字列を解析する。
+	// 1行ごとにstd::stringを作らないよう、std::string_viewで行を切り出して処理する。
+	// posは平手の開始局面から指し手を進めるために用いる。
+	void ParseCsaText(std::string_view text, Position& pos, CsaGame& game) {
+		std::deque<StateInfo> state_info(1);
+		pos.set_hirate(&state_info.back(), pos.this_thread());
+
+		game = CsaGame();
+		std::string black_win = " win";
+		std::string white_win = " win";
+		while (!text.empty()) {
+			auto end = text.find('\n');
+			std::string_view line = text.substr(0, end);
+			text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+			// 行末の改行を削除する。
+			while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+				line.remove_suffix(1);
 			}
 
 			auto offset = line.find(',');
-			if (offset != std::string::npos) {
+			if (offset != std::string_view::npos) {
 				// 将棋所の出力するCSAの指し手の末尾に",T1"などとつくため
 				// ","以降を削除する
 				line = line.substr(0, offset);
 			}
 
-			if (line.find("N+") == 0) {
-				black_player_name = line.substr(2);
+			if (line.compare(0, 2, "N+") == 0) {
+				black_win = std::string(line.substr(2)) + " win";
 			}
-			else if (line.find("N-") == 0) {
-				white_player_name = line.substr(2);
+			else if (line.compare(0, 2, "N-") == 0) {
+				white_win = std::string(line.substr(2)) + " win";
 			}
 			else if (line.size() == 7 && (line[0] == '+' || line[0] == '-')) {
-				Move move = CSA::to_move(pos, line.substr(1));
+				Move move = CSA::to_move(pos, std::string(line.substr(1)));
 
 				if (!pos.pseudo_legal(move) || !pos.legal(move)) {
 					std::cout << "!!! Found an illegal move." << std::endl;
 					break;
 				}
 
-				pos.do_move(move, state_info[pos.game_ply()]);
+				state_info.emplace_back();
+				pos.do_move(move, state_info.back());
 
-				moves.push_back(move);
+				game.moves.push_back(move);
 			}
-			else if (line.find(black_player_name + " win") != std::string::npos) {
-				winner_offset = 0;
+			else if (line.find(black_win) != std::string_view::npos) {
+				game.winner_offset = 0;
 			}
-			else if (line.find(white_player_name + " win") != std::string::npos) {
-				winner_offset = 1;
+			else if (line.find(white_win) != std::string_view::npos) {
+				game.winner_offset = 1;
 			}
 
-			if (line.find("toryo") != std::string::npos) {
-				toryo = true;
+			if (line.find("toryo") != std::string_view::npos) {
+				game.toryo = true;
 			}
 		}
+	}
+
+	// CSA形式の棋譜ファイルを読み込む。
+	// bufferはファイルの内容を読み込むために用いる。呼び出し側で使い回すことで、メモリの確保を減らす。
+	bool ReadCsaFile(const std::string& file_path, Position& pos, std::string& buffer, CsaGame& game) {
+		FILE* file = std::fopen(file_path.c_str(), "rb");
+
+		if (file == nullptr) {
+			std::cout << "!!! Failed to open the input file: filepath=" << file_path << std::endl;
+			return false;
+		}
+
+		buffer.clear();
+		char chunk[64 * 1024];
+		size_t read_size;
+		while ((read_size = std::fread(chunk, 1, sizeof(chunk), file)) > 0) {
+			buffer.append(chunk, read_size);
+		}
 
 		std::fclose(file);
 		file = nullptr;
 
+		ParseCsaText(buffer, pos, game);
 		return true;
 	}
 
-	void ParseFloodgateCsaFiles(const std::string& csa_folder_path,
-		const std::vector<Player>& strong_players, int minimum_rating,
-		InternalBook& internal_book) {
-		int num_records = 0;
+	bool ReadCsaGameCache(const std::string& cache_file_path, CsaGameCache& cache) {
+		FILE* file = std::fopen(cache_file_path.c_str(), "rb");
+		if (file == nullptr) {
+			return false;
+		}
+
+		char magic[sizeof(kCsaGameCacheMagic)];
+		bool ok = std::fread(magic, sizeof(magic), 1, file) == 1
+			&& std::memcmp(magic, kCsaGameCacheMagic, sizeof(magic)) == 0;
+
+		u32 path_length;
+		while (ok && std::fread(&path_length, sizeof(path_length), 1, file) == 1) {
+			std::string path(path_length, '\0');
+			CsaGameCacheEntry entry;
+			u8 toryo;
+			u8 winner_offset;
+			u32 num_moves;
+			ok = std::fread(path.data(), 1, path_length, file) == path_length
+				&& std::fread(&entry.file_size, sizeof(entry.file_size), 1, file) == 1
+				&& std::fread(&entry.last_write_time, sizeof(entry.last_write_time), 1, file) == 1
+				&& std::fread(&toryo, sizeof(toryo), 1, file) == 1
+				&& std::fread(&winner_offset, sizeof(winner_offset), 1, file) == 1
+				&& std::fread(&num_moves, sizeof(num_moves), 1, file) == 1;
+			if (!ok) {
+				break;
+			}
+
+			entry.game.toryo = toryo != 0;
+			entry.game.winner_offset = winner_offset;
+			entry.game.moves.resize(num_moves);
+			ok = std::fread(entry.game.moves.data(), sizeof(Move), num_moves, file) == num_moves;
+			if (!ok) {
+				break;
+			}
+
+			cache[std::move(path)] = std::move(entry);
+		}
+
+		std::fclose(file);
+		file = nullptr;
+
+		if (!ok) {
+			sync_cout << "info string The csa cache file is broken. Ignored. cache_file_path=" << cache_file_path << sync_endl;
+			cache.clear();
+		}
+		return ok;
+	}
+
+	bool WriteCsaGameCache(const std::string& cache_file_path, const std::vector<std::string>& file_paths,
+		const std::vector<CsaGameCacheEntry>& entries) {
+		// 書き込み中に中断されても前回のキャッシュファイルが壊れないよう、一時ファイルに書いてから置き換える。
+		std::string temporary_file_path = cache_file_path + ".tmp";
+		FILE* file = std::fopen(temporary_file_path.c_str(), "wb");
+		if (file == nullptr) {
+			sync_cout << "Failed to open the csa cache file. cache_file_path=" << temporary_file_path << sync_endl;
+			return false;
+		}
+
+		bool ok = std::fwrite(kCsaGameCacheMagic, sizeof(kCsaGameCacheMagic), 1, file) == 1;
+		for (size_t i = 0; ok && i < file_paths.size(); ++i) {
+			const auto& path = file_paths[i];
+			const auto& entry = entries[i];
+			u32 path_length = static_cast<u32>(path.size());
+			u8 toryo = entry.game.toryo;
+			u8 winner_offset = static_cast<u8>(entry.game.winner_offset);
+			u32 num_moves = static_cast<u32>(entry.game.moves.size());
+			ok = std::fwrite(&path_length, sizeof(path_length), 1, file) == 1
+				&& std::fwrite(path.data(), 1, path.size(), file) == path.size()
+				&& std::fwrite(&entry.file_size, sizeof(entry.file_size), 1, file) == 1
+				&& std::fwrite(&entry.last_write_time, sizeof(entry.last_write_time), 1, file) == 1
+				&& std::fwrite(&toryo, sizeof(toryo), 1, file) == 1
+				&& std::fwrite(&winner_offset, sizeof(winner_offset), 1, file) == 1
+				&& std::fwrite(&num_moves, sizeof(num_moves), 1, file) == 1
+				&& std::fwrite(entry.game.moves.data(), sizeof(Move), num_moves, file) == num_moves;
+		}
+
+		ok = std::fclose(file) == 0 && ok;
+		file = nullptr;
+
+		std::error_code error_code;
+		if (ok) {
+			std::filesystem::rename(temporary_file_path, cache_file_path, error_code);
+		}
+		if (!ok || error_code) {
+			sync_cout << "Failed to write the csa cache file. cache_file_path=" << cache_file_path << sync_endl;
+			std::filesystem::remove(temporary_file_path, error_code);
+			return false;
+		}
+		return true;
+	}
+
+	// csa_folder_path以下の拡張子が .csa のファイルを列挙する。
+	// floodgateの棋譜は直下のフォルダ(年ごと)に数百万ファイル置かれているため、直下のフォルダ単位で並列に列挙する。
+	// 結果は実行ごとに同じ順序になるよう、パスの順に並べ替えて返す。
+	std::vector<std::string> EnumerateCsaFiles(const std::string& csa_folder_path) {
+		std::vector<std::string> file_paths;
+		std::vector<std::filesystem::path> sub_folders;
 		for (const std::filesystem::directory_entry& entry :
-			std::filesystem::recursive_directory_iterator(csa_folder_path)) {
-			auto& file_path = entry.path();
-			if (file_path.extension() != ".csa") {
-				// 拡張子が .csa でなかったらスキップする。
-				continue;
+			std::filesystem::directory_iterator(csa_folder_path)) {
+			if (entry.is_directory()) {
+				sub_folders.push_back(entry.path());
+			}
+			else if (entry.path().extension() == ".csa") {
+				file_paths.push_back(entry.path().string());
 			}
+		}
 
-			if (std::count_if(strong_players.begin(), strong_players.end(),
-				[&file_path, minimum_rating](const auto& strong_player) {
-					// レーティングが低いソフトの棋譜は使用しない。
-					if (strong_player.rate < minimum_rating) {
-						return false;
-					}
+		std::vector<std::vector<std::string>> sub_folder_file_paths(sub_folders.size());
+#pragma omp parallel for schedule(dynamic, 1)
+		for (s64 i = 0; i < s64(sub_folders.size()); ++i) {
+			for (const std::filesystem::directory_entry& entry :
+				std::filesystem::recursive_directory_iterator(sub_folders[i])) {
+				if (entry.path().extension() == ".csa") {
+					sub_folder_file_paths[i].push_back(entry.path().string());
+				}
+			}
+		}
+
+		for (auto& paths : sub_folder_file_paths) {
+			file_paths.insert(file_paths.end(), std::make_move_iterator(paths.begin()), std::make_move_iterator(paths.end()));
+		}
+		std::sort(file_paths.begin(), file_paths.end());
+		return file_paths;
+	}
+
+	// 強いプレイヤー同士の対局の棋譜かどうかをファイル名から判定する。
+	bool IsStrongPlayersGame(const std::string& file_path, const std::vector<Player>& strong_players, int minimum_rating) {
+		return std::count_if(strong_players.begin(), strong_players.end(),
+			[&file_path, minimum_rating](const auto& strong_player) {
+				// レーティングが低いソフトの棋譜は使用しない。
+				if (strong_player.rate < minimum_rating) {
+					return false;
+				}
+
+				return file_path.find("+" + strong_player.name + "+") != std::string::npos;
+			}) == 2;
+	}
+
+	// csa_folder_path以下の棋譜のうち、強いプレイヤー同士の投了で終わった対局を並列に読み込む。
+	// BookCsaCacheFileが指定されている場合、解析結果をキャッシュファイルに保存し、
+	// 次回以降はサイズと更新日時が変わっていないファイルの解析を省略する。
+	std::vector<CsaGame> ReadFloodgateCsaGames(const std::string& csa_folder_path,
+		const std::vector<Player>& strong_players, int minimum_rating) {
+		std::string cache_file_path = Options[kBookCsaCacheFile];
 
-					return file_path.string().find("+" + strong_player.name + "+") != std::string::npos;
-				}) != 2) {
+		std::vector<std::string> file_paths = EnumerateCsaFiles(csa_folder_path);
+		file_paths.erase(std::remove_if(file_paths.begin(), file_paths.end(),
+			[&strong_players, minimum_rating](const std::string& file_path) {
 				// 強いプレイヤー同士の対局でなかったらスキップする。
-				continue;
-			}
+				return !IsStrongPlayersGame(file_path, strong_players, minimum_rating);
+			}), file_paths.end());
+		sync_cout << "|file_paths|=" << file_paths.size() << sync_endl;
+
+		CsaGameCache cache;
+		if (!cache_file_path.empty() && ReadCsaGameCache(cache_file_path, cache)) {
+			sync_cout << "|cache|=" << cache.size() << sync_endl;
+		}
+
+		std::vector<CsaGameCacheEntry> entries(file_paths.size());
+		std::vector<char> succeeded(file_paths.size());
+		std::atomic<int> num_records = 0;
+		std::atomic<int> num_cache_hits = 0;
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			Position pos;
+			StateInfo state_info;
+			pos.set_hirate(&state_info, Threads[thread_index % Threads.size()]);
+			std::string buffer;
+#pragma omp for schedule(dynamic, 64)
+			for (s64 i = 0; i < s64(file_paths.size()); ++i) {
+				const auto& file_path = file_paths[i];
+				auto& entry = entries[i];
+
+				if (++num_records % 1000 == 0) {
+					sync_cout << num_records << sync_endl;
+				}
+
+				std::error_code error_code;
+				entry.file_size = std::filesystem::file_size(file_path, error_code);
+				entry.last_write_time = static_cast<s64>(std::filesystem::last_write_time(file_path, error_code).time_since_epoch().count());
 
-			if (++num_records % 1000 == 0) {
-				sync_cout << num_records << sync_endl;
+				auto it = cache.find(file_path);
+				if (!error_code && it != cache.end() && it->second.file_size == entry.file_size
+					&& it->second.last_write_time == entry.last_write_time) {
+					entry.game = it->second.game;
+					succeeded[i] = true;
+					++num_cache_hits;
+					continue;
+				}
+
+				if (!ReadCsaFile(file_path, pos, buffer, entry.game)) {
+					sync_cout << "Failed to read a csa file. file_path" << file_path << sync_endl;
+					continue;
+				}
+				succeeded[i] = true;
 			}
+		}
+		sync_cout << "num_cache_hits=" << num_cache_hits << sync_endl;
 
-			bool toryo = false;
-			std::vector<Move> moves;
-			int winner_offset = 0;
-			if (!ReadCsaFile(file_path.string(), moves, toryo, winner_offset)) {
-				sync_cout << "Failed to read a csa file. file_path" << file_path << sync_endl;
+		std::vector<CsaGame> games;
+		std::vector<std::string> cached_file_paths;
+		std::vector<CsaGameCacheEntry> cached_entries;
+		for (size_t i = 0; i < file_paths.size(); ++i) {
+			if (!succeeded[i]) {
 				continue;
 			}
 
+			if (!cache_file_path.empty()) {
+				cached_file_paths.push_back(file_paths[i]);
+				cached_entries.push_back(entries[i]);
+			}
+
 			// 投了以外の棋譜はスキップする
-			if (!toryo) {
+			if (!entries[i].game.toryo) {
 				continue;
 			}
 
-			auto& pos = Threads[0]->rootPos;
-			StateInfo state_info[512];
-			pos.set_hirate(&state_info[0], Threads[0]);
+			games.push_back(std::move(entries[i].game));
+		}
 
-			for (int play = 0; play < static_cast<int>(moves.size()); ++play) {
-				auto move = moves[play];
-				if (!pos.pseudo_legal(move) || !pos.legal(move)) {
-					std::cout << "Illegal move. sfen=" << pos.sfen() << " move=" << move << std::endl;
-					break;
-				}
+		if (!cache_file_path.empty()) {
+			WriteCsaGameCache(cache_file_path, cached_file_paths, cached_entries);
+		}
 
-				auto& internal_book_move = internal_book[pos.sfen()][static_cast<u16>(move)];
-				internal_book_move.move = move;
-				internal_book_move.ponder = (play + 1 < static_cast<int>(moves.size())) ? moves[play + 1] : Move::MOVE_NONE;
-				if (play % 2 == winner_offset) {
-					++internal_book_move.num_win;
-				}
-				else {
-					++internal_book_move.num_lose;
-				}
+		sync_cout << "|games|=" << games.size() << sync_endl;
+		return games;
+	}
 
-				pos.do_move(move, state_info[pos.game_ply()]);
+	// partial_bookをinternal_bookにマージする。
+	// partial_bookはinternal_bookに登録された対局より後の対局から作られたものとする。
+	void MergeInternalBook(InternalBook& internal_book, InternalBook& partial_book) {
+		if (internal_book.empty()) {
+			internal_book.swap(partial_book);
+			return;
+		}
+
+		for (auto& [sfen, move16_to_book_move] : partial_book) {
+			auto& internal_book_moves = internal_book[sfen];
+			for (auto& [move16, book_move] : move16_to_book_move) {
+				auto& internal_book_move = internal_book_moves[move16];
+				internal_book_move.move = book_move.move;
+				internal_book_move.ponder = book_move.ponder;
+				internal_book_move.num_win += book_move.num_win;
+				internal_book_move.num_lose += book_move.num_lose;
+				internal_book_move.sum_values += book_move.sum_values;
+				internal_book_move.num_values += book_move.num_values;
+			}
+		}
+		partial_book.clear();
+	}
+
+	// 棋譜の指し手をinternal_bookに登録する。
+	// winner_moves_only == trueの場合、勝った側の指し手のみを登録する。
+	// スレッドごとに連続した範囲の棋譜から部分的な定跡を作り、最後に棋譜の順にマージする。
+	// ponderは後の対局のもので上書きされるので、逐次的に登録した場合と同じ結果になる。
+	void AddCsaGamesToInternalBook(const std::vector<CsaGame>& games, bool winner_moves_only, InternalBook& internal_book) {
+		std::vector<InternalBook> partial_books(omp_get_max_threads());
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			auto& partial_book = partial_books[thread_index];
+			Position pos;
+			std::vector<StateInfo> state_info;
+#pragma omp for schedule(static)
+			for (s64 i = 0; i < s64(games.size()); ++i) {
+				const auto& moves = games[i].moves;
+				int winner_offset = games[i].winner_offset;
+				state_info.resize(moves.size() + 1);
+				pos.set_hirate(&state_info[0], Threads[thread_index % Threads.size()]);
+
+				for (int play = 0; play < static_cast<int>(moves.size()); ++play) {
+					auto move = moves[play];
+					if (!pos.pseudo_legal(move) || !pos.legal(move)) {
+						sync_cout << "Illegal move. sfen=" << pos.sfen() << " move=" << move << sync_endl;
+						break;
+					}
+
+					if (!winner_moves_only || play % 2 == winner_offset) {
+						auto& internal_book_move = partial_book[pos.sfen()][static_cast<u16>(move)];
+						internal_book_move.move = move;
+						internal_book_move.ponder = (play + 1 < static_cast<int>(moves.size())) ? moves[play + 1] : Move::MOVE_NONE;
+						if (play % 2 == winner_offset) {
+							++internal_book_move.num_win;
+						}
+						else {
+							++internal_book_move.num_lose;
+						}
+					}
+
+					pos.do_move(move, state_info[play + 1]);
+				}
 			}
 		}
+
+		for (auto& partial_book : partial_books) {
+			MergeInternalBook(internal_book, partial_book);
+		}
+	}
+
+	void ParseFloodgateCsaFiles(const std::string& csa_folder_path,
+		const std::vector<Player>& strong_players, int minimum_rating,
+		InternalBook& internal_book, bool winner_moves_only = false) {
+		int num_threads = Options[kThreads];
+		omp_set_num_threads(num_threads);
+
+		auto games = ReadFloodgateCsaGames(csa_folder_path, strong_players, minimum_rating);
+		AddCsaGamesToInternalBook(games, winner_moves_only, internal_book);
+	}
+}
+
+bool Tanuki::Create18Book() {
+	std::string csa_folder = Options[kBookCsaFolder];
+	std::string output_book_file = Options[kBookOutputFile];
+	int minimum_rating = static_cast<int>(Options[kBookMinimumRating]);
+
+	MemoryBook output_book;
+	output_book_file = "book/" + output_book_file;
+	sync_cout << "Reading output book file: " << output_book_file << sync_endl;
+	output_book.read_book(output_book_file);
+	sync_cout << "done..." << sync_endl;
+	sync_cout << "|output_book|=" << output_book.get_body().size() << sync_endl;
+
+	std::vector<Player> strong_players;
+	if (!ReadStrongPlayers(strong_players)) {
+		sync_cout << "Failed to read the player list." << sync_endl;
+		return false;
+	}
+
+	InternalBook internal_book;
+	ParseFloodgateCsaFiles(csa_folder, strong_players, minimum_rating, internal_book, true);
+
+	for (auto& [sfen, move16_to_book_move] : internal_book) {
+		for (auto& [move16, book_move] : move16_to_book_move) {
+			output_book.insert(sfen, Book::BookMove(book_move.move, book_move.ponder, 0, 0, book_move.num_win));
+		}
 	}
 
+	WriteBook(output_book, output_book_file);
+
+	return true;
+}
+
+namespace {
 	int GetGameIdsAndWinners(sqlite3* database, std::vector<std::pair<int, int>>& game_ids_and_winners) {
 		sync_cout << "GetGameIdsAndWinners()" << sync_endl;
 
@@ -2019,199 +3730,233 @@ namespace {
 
 		result = sqlite3_reset(stmt);
 		if (result != SQLITE_OK) {
-			sync_cout << "Failed to reset a statement."
-				<< " result=" << result
-				<< sync_endl;
-			return result;
-		}
-
-		result = sqlite3_clear_bindings(stmt);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to clear bindings."
-				<< " result=" << result
-				<< sync_endl;
-			return result;
-		}
-
-		return SQLITE_OK;
-	}
-
-	int WriteRecordToSQLiteBody(sqlite3* database, int winner, const std::vector<InternalMove>& internal_moves) {
-		char* error_message = nullptr;
-		int result = 0;
-		int finalize_result = 0;
-		sqlite3_stmt* stmt = NULL;
-
-		// トランザクションを開始する
-		result = sqlite3_exec(database, "BEGIN", 0, 0, &error_message);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to execute BEGIN."
-				<< " result=" << result
-				<< " error_message=" << error_message
-				<< sync_endl;
-			return result;
-		}
-
-		// テーブルを作成する
-		result = sqlite3_exec(database,
-			"CREATE TABLE IF NOT EXISTS game("
-			"	id INTEGER PRIMARY KEY ASC,"
-			"	winner INTEGER"
-			");", 0, 0, &error_message);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to create the game table."
-				<< " result=" << result
-				<< " error_message=" << error_message
-				<< sync_endl;
-			return result;
-		}
-
-		result = sqlite3_exec(database,
-			"CREATE TABLE IF NOT EXISTS move ("
-			"	game_id INTEGER,"
-			"	play INTEGER,"
-			"	best TEXT,"
-			"	next TEXT,"
-			"	value INTEGER,"
-			"	depth INTEGER,"
-			"	book INTEGER"
-			");", 0, 0, &error_message);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to create the game table."
-				<< " result=" << result
-				<< " error_message=" << error_message
-				<< sync_endl;
-			return result;
-		}
-
-		// インデックスの作成
-		result = sqlite3_exec(database,
-			"CREATE INDEX IF NOT EXISTS move_game_id_index ON move ("
-			"	game_id"
-			");", 0, 0, &error_message);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to create the game table."
+			sync_cout << "Failed to reset a statement."
 				<< " result=" << result
-				<< " error_message=" << error_message
 				<< sync_endl;
 			return result;
 		}
 
-		// すでに記録されている対局の結果を読み込む
-		std::vector<std::pair<int, int>> game_ids_and_winners;
-		result = GetGameIdsAndWinners(database, game_ids_and_winners);
+		result = sqlite3_clear_bindings(stmt);
 		if (result != SQLITE_OK) {
-			sync_cout << "Failed to get ids and winners."
+			sync_cout << "Failed to clear bindings."
 				<< " result=" << result
 				<< sync_endl;
 			return result;
 		}
 
-		int last_game_id = 0;
-		for (auto& [game_id, winner] : game_ids_and_winners) {
-			last_game_id = std::max(last_game_id, game_id);
+		return SQLITE_OK;
+	}
+
+	// 自己対局の棋譜をSQLiteデータベースに書き込む。
+	// データベースは最初に1回だけ開き、ステートメントも使い回す。
+	// 対局はAppend()でバッファに溜め、kUctGamesPerTransaction局ごとに1つのトランザクションでまとめて書き込む。
+	// 複数のスレッドから同時に呼び出して良い。
+	class UctRecordWriter {
+	public:
+		~UctRecordWriter() {
+			Close();
 		}
 
-		int game_id = last_game_id + 1;
+		bool Open(const std::string& record_file) {
+			int result = sqlite3_open(record_file.c_str(), &database_);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to open an sqlite file."
+					<< " record_file=" << record_file
+					<< sync_endl;
+				return false;
+			}
 
-		// 対局IDと対局結果の書き込み
-		result = sqlite3_prepare(database,
-			"INSERT INTO game(id, winner)"
-			"VALUES(?, ?)", -1, &stmt, nullptr);
-		if (result != SQLITE_OK || stmt == nullptr) {
-			sync_cout << "Failed to prepare a statement."
-				<< " result=" << result
-				<< sync_endl;
-			return result;
-		}
+			char* error_message = nullptr;
 
-		result = WriteGameIdsAndWinners(stmt, game_id, winner);
+			// テーブルを作成する
+			result = sqlite3_exec(database_,
+				"CREATE TABLE IF NOT EXISTS game("
+				"	id INTEGER PRIMARY KEY ASC,"
+				"	winner INTEGER"
+				");", 0, 0, &error_message);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to create the game table."
+					<< " result=" << result
+					<< " error_message=" << error_message
+					<< sync_endl;
+				return false;
+			}
 
-		finalize_result = sqlite3_finalize(stmt);
-		stmt = nullptr;
+			result = sqlite3_exec(database_,
+				"CREATE TABLE IF NOT EXISTS move ("
+				"	game_id INTEGER,"
+				"	play INTEGER,"
+				"	best TEXT,"
+				"	next TEXT,"
+				"	value INTEGER,"
+				"	depth INTEGER,"
+				"	book INTEGER"
+				");", 0, 0, &error_message);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to create the game table."
+					<< " result=" << result
+					<< " error_message=" << error_message
+					<< sync_endl;
+				return false;
+			}
 
-		if (result != SQLITE_OK) {
-			// エラーメッセージは表示済み
-			return result;
-		}
+			// インデックスの作成
+			result = sqlite3_exec(database_,
+				"CREATE INDEX IF NOT EXISTS move_game_id_index ON move ("
+				"	game_id"
+				");", 0, 0, &error_message);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to create the game table."
+					<< " result=" << result
+					<< " error_message=" << error_message
+					<< sync_endl;
+				return false;
+			}
 
-		if (finalize_result != SQLITE_OK) {
-			sync_cout << "Failed to finalize a statement."
-				<< " finalize_result=" << finalize_result
-				<< sync_endl;
-			return result;
-		}
+			// すでに記録されている対局の最大のIDを調べる
+			sqlite3_stmt* stmt = nullptr;
+			result = sqlite3_prepare(database_, "SELECT MAX(id) FROM game", -1, &stmt, nullptr);
+			if (result != SQLITE_OK || stmt == nullptr) {
+				sync_cout << "Failed to prepare a statement."
+					<< " result=" << result
+					<< sync_endl;
+				return false;
+			}
+			if (sqlite3_step(stmt) == SQLITE_ROW) {
+				last_game_id_ = sqlite3_column_int(stmt, 0);
+			}
+			sqlite3_finalize(stmt);
+
+			result = sqlite3_prepare(database_,
+				"INSERT INTO game(id, winner)"
+				"VALUES(?, ?)", -1, &insert_game_stmt_, nullptr);
+			if (result != SQLITE_OK || insert_game_stmt_ == nullptr) {
+				sync_cout << "Failed to prepare a statement."
+					<< " result=" << result
+					<< sync_endl;
+				return false;
+			}
 
-		// 棋譜の書き込み
-		for (int play = 0; play < static_cast<int>(internal_moves.size()); ++play) {
-			result = sqlite3_prepare(database,
+			result = sqlite3_prepare(database_,
 				"INSERT INTO move(game_id, play, best, next, value, depth, book)"
-				"VALUES(?, ?, ?, ?, ?, ?, ?)", -1, &stmt, nullptr);
-			if (result != SQLITE_OK || stmt == nullptr) {
+				"VALUES(?, ?, ?, ?, ?, ?, ?)", -1, &insert_move_stmt_, nullptr);
+			if (result != SQLITE_OK || insert_move_stmt_ == nullptr) {
 				sync_cout << "Failed to prepare a statement."
 					<< " result=" << result
 					<< sync_endl;
-				return result;
+				return false;
 			}
 
-			result = WriteMove(stmt, game_id, play, internal_moves[play]);
+			return true;
+		}
+
+		// 1局分の棋譜を追加する。
+		void Append(int winner, const std::vector<InternalMove>& internal_moves) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			pending_games_.emplace_back(winner, internal_moves);
+			if (static_cast<int>(pending_games_.size()) >= kUctGamesPerTransaction) {
+				FlushLocked();
+			}
+		}
 
-			finalize_result = sqlite3_finalize(stmt);
-			stmt = nullptr;
+		// バッファに溜まっている棋譜を書き込む。
+		bool Flush() {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return FlushLocked();
+		}
 
-			if (result != SQLITE_OK) {
-				// エラーメッセージは表示済み
-				return result;
+		void Close() {
+			if (database_ == nullptr) {
+				return;
 			}
 
-			if (finalize_result != SQLITE_OK) {
-				sync_cout << "Failed to finalize a statement."
-					<< " finalize_result=" << finalize_result
+			Flush();
+			sqlite3_finalize(insert_game_stmt_);
+			insert_game_stmt_ = nullptr;
+			sqlite3_finalize(insert_move_stmt_);
+			insert_move_stmt_ = nullptr;
+
+			int result = sqlite3_close(database_);
+			database_ = nullptr;
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to close a databse."
+					<< " result=" << result
 					<< sync_endl;
-				return result;
 			}
 		}
 
-		// トランザクションを終了する
-		result = sqlite3_exec(database, "COMMIT", 0, 0, &error_message);
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to execute COMMIT."
-				<< " result=" << result
-				<< " error_message=" << error_message
-				<< sync_endl;
-			return result;
-		}
+	private:
+		bool FlushLocked() {
+			if (pending_games_.empty() || database_ == nullptr) {
+				return true;
+			}
 
-		result = sqlite3_close(database);
-		database = nullptr;
-		if (result != SQLITE_OK) {
-			sync_cout << "Failed to close a databse."
-				<< " result=" << result
-				<< sync_endl;
-			return result;
-		}
+			char* error_message = nullptr;
 
-		return result;
-	}
+			// トランザクションを開始する
+			int result = sqlite3_exec(database_, "BEGIN", 0, 0, &error_message);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to execute BEGIN."
+					<< " result=" << result
+					<< " error_message=" << error_message
+					<< sync_endl;
+				return false;
+			}
 
-	bool WriteRecordToSQLite(const std::string& record_file, int winner, const std::vector<InternalMove>& internal_moves) {
-		// SQLiteデータベースへの棋譜の保存
-		sqlite3* database = nullptr;
-		int result = 0;
+			for (const auto& [winner, internal_moves] : pending_games_) {
+				int game_id = ++last_game_id_;
 
-		result = sqlite3_open(record_file.c_str(), &database);
-		if (result == SQLITE_OK) {
-			result = WriteRecordToSQLiteBody(database, winner, internal_moves);
-		} else {
-			sync_cout << "Failed to open an sqlite file."
-				<< " record_file=" << record_file
-				<< sync_endl;
+				// 対局IDと対局結果の書き込み
+				// ステートメントはWriteGameIdsAndWinners()、WriteMove()の中でリセットされる。
+				// エラーメッセージは表示済み
+				result = WriteGameIdsAndWinners(insert_game_stmt_, game_id, winner);
+				if (result != SQLITE_OK) {
+					break;
+				}
+
+				// 棋譜の書き込み
+				for (int play = 0; play < static_cast<int>(internal_moves.size()); ++play) {
+					result = WriteMove(insert_move_stmt_, game_id, play, internal_moves[play]);
+					if (result != SQLITE_OK) {
+						break;
+					}
+				}
+				if (result != SQLITE_OK) {
+					break;
+				}
+			}
+
+			if (result != SQLITE_OK) {
+				// 失敗したステートメントを再利用できるようにしておく。
+				sqlite3_reset(insert_game_stmt_);
+				sqlite3_clear_bindings(insert_game_stmt_);
+				sqlite3_reset(insert_move_stmt_);
+				sqlite3_clear_bindings(insert_move_stmt_);
+			}
+
+			// トランザクションを終了する
+			// 書き込みに失敗した場合はロールバックし、バッファの棋譜は破棄する。
+			const char* end_transaction = result == SQLITE_OK ? "COMMIT" : "ROLLBACK";
+			pending_games_.clear();
+			result = sqlite3_exec(database_, end_transaction, 0, 0, &error_message);
+			if (result != SQLITE_OK) {
+				sync_cout << "Failed to execute " << end_transaction << "."
+					<< " result=" << result
+					<< " error_message=" << error_message
+					<< sync_endl;
+				return false;
+			}
+
+			return true;
 		}
 
-		sqlite3_close(database);
-		database = nullptr;
-		return result == SQLITE_OK;
-	}
+		sqlite3* database_ = nullptr;
+		sqlite3_stmt* insert_game_stmt_ = nullptr;
+		sqlite3_stmt* insert_move_stmt_ = nullptr;
+		int last_game_id_ = 0;
+		std::mutex mutex_;
+		std::vector<std::pair<int, std::vector<InternalMove>>> pending_games_;
+	};
 
 	using BadMove = std::pair<std::string, std::string>;
 	static const std::vector<BadMove> BadMoves = {
@@ -2254,20 +3999,20 @@ namespace {
 		std::ifstream ifs("bad_moves.txt");
 		std::string url;
 		int target_play;
+		std::string buffer;
 		while (ifs >> url >> target_play) {
 			int offset = static_cast<int>(url.find_last_of("/"));
 			std::string file_name = url.substr(offset + 1);
 			std::string file_path = csa_folder + "\\wdoor2021\\2021\\" + file_name;
 
-			std::vector<Move> moves;
-			bool toryo = false;
-			int winner_offset = 0;
-			if (!ReadCsaFile(file_path, moves, toryo, winner_offset)) {
+			auto& pos = Threads[0]->rootPos;
+			CsaGame game;
+			if (!ReadCsaFile(file_path, pos, buffer, game)) {
 				sync_cout << "Failed to read a csa file. file_path" << file_path << sync_endl;
 				continue;
 			}
 
-			auto& pos = Threads[0]->rootPos;
+			const auto& moves = game.moves;
 			std::vector<StateInfo> state_info(512);
 			pos.set_hirate(&state_info[0], Threads[0]);
 			for (int play = 0; play + 1 < target_play; ++play) {
@@ -2316,61 +4061,408 @@ namespace {
 		}
 	}
 
-	void ReadInternalBook(const std::string& file_path, InternalBook& internal_book) {
-		sync_cout << "ReadInternalBook(): file_path=" << file_path << sync_endl;
-		int counter = 0;
-		std::ifstream ifs(file_path);
-		std::string sfen;
-		while (std::getline(ifs, sfen)) {
-			if (++counter % 10000 == 0) {
-				sync_cout << counter << "/" << internal_book.size() << sync_endl;
+	void ReadInternalBook(const std::string& file_path, InternalBook& internal_book) {
+		sync_cout << "ReadInternalBook(): file_path=" << file_path << sync_endl;
+		int counter = 0;
+		std::ifstream ifs(file_path);
+		std::string sfen;
+		while (std::getline(ifs, sfen)) {
+			if (++counter % 10000 == 0) {
+				sync_cout << counter << "/" << internal_book.size() << sync_endl;
+			}
+
+			int num_book_moves;
+			ifs >> num_book_moves;
+
+			for (int book_move_index = 0; book_move_index < num_book_moves; ++book_move_index) {
+				std::string move_string;
+				std::string ponder_string;
+				int num_win;
+				int num_lose;
+				s64 sum_values;
+				int num_values;
+				ifs >> move_string >> ponder_string >> num_win >> num_lose >> sum_values >> num_values;
+				u16 move16 = USI::to_move16(move_string).to_u16();
+				u16 ponder16 = ponder_string == "none" ? static_cast<u16>(Move::MOVE_NONE) : USI::to_move16(ponder_string).to_u16();
+				internal_book[sfen][move16] = { move16, ponder16, num_win, num_lose, sum_values, num_values };
+			}
+
+			// 末尾の改行を読む
+			std::string _;
+			std::getline(ifs, _);
+		}
+		sync_cout << "done." << sync_endl;
+	}
+
+	// 1局面分をReadInternalBook()で読み込める形式で書き出す。
+	void WriteInternalBookEntry(std::ostream& os, const std::string& sfen,
+		const std::map<u16 /* Move16 */, InternalBookMove>& move16_to_book_move) {
+		os << sfen << std::endl;
+		os << move16_to_book_move.size() << std::endl;
+		for (const auto& [move16, book_move] : move16_to_book_move) {
+			os
+				<< to_usi_string(book_move.move) << " "
+				<< to_usi_string(book_move.ponder) << " "
+				<< book_move.num_win << " "
+				<< book_move.num_lose << " "
+				<< book_move.sum_values << " "
+				<< book_move.num_values << std::endl;
+		}
+	}
+
+	void WriteInternalBook(const std::string& file_path, const InternalBook& internal_book) {
+		sync_cout << "WriteInternalBook(): file_path=" << file_path << sync_endl;
+		int counter = 0;
+		std::ofstream ofs(file_path);
+		for (const auto& [sfen, move16_to_book_move] : internal_book) {
+			if (++counter % 10000 == 0) {
+				sync_cout << counter << "/" << internal_book.size() << sync_endl;
+			}
+
+			WriteInternalBookEntry(ofs, sfen, move16_to_book_move);
+		}
+		sync_cout << "done." << sync_endl;
+	}
+
+	struct BookNodeKeyHash {
+		size_t operator()(const BookNodeKey& node_key) const {
+			return size_t((node_key.key[0] ^ node_key.key[1]) * 0x9E3779B97F4A7C15ULL) ^ size_t(node_key.ply);
+		}
+	};
+
+	// CreateUctBook()で用いる、局面のhash keyをkeyとする定跡の表。
+	// InternalBookはsfen文字列をkeyとするstd::mapなので、1手ごとにsfen文字列の生成と文字列比較による探索が必要だった。
+	// この表では、局面はhash keyと手数の組で引き、sfen文字列は表への書き出し用に局面の登録時にだけ生成する。
+	// 局面はhash keyでshardに分け、shardごとにロックを取るので、複数の対局から同時に参照・更新して良い。
+	// ignore_book_ply == trueの場合は、手数違いの同一局面を同じ局面として扱う。
+	class UctBookTable {
+	public:
+		explicit UctBookTable(bool ignore_book_ply) : ignore_book_ply_(ignore_book_ply) {}
+
+		// InternalBookの内容を登録する。
+		// 手数違いの同一局面を同じ局面として扱う場合、それらの指し手の対局結果は合算する。
+		void Import(const InternalBook& internal_book) {
+			Position pos;
+			StateInfo state_info;
+			for (const auto& [sfen, move16_to_book_move] : internal_book) {
+				pos.set(sfen, &state_info, Threads.main());
+				BookNodeKey node_key = GetNodeKey(pos);
+				auto& node = GetShard(node_key).nodes[node_key];
+				if (node.sfen.empty()) {
+					node.sfen = sfen;
+					node.moves = move16_to_book_move;
+					continue;
+				}
+
+				for (const auto& [move16, book_move] : move16_to_book_move) {
+					auto [it, inserted] = node.moves.emplace(move16, book_move);
+					if (inserted) {
+						continue;
+					}
+
+					auto& internal_book_move = it->second;
+					if (internal_book_move.ponder.to_u16() == static_cast<u16>(Move::MOVE_NONE)) {
+						internal_book_move.ponder = book_move.ponder;
+					}
+					internal_book_move.num_win += book_move.num_win;
+					internal_book_move.num_lose += book_move.num_lose;
+					internal_book_move.sum_values += book_move.sum_values;
+					internal_book_move.num_values += book_move.num_values;
+				}
+			}
+		}
+
+		// この局面で探索した回数を返す。
+		// 探索した場合は評価値を記録するため、その個数を数える。
+		int NumSearches(const Position& pos) {
+			BookNodeKey node_key = GetNodeKey(pos);
+			auto& shard = GetShard(node_key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.nodes.find(node_key);
+			if (it == shard.nodes.end()) {
+				return 0;
+			}
+
+			int num_searches = 0;
+			for (const auto& [best16, internal_book_move] : it->second.moves) {
+				num_searches += internal_book_move.num_values;
+			}
+			return num_searches;
+		}
+
+		// UCB1が最大となる指し手を選ぶ。この局面が登録されていない場合はfalseを返す。
+		bool SelectByUcb1(const Position& pos, double ucb1_constant, InternalBookMove& selected) {
+			BookNodeKey node_key = GetNodeKey(pos);
+			auto& shard = GetShard(node_key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.nodes.find(node_key);
+			if (it == shard.nodes.end() || it->second.moves.empty()) {
+				return false;
+			}
+
+			// 全シミュレーション回数を求める
+			int N = 0;
+			for (const auto& [best16, internal_book_move] : it->second.moves) {
+				N += internal_book_move.num_win;
+				N += internal_book_move.num_lose;
+			}
+
+			// 最大の UCB1 を求める。
+			// 全シミュレーション回数が1回で負けている場合などはUCB1が0になるので、負の値から始める。
+			double best_ucb1 = -1.0;
+			for (const auto& [best16, internal_book_move] : it->second.moves) {
+				double w = internal_book_move.num_win;
+				double n = internal_book_move.num_win + internal_book_move.num_lose;
+				double ucb1 = w / n + ucb1_constant * std::sqrt(std::log(N) / n);
+				if (best_ucb1 < ucb1) {
+					best_ucb1 = ucb1;
+					selected = internal_book_move;
+				}
+			}
+			return true;
+		}
+
+		// 対局結果を登録する。
+		void Update(const Position& pos, Move16 move, Move16 ponder, bool win, int value) {
+			BookNodeKey node_key = GetNodeKey(pos);
+			auto& shard = GetShard(node_key);
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto& node = shard.nodes[node_key];
+			if (node.sfen.empty()) {
+				node.sfen = pos.sfen();
+			}
+
+			auto& internal_book_move = node.moves[move.to_u16()];
+			internal_book_move.move = move;
+			if (ponder.to_u16() != static_cast<u16>(Move::MOVE_NONE)) {
+				internal_book_move.ponder = ponder;
+			}
+
+			if (win) {
+				++internal_book_move.num_win;
+			}
+			else {
+				++internal_book_move.num_lose;
+			}
+
+			if (value != Value::VALUE_NONE) {
+				++internal_book_move.num_values;
+				internal_book_move.sum_values += value;
+			}
+		}
+
+		// ReadInternalBook()で読み込める形式で書き出す。
+		void Write(const std::string& file_path) {
+			sync_cout << "WriteInternalBook(): file_path=" << file_path << sync_endl;
+			std::ofstream ofs(file_path);
+			for (auto& shard : shards_) {
+				std::lock_guard<std::mutex> lock(shard.mutex);
+				for (const auto& [node_key, node] : shard.nodes) {
+					WriteInternalBookEntry(ofs, node.sfen, node.moves);
+				}
+			}
+			sync_cout << "done." << sync_endl;
+		}
+
+	private:
+		static constexpr int kNumShards = 64;
+
+		struct Node {
+			std::string sfen;
+			std::map<u16 /* Move16 */, InternalBookMove> moves;
+		};
+
+		struct Shard {
+			std::mutex mutex;
+			std::unordered_map<BookNodeKey, Node, BookNodeKeyHash> nodes;
+		};
+
+		Shard& GetShard(const BookNodeKey& node_key) {
+			return shards_[BookNodeKeyHash()(node_key) % kNumShards];
+		}
+
+		BookNodeKey GetNodeKey(const Position& pos) const {
+			return GetBookNodeKey(pos, ignore_book_ply_);
+		}
+
+		bool ignore_book_ply_;
+		std::array<Shard, kNumShards> shards_;
+	};
+
+	struct UctMatchSettings {
+		double ucb1_constant;
+		int time_ms;
+		int inc_ms;
+		int max_moves_to_draw;
+		int max_search_per_position;
+		int resign_value;
+		int search_depth;
+		int search_nodes;
+	};
+
+	// 自己対局を1局行い、棋譜をinternal_movesに格納する。
+	// 勝敗が付いた場合はtrueを返し、先手が勝った場合はblack_winにtrueを格納する。
+	// threadがnullptrの場合、goコマンドを用い、全スレッドで持ち時間付きの探索を行う。
+	// threadがnullptrでない場合、そのスレッドとそのスレッドの置換表のみを用い、Learner::search()で探索する。
+	// 複数の対局を同時に行う場合に用いる。
+	bool PlayUctMatch(UctBookTable& table, const UctMatchSettings& settings, Thread* thread,
+		std::vector<InternalMove>& internal_moves, bool& black_win) {
+		Position local_pos;
+		Position& pos = thread == nullptr ? local_pos : thread->rootPos;
+		StateListPtr states(new StateList(1));
+		if (thread == nullptr) {
+			std::istringstream iss("startpos");
+			position_cmd(pos, iss, states);
+		}
+		else {
+			pos.set_hirate(&states->back(), thread);
+		}
+
+		int black_time_ms = settings.time_ms;
+		int white_time_ms = settings.time_ms;
+
+		while (pos.game_ply() < settings.max_moves_to_draw &&
+			!pos.is_mated() &&
+			pos.DeclarationWin() == MOVE_NONE &&
+			(internal_moves.empty() || internal_moves.back().value == Value::VALUE_NONE || std::abs(internal_moves.back().value) < settings.resign_value) &&
+			pos.is_repetition() == RepetitionState::REPETITION_NONE) {
+			InternalMove internal_move = {};
+			internal_move.best = Move::MOVE_NONE;
+			internal_move.next = Move::MOVE_NONE;
+			internal_move.value = Value::VALUE_NONE;
+
+			InternalBookMove book_move;
+			if (table.NumSearches(pos) >= settings.max_search_per_position &&
+				table.SelectByUcb1(pos, settings.ucb1_constant, book_move)) {
+				// この局面で探索した回数が一定値を超えている場合、定跡の指し手を指す
+				internal_move.best = book_move.move.to_u16();
+				internal_move.next = book_move.ponder.to_u16();
+				internal_move.value = Value::VALUE_NONE;
+				internal_move.book = 1;
+				internal_move.depth = 0;
+			}
+			else if (thread == nullptr) {
+				// goコマンドを生成して実行する
+				std::string go_command = "go";
+				go_command += " btime " + std::to_string(black_time_ms);
+				go_command += " wtime " + std::to_string(white_time_ms);
+				go_command += " binc " + std::to_string(settings.inc_ms);
+				go_command += " winc " + std::to_string(settings.inc_ms);
+				{
+					std::istringstream iss(go_command);
+					go_cmd(pos, iss, states);
+				}
+
+				// goコマンドを待機する
+				Threads.main()->wait_for_search_finished();
+
+				// 残り時間を更新する
+				TimePoint elapsed = Time.elapsed() + 1;
+				if (pos.game_ply() % 2 == 1) {
+					// 先手
+					black_time_ms += settings.inc_ms;
+					black_time_ms -= static_cast<int>(elapsed);
+				}
+				else {
+					white_time_ms += settings.inc_ms;
+					white_time_ms -= static_cast<int>(elapsed);
+				}
+
+				// 選ばれた指し手のスコアをこの局面のスコアとして記録する
+				const auto& root_moves = Threads.main()->rootMoves;
+				internal_move.best = root_moves[0].pv[0];
+				if (root_moves[0].pv.size() > 1) {
+					internal_move.next = root_moves[0].pv[1];
+				}
+				internal_move.value = root_moves[0].score;
+				internal_move.depth = Threads.get_best_thread()->completedDepth;
+				internal_move.book = 0;
+			}
+			else {
+				Learner::search(pos, settings.search_depth, 1, settings.search_nodes);
+				thread->tt.new_search();
+
+				const auto& root_moves = thread->rootMoves;
+				internal_move.best = root_moves[0].pv[0];
+				if (root_moves[0].pv.size() > 1) {
+					internal_move.next = root_moves[0].pv[1];
+				}
+				internal_move.value = root_moves[0].score;
+				internal_move.depth = thread->completedDepth;
+				internal_move.book = 0;
 			}
 
-			int num_book_moves;
-			ifs >> num_book_moves;
+			internal_moves.push_back(internal_move);
 
-			for (int book_move_index = 0; book_move_index < num_book_moves; ++book_move_index) {
-				std::string move_string;
-				std::string ponder_string;
-				int num_win;
-				int num_lose;
-				s64 sum_values;
-				int num_values;
-				ifs >> move_string >> ponder_string >> num_win >> num_lose >> sum_values >> num_values;
-				u16 move16 = USI::to_move16(move_string).to_u16();
-				u16 ponder16 = ponder_string == "none" ? static_cast<u16>(Move::MOVE_NONE) : USI::to_move16(ponder_string).to_u16();
-				internal_book[sfen][move16] = { move16, ponder16, num_win, num_lose, sum_values, num_values };
+			if (thread == nullptr) {
+				// goコマンドに局面の履歴を渡しているので、局面を作り直す。
+				std::string position_command = "startpos moves";
+				for (auto move : internal_moves) {
+					position_command += " ";
+					position_command += to_usi_string(move.best);
+				}
+				std::istringstream iss(position_command);
+				position_cmd(pos, iss, states);
+			}
+			else {
+				states->emplace_back();
+				pos.do_move(pos.to_move(internal_move.best), states->back());
 			}
-
-			// 末尾の改行を読む
-			std::string _;
-			std::getline(ifs, _);
 		}
-		sync_cout << "done." << sync_endl;
-	}
 
-	void WriteInternalBook(const std::string& file_path, const InternalBook& internal_book) {
-		sync_cout << "WriteInternalBook(): file_path=" << file_path << sync_endl;
-		int counter = 0;
-		std::ofstream ofs(file_path);
-		for (const auto& [sfen, move16_to_book_move] : internal_book) {
-			if (++counter % 10000 == 0) {
-				sync_cout << counter << "/" << internal_book.size() << sync_endl;
-			}
+		// 終局処理
+		// 現局面のプレイヤーが勝ったかどうか。
+		bool current_player_is_win;
+		RepetitionState repetition_state = pos.is_repetition(0);
+		if (pos.is_mated()) {
+			// 負け
+			// 詰まされた
+			current_player_is_win = false;
+		}
+		else if (pos.DeclarationWin() != MOVE_NONE) {
+			// 勝ち
+			// 入玉勝利
+			current_player_is_win = true;
+		}
+		else if (!internal_moves.empty() && internal_moves.back().value >= settings.resign_value) {
+			// 勝ち
+			current_player_is_win = false;
+		}
+		else if (!internal_moves.empty() && internal_moves.back().value <= -settings.resign_value) {
+			// 負け
+			current_player_is_win = true;
+		}
+		else if (repetition_state == RepetitionState::REPETITION_WIN)
+		{
+			// 連続王手の千日手による勝ち
+			current_player_is_win = true;
+		}
+		else if (repetition_state == RepetitionState::REPETITION_LOSE)
+		{
+			// 連続王手の千日手による負け
+			current_player_is_win = false;
+		}
+		else if (repetition_state == RepetitionState::REPETITION_SUPERIOR)
+		{
+			// 優等局面
+			current_player_is_win = true;
+		}
+		else if (repetition_state == RepetitionState::REPETITION_INFERIOR)
+		{
+			// 劣等局面
+			current_player_is_win = false;
+		}
+		else {
+			// 引き分け
+			return false;
+		}
 
-			ofs << sfen << std::endl;
-			ofs << move16_to_book_move.size() << std::endl;
-			for (const auto& [move16, book_move] : move16_to_book_move) {
-				ofs
-					<< to_usi_string(book_move.move) << " "
-					<< to_usi_string(book_move.ponder) << " "
-					<< book_move.num_win << " "
-					<< book_move.num_lose << " "
-					<< book_move.sum_values << " "
-					<< book_move.num_values << std::endl;
-			}
+		// 先手が勝ったかどうか
+		black_win = current_player_is_win;
+		if (internal_moves.size() % 2 == 1) {
+			black_win = !black_win;
 		}
-		sync_cout << "done." << sync_endl;
+		return true;
 	}
 }
 
@@ -2528,8 +4620,17 @@ bool Tanuki::CreateUctBook() {
 	int max_search_per_position = static_cast<int>(Options[kBookUctMaxSearchPerPosition]);
 	int resign_value = static_cast<int>(Options["ResignValue"]);
 	std::string record_file = Options[kBookUctRecordFile];
+	int num_parallel_matches = static_cast<int>(Options[kBookUctParallelMatches]);
+	int search_depth = static_cast<int>(Options[kBookSearchDepth]);
+	int search_nodes = static_cast<int>(Options[kBookSearchNodes]);
+	bool ignore_book_ply = Options["IgnoreBookPly"];
 	ASSERT_LV3(max_moves_to_draw > 0);
 
+	if (num_parallel_matches > static_cast<int>(Threads.size())) {
+		sync_cout << "info string BookUctParallelMatches is limited by Threads. Threads=" << Threads.size() << sync_endl;
+		num_parallel_matches = static_cast<int>(Threads.size());
+	}
+
 	sync_cout << "output_book_file=" << output_book_file << sync_endl;
 	sync_cout << "ucb1_constant=" << ucb1_constant << sync_endl;
 	sync_cout << "time_ms=" << time_ms << sync_endl;
@@ -2538,242 +4639,98 @@ bool Tanuki::CreateUctBook() {
 	sync_cout << "max_moves_to_draw=" << max_moves_to_draw << sync_endl;
 	sync_cout << "max_search_per_position=" << max_search_per_position << sync_endl;
 	sync_cout << "resign_value=" << resign_value << sync_endl;
+	sync_cout << "num_parallel_matches=" << num_parallel_matches << sync_endl;
+	sync_cout << "ignore_book_ply=" << ignore_book_ply << sync_endl;
+	if (num_parallel_matches > 1) {
+		sync_cout << "search_depth=" << search_depth << sync_endl;
+		sync_cout << "search_nodes=" << search_nodes << sync_endl;
+	}
 
-	InternalBook internal_book;
-	ReadInternalBook("book\\" + output_book_file, internal_book);
-
-	time_t last_save_time_sec = std::time(nullptr);
-
-	std::random_device random_device;
-	std::mt19937_64 mt(random_device());
-
-	for (int match_index = 0; match_index < num_matches; ++match_index) {
-		sync_cout << "Match:" << match_index << "/" << num_matches << sync_endl;
-		std::vector<InternalMove> internal_moves;
-
-		Position pos;
-		StateListPtr states(new StateList(1));
-		{
-			std::istringstream iss("startpos");
-			position_cmd(pos, iss, states);
-		}
+	UctBookTable table(ignore_book_ply);
+	{
+		InternalBook internal_book;
+		ReadInternalBook("book\\" + output_book_file, internal_book);
+		table.Import(internal_book);
+	}
 
-		is_ready();
+	UctRecordWriter record_writer;
+	if (!record_writer.Open(record_file)) {
+		return false;
+	}
 
-		int black_time_ms = time_ms;
-		int white_time_ms = time_ms;
+	UctMatchSettings settings = { ucb1_constant, time_ms, inc_ms, max_moves_to_draw, max_search_per_position,
+		resign_value, search_depth, search_nodes };
 
-		while (pos.game_ply() < max_moves_to_draw &&
-			!pos.is_mated() &&
-			pos.DeclarationWin() == MOVE_NONE &&
-			(internal_moves.empty() || internal_moves.back().value == Value::VALUE_NONE || std::abs(internal_moves.back().value) < resign_value) &&
-			pos.is_repetition() == RepetitionState::REPETITION_NONE) {
-			InternalMove internal_move = {};
-			internal_move.best = Move::MOVE_NONE;
-			internal_move.next = Move::MOVE_NONE;
-			internal_move.value = Value::VALUE_NONE;
-			auto sfen = pos.sfen();
+	time_t last_save_time_sec = std::time(nullptr);
+	std::mutex save_mutex;
+	std::atomic_int global_match_index;
+	global_match_index = 0;
 
-			//sync_cout << "sfen=" << pos.sfen() << sync_endl;
+	// threadがnullptrの場合はgoコマンドで全スレッドを用いて対局する。
+	auto play_matches = [&](Thread* thread) {
+		for (int match_index = global_match_index++; match_index < num_matches; match_index = global_match_index++) {
+			sync_cout << "Match:" << match_index << "/" << num_matches << sync_endl;
 
-			// この局面で探索した回数を調べる。
-			// 探索した場合は、評価値を記録するため、その個数を調べる。
-			int num_searches = 0;
-			if (auto it = internal_book.find(sfen); it != internal_book.end()) {
-				for (const auto& [best16, internal_book_move] : it->second) {
-					num_searches += internal_book_move.num_values;
-				}
+			if (thread == nullptr) {
+				is_ready();
 			}
 
-			if (num_searches < max_search_per_position){
-				// この局面で探索した回数が一定値以下の場合、探索を行う。
-
-				// goコマンドを生成して実行する
-				std::string go_command = "go";
-				go_command += " btime " + std::to_string(black_time_ms);
-				go_command += " wtime " + std::to_string(white_time_ms);
-				go_command += " binc " + std::to_string(inc_ms);
-				go_command += " winc " + std::to_string(inc_ms);
-
-				//sync_cout << go_command << sync_endl;
-
-				// goコマンドを実行する
-				{
-					std::istringstream iss(go_command);
-					go_cmd(pos, iss, states);
-				}
-
-				// goコマンドを待機する
-				Threads.main()->wait_for_search_finished();
-
-				// 残り時間を更新する
-				TimePoint elapsed = Time.elapsed() + 1;
-				if (pos.game_ply() % 2 == 1) {
-					// 先手
-					black_time_ms += inc_ms;
-					black_time_ms -= static_cast<int>(elapsed);
-				}
-				else {
-					white_time_ms += inc_ms;
-					white_time_ms -= static_cast<int>(elapsed);
-				}
-
-				// 選ばれた指し手のスコアをこの局面のスコアとして記録する
-				// 終局している場合はmated_in(0)が代入されている。
-				const auto& root_moves = Threads.main()->rootMoves;
-
-				// 指し手と評価値を保存する
-				internal_move.best = root_moves[0].pv[0];
-				if (root_moves[0].pv.size() > 1) {
-					internal_move.next = root_moves[0].pv[1];
-				}
-				internal_move.value = root_moves[0].score;
-				internal_move.depth = Threads.get_best_thread()->completedDepth;
-				internal_move.book = 0;
+			std::vector<InternalMove> internal_moves;
+			bool black_win = false;
+			if (!PlayUctMatch(table, settings, thread, internal_moves, black_win)) {
+				// 引き分け
+				// この対局は定跡データベースに記録しない。
+				continue;
 			}
-			else {
-				// 定跡の指し手を指す
-				auto it = internal_book.find(sfen);
-				ASSERT_LV3(it != internal_book.end());
-				//sync_cout << "Selecting a move with the book." << sync_endl;
-
-				// 全シミュレーション回数を求める
-				int N = 0;
-				for (const auto& [best16, internal_book_move] : it->second) {
-					N += internal_book_move.num_win;
-					N += internal_book_move.num_lose;
-				}
-
-				// 最大の UCB1 を求める。
-				double best_ucb1 = 0.0;
-				InternalBookMove best_internal_book_move;
-				for (const auto& [best16, internal_book_move] : it->second) {
-					double w = internal_book_move.num_win;
-					double n = internal_book_move.num_win + internal_book_move.num_lose;
-					double ucb1 = w / n + ucb1_constant * std::sqrt(std::log(N) / n);
-					//sync_cout << "w=" << w << " n=" << n << " ucb1=" << ucb1 << sync_endl;
-					if (best_ucb1 < ucb1) {
-						best_ucb1 = ucb1;
-						best_internal_book_move = internal_book_move;
-					}
-				}
 
-				//その手を指す
-				internal_move.best = best_internal_book_move.move.to_u16();
-				internal_move.next = best_internal_book_move.ponder.to_u16();
-				internal_move.value = Value::VALUE_NONE;
-				internal_move.book = 1;
-				internal_move.depth = 0;
+			// 定跡データベースに追加していく
+			Position pos;
+			StateListPtr states(new StateList(1));
+			pos.set_hirate(&states->back(), thread == nullptr ? Threads.main() : thread);
+			bool win = black_win;
+			for (int play = 0; play < static_cast<int>(internal_moves.size()); ++play) {
+				Move16 move = internal_moves[play].best;
+				Move16 ponder = play + 1 < static_cast<int>(internal_moves.size())
+					? Move16(internal_moves[play + 1].best) : Move16(Move::MOVE_NONE);
+				table.Update(pos, move, ponder, win, internal_moves[play].value);
+
+				states->emplace_back();
+				pos.do_move(pos.to_move(move), states->back());
+				win = !win;
 			}
 
-			internal_moves.push_back(internal_move);
-
-			std::string position_command = "startpos";
-			if (!internal_moves.empty()) {
-				position_command += " moves";
-			}
-			for (auto move : internal_moves) {
-				position_command += " ";
-				position_command += to_usi_string(move.best);
-			}
 			{
-				std::istringstream iss(position_command);
-				position_cmd(pos, iss, states);
-			}
-		}
-
-		// 終局処理
-		// 現局面のプレイヤーが勝ったかどうか。
-		bool current_player_is_win;
-		RepetitionState repetition_state = pos.is_repetition(0);
-		if (pos.is_mated()) {
-			// 負け
-			// 詰まされた
-			current_player_is_win = false;
-		}
-		else if (pos.DeclarationWin() != MOVE_NONE) {
-			// 勝ち
-			// 入玉勝利
-			current_player_is_win = true;
-		}
-		else if (!internal_moves.empty() && internal_moves.back().value >= resign_value) {
-			// 勝ち
-			current_player_is_win = false;
-		}
-		else if (!internal_moves.empty() && internal_moves.back().value <= -resign_value) {
-			// 負け
-			current_player_is_win = true;
-		}
-		else if (repetition_state == RepetitionState::REPETITION_WIN)
-		{
-			// 連続王手の千日手による勝ち
-			current_player_is_win = true;
-		}
-		else if (repetition_state == RepetitionState::REPETITION_LOSE)
-		{
-			// 連続王手の千日手による負け
-			current_player_is_win = false;
-		}
-		else if (repetition_state == RepetitionState::REPETITION_SUPERIOR)
-		{
-			// 優等局面
-			current_player_is_win = true;
-		}
-		else if (repetition_state == RepetitionState::REPETITION_INFERIOR)
-		{
-			// 劣等局面
-			current_player_is_win = false;
-		}
-		else {
-			// 引き分け
-			// この対局は定跡データベースに記録しない。
-			continue;
-		}
-
-		// 先手が勝ったかどうか
-		bool win = current_player_is_win;
-		if (internal_moves.size() % 2 == 1) {
-			win = !win;
-		}
-
-		// 定跡データベースに追加していく
-		states.reset(new StateList(1));
-		pos.set_hirate(&states->back(), Threads.main());
-		for (int play = 0; play < static_cast<int>(internal_moves.size()); ++play) {
-			auto sfen = pos.sfen();
-			auto move = internal_moves[play].best;
-			auto value = internal_moves[play].value;
-			auto& internal_book_move = internal_book[sfen][move];
-			internal_book_move.move = move;
-			if (play + 1 < static_cast<int>(internal_moves.size())) {
-				internal_book_move.ponder = internal_moves[play + 1].best;
-			}
-
-			if (win) {
-				++internal_book_move.num_win;
-			}
-			else {
-				++internal_book_move.num_lose;
-			}
-
-			if (value != Value::VALUE_NONE) {
-				++internal_book_move.num_values;
-				internal_book_move.sum_values += value;
+				std::lock_guard<std::mutex> lock(save_mutex);
+				if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
+					table.Write("book\\" + output_book_file);
+					record_writer.Flush();
+					last_save_time_sec = std::time(nullptr);
+				}
 			}
 
-			states->emplace_back();
-			pos.do_move(pos.to_move(move), states->back());
-			win = !win;
+			record_writer.Append(win ? 0 : 1, internal_moves);
 		}
+	};
 
-		if (last_save_time_sec + kSavePerAtMostSec < std::time(nullptr)) {
-			WriteInternalBook("book\\" + output_book_file, internal_book);
-			last_save_time_sec = std::time(nullptr);
+	if (num_parallel_matches <= 1) {
+		play_matches(nullptr);
+	}
+	else {
+		// 対局ごとに1スレッドとそのスレッドの置換表を割り当て、複数の対局を同時に行う。
+		SetUpBookSearchLimits();
+		is_ready();
+		omp_set_num_threads(num_parallel_matches);
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			WinProcGroup::bindThisThread(thread_index);
+			play_matches(Threads[thread_index]);
 		}
-
-		WriteRecordToSQLite(record_file, win ? 0 : 1, internal_moves);
 	}
 
+	table.Write("book\\" + output_book_file);
+	record_writer.Close();
+
 	return true;
 }
 
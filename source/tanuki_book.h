@@ -16,6 +16,7 @@ namespace Tanuki {
 	bool PropagateLeafNodeValuesToRoot();
 	bool ExtractTargetPositions();
 	bool AddTargetPositions();
+	bool EndlessTeraShock();
 	bool CreateFromTanukiColiseum();
 	bool Create18Book();
 	bool CreateTayayanBook();
@@ -0,0 +1,440 @@
+﻿#include "tanuki_kifu_container.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "misc.h"
+#include "tanuki_kifu_reader.h"
+
+using Learner::PackedSfenValue;
+using Tanuki::KifuContainer::BlockIndexEntry;
+
+namespace {
+	constexpr int kBufferSize = 1024 * 1024;
+	constexpr char kMagic[8] = { 'T', 'N', 'K', 'K', 'I', 'F', 'U', 'Z' };
+	constexpr u32 kVersion = 1;
+
+	struct FileHeader {
+		char magic[8];
+		u32 version;
+		u32 block_records;
+	};
+	static_assert(sizeof(FileHeader) == 16);
+
+	struct BlockHeader {
+		u32 codec;
+		u32 num_records;
+		u32 compressed_bytes;
+		// 展開後のデータのCRC32
+		u32 checksum;
+	};
+	static_assert(sizeof(BlockHeader) == 16);
+	static_assert(sizeof(BlockIndexEntry) == 16);
+
+	struct Footer {
+		u64 index_offset;
+		u64 num_blocks;
+		u64 num_records;
+		u32 index_checksum;
+		u32 reserved;
+		char magic[8];
+	};
+	static_assert(sizeof(Footer) == 40);
+
+	// CodecDeltaRleのランレングス圧縮の制御バイト
+	// 0x00-0x7f : 続く(c + 1)バイトをそのまま出力する
+	// 0x80-0xff : 続く1バイトを(c - 0x80 + kMinRun)回繰り返す
+	constexpr int kMinRun = 3;
+	constexpr int kMaxRun = 0x7f + kMinRun;
+	constexpr int kMaxLiteral = 0x80;
+
+	// 局面をバイト毎の列に並べ替え、同じ列の直前の局面との差分に変換する。
+	// 手数や評価値など、隣り合う局面で値が近いフィールドが0付近に集まる。
+	void Transpose(const PackedSfenValue* records, size_t num_records, std::vector<u8>& planes) {
+		const u8* bytes = reinterpret_cast<const u8*>(records);
+		planes.resize(num_records * sizeof(PackedSfenValue));
+		for (size_t byte_index = 0; byte_index < sizeof(PackedSfenValue); ++byte_index) {
+			u8* plane = &planes[byte_index * num_records];
+			u8 previous = 0;
+			for (size_t record_index = 0; record_index < num_records; ++record_index) {
+				u8 current = bytes[record_index * sizeof(PackedSfenValue) + byte_index];
+				plane[record_index] = static_cast<u8>(current - previous);
+				previous = current;
+			}
+		}
+	}
+
+	void Untranspose(const std::vector<u8>& planes, size_t num_records, PackedSfenValue* records) {
+		u8* bytes = reinterpret_cast<u8*>(records);
+		for (size_t byte_index = 0; byte_index < sizeof(PackedSfenValue); ++byte_index) {
+			const u8* plane = &planes[byte_index * num_records];
+			u8 previous = 0;
+			for (size_t record_index = 0; record_index < num_records; ++record_index) {
+				previous = static_cast<u8>(previous + plane[record_index]);
+				bytes[record_index * sizeof(PackedSfenValue) + byte_index] = previous;
+			}
+		}
+	}
+
+	void EncodeRle(const std::vector<u8>& input, std::vector<u8>& output) {
+		output.clear();
+		size_t size = input.size();
+		size_t literal_begin = 0;
+		size_t i = 0;
+
+		auto flush_literals = [&](size_t end) {
+			while (literal_begin < end) {
+				size_t length = std::min<size_t>(end - literal_begin, kMaxLiteral);
+				output.push_back(static_cast<u8>(length - 1));
+				output.insert(output.end(), input.begin() + literal_begin, input.begin() + literal_begin + length);
+				literal_begin += length;
+			}
+		};
+
+		while (i < size) {
+			size_t run = 1;
+			while (i + run < size && run < kMaxRun && input[i + run] == input[i]) {
+				++run;
+			}
+
+			if (run >= kMinRun) {
+				flush_literals(i);
+				output.push_back(static_cast<u8>(0x80 + run - kMinRun));
+				output.push_back(input[i]);
+				i += run;
+				literal_begin = i;
+			}
+			else {
+				i += run;
+			}
+		}
+		flush_literals(size);
+	}
+
+	bool DecodeRle(const u8* input, size_t input_size, std::vector<u8>& output, size_t output_size) {
+		output.resize(output_size);
+		size_t out = 0;
+		size_t i = 0;
+		while (i < input_size) {
+			u8 control = input[i++];
+			if (control < 0x80) {
+				size_t length = control + 1;
+				if (i + length > input_size || out + length > output_size) {
+					return false;
+				}
+				std::memcpy(&output[out], input + i, length);
+				i += length;
+				out += length;
+			}
+			else {
+				size_t length = control - 0x80 + kMinRun;
+				if (i >= input_size || out + length > output_size) {
+					return false;
+				}
+				std::memset(&output[out], input[i++], length);
+				out += length;
+			}
+		}
+		return out == output_size;
+	}
+}
+
+bool Tanuki::KifuContainer::IsContainerFile(const std::string& file_path) {
+	FILE* file = std::fopen(file_path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	char magic[sizeof(kMagic)];
+	bool result = std::fread(magic, sizeof(magic), 1, file) == 1 && IsContainer(magic, sizeof(magic));
+	std::fclose(file);
+	return result;
+}
+
+bool Tanuki::KifuContainer::IsContainer(const void* data, size_t size) {
+	return size >= sizeof(kMagic) && std::memcmp(data, kMagic, sizeof(kMagic)) == 0;
+}
+
+u32 Tanuki::KifuContainer::Crc32(const void* data, size_t size) {
+	static const auto table = [] {
+		std::vector<u32> table(256);
+		for (u32 i = 0; i < 256; ++i) {
+			u32 c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : (c >> 1);
+			}
+			table[i] = c;
+		}
+		return table;
+	}();
+
+	const u8* bytes = static_cast<const u8*>(data);
+	u32 crc = 0xffffffffu;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffu;
+}
+
+Tanuki::KifuContainerWriter::KifuContainerWriter(const std::string& output_file_path,
+	int block_records, KifuContainer::Codec codec)
+	: output_file_path_(output_file_path), block_records_(block_records), codec_(codec) {
+	block_.reserve(block_records_);
+}
+
+Tanuki::KifuContainerWriter::~KifuContainerWriter() { Close(); }
+
+bool Tanuki::KifuContainerWriter::Write(const PackedSfenValue& record) {
+	return Write(&record, 1);
+}
+
+bool Tanuki::KifuContainerWriter::Write(const PackedSfenValue* records, size_t num_records) {
+	if (!EnsureOpen()) {
+		return false;
+	}
+
+	while (num_records > 0) {
+		size_t length = std::min<size_t>(num_records, block_records_ - block_.size());
+		block_.insert(block_.end(), records, records + length);
+		records += length;
+		num_records -= length;
+
+		if (static_cast<int>(block_.size()) == block_records_ && !FlushBlock()) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool Tanuki::KifuContainerWriter::Close() {
+	if (!file_) {
+		return true;
+	}
+
+	bool result = FlushBlock();
+
+	Footer footer = {};
+	footer.index_offset = offset_;
+	footer.num_blocks = index_.size();
+	footer.num_records = num_records_;
+	footer.index_checksum = KifuContainer::Crc32(index_.data(), sizeof(BlockIndexEntry) * index_.size());
+	std::memcpy(footer.magic, kMagic, sizeof(kMagic));
+
+	if (std::fwrite(index_.data(), sizeof(BlockIndexEntry), index_.size(), file_) != index_.size() ||
+		std::fwrite(&footer, sizeof(footer), 1, file_) != 1) {
+		sync_cout << "info string Failed to write the block index: output_file_path="
+			<< output_file_path_ << sync_endl;
+		result = false;
+	}
+
+	if (std::fclose(file_) != 0) {
+		sync_cout << "info string Failed to close the output kifu file: output_file_path="
+			<< output_file_path_ << sync_endl;
+		result = false;
+	}
+	file_ = nullptr;
+	index_.clear();
+	return result;
+}
+
+bool Tanuki::KifuContainerWriter::EnsureOpen() {
+	if (file_) {
+		return true;
+	}
+	file_ = std::fopen(output_file_path_.c_str(), "wb");
+	if (!file_) {
+		sync_cout << "info string Failed to open the output kifu file: output_file_path_="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+
+	if (std::setvbuf(file_, nullptr, _IOFBF, kBufferSize)) {
+		sync_cout << "info string Failed to set the output buffer: output_file_path_="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+
+	FileHeader header = {};
+	std::memcpy(header.magic, kMagic, sizeof(kMagic));
+	header.version = kVersion;
+	header.block_records = block_records_;
+	if (std::fwrite(&header, sizeof(header), 1, file_) != 1) {
+		sync_cout << "info string Failed to write the file header: output_file_path_="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+	offset_ = sizeof(header);
+	num_records_ = 0;
+
+	return true;
+}
+
+bool Tanuki::KifuContainerWriter::FlushBlock() {
+	if (block_.empty()) {
+		return true;
+	}
+
+	size_t raw_bytes = sizeof(PackedSfenValue) * block_.size();
+	BlockHeader header = {};
+	header.codec = KifuContainer::CodecStored;
+	header.num_records = static_cast<u32>(block_.size());
+	header.checksum = KifuContainer::Crc32(block_.data(), raw_bytes);
+
+	const void* payload = block_.data();
+	size_t payload_bytes = raw_bytes;
+	if (codec_ == KifuContainer::CodecDeltaRle) {
+		std::vector<u8> planes;
+		Transpose(block_.data(), block_.size(), planes);
+		EncodeRle(planes, compressed_);
+		// 圧縮しても小さくならない場合はそのまま格納する
+		if (compressed_.size() < raw_bytes) {
+			header.codec = KifuContainer::CodecDeltaRle;
+			payload = compressed_.data();
+			payload_bytes = compressed_.size();
+		}
+	}
+	header.compressed_bytes = static_cast<u32>(payload_bytes);
+
+	if (std::fwrite(&header, sizeof(header), 1, file_) != 1 ||
+		std::fwrite(payload, 1, payload_bytes, file_) != payload_bytes) {
+		sync_cout << "info string Failed to write a block: output_file_path_="
+			<< output_file_path_ << sync_endl;
+		return false;
+	}
+
+	index_.push_back({ offset_, header.num_records, header.compressed_bytes });
+	offset_ += sizeof(header) + payload_bytes;
+	num_records_ += block_.size();
+	block_.clear();
+	return true;
+}
+
+Tanuki::KifuContainerReader::KifuContainerReader() {}
+
+Tanuki::KifuContainerReader::~KifuContainerReader() { Close(); }
+
+bool Tanuki::KifuContainerReader::Open(const std::string& file_path) {
+	auto file = std::make_unique<MappedKifuFile>();
+	if (!file->Open(file_path)) {
+		return false;
+	}
+	return Open(std::move(file));
+}
+
+bool Tanuki::KifuContainerReader::Open(std::unique_ptr<MappedKifuFile> file) {
+	Close();
+
+	const u8* bytes = static_cast<const u8*>(file->Bytes());
+	size_t size = file->NumBytes();
+	if (size < sizeof(FileHeader) + sizeof(Footer) || !KifuContainer::IsContainer(bytes, size)) {
+		sync_cout << "info string Not a compressed kifu file." << sync_endl;
+		return false;
+	}
+
+	FileHeader header;
+	std::memcpy(&header, bytes, sizeof(header));
+	if (header.version != kVersion) {
+		sync_cout << "info string Unsupported compressed kifu version: version=" << header.version << sync_endl;
+		return false;
+	}
+
+	// 索引の大きさはファイルサイズから上限が決まるので、先にnum_blocksを検証してから掛け算する。
+	// こうしないと、壊れたnum_blocksで掛け算が桁あふれしたり、巨大な索引を確保しようとしたりする。
+	Footer footer;
+	std::memcpy(&footer, bytes + size - sizeof(footer), sizeof(footer));
+	size_t max_num_blocks = std::min<size_t>((size - sizeof(FileHeader) - sizeof(footer)) / sizeof(BlockIndexEntry),
+		std::numeric_limits<int>::max());
+	if (!KifuContainer::IsContainer(footer.magic, sizeof(footer.magic)) ||
+		footer.num_blocks > max_num_blocks ||
+		footer.index_offset != size - sizeof(footer) - footer.num_blocks * sizeof(BlockIndexEntry)) {
+		sync_cout << "info string The block index of a compressed kifu file is broken." << sync_endl;
+		return false;
+	}
+
+	std::vector<BlockIndexEntry> index(footer.num_blocks);
+	std::memcpy(index.data(), bytes + footer.index_offset, sizeof(BlockIndexEntry) * index.size());
+	if (KifuContainer::Crc32(index.data(), sizeof(BlockIndexEntry) * index.size()) != footer.index_checksum) {
+		sync_cout << "info string The block index checksum of a compressed kifu file does not match." << sync_endl;
+		return false;
+	}
+
+	// 各ブロックがFileHeaderと索引の間に収まり、展開後の大きさが圧縮後の大きさから見て妥当かを確かめる。
+	// ランレングス圧縮は2バイトで最大kMaxRunバイトに展開されるので、それを超える局面数は壊れている。
+	for (const auto& entry : index) {
+		if (entry.offset < sizeof(FileHeader) || entry.offset > footer.index_offset ||
+			sizeof(BlockHeader) + entry.compressed_bytes > footer.index_offset - entry.offset ||
+			sizeof(PackedSfenValue) * u64(entry.num_records) > u64(entry.compressed_bytes) * kMaxRun) {
+			sync_cout << "info string A block index entry of a compressed kifu file is broken." << sync_endl;
+			return false;
+		}
+	}
+
+	file_ = std::move(file);
+	index_ = std::move(index);
+	num_records_ = footer.num_records;
+	return true;
+}
+
+void Tanuki::KifuContainerReader::Close() {
+	file_.reset();
+	index_.clear();
+	num_records_ = 0;
+}
+
+bool Tanuki::KifuContainerReader::ReadBlock(int block_index, std::vector<PackedSfenValue>& records) const {
+	const BlockIndexEntry& entry = index_[block_index];
+	const u8* bytes = static_cast<const u8*>(file_->Bytes());
+	if (entry.offset + sizeof(BlockHeader) + entry.compressed_bytes > file_->NumBytes()) {
+		sync_cout << "info string A block of a compressed kifu file is out of range: block_index="
+			<< block_index << sync_endl;
+		return false;
+	}
+
+	BlockHeader header;
+	std::memcpy(&header, bytes + entry.offset, sizeof(header));
+	const u8* payload = bytes + entry.offset + sizeof(header);
+	size_t raw_bytes = sizeof(PackedSfenValue) * header.num_records;
+	records.resize(header.num_records);
+
+	bool decoded = false;
+	if (header.num_records == entry.num_records && header.compressed_bytes == entry.compressed_bytes) {
+		switch (header.codec) {
+		case KifuContainer::CodecStored:
+			if (header.compressed_bytes == raw_bytes) {
+				std::memcpy(records.data(), payload, raw_bytes);
+				decoded = true;
+			}
+			break;
+
+		case KifuContainer::CodecDeltaRle: {
+			std::vector<u8> planes;
+			if (DecodeRle(payload, header.compressed_bytes, planes, raw_bytes)) {
+				Untranspose(planes, header.num_records, records.data());
+				decoded = true;
+			}
+			break;
+		}
+		}
+	}
+
+	if (!decoded) {
+		sync_cout << "info string Failed to decode a block of a compressed kifu file: block_index="
+			<< block_index << sync_endl;
+		return false;
+	}
+
+	if (KifuContainer::Crc32(records.data(), raw_bytes) != header.checksum) {
+		sync_cout << "info string The checksum of a block of a compressed kifu file does not match: block_index="
+			<< block_index << sync_endl;
+		return false;
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef _TANUKI_KIFU_CONTAINER_H_
+#define _TANUKI_KIFU_CONTAINER_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "learn/learn.h"
+
+// ブロック単位で圧縮した棋譜ファイルのコンテナ形式
+//
+// [FileHeader][Block 0][Block 1]...[Block N-1][BlockIndexEntry * N][Footer]
+//
+// 各ブロックはBlockHeaderと圧縮後のデータからなり、ブロック毎に圧縮方式を選べる。
+// 末尾の索引から任意のブロックに直接アクセスできるため、
+// ファイル全体を展開せずにブロック単位でシャッフルしたり、
+// 複数のスレッドで並列にブロックを展開したりできる。
+// 展開後のデータと索引にはそれぞれCRC32を持たせ、読み込み時に検証する。
+namespace Tanuki {
+	class MappedKifuFile;
+
+	namespace KifuContainer {
+		enum Codec : u32 {
+			// 無圧縮
+			CodecStored = 0,
+			// 局面をバイト毎の列に並べ替えて前の局面との差分を取り、ランレングス圧縮する
+			CodecDeltaRle = 1,
+		};
+
+		// 末尾の索引の1エントリ
+		struct BlockIndexEntry {
+			// ファイル先頭からBlockHeaderまでのバイト数
+			u64 offset;
+			u32 num_records;
+			u32 compressed_bytes;
+		};
+
+		// 1ブロックあたりの既定の局面数
+		constexpr int kDefaultBlockRecords = 64 * 1024;
+
+		// ファイルの先頭がコンテナ形式のマジックナンバーかどうかを調べる
+		bool IsContainerFile(const std::string& file_path);
+		bool IsContainer(const void* data, size_t size);
+
+		u32 Crc32(const void* data, size_t size);
+	}
+
+	// 圧縮棋譜コンテナの書き出し
+	class KifuContainerWriter {
+	public:
+		KifuContainerWriter(const std::string& output_file_path,
+			int block_records = KifuContainer::kDefaultBlockRecords,
+			KifuContainer::Codec codec = KifuContainer::CodecDeltaRle);
+		virtual ~KifuContainerWriter();
+		bool Write(const Learner::PackedSfenValue& record);
+		bool Write(const Learner::PackedSfenValue* records, size_t num_records);
+		// 残りのブロックと索引を書き出してファイルを閉じる
+		bool Close();
+
+	private:
+		bool EnsureOpen();
+		bool FlushBlock();
+
+		const std::string output_file_path_;
+		const int block_records_;
+		const KifuContainer::Codec codec_;
+		FILE* file_ = nullptr;
+		u64 offset_ = 0;
+		u64 num_records_ = 0;
+		std::vector<Learner::PackedSfenValue> block_;
+		std::vector<u8> compressed_;
+		std::vector<KifuContainer::BlockIndexEntry> index_;
+	};
+
+	// 圧縮棋譜コンテナの読み込み
+	// ファイルはメモリにマップして扱う。Open()後のReadBlock()は複数のスレッドから同時に呼び出してよい。
+	class KifuContainerReader {
+	public:
+		KifuContainerReader();
+		virtual ~KifuContainerReader();
+		bool Open(const std::string& file_path);
+		// マップ済みのファイルを引き継いで開く
+		bool Open(std::unique_ptr<MappedKifuFile> file);
+		void Close();
+		int NumBlocks() const { return static_cast<int>(index_.size()); }
+		u64 NumRecords() const { return num_records_; }
+		int NumBlockRecords(int block_index) const { return index_[block_index].num_records; }
+		bool ReadBlock(int block_index, std::vector<Learner::PackedSfenValue>& records) const;
+
+	private:
+		std::unique_ptr<MappedKifuFile> file_;
+		std::vector<KifuContainer::BlockIndexEntry> index_;
+		u64 num_records_ = 0;
+	};
+}
+
+#endif
+
+#endif
@@ -17,12 +17,16 @@
 #include "learn/learn.h"
 #include "misc.h"
 #include "search.h"
-#include "tanuki_kifu_writer.h"
+#include "tanuki_kifu_write_pipeline.h"
 #include "tanuki_progress_report.h"
 #include "tanuki_s_book_black_start_position_picker.h"
 #include "tanuki_sfen_start_position_picker.h"
 #include "thread.h"
 
+#if defined(EVAL_NNUE)
+#include "eval/nnue/evaluate_nnue.h"
+#endif
+
 #ifdef abs
 #undef abs
 #endif
@@ -58,6 +62,7 @@ namespace {
 	constexpr const char* kOptionGeneratorMaxEvalDiff = "GeneratorMaxEvalDiff";
 	constexpr const char* kOptionGeneratorRandomMove = "GeneratorRandomMove";
 	constexpr const char* kOptionGeneratorStartposType = "GeneratorStartposType";
+	constexpr const char* kOptionGeneratorCompressKifu = "GeneratorCompressKifu";
 	constexpr const char* kOptionConvertSfenToLearningDataInputSfenFileName =
 		"ConvertSfenToLearningDataInputSfenFileName";
 	constexpr const char* kOptionConvertSfenToLearningDataSearchDepth =
@@ -93,7 +98,8 @@ void Tanuki::InitializeGenerator(USI::OptionsMap& o) {
 	o[kOptionGeneratorMeasureDepth] << Option(false);
 	o[kOptionGeneratorStartPositionMaxPlay] << Option(std::numeric_limits<int>::max(), 1, std::numeric_limits<int>::max());
 	o[kOptionConvertSfenToLearningDataInputSfenFileName] << Option("nyugyoku_win.sfen");
-	o[kOptionConvertSfenToLearningDataSearchDepth] << Option(12, 1, MAX_PLY);
+	// 0なら探索せず、各局面の静的評価値を付ける
+	o[kOptionConvertSfenToLearningDataSearchDepth] << Option(12, 0, MAX_PLY);
 	o[kOptionConvertSfenToLearningDataOutputFileName] << Option("nyugyoku_win.bin");
 	o[kOptionGeneratorRandomMultiPV] << Option(1, 1, std::numeric_limits<int>::max());
 	o[kOptionGeneratorMinMultiPVPlay] << Option(1, 1, std::numeric_limits<int>::max());
@@ -101,6 +107,8 @@ void Tanuki::InitializeGenerator(USI::OptionsMap& o) {
 	o[kOptionGeneratorMaxMultiPVMoves] << Option(16, 0, std::numeric_limits<int>::max());
 	o[kOptionGeneratorMaxEvalDiff] << Option(30, 0, std::numeric_limits<int>::max());
 	o[kOptionGeneratorRandomMove] << Option(true);
+	// 生成した棋譜を圧縮棋譜コンテナ形式で書き出すかどうか
+	o[kOptionGeneratorCompressKifu] << Option(false);
 }
 
 namespace {
@@ -181,6 +189,7 @@ void Tanuki::GenerateKifu() {
 	int max_multi_pv_moves = Options[kOptionGeneratorMaxMultiPVMoves];
 	int max_eval_diff = Options[kOptionGeneratorMaxEvalDiff];
 	bool random_move = Options[kOptionGeneratorRandomMove];
+	bool compress_kifu = Options[kOptionGeneratorCompressKifu];
 
 	std::cout << "search_depth=" << search_depth << std::endl;
 	std::cout << "num_positions=" << num_positions << std::endl;
@@ -194,6 +203,7 @@ void Tanuki::GenerateKifu() {
 	std::cout << "max_multi_pv_count=" << max_multi_pv_moves << std::endl;
 	std::cout << "max_eval_diff=" << max_eval_diff << std::endl;
 	std::cout << "random_move=" << random_move << std::endl;
+	std::cout << "compress_kifu=" << compress_kifu << std::endl;
 
 	Search::LimitsType limits;
 	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
@@ -203,32 +213,39 @@ void Tanuki::GenerateKifu() {
 	limits.enteringKingRule = EKR_27_POINT;
 	Search::Limits = limits;
 
-	// 何手目 -> 探索深さ
-	std::vector<std::vector<int> > game_play_to_depths(kMaxGamePlay + 1);
+	// スレッド毎の 何手目 -> 探索深さ
+	// 生成中はスレッド間で共有せず、最後にまとめて集計する
+	std::vector<std::vector<std::vector<int> > > thread_game_play_to_depths(num_threads,
+		std::vector<std::vector<int> >(kMaxGamePlay + 1));
 
 	time_t start_time;
 	std::time(&start_time);
 
+	// 各スレッドの棋譜は専用のI/Oスレッドがまとめて書き出す
+	std::vector<std::string> output_file_paths;
+	for (int thread_index = 0; thread_index < num_threads; ++thread_index) {
+		char output_file_path[1024];
+		std::sprintf(output_file_path,
+			"%s/kifu.tag=%s.depth=%d.num_positions=%I64d.start_time=%I64d.thread_index=%03d.bin",
+			kifu_directory.c_str(), output_file_name_tag.c_str(), search_depth, num_positions,
+			start_time, thread_index);
+		output_file_paths.push_back(output_file_path);
+	}
+	KifuWritePipeline write_pipeline(output_file_paths, num_threads, compress_kifu);
+
 	// スレッド間で共有する
 	std::atomic_int64_t global_position_index;
 	global_position_index = 0;
 	ProgressReport progress_report(num_positions, 60 * 60);
-	std::mutex mutex_game_play_to_depths;
-	std::atomic<bool> need_wait = false;
+	// 処理速度が低下した場合、この時刻まで全てのスレッドが待機する
+	std::atomic<time_t> wait_until = 0;
 	std::atomic<int> num_records = 0;
 
 #pragma omp parallel
 	{
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
-		char output_file_path[1024];
-		std::sprintf(output_file_path,
-			"%s/kifu.tag=%s.depth=%d.num_positions=%I64d.start_time=%I64d.thread_index=%03d.bin",
-			kifu_directory.c_str(), output_file_name_tag.c_str(), search_depth, num_positions,
-			start_time, thread_index);
-		// 各スレッドに持たせる
-		std::unique_ptr<KifuWriter> kifu_writer =
-			std::make_unique<KifuWriter>(output_file_path);
+		auto& game_play_to_depths = thread_game_play_to_depths[thread_index];
 		std::mt19937_64 mt19937_64(start_time + thread_index);
 
 		std::vector<StateInfo> state_info(1024);
@@ -315,7 +332,6 @@ void Tanuki::GenerateKifu() {
 				// 何らかの形で勝ちが決まっている局面は
 				// 探索深さが極端に深くなるため除外する
 				if (measure_depth && abs(root_move.score) < VALUE_KNOWN_WIN) {
-					std::lock_guard<std::mutex> lock(mutex_game_play_to_depths);
 					game_play_to_depths[pos.game_ply()].push_back(thread.rootDepth);
 				}
 			}
@@ -361,38 +377,31 @@ void Tanuki::GenerateKifu() {
 				records.back().last_position = true;
 			}
 
-			for (const auto& record : records) {
-				if (!kifu_writer->Write(record)) {
-					sync_cout << "info string Failed to write a record." << sync_endl;
-					std::exit(1);
-				}
+			int64_t num_game_records = records.size();
+			write_pipeline.Push(thread_index, records);
+			if (write_pipeline.Failed()) {
+				std::exit(1);
 			}
 
-			progress_report.Show(global_position_index += records.size());
-
-			need_wait = need_wait ||
-				(progress_report.HasDataPerTime() &&
-					progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime());
+			progress_report.Show(global_position_index += num_game_records);
 
-			if (need_wait) {
+			if (progress_report.HasDataPerTime() &&
+				progress_report.GetDataPerTime() * 2 < progress_report.GetMaxDataPerTime()) {
 				// 処理速度が低下してきている。
-				// 全てのスレッドを待機する。
-#pragma omp barrier
-
-				// マスタースレッドでしばらく待機する。
-#pragma omp master
-				{
+				// 最初に気付いたスレッドが待機終了時刻を設定し、全てのスレッドがそれぞれ待機する。
+				time_t current_time = std::time(nullptr);
+				time_t expected = wait_until;
+				if (expected <= current_time &&
+					wait_until.compare_exchange_strong(expected, current_time + 10 * 60)) {
 					sync_cout << "Speed is down. Waiting for a while. GetDataPerTime()=" <<
 						progress_report.GetDataPerTime() << " GetMaxDataPerTime()=" <<
 						progress_report.GetMaxDataPerTime() << sync_endl;
-
-					std::this_thread::sleep_for(std::chrono::minutes(10));
 					progress_report.Reset();
-					need_wait = false;
 				}
+			}
 
-				// マスタースレッドの待機が終わるまで、再度全てのスレッドを待機する。
-#pragma omp barrier
+			while (std::time(nullptr) < wait_until) {
+				std::this_thread::sleep_for(std::chrono::seconds(1));
 			}
 		}
 
@@ -401,6 +410,19 @@ void Tanuki::GenerateKifu() {
 		Threads.stop = true;
 	}
 
+	if (!write_pipeline.Close()) {
+		std::exit(1);
+	}
+
+	// スレッド毎の探索深さを集計する
+	std::vector<std::vector<int> > game_play_to_depths(kMaxGamePlay + 1);
+	for (const auto& depths : thread_game_play_to_depths) {
+		for (int game_play = 0; game_play <= kMaxGamePlay; ++game_play) {
+			game_play_to_depths[game_play].insert(game_play_to_depths[game_play].end(),
+				depths[game_play].begin(), depths[game_play].end());
+		}
+	}
+
 	std::cout << "Number of plays per record=" << global_position_index / num_records << std::endl;
 
 	if (measure_depth) {
@@ -435,7 +457,8 @@ void Tanuki::GenerateKifu() {
 void Tanuki::ConvertSfenToLearningData() {
 	//Eval::load_eval();
 
-	omp_set_num_threads((int)Options["Threads"]);
+	int num_threads = (int)Options["Threads"];
+	omp_set_num_threads(num_threads);
 
 	Search::LimitsType limits;
 	// 引き分けの手数付近で引き分けの値が返るのを防ぐため1 << 16にする
@@ -471,14 +494,27 @@ void Tanuki::ConvertSfenToLearningData() {
 	global_sfen_index = 0;
 	int64_t num_sfens = sfens.size();
 	ProgressReport progress_report(num_sfens, 60);
-	std::unique_ptr<KifuWriter> kifu_writer =
-		std::make_unique<KifuWriter>(output_file_name);
-	std::mutex mutex;
+	// 全スレッドの棋譜を専用のI/Oスレッドが1つのファイルに書き出す
+	KifuWritePipeline write_pipeline({ output_file_name }, num_threads, false);
 #pragma omp parallel
 	{
 		int thread_index = ::omp_get_thread_num();
 		WinProcGroup::bindThisThread(thread_index);
 
+#if defined(EVAL_NNUE)
+		// 静的評価値はkMaxBatchSize局面ずつまとめて計算する
+		Eval::NNUE::BatchEvaluator batch_evaluator;
+		Value batch_scores[Eval::NNUE::kMaxBatchSize];
+		// 溜まっている局面の評価値を計算し、recordsの末尾の対応する局面に書き込む
+		auto flush_batch = [&](std::vector<Learner::PackedSfenValue>& records) {
+			const std::size_t n = batch_evaluator.size();
+			batch_evaluator.Evaluate(batch_scores);
+			for (std::size_t i = 0; i < n; ++i) {
+				records[records.size() - n + i].score = batch_scores[i];
+			}
+		};
+#endif
+
 		for (int64_t sfen_index = global_sfen_index++; sfen_index < num_sfens;
 			sfen_index = global_sfen_index++) {
 			const std::string& sfen = sfens[sfen_index];
@@ -505,15 +541,29 @@ void Tanuki::ConvertSfenToLearningData() {
 
 				pos.do_move(m, state[pos.game_ply()]);
 
-				Learner::search(pos, search_depth);
-				const auto& root_moves = pos.this_thread()->rootMoves;
-				const auto& root_move = root_moves[0];
-
 				Learner::PackedSfenValue record = {};
 				pos.sfen_pack(record.sfen);
-				record.score = root_move.score;
 				record.gamePly = pos.game_ply();
-				records.push_back(record);
+				if (search_depth > 0) {
+					Learner::search(pos, search_depth);
+					const auto& root_moves = pos.this_thread()->rootMoves;
+					const auto& root_move = root_moves[0];
+					record.score = root_move.score;
+					records.push_back(record);
+				}
+				else {
+#if defined(EVAL_NNUE)
+					// 評価値は後でまとめて計算する
+					records.push_back(record);
+					batch_evaluator.Add(pos);
+					if (batch_evaluator.size() == Eval::NNUE::kMaxBatchSize) {
+						flush_batch(records);
+					}
+#else
+					record.score = Eval::evaluate(pos);
+					records.push_back(record);
+#endif
+				}
 
 				if (pos.DeclarationWin()) {
 					win = pos.side_to_move();
@@ -521,6 +571,10 @@ void Tanuki::ConvertSfenToLearningData() {
 				}
 			}
 
+#if defined(EVAL_NNUE)
+			flush_batch(records);
+#endif
+
 			// sync_cout << pos << sync_endl;
 			// pos.DeclarationWin();
 
@@ -536,19 +590,18 @@ void Tanuki::ConvertSfenToLearningData() {
 				game_result = -game_result;
 			}
 
-			std::lock_guard<std::mutex> lock_gurad(mutex);
-			{
-				for (const auto& record : records) {
-					if (!kifu_writer->Write(record)) {
-						sync_cout << "info string Failed to write a record." << sync_endl;
-						std::exit(1);
-					}
-				}
+			write_pipeline.Push(thread_index, records);
+			if (write_pipeline.Failed()) {
+				std::exit(1);
 			}
 
 			progress_report.Show(global_sfen_index);
 		}
 	}
+
+	if (!write_pipeline.Close()) {
+		std::exit(1);
+	}
 }
 
 #endif
@@ -3,10 +3,24 @@
 
 #ifdef EVAL_LEARN
 
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
 #include <numeric>
 #include <sstream>
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "misc.h"
 #include "usi.h"
 
@@ -18,13 +32,143 @@ namespace {
 	constexpr int kBufferSize = 1024 * 1024;
 }
 
-Tanuki::KifuReader::KifuReader(const std::string& folder_name, int num_loops)
-	: folder_name_(folder_name), num_loops_(num_loops) {}
+Tanuki::MappedKifuFile::~MappedKifuFile() { Close(); }
+
+bool Tanuki::MappedKifuFile::Open(const std::string& file_path) {
+	Close();
+
+#ifdef _WIN32
+	HANDLE file_handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE) {
+		sync_cout << "info string Failed to open a kifu file: " << file_path << sync_endl;
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size)) {
+		sync_cout << "info string Failed to get the size of a kifu file: " << file_path << sync_endl;
+		CloseHandle(file_handle);
+		return false;
+	}
+
+	file_handle_ = file_handle;
+	mapped_bytes_ = static_cast<size_t>(file_size.QuadPart);
+	if (mapped_bytes_ > 0) {
+		HANDLE mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		void* address = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if (address == nullptr) {
+			sync_cout << "info string Failed to map a kifu file: " << file_path << sync_endl;
+			if (mapping_handle) {
+				CloseHandle(mapping_handle);
+			}
+			CloseHandle(file_handle);
+			file_handle_ = nullptr;
+			mapped_bytes_ = 0;
+			return false;
+		}
+		mapping_handle_ = mapping_handle;
+		data_ = static_cast<const PackedSfenValue*>(address);
+	}
+#else
+	int fd = ::open(file_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		sync_cout << "info string Failed to open a kifu file: " << file_path << sync_endl;
+		return false;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+		sync_cout << "info string Failed to get the size of a kifu file: " << file_path << sync_endl;
+		::close(fd);
+		return false;
+	}
+
+	mapped_bytes_ = static_cast<size_t>(st.st_size);
+	if (mapped_bytes_ > 0) {
+		void* address = ::mmap(nullptr, mapped_bytes_, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (address == MAP_FAILED) {
+			sync_cout << "info string Failed to map a kifu file: " << file_path << sync_endl;
+			::close(fd);
+			mapped_bytes_ = 0;
+			return false;
+		}
+		::madvise(address, mapped_bytes_, MADV_SEQUENTIAL);
+		data_ = static_cast<const PackedSfenValue*>(address);
+	}
+
+	// マップした領域はfdを閉じても有効
+	::close(fd);
+#endif
+
+	size_ = mapped_bytes_ / sizeof(PackedSfenValue);
+	is_open_ = true;
+	return true;
+}
+
+void Tanuki::MappedKifuFile::Close() {
+#ifdef _WIN32
+	if (data_) {
+		UnmapViewOfFile(data_);
+	}
+	if (mapping_handle_) {
+		CloseHandle(mapping_handle_);
+		mapping_handle_ = nullptr;
+	}
+	if (file_handle_) {
+		CloseHandle(file_handle_);
+		file_handle_ = nullptr;
+	}
+#else
+	if (data_) {
+		::munmap(const_cast<PackedSfenValue*>(data_), mapped_bytes_);
+	}
+#endif
+	data_ = nullptr;
+	size_ = 0;
+	mapped_bytes_ = 0;
+	is_open_ = false;
+}
+
+void Tanuki::MappedKifuFile::WillNeed() {
+	if (!data_) {
+		return;
+	}
+#ifdef _WIN32
+	// Windowsではマップ時のFILE_FLAG_SEQUENTIAL_SCANによる先読みに任せる
+#else
+	::madvise(const_cast<PackedSfenValue*>(data_), mapped_bytes_, MADV_WILLNEED);
+#endif
+}
+
+Tanuki::KifuReader::KifuReader(const std::string& folder_name, int num_loops, bool memory_mapped)
+	: folder_name_(folder_name), num_loops_(num_loops), memory_mapped_(memory_mapped) {}
 
 Tanuki::KifuReader::~KifuReader() { Close(); }
 
 bool Tanuki::KifuReader::Read(int num_records, std::vector<PackedSfenValue>& records) {
 	records.resize(num_records);
+
+	// ファイルリストを取得し、ファイルを開いた状態にする
+	// 圧縮棋譜コンテナが含まれている場合はここでメモリマップモードに切り替わる
+	if (!EnsureOpen()) {
+		return false;
+	}
+
+	if (memory_mapped_) {
+		size_t offset = 0;
+		while (offset < records.size()) {
+			const PackedSfenValue* data;
+			size_t num_read;
+			if (!Read(records.size() - offset, data, num_read)) {
+				return false;
+			}
+			std::memcpy(&records[offset], data, sizeof(PackedSfenValue) * num_read);
+			offset += num_read;
+		}
+		return true;
+	}
+
 	for (auto& record : records) {
 		if (!Read(record)) {
 			return false;
@@ -35,10 +179,21 @@ bool Tanuki::KifuReader::Read(int num_records, std::vector<PackedSfenValue>& rec
 
 bool Tanuki::KifuReader::Read(PackedSfenValue& record) {
 	// ファイルリストを取得し、ファイルを開いた状態にする
+	// 圧縮棋譜コンテナが含まれている場合はここでメモリマップモードに切り替わる
 	if (!EnsureOpen()) {
 		return false;
 	}
 
+	if (memory_mapped_) {
+		const PackedSfenValue* data;
+		size_t num_read;
+		if (!Read(1, data, num_read)) {
+			return false;
+		}
+		record = *data;
+		return true;
+	}
+
 	// ループ終了条件は以下の通りとする
 	if (file_index_ == static_cast<int>(file_paths_.size()) && loop_ == num_loops_) {
 		return false;
@@ -85,7 +240,53 @@ bool Tanuki::KifuReader::Read(PackedSfenValue& record) {
 	return true;
 }
 
+bool Tanuki::KifuReader::Read(size_t max_records, const PackedSfenValue*& records, size_t& num_records) {
+	ASSERT_LV3(memory_mapped_);
+
+	if (!EnsureOpen()) {
+		return false;
+	}
+
+	for (;;) {
+		if (container_reader_) {
+			// 圧縮棋譜コンテナの場合は、展開済みのブロックから返す
+			if (position_ < block_.size()) {
+				records = block_.data() + position_;
+				num_records = std::min(max_records, block_.size() - position_);
+				position_ += num_records;
+				return true;
+			}
+
+			if (block_index_ < container_reader_->NumBlocks()) {
+				if (!container_reader_->ReadBlock(block_index_++, block_)) {
+					return false;
+				}
+				position_ = 0;
+				continue;
+			}
+		}
+		else if (current_file_ && position_ < current_file_->Size()) {
+			records = current_file_->Data() + position_;
+			num_records = std::min(max_records, current_file_->Size() - position_);
+			position_ += num_records;
+			return true;
+		}
+
+		// 現在のファイルを読み終えていたら、先読み済みの次のファイルに切り替える
+		if (!AdvanceMappedFile()) {
+			return false;
+		}
+	}
+}
+
 bool Tanuki::KifuReader::Close() {
+	container_reader_.reset();
+	current_file_.reset();
+	next_file_.reset();
+
+	if (!file_) {
+		return true;
+	}
 	if (fclose(file_)) {
 		return false;
 	}
@@ -93,6 +294,83 @@ bool Tanuki::KifuReader::Close() {
 	return true;
 }
 
+bool Tanuki::KifuReader::OpenMappedFiles() {
+	current_file_ = std::make_unique<MappedKifuFile>();
+	if (!current_file_->Open(file_paths_[file_index_])) {
+		current_file_.reset();
+		return false;
+	}
+	current_file_->WillNeed();
+
+	PrefetchNextMappedFile();
+	return OpenContainerIfNeeded();
+}
+
+bool Tanuki::KifuReader::OpenContainerIfNeeded() {
+	container_reader_.reset();
+	block_.clear();
+	block_index_ = 0;
+	position_ = 0;
+
+	if (!KifuContainer::IsContainer(current_file_->Bytes(), current_file_->NumBytes())) {
+		return true;
+	}
+
+	container_reader_ = std::make_unique<KifuContainerReader>();
+	if (!container_reader_->Open(std::move(current_file_))) {
+		sync_cout << "info string Failed to open a compressed kifu file: " << file_paths_[file_index_] << sync_endl;
+		container_reader_.reset();
+		return false;
+	}
+	return true;
+}
+
+bool Tanuki::KifuReader::AdvanceMappedFile() {
+	if (loop_ == num_loops_) {
+		return false;
+	}
+
+	++file_index_;
+	if (file_index_ == static_cast<int>(file_paths_.size())) {
+		++loop_;
+		if (loop_ == num_loops_) {
+			container_reader_.reset();
+			current_file_.reset();
+			next_file_.reset();
+			return false;
+		}
+
+		file_index_ = 0;
+	}
+
+	// 先読みしておいたファイルがあれば、それをそのまま使う
+	if (next_file_ && next_file_->IsOpen()) {
+		current_file_ = std::move(next_file_);
+		PrefetchNextMappedFile();
+		return OpenContainerIfNeeded();
+	}
+
+	return OpenMappedFiles();
+}
+
+void Tanuki::KifuReader::PrefetchNextMappedFile() {
+	next_file_.reset();
+
+	int next_file_index = file_index_ + 1;
+	if (next_file_index == static_cast<int>(file_paths_.size())) {
+		if (loop_ + 1 == num_loops_) {
+			return;
+		}
+		next_file_index = 0;
+	}
+
+	// 開けなかった場合は、切り替え時にもう一度開き直してエラーを報告する
+	next_file_ = std::make_unique<MappedKifuFile>();
+	if (next_file_->Open(file_paths_[next_file_index])) {
+		next_file_->WillNeed();
+	}
+}
+
 bool Tanuki::KifuReader::EnsureOpen() {
 	if (!file_paths_.empty()) {
 		return true;
@@ -109,6 +387,19 @@ bool Tanuki::KifuReader::EnsureOpen() {
 		return false;
 	}
 
+	if (!memory_mapped_) {
+		for (const auto& file_path : file_paths_) {
+			if (KifuContainer::IsContainerFile(file_path)) {
+				memory_mapped_ = true;
+				break;
+			}
+		}
+	}
+
+	if (memory_mapped_) {
+		return OpenMappedFiles();
+	}
+
 	file_ = std::fopen(file_paths_[0].c_str(), "rb");
 
 	if (!file_) {
@@ -6,30 +6,78 @@
 #ifdef EVAL_LEARN
 
 #include <fstream>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
 #include "learn/learn.h"
+#include "tanuki_kifu_container.h"
 
 namespace Tanuki {
+	// 棋譜ファイル全体を読み込み専用でメモリにマップする
+	class MappedKifuFile {
+	public:
+		MappedKifuFile() = default;
+		MappedKifuFile(const MappedKifuFile&) = delete;
+		MappedKifuFile& operator=(const MappedKifuFile&) = delete;
+		virtual ~MappedKifuFile();
+		bool Open(const std::string& file_path);
+		void Close();
+		// 近いうちに先頭から順に読み込むことをOSに伝え、先読みさせる
+		void WillNeed();
+		bool IsOpen() const { return is_open_; }
+		const Learner::PackedSfenValue* Data() const { return data_; }
+		size_t Size() const { return size_; }
+		const void* Bytes() const { return data_; }
+		size_t NumBytes() const { return mapped_bytes_; }
+
+	private:
+		bool is_open_ = false;
+		const Learner::PackedSfenValue* data_ = nullptr;
+		size_t size_ = 0;
+		size_t mapped_bytes_ = 0;
+#ifdef _WIN32
+		void* file_handle_ = nullptr;
+		void* mapping_handle_ = nullptr;
+#endif
+	};
+
 	class KifuReader {
 	public:
-		KifuReader(const std::string& folder_name, int num_loops);
+		// memory_mapped=trueの場合、各ファイルをメモリにマップして読み込む。
+		// 次に読むファイルは事前にマップし、先読みさせておく。
+		// 圧縮棋譜コンテナ形式のファイルが含まれている場合は、常にメモリマップモードで読み込む。
+		KifuReader(const std::string& folder_name, int num_loops, bool memory_mapped = false);
 		virtual ~KifuReader();
 		bool Read(Learner::PackedSfenValue& record);
 		bool Read(int num_records, std::vector<Learner::PackedSfenValue>& records);
+		// メモリマップモード専用。コピーせずに、最大max_records個の連続した局面を返す。
+		// 返した領域は、次にRead()またはClose()を呼ぶまで有効。
+		bool Read(size_t max_records, const Learner::PackedSfenValue*& records, size_t& num_records);
 		bool Close();
 
 	private:
 		bool EnsureOpen();
+		bool OpenMappedFiles();
+		bool AdvanceMappedFile();
+		bool OpenContainerIfNeeded();
+		void PrefetchNextMappedFile();
 
 		const std::string folder_name_;
 		const int num_loops_;
+		bool memory_mapped_;
 		std::vector<std::string> file_paths_;
-		FILE* file_;
+		FILE* file_ = nullptr;
 		int loop_ = 0;
 		int file_index_ = 0;
+		std::unique_ptr<MappedKifuFile> current_file_;
+		std::unique_ptr<MappedKifuFile> next_file_;
+		size_t position_ = 0;
+		// 現在のファイルが圧縮棋譜コンテナの場合に使う
+		std::unique_ptr<KifuContainerReader> container_reader_;
+		int block_index_ = 0;
+		std::vector<Learner::PackedSfenValue> block_;
 	};
 }
 
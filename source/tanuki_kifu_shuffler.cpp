@@ -3,117 +3,410 @@
 
 #ifdef EVAL_LEARN
 
+#include <omp.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
 #include <ctime>
 #include <filesystem>
+#include <limits>
+#include <mutex>
 #include <random>
 
+#include "tanuki_kifu_container.h"
 #include "tanuki_kifu_reader.h"
 #include "tanuki_kifu_writer.h"
+#include "tanuki_progress_report.h"
 #include "misc.h"
 
 using Learner::PackedSfenValue;
 
 namespace {
 	static const constexpr char* kShuffledKifuDir = "ShuffledKifuDir";
-	// シャッフル後のファイル数
+	static const constexpr char* kShuffleMemoryBudgetMb = "ShuffleMemoryBudgetMB";
+	static const constexpr char* kShuffleCompressOutput = "ShuffleCompressOutput";
+	// 1回の振り分けで同時に開くファイル数の上限
 	// Windowsでは一度に512個までのファイルしか開けないため
 	// 256個に制限しておく
-	static const constexpr int kNumShuffledKifuFiles = 256;
-	static const constexpr int kMaxPackedSfenValues = 1024 * 1024;
+	// これを超える数のファイルが必要な場合は、振り分けたファイルをさらに振り分ける
+	static const constexpr int kMaxShuffledKifuFilesPerPass = 256;
+	// 進捗を更新する間隔の局面数
+	static const constexpr int kReadChunkRecords = 64 * 1024;
+	// 無圧縮の入力ファイルを複数のスレッドで分担する単位の局面数
+	static const constexpr int64_t kDivideUnitRecords = 4 * 1024 * 1024;
+	// 各スレッドが振り分け先のファイル毎に持つ書き込みバッファの局面数の下限
+	static const constexpr int kMinWriteBufferRecords = 256;
+	// KifuWriterがファイル毎に確保するstdioのバッファのバイト数
+	static const constexpr int64_t kWriterBufferBytes = 1024 * 1024;
+	// ファイルサイズのばらつきを考慮し、メモリ予算に対して余裕を持たせる
+	static const constexpr double kBucketSizeMargin = 1.25;
+	static const constexpr int kShowProgressPerAtMostSec = 60;
+
+	// 振り分けの入力の単位
+	// 圧縮棋譜コンテナはブロック単位、無圧縮のファイルは[begin, end)の局面の範囲を単位とする。
+	struct InputUnit {
+		int file_index;
+		// 無圧縮のファイルの場合は-1
+		int block_index;
+		int64_t begin;
+		int64_t end;
+	};
+
+	// 入力棋譜のファイル一覧を取得する
+	std::vector<std::string> ListKifuFiles(const std::string& folder_name) {
+		std::vector<std::string> file_paths;
+		for (const auto& entry : std::filesystem::directory_iterator(folder_name)) {
+			if (!entry.is_regular_file()) {
+				continue;
+			}
+			file_paths.push_back(entry.path().string());
+		}
+		return file_paths;
+	}
+
+	// 無圧縮のファイルをkDivideUnitRecords局面ずつの単位に分ける
+	void AddPlainFileUnits(int file_index, int64_t num_records, std::vector<InputUnit>& input_units) {
+		for (int64_t begin = 0; begin < num_records; begin += kDivideUnitRecords) {
+			input_units.push_back({ file_index, -1, begin, std::min(begin + kDivideUnitRecords, num_records) });
+		}
+	}
+
+	void ShowThroughput(const char* phase, int64_t num_records, time_t start_time) {
+		time_t elapsed_time = std::max<time_t>(std::time(nullptr) - start_time, 1);
+		sync_cout << "info string " << phase << ": num_records=" << num_records
+			<< " elapsed_sec=" << elapsed_time
+			<< " speed=" << num_records / elapsed_time << " (records/sec)" << sync_endl;
+	}
+
+	// 1回の振り分けで使うファイル数の上限を返す。
+	// 振り分け先のファイル毎に、stdioのバッファと、全スレッド分の書き込みバッファの下限が必要になるため、
+	// それらがメモリ予算に収まる数に制限する。
+	int MaxShuffledKifuFilesPerPass(int64_t memory_budget, int num_threads) {
+		int64_t bytes_per_file = kWriterBufferBytes
+			+ static_cast<int64_t>(num_threads) * kMinWriteBufferRecords * sizeof(PackedSfenValue);
+		return static_cast<int>(std::clamp<int64_t>(memory_budget / bytes_per_file, 2, kMaxShuffledKifuFilesPerPass));
+	}
+
+	// input_unitsの局面を、output_file_pathsのファイルへランダムに振り分ける。
+	// 書き込みはスレッド毎・ファイル毎のバッファに溜めてからまとめて行う。
+	// stdioのバッファと書き込みバッファの合計がmemory_budgetに収まるように、書き込みバッファの大きさを決める。
+	bool DivideKifu(const std::vector<std::string>& input_file_paths,
+		const std::vector<std::unique_ptr<Tanuki::KifuContainerReader> >& container_readers,
+		const std::vector<InputUnit>& input_units, int64_t total_records,
+		const std::vector<std::string>& output_file_paths, int num_threads, int64_t memory_budget, u64 seed,
+		int64_t& num_divided_records) {
+		using Tanuki::KifuWriter;
+		int num_output_files = static_cast<int>(output_file_paths.size());
+		int64_t write_buffer_budget = memory_budget - num_output_files * kWriterBufferBytes;
+		int write_buffer_records = static_cast<int>(std::clamp<int64_t>(
+			write_buffer_budget / num_threads / num_output_files / static_cast<int64_t>(sizeof(PackedSfenValue)),
+			kMinWriteBufferRecords, std::numeric_limits<int>::max()));
+
+		sync_cout << "info string num_input_units=" << input_units.size()
+			<< " total_records=" << total_records
+			<< " num_output_files=" << num_output_files
+			<< " write_buffer_records=" << write_buffer_records << sync_endl;
+
+		std::vector<std::unique_ptr<KifuWriter> > writers;
+		std::vector<std::mutex> writer_mutexes(num_output_files);
+		for (const auto& file_path : output_file_paths) {
+			writers.push_back(std::make_unique<KifuWriter>(file_path));
+		}
+
+		std::atomic<int> global_input_unit_index = 0;
+		std::atomic<int64_t> global_num_divided_records = 0;
+		std::atomic<bool> failed = false;
+		Tanuki::ProgressReport divide_progress_report(total_records, kShowProgressPerAtMostSec);
+
+#pragma omp parallel
+		{
+			int thread_index = ::omp_get_thread_num();
+			WinProcGroup::bindThisThread(thread_index);
+			std::mt19937_64 mt(seed + thread_index);
+			std::uniform_int_distribution<> dist(0, num_output_files - 1);
+
+			std::vector<std::vector<PackedSfenValue> > buffers(num_output_files);
+			for (auto& buffer : buffers) {
+				buffer.reserve(write_buffer_records);
+			}
+
+			auto flush = [&](int file_index) {
+				auto& buffer = buffers[file_index];
+				std::lock_guard<std::mutex> lock(writer_mutexes[file_index]);
+				if (!writers[file_index]->Write(buffer.data(), buffer.size())) {
+					sync_cout << "info string Failed to write records to a kifu file. " << output_file_paths[file_index] << sync_endl;
+					failed = true;
+				}
+				buffer.clear();
+			};
+
+			auto divide = [&](const PackedSfenValue* records, size_t num_records) {
+				for (size_t offset = 0; offset < num_records; offset += kReadChunkRecords) {
+					size_t num_read = std::min<size_t>(kReadChunkRecords, num_records - offset);
+					for (size_t record_index = offset; record_index < offset + num_read; ++record_index) {
+						int file_index = dist(mt);
+						buffers[file_index].push_back(records[record_index]);
+						if (static_cast<int>(buffers[file_index].size()) >= write_buffer_records) {
+							flush(file_index);
+						}
+					}
+					divide_progress_report.Show(global_num_divided_records += num_read);
+				}
+			};
+
+			Tanuki::MappedKifuFile input_file;
+			std::vector<PackedSfenValue> block;
+			for (int input_unit_index = global_input_unit_index++;
+				input_unit_index < static_cast<int>(input_units.size()) && !failed;
+				input_unit_index = global_input_unit_index++) {
+				const auto& input_unit = input_units[input_unit_index];
+				const auto& input_file_path = input_file_paths[input_unit.file_index];
+
+				if (input_unit.block_index >= 0) {
+					if (!container_readers[input_unit.file_index]->ReadBlock(input_unit.block_index, block)) {
+						sync_cout << "info string Failed to read a compressed kifu file. " << input_file_path << sync_endl;
+						failed = true;
+						break;
+					}
+					divide(block.data(), block.size());
+					continue;
+				}
+
+				// 入力ファイルはメモリにマップし、コピーせずに直接振り分ける
+				if (!input_file.Open(input_file_path)) {
+					failed = true;
+					break;
+				}
+				input_file.WillNeed();
+				int64_t end = std::min<int64_t>(input_unit.end, input_file.Size());
+				if (input_unit.begin < end) {
+					divide(input_file.Data() + input_unit.begin, end - input_unit.begin);
+				}
+				input_file.Close();
+			}
+
+			for (int file_index = 0; file_index < num_output_files; ++file_index) {
+				flush(file_index);
+			}
+		}
+
+		for (auto& writer : writers) {
+			writer->Close();
+		}
+
+		num_divided_records = global_num_divided_records;
+		return !failed;
+	}
 }
 
 void Tanuki::InitializeShuffler(USI::OptionsMap& o) {
 	o[kShuffledKifuDir] << USI::Option("kifu_shuffled");
+	// シャッフル中に使用するメモリ量の上限(MB)
+	// 2パス目では各スレッドが1ファイルずつメモリ上に読み込んでシャッフルするため、
+	// 1ファイルあたりのサイズが (この値 / スレッド数) 以下になるようにファイル数を決める。
+	// 1パス目の振り分けでは、振り分け先のファイル毎のstdioのバッファと書き込みバッファをこの値に収める。
+	o[kShuffleMemoryBudgetMb] << USI::Option(4096, 64, std::numeric_limits<int>::max());
+	// シャッフル後のファイルを圧縮棋譜コンテナ形式で書き出すかどうか
+	o[kShuffleCompressOutput] << USI::Option(false);
 }
 
+// 外部メモリを用いた2パスのシャッフルを行う。
+// 1パス目 : 各スレッドが入力を分担して読み込み、各局面をランダムに選んだ中間ファイルへ振り分ける。
+//           同時に開くファイル数には上限があるため、メモリ上でシャッフルできない大きさの中間ファイルは、
+//           さらに複数のファイルへ振り分け直す。
+// 2パス目 : 各スレッドが中間ファイルを1つずつメモリ上に読み込み、シャッフルして書き戻す。
 void Tanuki::ShuffleKifu() {
-	// 棋譜を入力し、複数のファイルにランダムに追加していく
-	sync_cout << "info string Reading and dividing kifu files..." << sync_endl;
-
 	std::string kifu_dir = Options["KifuDir"];
 	std::string shuffled_kifu_dir = Options[kShuffledKifuDir];
+	int num_threads = std::max(1, static_cast<int>(Options["Threads"]));
+	int64_t memory_budget = static_cast<int64_t>(static_cast<int>(Options[kShuffleMemoryBudgetMb])) * 1024 * 1024;
+
+	bool compress_output = Options[kShuffleCompressOutput];
+
+	// 入力を振り分けの単位に分割する。
+	// 圧縮棋譜コンテナはブロック毎に別々のスレッドで展開できるようにする。
+	std::vector<std::string> input_file_paths = ListKifuFiles(kifu_dir);
+	std::vector<std::unique_ptr<KifuContainerReader> > container_readers(input_file_paths.size());
+	std::vector<InputUnit> input_units;
+	int64_t total_records = 0;
+	for (int input_file_index = 0; input_file_index < static_cast<int>(input_file_paths.size()); ++input_file_index) {
+		const auto& file_path = input_file_paths[input_file_index];
+		if (!KifuContainer::IsContainerFile(file_path)) {
+			int64_t num_records = std::filesystem::file_size(file_path) / sizeof(PackedSfenValue);
+			total_records += num_records;
+			AddPlainFileUnits(input_file_index, num_records, input_units);
+			continue;
+		}
+
+		auto& container_reader = container_readers[input_file_index];
+		container_reader = std::make_unique<KifuContainerReader>();
+		if (!container_reader->Open(file_path)) {
+			sync_cout << "info string Failed to open a compressed kifu file. " << file_path << sync_endl;
+			return;
+		}
+		total_records += container_reader->NumRecords();
+		for (int block_index = 0; block_index < container_reader->NumBlocks(); ++block_index) {
+			input_units.push_back({ input_file_index, block_index, 0, 0 });
+		}
+	}
+	int64_t total_bytes = total_records * sizeof(PackedSfenValue);
+
+	// 各スレッドが同時に1ファイルずつメモリ上に保持しても予算内に収まるように、中間ファイルの大きさの上限を決める
+	int64_t max_bucket_bytes = std::max<int64_t>(memory_budget / num_threads, sizeof(PackedSfenValue));
+	int64_t num_required_files = static_cast<int64_t>(std::ceil(total_bytes * kBucketSizeMargin / max_bucket_bytes));
+	int max_files_per_pass = MaxShuffledKifuFilesPerPass(memory_budget, num_threads);
+	// 1パス目の振り分け先のファイル数。入力が小さい場合に小さなファイルを大量に作らないよう、必要な数だけにする。
+	// ただし、2パス目で全スレッドが働けるよう、スレッド数は下回らないようにする。
+	// 必要な数が1パスで開けるファイル数を超える場合は、大きくなったファイルを後で振り分け直す。
+	int num_first_pass_files = static_cast<int>(std::clamp<int64_t>(
+		std::max<int64_t>(num_required_files, num_threads), 1, max_files_per_pass));
+
+	sync_cout << "info string num_input_files=" << input_file_paths.size()
+		<< " total_records=" << total_records
+		<< " num_threads=" << num_threads
+		<< " memory_budget_mb=" << memory_budget / 1024 / 1024
+		<< " num_required_files=" << num_required_files
+		<< " max_files_per_pass=" << max_files_per_pass
+		<< " num_first_pass_files=" << num_first_pass_files
+		<< " compress_output=" << compress_output << sync_endl;
 
-	auto reader = std::make_unique<KifuReader>(kifu_dir, 1);
 	std::filesystem::create_directories(shuffled_kifu_dir);
 
 	std::vector<std::string> file_paths;
-	for (int file_index = 0; file_index < kNumShuffledKifuFiles; ++file_index) {
+	for (int file_index = 0; file_index < num_first_pass_files; ++file_index) {
 		char file_path[1024];
 		sprintf(file_path, "%s/shuffled.%03d.bin", shuffled_kifu_dir.c_str(), file_index);
 		file_paths.push_back(file_path);
 	}
 
-	std::vector<std::shared_ptr<KifuWriter> > writers;
-	for (const auto& file_path : file_paths) {
-		writers.push_back(std::make_shared<KifuWriter>(file_path));
+	omp_set_num_threads(num_threads);
+
+	// 棋譜を入力し、複数のファイルにランダムに追加していく
+	sync_cout << "info string Reading and dividing kifu files..." << sync_endl;
+	time_t start_time = std::time(nullptr);
+	int64_t num_divided_records = 0;
+	bool succeeded = DivideKifu(input_file_paths, container_readers, input_units, total_records, file_paths,
+		num_threads, memory_budget, start_time, num_divided_records);
+	container_readers.clear();
+	if (!succeeded) {
+		return;
+	}
+	ShowThroughput("Divided kifu files", num_divided_records, start_time);
+
+	// メモリ上でシャッフルできない大きさのファイルは、さらに複数のファイルへ振り分け直す。
+	// 振り分け直したファイルはfile_pathsの末尾に追加し、同様に大きさを確かめる。
+	std::vector<std::string> shuffled_file_paths;
+	for (size_t file_path_index = 0; file_path_index < file_paths.size(); ++file_path_index) {
+		std::string file_path = file_paths[file_path_index];
+		int64_t size = std::filesystem::exists(file_path) ? std::filesystem::file_size(file_path) : 0;
+		if (size <= max_bucket_bytes) {
+			shuffled_file_paths.push_back(file_path);
+			continue;
+		}
+
+		int num_sub_files = static_cast<int>(std::clamp<int64_t>(
+			static_cast<int64_t>(std::ceil(size * kBucketSizeMargin / max_bucket_bytes)), 2, max_files_per_pass));
+		std::string stem = file_path.substr(0, file_path.size() - std::string(".bin").size());
+		std::vector<std::string> sub_file_paths;
+		for (int sub_file_index = 0; sub_file_index < num_sub_files; ++sub_file_index) {
+			char sub_file_path[1024];
+			sprintf(sub_file_path, "%s.%03d.bin", stem.c_str(), sub_file_index);
+			sub_file_paths.push_back(sub_file_path);
+		}
+
+		sync_cout << "info string Dividing a large kifu file again. " << file_path << sync_endl;
+		int64_t num_records = size / sizeof(PackedSfenValue);
+		std::vector<InputUnit> sub_input_units;
+		AddPlainFileUnits(0, num_records, sub_input_units);
+		start_time = std::time(nullptr);
+		int64_t num_redivided_records = 0;
+		if (!DivideKifu({ file_path }, std::vector<std::unique_ptr<KifuContainerReader> >(1), sub_input_units,
+			num_records, sub_file_paths, num_threads, memory_budget, start_time + file_path_index,
+			num_redivided_records)) {
+			return;
+		}
+		ShowThroughput("Divided a large kifu file", num_redivided_records, start_time);
+
+		std::filesystem::remove(file_path);
+		file_paths.insert(file_paths.end(), sub_file_paths.begin(), sub_file_paths.end());
 	}
 
-	std::mt19937_64 mt(std::time(nullptr));
-	std::uniform_int_distribution<> dist(0, kNumShuffledKifuFiles - 1);
-	int64_t num_records = 0;
-	for (;;) {
+	// 各ファイルをシャッフルする
+	sync_cout << "info string Shuffling kifu files..." << sync_endl;
+	start_time = std::time(nullptr);
+	int num_shuffled_files = static_cast<int>(shuffled_file_paths.size());
+	std::atomic<int> global_file_index = 0;
+	std::atomic<int64_t> num_shuffled_records = 0;
+	std::atomic<bool> failed = false;
+	ProgressReport shuffle_progress_report(num_divided_records, kShowProgressPerAtMostSec);
+
+#pragma omp parallel
+	{
+		int thread_index = ::omp_get_thread_num();
+		WinProcGroup::bindThisThread(thread_index);
+		std::mt19937_64 mt(start_time + num_threads + thread_index);
 		std::vector<PackedSfenValue> records;
-		PackedSfenValue record;
-		while (reader->Read(record)) {
-			records.push_back(record);
-			if (record.last_position || static_cast<int>(records.size()) > kMaxPackedSfenValues) {
+
+		for (int file_index = global_file_index++; file_index < num_shuffled_files && !failed;
+			file_index = global_file_index++) {
+			const auto& file_path = shuffled_file_paths[file_index];
+
+			// ファイル全体を読み込む
+			int64_t size = std::filesystem::exists(file_path) ? std::filesystem::file_size(file_path) : 0;
+			records.resize(size / sizeof(PackedSfenValue));
+			if (records.empty()) {
+				continue;
+			}
+
+			FILE* file = std::fopen(file_path.c_str(), "rb");
+			if (file == nullptr) {
+				sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
+				failed = true;
 				break;
 			}
-		}
+			std::fread(&records[0], sizeof(PackedSfenValue), records.size(), file);
+			std::fclose(file);
+			file = nullptr;
 
-		if (records.empty()) {
-			break;
-		}
+			// 棋譜全体をシャッフルする
+			std::shuffle(records.begin(), records.end(), mt);
 
-		for (const auto& record : records) {
-			if (!writers[dist(mt)]->Write(record)) {
-				sync_cout << "info string Failed to write a record to a kifu file. " << sync_endl;
+			// 棋譜全体を上書きして書き戻す
+			if (compress_output) {
+				KifuContainerWriter writer(file_path);
+				if (!writer.Write(records.data(), records.size()) || !writer.Close()) {
+					sync_cout << "info string Failed to write records to a kifu file. " << file_path
+						<< sync_endl;
+					failed = true;
+				}
+				shuffle_progress_report.Show(num_shuffled_records += records.size());
+				continue;
+			}
+
+			file = std::fopen(file_path.c_str(), "wb");
+			if (file == nullptr) {
+				sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
+				failed = true;
+				break;
 			}
-			++num_records;
-			if (num_records % 10000000 == 0) {
-				sync_cout << "info string " << num_records << sync_endl;
+			if (std::fwrite(&records[0], sizeof(PackedSfenValue), records.size(), file) !=
+				records.size()) {
+				sync_cout << "info string Failed to write records to a kifu file. " << file_path
+					<< sync_endl;
+				failed = true;
 			}
+			std::fclose(file);
+			file = nullptr;
+
+			shuffle_progress_report.Show(num_shuffled_records += records.size());
 		}
 	}
-	for (auto& writer : writers) {
-		writer->Close();
-	}
 
-	// 各ファイルをシャッフルする
-	for (const auto& file_path : file_paths) {
-		sync_cout << "info string " << file_path << sync_endl;
-
-		// ファイル全体を読み込む
-		int64_t size = std::filesystem::file_size(file_path);
-		FILE* file = std::fopen(file_path.c_str(), "rb");
-		if (file == nullptr) {
-			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
-			return;
-		}
-		std::vector<PackedSfenValue> records(size / sizeof(PackedSfenValue));
-		std::fread(&records[0], sizeof(PackedSfenValue), size / sizeof(PackedSfenValue), file);
-		std::fclose(file);
-		file = nullptr;
-
-		// 棋譜全体をシャッフルする
-		std::shuffle(records.begin(), records.end(), mt);
-
-		// 棋譜全体を上書きして書き戻す
-		file = std::fopen(file_path.c_str(), "wb");
-		if (file == nullptr) {
-			sync_cout << "info string Failed to open a kifu file. " << file_path << sync_endl;
-			return;
-		}
-		if (std::fwrite(&records[0], sizeof(PackedSfenValue), records.size(), file) !=
-			records.size()) {
-			sync_cout << "info string Failed to write records to a kifu file. " << file_path
-				<< sync_endl;
-			return;
-		}
-		std::fclose(file);
-		file = nullptr;
+	if (failed) {
+		return;
 	}
+	ShowThroughput("Shuffled kifu files", num_shuffled_records, start_time);
 }
 
 #endif
@@ -0,0 +1,79 @@
+#include "tanuki_kifu_write_pipeline.h"
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include "misc.h"
+
+namespace {
+	// 生産者1つあたりのリングバッファに保持できる局数
+	constexpr size_t kRingCapacity = 1024;
+}
+
+Tanuki::KifuWritePipeline::KifuWritePipeline(const std::vector<std::string>& output_file_paths,
+	int num_producers, bool compressed) {
+	for (const auto& output_file_path : output_file_paths) {
+		writers_.push_back(std::make_unique<KifuWriter>(output_file_path, compressed));
+	}
+	for (int producer_index = 0; producer_index < num_producers; ++producer_index) {
+		rings_.push_back(std::make_unique<KifuGameRing>(kRingCapacity));
+	}
+	thread_ = std::thread([this] { Run(); });
+}
+
+Tanuki::KifuWritePipeline::~KifuWritePipeline() { Close(); }
+
+void Tanuki::KifuWritePipeline::Push(int producer_index, KifuGame& game) {
+	auto& ring = *rings_[producer_index];
+	while (!ring.TryPush(game)) {
+		// 書き出しが追いついていない
+		Tools::sleep(1);
+	}
+}
+
+bool Tanuki::KifuWritePipeline::Close() {
+	if (!thread_.joinable()) {
+		return !failed_;
+	}
+
+	stop_ = true;
+	thread_.join();
+
+	for (auto& writer : writers_) {
+		if (!writer->Close()) {
+			failed_ = true;
+		}
+	}
+	return !failed_;
+}
+
+void Tanuki::KifuWritePipeline::Run() {
+	KifuGame game;
+	for (;;) {
+		// stop_を見てから最後にもう一周取り出すことで、取りこぼしを防ぐ
+		bool stopping = stop_;
+		bool popped = false;
+
+		for (size_t producer_index = 0; producer_index < rings_.size(); ++producer_index) {
+			auto& writer = *writers_[producer_index % writers_.size()];
+			while (rings_[producer_index]->TryPop(game)) {
+				popped = true;
+				if (!writer.Write(game.data(), game.size())) {
+					sync_cout << "info string Failed to write a record." << sync_endl;
+					failed_ = true;
+				}
+				num_written_records_ += game.size();
+			}
+		}
+
+		if (stopping && !popped) {
+			break;
+		}
+
+		if (!popped) {
+			Tools::sleep(1);
+		}
+	}
+}
+
+#endif
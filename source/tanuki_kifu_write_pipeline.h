@@ -0,0 +1,87 @@
+#ifndef _TANUKI_KIFU_WRITE_PIPELINE_H_
+#define _TANUKI_KIFU_WRITE_PIPELINE_H_
+
+#include "config.h"
+
+#ifdef EVAL_LEARN
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "learn/learn.h"
+#include "tanuki_kifu_writer.h"
+
+namespace Tanuki {
+	// 生成した1局分の局面列
+	using KifuGame = std::vector<Learner::PackedSfenValue>;
+
+	// 1つの生産者スレッドと1つの消費者スレッドの間で1局ずつ受け渡すロックフリーのリングバッファ
+	// 受け渡しはstd::swap()で行うため、要素のメモリ領域は再利用される。
+	class KifuGameRing {
+	public:
+		explicit KifuGameRing(size_t capacity) : slots_(capacity) {}
+
+		// [生産者] 1局追加する。満杯ならfalseを返す。成功した場合、gameには再利用可能な空のvectorが入る。
+		bool TryPush(KifuGame& game) {
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			size_t next = (tail + 1) % slots_.size();
+			if (next == head_.load(std::memory_order_acquire)) {
+				return false;
+			}
+			std::swap(slots_[tail], game);
+			game.clear();
+			tail_.store(next, std::memory_order_release);
+			return true;
+		}
+
+		// [消費者] 1局取り出す。空ならfalseを返す。
+		bool TryPop(KifuGame& game) {
+			size_t head = head_.load(std::memory_order_relaxed);
+			if (head == tail_.load(std::memory_order_acquire)) {
+				return false;
+			}
+			std::swap(slots_[head], game);
+			head_.store((head + 1) % slots_.size(), std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::vector<KifuGame> slots_;
+		alignas(64) std::atomic<size_t> head_ = 0;
+		alignas(64) std::atomic<size_t> tail_ = 0;
+	};
+
+	// 棋譜生成スレッドからの書き出しを専用のI/Oスレッドにまとめる。
+	// 各生成スレッドはPush()で自分のリングバッファに1局を追加するだけで、ディスクや他のスレッドを待たない。
+	// I/Oスレッドは全てのリングバッファからまとめて取り出し、生産者毎に割り当てられたファイルへ書き出す。
+	// 生産者producer_indexの書き出し先は output_file_paths[producer_index % output_file_paths.size()] となる。
+	class KifuWritePipeline {
+	public:
+		KifuWritePipeline(const std::vector<std::string>& output_file_paths, int num_producers,
+			bool compressed);
+		virtual ~KifuWritePipeline();
+		// [生産者] 1局追加する。リングバッファが満杯の場合のみ、空きができるまで待つ。
+		void Push(int producer_index, KifuGame& game);
+		// 残りを全て書き出し、I/Oスレッドを終了してファイルを閉じる
+		bool Close();
+		int64_t NumWrittenRecords() const { return num_written_records_; }
+		bool Failed() const { return failed_; }
+
+	private:
+		void Run();
+
+		std::vector<std::unique_ptr<KifuWriter> > writers_;
+		std::vector<std::unique_ptr<KifuGameRing> > rings_;
+		std::thread thread_;
+		std::atomic<bool> stop_ = false;
+		std::atomic<bool> failed_ = false;
+		std::atomic<int64_t> num_written_records_ = 0;
+	};
+}
+
+#endif
+
+#endif
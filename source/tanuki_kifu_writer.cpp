@@ -9,12 +9,20 @@ namespace {
 	constexpr int kBufferSize = 1024 * 1024;
 }
 
-Tanuki::KifuWriter::KifuWriter(const std::string& output_file_path)
-	: output_file_path_(output_file_path) {}
+Tanuki::KifuWriter::KifuWriter(const std::string& output_file_path, bool compressed)
+	: output_file_path_(output_file_path) {
+	if (compressed) {
+		container_writer_ = std::make_unique<KifuContainerWriter>(output_file_path);
+	}
+}
 
 Tanuki::KifuWriter::~KifuWriter() { Close(); }
 
 bool Tanuki::KifuWriter::Write(const Learner::PackedSfenValue& record) {
+	if (container_writer_) {
+		return container_writer_->Write(record);
+	}
+
 	if (!EnsureOpen()) {
 		return false;
 	}
@@ -26,7 +34,31 @@ bool Tanuki::KifuWriter::Write(const Learner::PackedSfenValue& record) {
 	return true;
 }
 
+bool Tanuki::KifuWriter::Write(const Learner::PackedSfenValue* records, size_t num_records) {
+	if (num_records == 0) {
+		return true;
+	}
+
+	if (container_writer_) {
+		return container_writer_->Write(records, num_records);
+	}
+
+	if (!EnsureOpen()) {
+		return false;
+	}
+
+	if (std::fwrite(records, sizeof(Learner::PackedSfenValue), num_records, file_) != num_records) {
+		return false;
+	}
+
+	return true;
+}
+
 bool Tanuki::KifuWriter::Close() {
+	if (container_writer_) {
+		return container_writer_->Close();
+	}
+
 	if (!file_) {
 		return true;
 	}
@@ -5,20 +5,27 @@
 
 #ifdef EVAL_LEARN
 
+#include <memory>
+
 #include "learn/learn.h"
 #include "position.h"
+#include "tanuki_kifu_container.h"
 
 namespace Tanuki {
 	class KifuWriter {
 	public:
-		KifuWriter(const std::string& output_file_path);
+		// compressed=trueの場合、ブロック単位で圧縮したコンテナ形式で書き出す
+		KifuWriter(const std::string& output_file_path, bool compressed = false);
 		virtual ~KifuWriter();
 		bool Write(const Learner::PackedSfenValue& record);
+		// 複数の局面をまとめて書き込む
+		bool Write(const Learner::PackedSfenValue* records, size_t num_records);
 		bool Close();
 
 	private:
 		const std::string output_file_path_;
 		FILE* file_ = nullptr;
+		std::unique_ptr<KifuContainerWriter> container_writer_;
 
 		bool EnsureOpen();
 	};
@@ -5,7 +5,13 @@
 
 #ifdef EVAL_LEARN
 
-#include <boost/array.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
 #include <boost/asio.hpp>
 #include <boost/smart_ptr.hpp>
 
@@ -19,12 +25,30 @@ namespace boost {
 	void throw_exception(std::exception const& e) { }
 }
 
+using Tanuki::LazyCluster::Entry;
+using Tanuki::LazyCluster::PeerStatistics;
+
 namespace {
-	// xɑpPbg̐̍őlB
-	// UDPł͈xɑMf[^͍őł500`1300{ƒxɂ̂ʓI炵B
+	// xɑf[^O̍őoCgB
+	// UDPł͈xɑMf[^͍őł500`1300oCgxɂ̂ʓI炵B
 	// C# - C# UdpClient M@bteratail https://teratail.com/questions/32868
-	// 16oCg * 80 = 1280oCg
-	constexpr const int kMaxNumPacketsToSend = 80;
+	constexpr const std::size_t kMaxDatagramSize = 1280;
+
+	// f[^O̐擪ɕt}WbNio[B`̃pPbgȂǂMƂɒe߂ɗpB
+	constexpr const uint32_t kMagic = 0x32434C54; // "TLC2"
+
+	// wb_̃TCYB}WbNio[4oCgƃGg2oCgB
+	constexpr const std::size_t kHeaderSize = 6;
+
+	// 1Gg𕄍Ƃ̍őoCgB
+	// key̍10oCgAmove2oCgAvalueEevalEdepthe3oCgAtO1oCgB
+	constexpr const std::size_t kMaxEncodedEntrySize = 10 + 2 + 3 + 3 + 3 + 1;
+
+	// 1Gg𕄍Ƃ̍ŏoCgBeϒ̒l1oCg̏ꍇB
+	constexpr const std::size_t kMinEncodedEntrySize = 1 + 2 + 1 + 1 + 1 + 1;
+
+	// M҂̃Gg̏B𒴂Dx̒Ⴂ̂̂ĂB
+	constexpr const std::size_t kMaxPendingEntries = 4096;
 
 	static boost::asio::io_context IO_CONTEXT;
 	static std::shared_ptr<boost::asio::ip::udp::socket> UDP_SOCKET;
@@ -36,61 +60,273 @@ namespace {
 			SERVER_RUNNING = false;
 		}
 	} INITIALIZER;
-	static boost::array<Tanuki::LazyCluster::Packet, kMaxNumPacketsToSend> RECEIVE_BUFFER;
+	static std::array<uint8_t, 65536> RECEIVE_BUFFER;
+	static boost::asio::ip::udp::endpoint RECEIVE_ENDPOINT;
+
+	// M҂̃GgBǖʂ̃Gg͗Dx̍̂cB
+	static std::mutex PENDING_MUTEX;
+	static std::unordered_map<Key, Entry> PENDING_ENTRIES;
+	static std::chrono::steady_clock::time_point LAST_SEND_TIME;
+
+	// ʐM育Ƃ̓v
+	static std::mutex STATISTICS_MUTEX;
+	static std::map<boost::asio::ip::udp::endpoint, PeerStatistics> STATISTICS;
+
+	// MDxBPV̂́A[Tꂽ́AboundEXACT̂̂D悷B
+	bool HasHigherPriority(const Entry& lhs, const Entry& rhs) {
+		if (lhs.is_pv != rhs.is_pv) {
+			return lhs.is_pv;
+		}
+		if (lhs.depth != rhs.depth) {
+			return lhs.depth > rhs.depth;
+		}
+		return lhs.bound == BOUND_EXACT && rhs.bound != BOUND_EXACT;
+	}
 
-	bool Serialize(Key key, Tanuki::LazyCluster::Packet& packet) {
+	bool Serialize(Key key, Entry& entry) {
 		bool found = false;
-		const auto* entry = TT.probe(key, found);
+		const auto* tt_entry = TT.read_probe(key, found);
 		if (!found) {
 			return false;
 		}
 
-		packet.key = static_cast<uint16_t>(key);
-		packet.move = static_cast<uint16_t>(entry->move());
-		packet.value = static_cast<int16_t>(entry->value());
-		packet.eval = static_cast<int16_t>(entry->eval());
-		packet.is_pv = static_cast<uint16_t>(entry->is_pv());
-		packet.bound = static_cast<uint16_t>(entry->bound());
-		packet.depth = static_cast<uint16_t>(entry->depth());
+		entry.key = key;
+		entry.move = tt_entry->move().to_u16();
+		entry.value = static_cast<int16_t>(tt_entry->value());
+		entry.eval = static_cast<int16_t>(tt_entry->eval());
+		entry.depth = static_cast<int16_t>(tt_entry->depth());
+		entry.is_pv = tt_entry->is_pv();
+		entry.bound = static_cast<uint8_t>(tt_entry->bound());
 		return true;
 	}
 
-	void Deserialize(const Tanuki::LazyCluster::Packet& packet) {
-		bool found = false;
-		auto* entry = TT.probe(packet.key, found);
+	// ȂϒŏށB7bitʂ珑AƂ͍ŏbit𗧂ĂB
+	void WriteVarint(std::vector<uint8_t>& buffer, uint64_t value) {
+		while (value >= 0x80) {
+			buffer.push_back(static_cast<uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		buffer.push_back(static_cast<uint8_t>(value));
+	}
 
-		Key k = static_cast<Key>(packet.key);
-		Value v = static_cast<Value>(packet.value);
-		bool pv = static_cast<bool>(packet.is_pv);
-		Bound b = static_cast<Bound>(packet.bound);
-		Depth d = static_cast<Depth>(packet.depth);
-		Move m = static_cast<Move>(packet.move);
-		Value ev = static_cast<Value>(packet.eval);
-		entry->save(k, v, pv, b, d, m, ev);
+	// tAΒl̏̂ZȂ悤ɕϊĂϒŏށB
+	void WriteSignedVarint(std::vector<uint8_t>& buffer, int64_t value) {
+		WriteVarint(buffer, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
 	}
 
-	void OnReceivePacket(const boost::system::error_code& error, std::size_t bytes_transferred) {
-		if (!error) {
-			int num_packets = bytes_transferred / sizeof(Tanuki::LazyCluster::Packet);
-			//sync_cout << "info string Lazy Cluster server: Received " << num_packets << " packets." << sync_endl;
-			for (int packet_index = 0; packet_index < num_packets; ++packet_index) {
-				Deserialize(RECEIVE_BUFFER[packet_index]);
+	bool ReadVarint(const uint8_t*& p, const uint8_t* end, uint64_t& value) {
+		value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			if (p == end) {
+				return false;
+			}
+			uint8_t byte = *p++;
+			value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool ReadSignedVarint(const uint8_t*& p, const uint8_t* end, int64_t& value) {
+		uint64_t encoded;
+		if (!ReadVarint(p, end, encoded)) {
+			return false;
+		}
+		value = static_cast<int64_t>(encoded >> 1) ^ -static_cast<int64_t>(encoded & 1);
+		return true;
+	}
+
+	// Ggkey̏ɕׁAkey1OƂ̍ƂĕB
+	// valueEevalEdepth0ɋ߂l̂ŉϒɂB
+	void Encode(std::vector<Entry>& entries, std::vector<uint8_t>& buffer) {
+		std::sort(entries.begin(), entries.end(),
+			[](const Entry& lhs, const Entry& rhs) { return lhs.key < rhs.key; });
+
+		buffer.clear();
+		for (int shift = 0; shift < 32; shift += 8) {
+			buffer.push_back(static_cast<uint8_t>(kMagic >> shift));
+		}
+		buffer.push_back(static_cast<uint8_t>(entries.size()));
+		buffer.push_back(static_cast<uint8_t>(entries.size() >> 8));
+
+		Key previous_key = 0;
+		for (const auto& entry : entries) {
+			WriteVarint(buffer, entry.key - previous_key);
+			previous_key = entry.key;
+			buffer.push_back(static_cast<uint8_t>(entry.move));
+			buffer.push_back(static_cast<uint8_t>(entry.move >> 8));
+			WriteSignedVarint(buffer, entry.value);
+			WriteSignedVarint(buffer, entry.eval);
+			WriteSignedVarint(buffer, entry.depth);
+			buffer.push_back(static_cast<uint8_t>((entry.is_pv ? 4 : 0) | entry.bound));
+		}
+	}
+
+	bool Decode(const uint8_t* p, std::size_t size, std::vector<Entry>& entries) {
+		const uint8_t* end = p + size;
+		if (size < kHeaderSize) {
+			return false;
+		}
+
+		uint32_t magic = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			magic |= static_cast<uint32_t>(*p++) << shift;
+		}
+		if (magic != kMagic) {
+			return false;
+		}
+		int num_entries = p[0] | (p[1] << 8);
+		p += 2;
+
+		entries.clear();
+		Key key = 0;
+		for (int entry_index = 0; entry_index < num_entries; ++entry_index) {
+			uint64_t key_delta;
+			int64_t value, eval, depth;
+			if (!ReadVarint(p, end, key_delta) || end - p < 2) {
+				return false;
+			}
+			key += key_delta;
+			uint16_t move = static_cast<uint16_t>(p[0] | (p[1] << 8));
+			p += 2;
+			if (!ReadSignedVarint(p, end, value) || !ReadSignedVarint(p, end, eval)
+				|| !ReadSignedVarint(p, end, depth) || p == end) {
+				return false;
 			}
+			uint8_t flags = *p++;
+
+			// u\Ɋi[łȂl͉ꂽf[^Ƃ݂ȂB
+			if (value < INT16_MIN || INT16_MAX < value || eval < INT16_MIN || INT16_MAX < eval
+				|| depth < DEPTH_OFFSET || UINT8_MAX + DEPTH_OFFSET < depth || (flags & ~7)) {
+				return false;
+			}
+
+			Entry entry;
+			entry.key = key;
+			entry.move = move;
+			entry.value = static_cast<int16_t>(value);
+			entry.eval = static_cast<int16_t>(eval);
+			entry.depth = static_cast<int16_t>(depth);
+			entry.is_pv = (flags & 4) != 0;
+			entry.bound = flags & 3;
+			entries.push_back(entry);
+		}
+		return p == end;
+	}
+
+	// MGgu\ɏށB
+	// u\ɓǖʂ̂[TʂɂƂ́A㏑Ȃ悤Ɏ̂ĂB
+	bool Deserialize(const Entry& entry) {
+		bool found = false;
+		const auto* existing = TT.read_probe(entry.key, found);
+		if (found && existing->depth() > entry.depth) {
+			return false;
 		}
-		else {
+
+		auto* tt_entry = TT.probe(entry.key, found);
+
+		Value v = static_cast<Value>(entry.value);
+		bool pv = entry.is_pv;
+		Bound b = static_cast<Bound>(entry.bound);
+		Depth d = static_cast<Depth>(entry.depth);
+		Move m = static_cast<Move>(entry.move);
+		Value ev = static_cast<Value>(entry.eval);
+		tt_entry->save(entry.key, v, pv, b, d, m, ev);
+		return true;
+	}
+
+	void OnReceivePacket(const boost::system::error_code& error, std::size_t bytes_transferred) {
+		if (error) {
 			sync_cout << "info string Failed to receive packets. " << error << sync_endl;
 			return;
 		}
 
-		UDP_SOCKET->async_receive(boost::asio::buffer(RECEIVE_BUFFER), OnReceivePacket);
+		static std::vector<Entry> entries;
+		PeerStatistics statistics;
+		statistics.datagrams_received = 1;
+		if (!Decode(RECEIVE_BUFFER.data(), bytes_transferred, entries)) {
+			statistics.malformed_datagrams = 1;
+			entries.clear();
+		}
+
+		// f[^O1܂Ƃ߂ďށB
+		// ɒu\̃NX^SprefetchĂAANZX̑҂Ԃd˂B
+		for (const auto& entry : entries) {
+			prefetch(TT.first_entry(entry.key));
+		}
+		for (const auto& entry : entries) {
+			++(Deserialize(entry) ? statistics.entries_applied : statistics.entries_rejected);
+		}
+		statistics.entries_received = entries.size();
+
+		{
+			std::lock_guard<std::mutex> lock(STATISTICS_MUTEX);
+			auto& peer = STATISTICS[RECEIVE_ENDPOINT];
+			peer.datagrams_received += statistics.datagrams_received;
+			peer.entries_received += statistics.entries_received;
+			peer.entries_applied += statistics.entries_applied;
+			peer.entries_rejected += statistics.entries_rejected;
+			peer.malformed_datagrams += statistics.malformed_datagrams;
+		}
+
+		UDP_SOCKET->async_receive_from(boost::asio::buffer(RECEIVE_BUFFER), RECEIVE_ENDPOINT, OnReceivePacket);
 	}
 
-	void OnSendPacket(std::vector<Tanuki::LazyCluster::Packet> /*packet*/,
-		const boost::system::error_code& error, std::size_t bytes_transferred) {
-		if (error) {
-			sync_cout << "info string Failed to send packets. " << error << sync_endl;
+	// M҂̃GgɒǉBǖʂ̃Ggɂ΁ADx̍cB
+	void Enqueue(const Entry& entry) {
+		auto result = PENDING_ENTRIES.emplace(entry.key, entry);
+		if (!result.second && HasHigherPriority(entry, result.first->second)) {
+			result.first->second = entry;
 		}
-		//sync_cout << "info string Lazy Cluster client: Sent " << bytes_transferred / sizeof(Tanuki::LazyCluster::Packet) << " packets." << sync_endl;
+	}
+
+	// M҂̃GĝADx̍̂1f[^OɎ܂邾oĕB
+	// PENDING_MUTEXmۂԂŌĂяoƁB
+	void TakeDatagram(std::vector<uint8_t>& buffer, std::size_t& num_entries) {
+		std::vector<Entry> entries;
+		entries.reserve(PENDING_ENTRIES.size());
+		for (const auto& key_and_entry : PENDING_ENTRIES) {
+			entries.push_back(key_and_entry.second);
+		}
+
+		// ̊֐͒TXbhĂ΂̂ŁAM҂̃GgŜ̓\[gȂB
+		// 1̃f[^Oɓ肤鐔Dx̍ɑIŕׂB
+		std::size_t max_count = std::min(entries.size(), (kMaxDatagramSize - kHeaderSize) / kMinEncodedEntrySize);
+		std::nth_element(entries.begin(), entries.begin() + max_count, entries.end(), HasHigherPriority);
+		std::sort(entries.begin(), entries.begin() + max_count, HasHigherPriority);
+
+		// ň̏ꍇł܂鐔n߂āAۂɕTCYȂ瑝₵ĂB
+		std::size_t count = std::min(entries.size(), (kMaxDatagramSize - kHeaderSize) / kMaxEncodedEntrySize);
+		std::vector<Entry> selected(entries.begin(), entries.begin() + count);
+		Encode(selected, buffer);
+		while (count < max_count) {
+			std::size_t extra = (kMaxDatagramSize - buffer.size()) / kMaxEncodedEntrySize;
+			if (extra == 0) {
+				break;
+			}
+			extra = std::min(extra, max_count - count);
+			selected.assign(entries.begin(), entries.begin() + count + extra);
+			Encode(selected, buffer);
+			count += extra;
+		}
+
+		for (std::size_t entry_index = 0; entry_index < count; ++entry_index) {
+			PENDING_ENTRIES.erase(entries[entry_index].key);
+		}
+
+		// 肫ꂸɗ܂肷̂́ADx̒Ⴂ̂̂ĂB
+		// Ȃ̂̒ADx̍kMaxPendingEntriescB
+		if (count + kMaxPendingEntries < entries.size()) {
+			std::nth_element(entries.begin() + count, entries.begin() + count + kMaxPendingEntries, entries.end(),
+				HasHigherPriority);
+			for (std::size_t entry_index = count + kMaxPendingEntries; entry_index < entries.size(); ++entry_index) {
+				PENDING_ENTRIES.erase(entries[entry_index].key);
+			}
+		}
+
+		num_entries = count;
 	}
 }
 
@@ -116,6 +352,15 @@ void Tanuki::LazyCluster::Start() {
 	// M̏sB
 	// LazyClusterSendToIvV͂AAhXƃ|[gENDPOINTSɊi[B
 	ENDPOINTS.clear();
+	{
+		std::lock_guard<std::mutex> lock(PENDING_MUTEX);
+		PENDING_ENTRIES.clear();
+		LAST_SEND_TIME = std::chrono::steady_clock::time_point();
+	}
+	{
+		std::lock_guard<std::mutex> lock(STATISTICS_MUTEX);
+		STATISTICS.clear();
+	}
 
 	int port = static_cast<int>(Options[Tanuki::LazyCluster::kLazyClusterRecievePort]);
 	UDP_SOCKET = std::make_shared<udp::socket>(IO_CONTEXT, udp::endpoint(udp::v4(), port));
@@ -142,7 +387,7 @@ void Tanuki::LazyCluster::Start() {
 		ENDPOINTS.push_back(receiver_endpoint);
 	}
 
-	UDP_SOCKET->async_receive(boost::asio::buffer(RECEIVE_BUFFER), OnReceivePacket);
+	UDP_SOCKET->async_receive_from(boost::asio::buffer(RECEIVE_BUFFER), RECEIVE_ENDPOINT, OnReceivePacket);
 	SERVER_RUNNING = true;
 	IO_CONTEXT_THREAD = std::thread([]() {
 		IO_CONTEXT.run();
@@ -163,70 +408,112 @@ void Tanuki::LazyCluster::Stop() {
 	SERVER_RUNNING = false;
 	IO_CONTEXT.stop();
 	IO_CONTEXT_THREAD.join();
+	UDP_SOCKET.reset();
+	// ĂStart()ł悤ɂĂB
+	IO_CONTEXT.restart();
+
+	PrintStatistics();
 }
 
 void Tanuki::LazyCluster::Send(Thread& thread) {
-	if (!static_cast<bool>(Options[kEnableLazyCluster])) {
+	if (!static_cast<bool>(Options[kEnableLazyCluster]) || !SERVER_RUNNING) {
 		return;
 	}
 
-	// ʐMpPbgɃVACYB
+	// TJn̐󂢒Tʂ͑ĂɗȂ̂őȂB
+	if (Time.elapsed() < static_cast<int>(Options[kLazyClusterDontSendFirstMs])) {
+		return;
+	}
+
+	// u\̃GgoB
 	int multiPV = static_cast<int>(Options["MultiPV"]);
 	Position& position = thread.rootPos;
-	auto packets = boost::make_shared<std::vector<Packet>>();
+	std::vector<Entry> entries;
 
 	// ePVɂď
 	multiPV = std::min<int>(multiPV, thread.rootMoves.size());
 	for (int pv_index = 0; pv_index < multiPV; ++pv_index) {
 		StateInfo state_info[MAX_PLY] = {};
 
-		Packet packet = {};
-		if (Serialize(position.key(), packet)) {
-			packets->push_back(packet);
+		Entry entry = {};
+		if (Serialize(position.key(), entry)) {
+			entries.push_back(entry);
 		}
 
 		const auto& pv = thread.rootMoves[pv_index].pv;
-		for (int moveIndex = 0; moveIndex < pv.size(); ++moveIndex) {
-			auto move = pv[moveIndex];
+		int num_moves = 0;
+		for (; num_moves < static_cast<int>(pv.size()); ++num_moves) {
+			auto move = pv[num_moves];
 			if (!is_ok(move)) {
 				break;
 			}
 
-			position.do_move(move, state_info[moveIndex]);
-			if (Serialize(position.key(), packet)) {
-				packets->push_back(packet);
+			position.do_move(move, state_info[num_moves]);
+			if (Serialize(position.key(), entry)) {
+				entries.push_back(entry);
 			}
 		}
-		for (auto rit = pv.rbegin(); rit != pv.rend(); ++rit) {
-			position.undo_move(*rit);
+		while (num_moves > 0) {
+			position.undo_move(pv[--num_moves]);
 		}
 	}
 
-	// ʐMpPbg̃TCYUDP1ő₷TCYɌ炷B
-	if (packets->size() > kMaxNumPacketsToSend) {
-		packets->resize(kMaxNumPacketsToSend);
-	}
+	// M҂̃GgɉAMԊu󂢂Ă1f[^O𑗂B
+	auto buffer = boost::make_shared<std::vector<uint8_t>>();
+	std::size_t num_entries = 0;
+	{
+		std::lock_guard<std::mutex> lock(PENDING_MUTEX);
+		for (const auto& entry : entries) {
+			Enqueue(entry);
+		}
 
-	if (packets->empty()) {
-		return;
+		auto now = std::chrono::steady_clock::now();
+		if (PENDING_ENTRIES.empty() || now - LAST_SEND_TIME < std::chrono::milliseconds(
+			static_cast<int>(Options[kLazyClusterSendIntervalMs]))) {
+			return;
+		}
+		LAST_SEND_TIME = now;
+		TakeDatagram(*buffer, num_entries);
 	}
 
 	// MB
-	for (const auto& receiver_endpoint : ENDPOINTS) {
-		// M܂packetsɕێȂ΂ȂȂB
-		// _֐ɃLv`AM܂ŕێB
-		UDP_SOCKET->async_send_to(boost::asio::buffer(*packets), receiver_endpoint,
-			[packets](const boost::system::error_code& /*error*/, std::size_t bytes_transferred) {});
+	// \Pbg̑IO_CONTEXT_THREAD̂ݍs悤ɂB
+	boost::asio::post(IO_CONTEXT, [buffer, num_entries]() {
+		for (const auto& receiver_endpoint : ENDPOINTS) {
+			// M܂bufferɕێȂ΂ȂȂB
+			// _֐ɃLv`AM܂ŕێB
+			UDP_SOCKET->async_send_to(boost::asio::buffer(*buffer), receiver_endpoint,
+				[buffer, num_entries, receiver_endpoint](const boost::system::error_code& error, std::size_t bytes_transferred) {
+					if (error) {
+						sync_cout << "info string Failed to send packets. " << error << sync_endl;
+						return;
+					}
+
+					std::lock_guard<std::mutex> lock(STATISTICS_MUTEX);
+					auto& peer = STATISTICS[receiver_endpoint];
+					++peer.datagrams_sent;
+					peer.entries_sent += num_entries;
+					peer.bytes_sent += bytes_transferred;
+				});
+		}
+		});
+}
 
-		//boost::system::error_code error_code;
-		//UDP_SOCKET->send_to(boost::asio::buffer(packets), receiver_endpoint, 0, error_code);
-		//if (error_code.failed()) {
-		//	sync_cout << "info string Falied to send packets. error_code.message()=" << error_code.message() << sync_endl;
-		//	continue;
-		//}
+void Tanuki::LazyCluster::PrintStatistics() {
+	std::lock_guard<std::mutex> lock(STATISTICS_MUTEX);
+	for (const auto& endpoint_and_statistics : STATISTICS) {
+		const auto& peer = endpoint_and_statistics.second;
+		sync_cout << "info string Lazy Cluster peer=" << endpoint_and_statistics.first
+			<< " sent_datagrams=" << peer.datagrams_sent
+			<< " sent_entries=" << peer.entries_sent
+			<< " sent_bytes=" << peer.bytes_sent
+			<< " received_datagrams=" << peer.datagrams_received
+			<< " received_entries=" << peer.entries_received
+			<< " applied_entries=" << peer.entries_applied
+			<< " rejected_entries=" << peer.entries_rejected
+			<< " malformed_datagrams=" << peer.malformed_datagrams
+			<< sync_endl;
 	}
-
-	//sync_cout << "info string Lazy Cluster client: Sent " << packets.size() << " packets." << sync_endl;
 }
 
 #endif
@@ -17,23 +17,42 @@ namespace Tanuki {
 		constexpr const char* kLazyClusterSendTo = "LazyClusterSendTo";
 		constexpr const char* kLazyClusterRecievePort = "LazyClusterRecievePort";
 
-		// Lazy ClusterőMʐMpPbg
-		struct Packet {
-			uint64_t key;
+		// Lazy ClusterőMu\̃Gg
+		// Mɂ͕̃Gg܂Ƃ߂č̂ŁA̍\̂̂܂ܑ킯ł͂ȂB
+		struct Entry {
+			Key key;
 			uint16_t move;
 			int16_t value;
 			int16_t eval;
-			uint8_t is_pv : 1;
-			uint8_t bound : 2;
-			uint8_t depth;
+			int16_t depth;
+			bool is_pv;
+			uint8_t bound;
+		};
+
+		// ʐM育Ƃ̓v
+		struct PeerStatistics {
+			// Mf[^O̐EGg̐EoCg
+			uint64_t datagrams_sent = 0;
+			uint64_t entries_sent = 0;
+			uint64_t bytes_sent = 0;
+			// Mf[^O̐EGg̐
+			uint64_t datagrams_received = 0;
+			uint64_t entries_received = 0;
+			// MGĝAu\ɏ񂾐ƁA[Tʂɂ̂Ŏ̂Ă
+			uint64_t entries_applied = 0;
+			uint64_t entries_rejected = 0;
+			// `sŎ̂Ăf[^O̐
+			uint64_t malformed_datagrams = 0;
 		};
-		static_assert(sizeof(Packet) == 16);
 
 		void InitializeLazyCluster(USI::OptionsMap& o);
 
 		void Start();
 		void Stop();
 		void Send(Thread& thread);
+
+		// ʐM育Ƃ̓vo͂
+		void PrintStatistics();
 	}
 }
 
@@ -1,5 +1,6 @@
 ﻿#include "tanuki_progress.h"
 
+#include <atomic>
 #include <ctime>
 
 #include <fstream>
@@ -33,6 +34,9 @@ namespace {
 	constexpr double kAdamBeta1 = 0.9;
 	constexpr double kAdamBeta2 = 0.999;
 	constexpr double kEps = 1e-8;
+
+	// ファイル上の重みの要素数
+	constexpr size_t kNumFileWeights = static_cast<size_t>(SQ_NB) * static_cast<size_t>(Eval::fe_end);
 }
 
 bool Tanuki::Progress::Initialize(USI::OptionsMap& o) {
@@ -54,12 +58,20 @@ bool Tanuki::Progress::Load() {
 		return false;
 	}
 
-	if (!ifs.read(reinterpret_cast<char*>(weights_), sizeof(weights_))) {
+	std::vector<double> weights(kNumFileWeights);
+	if (!ifs.read(reinterpret_cast<char*>(weights.data()), weights.size() * sizeof(double))) {
 		sync_cout << "info string Failed to read the progress file. file_path=" << file_path <<
 			sync_endl;
 		return false;
 	}
 
+	for (int square = 0; square < SQ_NB; ++square) {
+		for (int piece = 0; piece < Eval::fe_end; ++piece) {
+			weights_[square][piece] = static_cast<float>(weights[square * Eval::fe_end + piece]);
+		}
+	}
+	version_ = NewVersion();
+
 	return true;
 }
 
@@ -73,7 +85,14 @@ bool Tanuki::Progress::Save() {
 		return false;
 	}
 
-	if (!ofs.write(reinterpret_cast<char*>(weights_), sizeof(weights_))) {
+	std::vector<double> weights(kNumFileWeights);
+	for (int square = 0; square < SQ_NB; ++square) {
+		for (int piece = 0; piece < Eval::fe_end; ++piece) {
+			weights[square * Eval::fe_end + piece] = weights_[square][piece];
+		}
+	}
+
+	if (!ofs.write(reinterpret_cast<const char*>(weights.data()), weights.size() * sizeof(double))) {
 		sync_cout << "info string Failed to write the progress file. file_path=" << file_path <<
 			sync_endl;
 		return false;
@@ -263,8 +282,9 @@ bool Tanuki::Progress::Learn() {
 			// 重みテーブルに書き戻す
 			Square square = static_cast<Square>(dimension / Eval::fe_end);
 			Eval::BonaPiece piece = static_cast<Eval::BonaPiece>(dimension % Eval::fe_end);
-			weights_[square][piece] = w;
+			weights_[square][piece] = static_cast<float>(w);
 		}
+		version_ = NewVersion();
 
 		sync_cout << iteration << sync_endl;
 	}
@@ -273,15 +293,72 @@ bool Tanuki::Progress::Learn() {
 }
 #endif // EVAL_LEARN
 
+u32 Tanuki::Progress::NewVersion() {
+	// 0はStateInfoの未計算を表すので用いない。
+	static std::atomic<u32> next_version(1);
+	return next_version++;
+}
+
+float Tanuki::Progress::Sum(Square sq, const Eval::BonaPiece* list) const {
+	const float* weights = weights_[sq];
+	float sum = 0.0f;
+	int i = 0;
+#if defined(USE_AVX2)
+	// piece_list_fb()/piece_list_fw()はalignas(32)されている。
+	__m256 sum256 = _mm256_setzero_ps();
+	for (; i + 8 <= PIECE_NUMBER_KING; i += 8) {
+		__m256i index = _mm256_load_si256(reinterpret_cast<const __m256i*>(list + i));
+		sum256 = _mm256_add_ps(sum256, _mm256_i32gather_ps(weights, index, sizeof(float)));
+	}
+	__m128 sum128 = _mm_add_ps(_mm256_castps256_ps128(sum256), _mm256_extractf128_ps(sum256, 1));
+	sum128 = _mm_add_ps(sum128, _mm_movehl_ps(sum128, sum128));
+	sum128 = _mm_add_ss(sum128, _mm_shuffle_ps(sum128, sum128, 1));
+	sum = _mm_cvtss_f32(sum128);
+#endif
+	for (; i < PIECE_NUMBER_KING; ++i) {
+		sum += weights[list[i]];
+	}
+	return sum;
+}
+
 double Tanuki::Progress::Estimate(const Position& pos) {
-	Square sq_bk = pos.king_square(BLACK);
-	Square sq_wk = Inv(pos.king_square(WHITE));
-	const auto& list0 = pos.eval_list()->piece_list_fb();
-	const auto& list1 = pos.eval_list()->piece_list_fw();
-	double sum = 0.0;
-	for (int i = 0; i < PIECE_NUMBER_KING; ++i) {
-		sum += weights_[sq_bk][list0[i]];
-		sum += weights_[sq_wk][list1[i]];
+	StateInfo* st = pos.state();
+	if (st->progressVersion != version_) {
+		Square sq_bk = pos.king_square(BLACK);
+		Square sq_wk = Inv(pos.king_square(WHITE));
+		const StateInfo* prev = st->previous;
+		const auto& dp = st->dirtyPiece;
+
+		if (prev != nullptr && prev->progressVersion == version_) {
+			// 直前の局面から、動いた駒の分だけ差分計算する。玉が動いた側は全計算する。
+			for (Color c : COLOR) {
+				Square sq = c == BLACK ? sq_bk : sq_wk;
+				PieceNumber king = c == BLACK ? PIECE_NUMBER_BKING : PIECE_NUMBER_WKING;
+				bool king_moved = false;
+				float sum = prev->progressSum[c];
+				for (int i = 0; i < dp.dirty_num; ++i) {
+					// 玉自身は総和に含まれない。
+					if (dp.pieceNo[i] >= PIECE_NUMBER_KING) {
+						if (dp.pieceNo[i] == king) {
+							king_moved = true;
+							break;
+						}
+						continue;
+					}
+					sum -= weights_[sq][dp.changed_piece[i].old_piece.from[c]];
+					sum += weights_[sq][dp.changed_piece[i].new_piece.from[c]];
+				}
+				st->progressSum[c] = king_moved
+					? Sum(sq, c == BLACK ? pos.eval_list()->piece_list_fb() : pos.eval_list()->piece_list_fw())
+					: sum;
+			}
+		}
+		else {
+			st->progressSum[BLACK] = Sum(sq_bk, pos.eval_list()->piece_list_fb());
+			st->progressSum[WHITE] = Sum(sq_wk, pos.eval_list()->piece_list_fw());
+		}
+		st->progressVersion = version_;
 	}
-	return Math::sigmoid(sum);
+
+	return Math::sigmoid(static_cast<double>(st->progressSum[BLACK]) + st->progressSum[WHITE]);
 }
@@ -18,10 +18,22 @@ namespace Tanuki {
 		bool Save();
 		bool Learn();
 #endif // EVAL_LEARN
+		// 進行度を[0, 1]で返す。
+		// 重みの総和はStateInfoに保持し、直前の局面が計算済みであれば動いた駒の分だけ差分計算する。
 		double Estimate(const Position& pos);
 
 	private:
-		double weights_[SQ_NB][Eval::BonaPiece::fe_end] = {};
+		// 重みの版を新しく発行する。重みを書き換えたときに呼び出し、StateInfoに保持している古い総和を無効にする。
+		static u32 NewVersion();
+
+		// 玉の位置sqから見たlistの駒の重みの総和を計算する。
+		float Sum(Square sq, const Eval::BonaPiece* list) const;
+
+		// 重みはAVX2のgather命令でアクセスするのでfloatとし、行の先頭をalignas(32)に揃える。
+		// ファイル上はdouble[SQ_NB][fe_end]のまま。
+		static constexpr int kRowSize = (Eval::BonaPiece::fe_end + 7) / 8 * 8;
+		alignas(32) float weights_[SQ_NB][kRowSize] = {};
+		u32 version_ = NewVersion();
 	};
 }
 
@@ -9,6 +9,8 @@
 // "test genmate ..."のように"test"コマンドの後続コマンドとして書く。
 
 #include <sstream>
+#include <algorithm>
+#include <iomanip>
 
 #include "../mate/mate.h"
 
@@ -602,6 +604,154 @@ namespace {
 
 		cout << sync_endl;
 
+#endif // !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
+	}
+
+	// ----------------------------------
+	//      "test matebench3" command
+	// ----------------------------------
+
+	// MATE ENGINEの並列探索のbench。
+	// matebench2と同じ局面集を、スレッド数を変えながら解かせて、解くまでの時間を表にして出力する。
+	// 制限時間内に詰み手順を返せなかった局面は"-"と表示し、どれかのスレッド数で解けなかった局面は
+	// total,speedup,npsの集計から除く。(制限時間で打ち切った時間を足すと、speedupが実際より小さく見えるため)
+	// 例) test matebench3 1024 1 4 16 64
+	//   →　置換表1024MB、スレッド数1,4,16,64で計測する。(省略時もこの設定)
+	void mate_bench3(Position& pos, std::istringstream& is)
+	{
+#if !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
+		cout << "Error! : define TANUKI_MATE_ENGINE or YANEURAOU_MATE_ENGINE" << endl;
+#else
+		string token;
+
+		string ttSize = (is >> token) ? token : "1024";
+
+		// 計測するスレッド数
+		vector<int> thread_nums;
+		while (is >> token)
+			thread_nums.push_back(stoi(token));
+		if (thread_nums.empty())
+			thread_nums = { 1, 4, 16, 64 };
+
+		Options["USI_Hash"] = ttSize;
+
+		Search::LimitsType limits;
+
+		// ベンチマークモードにしておかないとPVの出力のときに置換表を漁られて探索に影響がある。
+		limits.bench = true;
+
+		// 探索制限
+		limits.nodes = 0;
+		limits.mate = 100000; // 100秒
+
+		// Optionsの影響を受けると嫌なので、その他の条件を固定しておく。
+		limits.enteringKingRule = EKR_NONE;
+
+		// times[i][j] : thread_nums[i]のスレッド数で、j番目の局面を解くのにかかった時間[ms]
+		vector<vector<TimePoint>> times;
+
+		// nodes[i][j] : thread_nums[i]のスレッド数で、j番目の局面で探索したノード数
+		vector<vector<int64_t>> nodes;
+
+		// solved[i][j] : thread_nums[i]のスレッド数で、j番目の局面の詰み手順を返せたか
+		vector<vector<bool>> solved;
+
+		for (int thread_num : thread_nums)
+		{
+			Options["Threads"] = std::to_string(thread_num);
+
+			// スレッドの生成、置換表の確保等
+			is_ready();
+
+			times.emplace_back();
+			nodes.emplace_back();
+			solved.emplace_back();
+
+			for (const char* sfen : TestMateEngineSfen) {
+				Position pos;
+				StateListPtr st(new StateList(1));
+				pos.set(sfen, &st->back(), Threads.main());
+
+				sync_cout << "\nThreads: " << thread_num << " Position: " << sfen << sync_endl;
+
+				// 探索時にnpsが表示されるが、それはこのglobalなTimerに基づくので探索ごとにリセットを行なうようにする。
+				Time.reset();
+
+				Timer time;
+				time.reset();
+
+				Threads.start_thinking(pos, st, limits);
+				Threads.main()->wait_for_search_finished(); // 探索の終了を待つ。
+
+				times.back().push_back(time.elapsed());
+				nodes.back().push_back(Threads.nodes_searched());
+				solved.back().push_back(Search::mate_found());
+			}
+		}
+
+		// すべてのスレッド数で解けた局面か
+		vector<bool> solved_by_all(times[0].size(), true);
+		for (size_t i = 0; i < thread_nums.size(); ++i)
+			for (size_t j = 0; j < times[i].size(); ++j)
+				if (!solved[i][j])
+					solved_by_all[j] = false;
+
+		// 結果を表にして出力する。
+		std::ostringstream oss;
+		oss << "\n==========================="
+			<< "\nTime to solve (ms)\n"
+			<< std::setw(10) << "threads";
+		for (int thread_num : thread_nums)
+			oss << std::setw(10) << thread_num;
+
+		for (size_t j = 0; j < times[0].size(); ++j)
+		{
+			oss << "\n" << std::setw(10) << ("#" + std::to_string(j + 1));
+			for (size_t i = 0; i < thread_nums.size(); ++i)
+				if (solved[i][j])
+					oss << std::setw(10) << times[i][j];
+				else
+					oss << std::setw(10) << "-";
+		}
+
+		vector<TimePoint> totals;
+		vector<int64_t> total_nodes;
+		for (size_t i = 0; i < thread_nums.size(); ++i)
+		{
+			TimePoint total = 0;
+			int64_t total_node = 0;
+			for (size_t j = 0; j < times[i].size(); ++j)
+			{
+				if (!solved_by_all[j])
+					continue;
+				total += times[i][j];
+				total_node += nodes[i][j];
+			}
+			totals.push_back(std::max(total, TimePoint(1)));
+			total_nodes.push_back(total_node);
+		}
+
+		oss << "\n" << std::setw(10) << "solved";
+		for (const auto& s : solved)
+			oss << std::setw(10) << std::count(s.begin(), s.end(), true);
+
+		oss << "\n" << std::setw(10) << "total";
+		for (auto total : totals)
+			oss << std::setw(10) << total;
+
+		oss << "\n" << std::setw(10) << "speedup";
+		for (auto total : totals)
+			oss << std::setw(10) << std::fixed << std::setprecision(2) << (double)totals[0] / total;
+
+		oss << "\n" << std::setw(10) << "nps";
+		for (size_t i = 0; i < thread_nums.size(); ++i)
+			oss << std::setw(10) << 1000 * total_nodes[i] / totals[i];
+
+		oss << "\n(total, speedup and nps are over the " << std::count(solved_by_all.begin(), solved_by_all.end(), true)
+			<< " positions solved by every thread count)";
+
+		sync_cout << oss.str() << sync_endl;
+
 #endif // !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
 	}
 
@@ -620,6 +770,7 @@ namespace Test
 		if (token == "genmate")         gen_mate(pos, is);         // N手詰みの局面を生成する。
 		else if (token == "matebench")  mate_bench(pos, is);       // 詰みルーチンに関するbenchをとる。
 		else if (token == "matebench2") mate_bench2(pos, is);      // MATE ENGINEのテスト。(ENGINEに対して局面図を送信する)
+		else if (token == "matebench3") mate_bench3(pos, is);      // MATE ENGINEの並列探索のbench。(スレッド数ごとの解くまでの時間)
 		else if (token == "dfpn")       mate_dfpn(pos, is);        // 現在の局面に対してdf-pn詰め将棋ルーチンを呼び出す。
 		//else if (token == "matesolve") mate_solve(pos, is);      // 現在の局面に対してN手詰みルーチンを呼び出す。
 		else return false;									       // どのコマンドも処理することがなかった
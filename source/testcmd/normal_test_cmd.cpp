@@ -7,15 +7,23 @@
 // ----------------------------------
 
 #include <sstream>
+#include <fstream>
+#include <deque>
+#include <thread>
 #include "../position.h"
 #include "../usi.h"
 #include "../thread.h"
 #include "../search.h"
+#include "../book/book.h"
 
 #if defined(EVAL_LEARN)
 #include "../eval/evaluate_common.h"
 #endif
 
+#if defined(EVAL_NNUE)
+#include "../eval/nnue/nnue_test_command.h"
+#endif
+
 namespace {
 
 	// "test genmoves" : 指し手生成テストコマンド
@@ -225,6 +233,90 @@ namespace {
 	}
 }
 
+namespace {
+
+	// "test bookprobe" : 定跡のprobeの速度を計測する。
+	// Options["BookDir"]とOptions["BookFile"]の定跡を読み込み、定跡に登録されている局面を複数スレッドから同時にprobeする。
+	// 凍結した定跡と、凍結を解除した(probeのたびにmutexを取る)定跡のそれぞれについて、1秒あたりのprobe回数を出力する。
+	//   threads : probeするスレッド数(デフォルトはOptions["Threads"])
+	//   loop    : 1スレッドあたりのprobe回数
+	void book_probe(Position& pos, std::istringstream& is)
+	{
+		size_t num_threads = (size_t)Options["Threads"];
+		int64_t loop = 1000000;
+
+		std::string token;
+		while (is >> token)
+		{
+			if (token == "threads")
+				is >> num_threads;
+			else if (token == "loop")
+				is >> loop;
+		}
+		num_threads = std::max(num_threads, (size_t)1);
+
+		Book::BookMoveSelector book;
+		book.read_book();
+
+		// 定跡ファイルから局面を集める。
+		const std::string book_file = Path::Combine((std::string)Options["BookDir"], (std::string)Options["BookFile"]);
+		std::deque<Position> positions;
+		std::deque<StateInfo> states;
+		{
+			std::ifstream ifs(book_file);
+			std::string line;
+			while (positions.size() < 100000 && std::getline(ifs, line))
+			{
+				if (line.compare(0, 5, "sfen ") != 0)
+					continue;
+				states.emplace_back();
+				positions.emplace_back();
+				positions.back().set(line.substr(5), &states.back(), pos.this_thread());
+			}
+		}
+
+		if (positions.empty())
+		{
+			std::cout << "Error! : no positions in the book : " << book_file << std::endl;
+			return;
+		}
+
+		std::cout << "Book Probe Test : " << std::endl
+				  << "  book file = " << book_file << std::endl
+				  << "  positions = " << positions.size() << std::endl
+				  << "  threads   = " << num_threads << std::endl
+				  << "  loop      = " << loop << std::endl;
+
+		auto bench = [&](const std::string& name)
+		{
+			std::atomic<int64_t> hits(0);
+			std::vector<std::thread> threads;
+			auto start = now();
+			for (size_t t = 0; t < num_threads; ++t)
+				threads.emplace_back([&, t]() {
+					int64_t local_hits = 0;
+					for (int64_t i = 0; i < loop; ++i)
+						if (book.get_body().find(positions[(size_t)(i * num_threads + t) % positions.size()]) != nullptr)
+							++local_hits;
+					hits += local_hits;
+				});
+			for (auto& th : threads)
+				th.join();
+			auto elapsed = std::max(now() - start, (TimePoint)1);
+
+			std::cout << "  " << name << " : " << (int64_t)num_threads * loop * 1000 / elapsed << " probes/s"
+					  << " , hits = " << hits << " , elapsed = " << elapsed << "[ms]" << std::endl;
+		};
+
+		std::cout << "  frozen = " << book.get_body().is_frozen() << std::endl;
+		bench("frozen");
+
+		// 凍結を解除して、mutexを取るprobeと比較する。
+		book.get_body().get_body();
+		bench("locked");
+	}
+}
+
 // ----------------------------------
 //      "test" command Decorator
 // ----------------------------------
@@ -236,8 +328,12 @@ namespace Test
 	{
 		if (token == "genmoves")         gen_moves(pos, is);       // 現在の局面に対して指し手生成のテストを行う。
 		else if (token == "autoplay")    auto_play(pos, is);       // 連続自己対局を行う。
+		else if (token == "bookprobe")   book_probe(pos, is);      // 定跡のprobeの速度を計測する。
 #if defined (EVAL_LEARN)
 		else if (token == "evalsave")    Eval::save_eval("");      // 現在の評価関数のパラメーターをファイルに保存
+#endif
+#if defined (EVAL_NNUE)
+		else if (token == "nn")          Eval::NNUE::TestCommand(pos, is); // NNUE評価関数に関するテスト
 #endif
 		else return false;									       // どのコマンドも処理することがなかった
 			
@@ -179,8 +179,25 @@ void ThreadPool::set(size_t requested)
 // ThreadPool::clear()は、threadPoolのデータを初期値に設定する。
 void ThreadPool::clear() {
 
+#if !defined(__EMSCRIPTEN__)
+	// historyなどのテーブルを、それを使うスレッドと同じNUMA NODEのメモリに置くために、
+	// 各スレッドと同じようにbindしたスレッドからクリアする。(first touch)
+	// そのスレッドがidle_loop()でbindしないときは、OSに任せる。
+	std::vector<std::thread> threads;
+	for (Thread* th : *this)
+		threads.emplace_back([th]() {
+#if !defined(FORCE_BIND_THIS_THREAD)
+			if (Options.count("Threads") == 0 || Options["Threads"] > 8)
+#endif
+				WinProcGroup::bindThisThread(th->thread_id());
+			th->clear();
+		});
+	for (auto& th : threads)
+		th.join();
+#else
 	for (Thread* th : *this)
 		th->clear();
+#endif
 
 	main()->callsCnt = 0;
 	main()->bestPreviousScore        = VALUE_INFINITE;
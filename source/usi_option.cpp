@@ -194,6 +194,15 @@ namespace USI {
 		// 評価関数パラメーターを共有するか。
 		// デフォルトで有効に変更。(V4.90～)
 		o["EvalShare"] << Option(true);
+#elif defined(EVAL_NNUE) && !defined(__EMSCRIPTEN__)
+		// 評価関数パラメーターを他プロセスと共有するか。
+		// 有効にすると、nn.binを読み込んだ後のメモリ上の表現を評価関数イメージファイルとして書き出しておき、
+		// 以降はそれをmapして用いる。同じイメージをmapしたプロセス同士は物理メモリを共有し、起動も速くなる。
+		o["EvalShare"] << Option(false);
+
+		// 評価関数イメージファイルのパス。空なら評価関数フォルダの"nn.bin.img"。
+		// hugetlbfs上のパス(例 : /dev/hugepages/nn.bin.img)を指定すると、Huge Pageに載せて共有できる。
+		o["EvalShareFile"] << Option("");
 #endif
 
 #if defined(EVAL_LEARN)
@@ -221,6 +230,11 @@ namespace USI {
 			});
 #endif
 
+#if defined(__linux__) && !defined(__ANDROID__)
+		// スレッドをどのNUMA NODE(論理プロセッサ)に割り当てたか、置換表をNUMA NODEに交互に配置したかを出力する。
+		o["PrintThreadPlacement"] << Option(false);
+#endif
+
 #if defined(_WIN64)
 		// LargePageを有効化するか。
 		// これを無効化できないと自己対局の時に片側のエンジンだけがLargePageを使うことがあり、